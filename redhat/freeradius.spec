@@ -1117,6 +1117,7 @@ fi
 /usr/bin/radclient
 /usr/bin/radcrypt
 /usr/bin/radict
+/usr/bin/radindex
 /usr/bin/radlast
 /usr/bin/radsniff
 /usr/bin/radsqlrelay
@@ -1,6 +1,7 @@
 SUBMAKEFILES := \
     radclient.mk \
     radict.mk \
+    radindex.mk \
     radiusd.mk \
     radlast.mk \
     radlock.mk \
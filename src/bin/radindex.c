@@ -0,0 +1,196 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file radindex.c
+ * @brief Compile CSV and passwd style files into indexes which rlm_csv and rlm_passwd can map.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/autoconf.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/line_index.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/version.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static NEVER_RETURNS void usage(int ret)
+{
+	fprintf(stderr, "usage: radindex [options] <file> <index>\n");
+	fprintf(stderr, "       radindex [options] -x <key> <index>\n");
+	fprintf(stderr, "  -d <char>        Field delimiter (default ',').\n");
+	fprintf(stderr, "  -k <field>       Number of the key field, starting at 1 (default 1).\n");
+	fprintf(stderr, "  -H               The first line is a header, don't index it.\n");
+	fprintf(stderr, "  -q               Fields may be quoted, as in RFC 4180.\n");
+	fprintf(stderr, "  -l               The key field is a comma separated list of keys.\n");
+	fprintf(stderr, "  -n               Ignore lines beginning with '+' or '-'.\n");
+	fprintf(stderr, "  -x <key>         Print the lines in <index> with the given key.\n");
+	fprintf(stderr, "  -h               This help text.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "The options must match the configuration of the module using the index.\n");
+	fr_exit_now(ret);
+}
+
+#define EXIT_WITH_FAILURE exit(EXIT_FAILURE)
+#define EXIT_WITH_SUCCESS exit(EXIT_SUCCESS)
+
+/**
+ *
+ * @hidecallgraph
+ */
+int main(int argc, char *argv[])
+{
+	int			c;
+	fr_line_index_conf_t	conf = { .delimiter = ',' };
+	char const		*key = NULL;
+	unsigned long		key_field;
+	TALLOC_CTX		*autofree;
+
+	autofree = talloc_autofree_context();
+
+#ifndef NDEBUG
+	if (fr_fault_setup(autofree, getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("radindex");
+		fr_exit(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	while ((c = getopt(argc, argv, "d:k:Hqlnx:h")) != -1) switch (c) {
+		case 'd':
+			if (!optarg[0] || optarg[1]) {
+				fr_perror("radindex - Delimiter must be one character");
+				usage(64);
+			}
+			conf.delimiter = optarg[0];
+			break;
+
+		case 'k':
+			key_field = strtoul(optarg, NULL, 10);
+			if ((key_field < 1) || (key_field > UINT16_MAX)) {
+				fr_perror("radindex - Invalid key field \"%s\"", optarg);
+				usage(64);
+			}
+			conf.key_field = key_field - 1;
+			break;
+
+		case 'H':
+			conf.header = true;
+			break;
+
+		case 'q':
+			conf.quoted = true;
+			break;
+
+		case 'l':
+			conf.key_list = true;
+			break;
+
+		case 'n':
+			conf.ignore_nislike = true;
+			break;
+
+		case 'x':
+			key = optarg;
+			break;
+
+		case 'h':
+		default:
+			usage(EXIT_SUCCESS);
+	}
+	argc -= optind;
+	argv += optind;
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("radindex");
+		EXIT_WITH_FAILURE;
+	}
+
+	if (key) {
+		fr_line_index_t		*index;
+		fr_line_index_cursor_t	cursor;
+		char const		*line;
+		size_t			len;
+		int			found = 0;
+
+		if (argc != 1) {
+			fr_perror("radindex - Need index to search");
+			usage(64);
+		}
+
+		index = fr_line_index_open(autofree, argv[0], &conf);
+		if (!index) {
+			fr_perror("radindex");
+			EXIT_WITH_FAILURE;
+		}
+
+		for (line = fr_line_index_find(&cursor, index, key, strlen(key), &len);
+		     line;
+		     line = fr_line_index_next(&cursor, &len)) {
+			fprintf(stdout, "%.*s\n", (int)len, line);
+			found++;
+		}
+
+		if (!found) EXIT_WITH_FAILURE;
+		EXIT_WITH_SUCCESS;
+	}
+
+	if (argc != 2) {
+		fr_perror("radindex - Need file to index, and index to write");
+		usage(64);
+	}
+
+	{
+		fr_line_index_t	*index;
+		fr_time_t	start;
+
+		fr_time_start();
+		start = fr_time();
+
+		if (fr_line_index_build(argv[1], argv[0], &conf) < 0) {
+			fr_perror("radindex");
+			EXIT_WITH_FAILURE;
+		}
+
+		index = fr_line_index_open(autofree, argv[1], &conf);
+		if (!index) {
+			fr_perror("radindex");
+			EXIT_WITH_FAILURE;
+		}
+
+		fprintf(stdout, "Indexed %"PRIu64" keys from %s in %"PRIu64" ms, index is %zu bytes\n",
+			fr_line_index_num_entries(index), argv[0],
+			fr_time_delta_to_msec(fr_time_sub(fr_time(), start)), fr_line_index_size(index));
+		if (fr_line_index_num_duplicates(index) > 0) {
+			fprintf(stdout, "%"PRIu64" keys are the same as an earlier key\n",
+				fr_line_index_num_duplicates(index));
+		}
+	}
+
+	EXIT_WITH_SUCCESS;
+}
@@ -0,0 +1,5 @@
+TARGET		:= radindex$(E)
+SOURCES		:= radindex.c
+
+TGT_PREREQS	:= libfreeradius-util$(L)
+TGT_LDLIBS	:= $(LIBS)
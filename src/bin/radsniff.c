@@ -35,6 +35,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/conf.h>
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/file.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/atexit.h>
 #include <freeradius-devel/util/pair_legacy.h>
@@ -51,13 +52,21 @@ RCSID("$Id$")
 #define RS_ASSERT(_x) if (!(_x) && !fr_cond_assert(_x)) exit(1)
 
 static rs_t *conf;
-static struct timeval start_pcap = {0, 0};
-static char timestr[50];
 
-static fr_rb_tree_t *request_tree = NULL;
-static fr_rb_tree_t *link_tree = NULL;
-static fr_event_list_t *events;
-static bool cleanup;
+/*
+ *	Per-thread so that worker threads (-j) each get their
+ *	own requests and timers.
+ */
+static _Thread_local struct timeval start_pcap = {0, 0};
+static _Thread_local char timestr[50];
+
+static _Thread_local fr_rb_tree_t *request_tree = NULL;
+static _Thread_local fr_rb_tree_t *link_tree = NULL;
+static _Thread_local fr_event_list_t *events;
+static _Thread_local bool cleanup;
+
+static pthread_mutex_t rs_intervals_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t rs_intervals;		//!< Stats intervals waiting for the workers.
 static int packets_count = 1; // Used in '$PATH/${packet}.txt.${count}'
 
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
@@ -839,19 +848,15 @@ static void rs_stats_print_csv(rs_update_t *this, rs_stats_t *stats, UNUSED stru
 	fprintf(stdout , "%s\n", buffer);
 }
 
-/** Process stats for a single interval
+/** Write out the stats for a single interval, and reset the interval counters
  *
  */
-static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
+static void rs_stats_output(rs_update_t *this, struct timeval *now)
 {
 	size_t		i;
 	size_t		rs_codes_len = (NUM_ELEMENTS(rs_useful_codes));
 	fr_pcap_t	*in_p;
-	rs_update_t	*this = ctx;
 	rs_stats_t	*stats = this->stats;
-	struct timeval	now;
-
-	now = fr_time_to_timeval(now_t);
 
 	if (!this->done_header) {
 		if (this->head) this->head(this);
@@ -866,7 +871,7 @@ static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
 		if (rs_check_pcap_drop(in_p) < 0) {
 			ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
 
-			rs_tv_add_ms(&now, conf->stats.timeout, &stats->quiet);
+			rs_tv_add_ms(now, conf->stats.timeout, &stats->quiet);
 			goto clear;
 		}
 	}
@@ -875,14 +880,14 @@ static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
 	 *	Stats temporarily muted
 	 */
 	if ((stats->quiet.tv_sec + (stats->quiet.tv_usec / 1000000.0)) -
-	    (now.tv_sec + (now.tv_usec / 1000000.0)) > 0) goto clear;
+	    (now->tv_sec + (now->tv_usec / 1000000.0)) > 0) goto clear;
 
 	for (i = 0; i < rs_codes_len; i++) {
 		rs_stats_process_latency(&stats->exchange[rs_useful_codes[i]]);
 		rs_stats_process_counters(&stats->exchange[rs_useful_codes[i]]);
 	}
 
-	if (this->body) this->body(this, stats, &now);
+	if (this->body) this->body(this, stats, now);
 
 #ifdef HAVE_COLLECTDC_H
 	/*
@@ -890,7 +895,7 @@ static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
 	 *	initialised earlier.
 	 */
 	if ((conf->stats.out == RS_STATS_OUT_COLLECTD) && conf->stats.handle) {
-		rs_stats_collectd_do_stats(conf, conf->stats.tmpl, &now);
+		rs_stats_collectd_do_stats(conf, conf->stats.tmpl, now);
 	}
 #endif
 
@@ -902,6 +907,19 @@ clear:
 		memset(&stats->exchange[rs_useful_codes[i]].interval, 0,
 		       sizeof(stats->exchange[rs_useful_codes[i]].interval));
 	}
+}
+
+/** Process stats for a single interval
+ *
+ */
+static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
+{
+	rs_update_t	*this = ctx;
+	struct timeval	now;
+
+	now = fr_time_to_timeval(now_t);
+
+	rs_stats_output(this, &now);
 
 	{
 		static fr_event_timer_t const *event;
@@ -937,37 +955,68 @@ static void rs_stats_update_latency(rs_latency_t *stats, struct timeval *latency
 
 }
 
-static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
-				      fr_pcap_t *in, struct timeval *now, bool live)
+/** Add the interval counters from one set of stats to another
+ *
+ */
+static void rs_stats_merge_latency(rs_latency_t *out, rs_latency_t const *in)
 {
-	static fr_event_timer_t	const *event;
-	static rs_update_t	update;
+	int i;
+
+	out->interval.received_total += in->interval.received_total;
+	out->interval.linked_total += in->interval.linked_total;
+	out->interval.unlinked_total += in->interval.unlinked_total;
+	out->interval.reused_total += in->interval.reused_total;
+	out->interval.lost_total += in->interval.lost_total;
 
-	memset(&update, 0, sizeof(update));
+	for (i = 0; i <= RS_RETRANSMIT_MAX; i++) out->interval.rt_total[i] += in->interval.rt_total[i];
 
-	update.list = el;
-	update.stats = stats;
-	update.in = in;
+	out->interval.latency_total += in->interval.latency_total;
+
+	if (in->interval.latency_high > out->interval.latency_high) {
+		out->interval.latency_high = in->interval.latency_high;
+	}
+	if (in->interval.latency_low &&
+	    (!out->interval.latency_low || (in->interval.latency_low < out->interval.latency_low))) {
+		out->interval.latency_low = in->interval.latency_low;
+	}
+}
+
+static void rs_stats_update_init(rs_update_t *update, fr_event_list_t *el, rs_stats_t *stats, fr_pcap_t *in)
+{
+	memset(update, 0, sizeof(*update));
+
+	update->list = el;
+	update->stats = stats;
+	update->in = in;
 
 	switch (conf->stats.out) {
 	default:
 	case RS_STATS_OUT_STDIO_FANCY:
-		update.head = NULL;
-		update.body = rs_stats_print_fancy;
+		update->head = NULL;
+		update->body = rs_stats_print_fancy;
 		break;
 
 	case RS_STATS_OUT_STDIO_CSV:
-		update.head = rs_stats_print_csv_header;
-		update.body = rs_stats_print_csv;
+		update->head = rs_stats_print_csv_header;
+		update->body = rs_stats_print_csv;
 		break;
 
 #ifdef HAVE_COLLECTDC_H
 	case RS_STATS_OUT_COLLECTD:
-		update.head = NULL;
-		update.body = NULL;
+		update->head = NULL;
+		update->body = NULL;
 		break;
 #endif
 	}
+}
+
+static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
+				      fr_pcap_t *in, struct timeval *now, bool live)
+{
+	static fr_event_timer_t	const *event;
+	static rs_update_t	update;
+
+	rs_stats_update_init(&update, el, stats, in);
 	/*
 	 *	Set the first time we print stats
 	 */
@@ -1245,6 +1294,25 @@ static inline int rs_request_to_pcap(rs_event_t *event, rs_request_t *request, s
 		_x = NULL;\
 	} while (0)
 
+/** Stop the libraries logging while we verify or decode a packet
+ *
+ * fr_log_fp is shared by all threads, so worker threads leave it alone.
+ * They're only used when packet logging is disabled.
+ */
+static inline FILE *rs_log_mute(void)
+{
+	FILE *log_fp = fr_log_fp;
+
+	if (!conf->threads) fr_log_fp = NULL;
+
+	return log_fp;
+}
+
+static inline void rs_log_restore(FILE *log_fp)
+{
+	if (!conf->threads) fr_log_fp = log_fp;
+}
+
 static rs_request_t *rs_request_alloc(TALLOC_CTX *ctx)
 {
 	rs_request_t *original;
@@ -1278,7 +1346,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
+	static _Thread_local uint64_t	captured = 0;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	fr_radius_packet_t	*packet;		/* Current packet were processing */
@@ -1389,7 +1457,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	packet = fr_radius_packet_alloc(conf, false);
+	packet = fr_radius_packet_alloc(event->ctx, false);
 	if (!packet) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1467,11 +1535,10 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 
 		if (conf->verify_radius_authenticator && original) {
 			int ret;
-			FILE *log_fp = fr_log_fp;
+			FILE *log_fp = rs_log_mute();
 
-			fr_log_fp = NULL;
 			ret = fr_radius_packet_verify(packet, original->expect, conf->radius_secret);
-			fr_log_fp = log_fp;
+			rs_log_restore(log_fp);
 			if (ret != 0) {
 				fr_perror("Failed verifying packet ID %d", packet->id);
 				fr_radius_packet_free(&packet);
@@ -1485,12 +1552,11 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 */
 		if (conf->decode_attrs) {
 			int ret;
-			FILE *log_fp = fr_log_fp;
+			FILE *log_fp = rs_log_mute();
 
-			fr_log_fp = NULL;
 			ret = fr_radius_packet_decode(packet, &decoded, packet, original ? original->expect : NULL,
 						      RADIUS_MAX_ATTRIBUTES, false, conf->radius_secret);
-			fr_log_fp = log_fp;
+			rs_log_restore(log_fp);
 			if (ret != 0) {
 				fr_radius_packet_free(&packet);		/* Also frees vps */
 				REDEBUG("Failed decoding");
@@ -1599,11 +1665,10 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			case FR_RADIUS_CODE_DISCONNECT_REQUEST:
 			{
 				int ret;
-				FILE *log_fp = fr_log_fp;
+				FILE *log_fp = rs_log_mute();
 
-				fr_log_fp = NULL;
 				ret = fr_radius_packet_verify(packet, NULL, conf->radius_secret);
-				fr_log_fp = log_fp;
+				rs_log_restore(log_fp);
 				if (ret != 0) {
 					fr_perror("Failed verifying packet ID %d", packet->id);
 					fr_radius_packet_free(&packet);
@@ -1623,12 +1688,11 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 */
 		if (conf->decode_attrs) {
 			int ret;
-			FILE *log_fp = fr_log_fp;
+			FILE *log_fp = rs_log_mute();
 
-			fr_log_fp = NULL;
 			ret = fr_radius_packet_decode(packet, &decoded, packet, NULL,
 						      RADIUS_MAX_ATTRIBUTES, false, conf->radius_secret);
-			fr_log_fp = log_fp;
+			rs_log_restore(log_fp);
 
 			if (ret != 0) {
 				fr_radius_packet_free(&packet);	/* Also frees vps */
@@ -1751,7 +1815,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = rs_request_alloc(conf);
+			original = rs_request_alloc(event->ctx);
 			original->id = count;
 			original->in = event->in;
 			original->stats_req = &stats->exchange[packet->code];
@@ -1951,7 +2015,7 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 		while (!fr_event_loop_exiting(el)) {
 			fr_time_t now;
 
-			ret = pcap_next_ex(handle, &header, &data);
+			ret = fr_pcap_next(event->in, &header, &data);
 			if (ret == 0) {
 				/* No more packets available at this time */
 				return;
@@ -1967,7 +2031,7 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 				return;
 			}
 			if (ret < 0) {
-				ERROR("Error requesting next packet, got (%i): %s", ret, pcap_geterr(handle));
+				ERROR("Error requesting next packet, got (%i): %s", ret, fr_strerror());
 				goto done_file;
 			}
 
@@ -2172,6 +2236,425 @@ static void timeout_event(fr_event_list_t *el, UNUSED fr_time_t now_t, UNUSED vo
 }
 
 
+/** Pick the worker thread for a packet
+ *
+ * Requests and their responses have the same client, server and RADIUS ID,
+ * so hashing the two endpoints in a fixed order sends a whole exchange,
+ * including retransmissions and ID reuse, to the same worker.
+ *
+ * Anything we can't parse goes to the first worker, which reports the error.
+ */
+static unsigned int rs_flow_worker(fr_pcap_t *in, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	uint8_t const		*p = data, *end = data + header->caplen;
+	ssize_t			len;
+	udp_header_t const	*udp;
+	uint32_t		hash;
+	int			cmp;
+
+	struct {
+		uint8_t		addr[16];
+		uint16_t	port;
+	} ends[2];
+
+	len = fr_pcap_link_layer_offset(data, header->caplen, in->link_layer);
+	if ((len < 0) || (len >= (end - p))) return 0;
+	p += len;
+
+	memset(ends, 0, sizeof(ends));
+
+	switch ((p[0] & 0xf0) >> 4) {
+	case 4:
+	{
+		ip_header_t const *ip = (ip_header_t const *)p;
+
+		if ((size_t)(end - p) < sizeof(*ip)) return 0;
+
+		memcpy(ends[0].addr, &ip->ip_src, sizeof(ip->ip_src));
+		memcpy(ends[1].addr, &ip->ip_dst, sizeof(ip->ip_dst));
+		p += (0x0f & ip->ip_vhl) * 4;
+	}
+		break;
+
+	case 6:
+	{
+		ip_header6_t const *ip6 = (ip_header6_t const *)p;
+
+		if ((size_t)(end - p) < sizeof(*ip6)) return 0;
+
+		memcpy(ends[0].addr, &ip6->ip_src, sizeof(ip6->ip_src));
+		memcpy(ends[1].addr, &ip6->ip_dst, sizeof(ip6->ip_dst));
+		p += sizeof(*ip6);
+	}
+		break;
+
+	default:
+		return 0;
+	}
+
+	if ((p > end) || ((size_t)(end - p) < (sizeof(udp_header_t) + 2))) return 0;
+	udp = (udp_header_t const *)p;
+
+	ends[0].port = udp->src;
+	ends[1].port = udp->dst;
+
+	cmp = memcmp(&ends[0], &ends[1], sizeof(ends[0])) > 0;
+
+	hash = fr_hash(&ends[cmp], sizeof(ends[0]));
+	hash = fr_hash_update(&ends[!cmp], sizeof(ends[0]), hash);
+	hash = fr_hash_update(&((radius_packet_t const *)(udp + 1))->id, 1, hash);
+
+	return hash % conf->threads;
+}
+
+/** Run a worker's timers up to a capture timestamp
+ *
+ */
+static void rs_worker_timers(fr_event_list_t *el, struct timeval const *when)
+{
+	fr_time_t now;
+
+	do {
+		now = fr_time_from_timeval(when);
+	} while (fr_event_timer_run(el, &now) == 1);
+}
+
+/** Add a worker's stats to an interval, and start the next one
+ *
+ */
+static void rs_worker_interval(rs_stats_t *stats, rs_interval_t *interval)
+{
+	size_t i;
+
+	pthread_mutex_lock(&rs_intervals_mutex);
+	for (i = 0; i < NUM_ELEMENTS(rs_useful_codes); i++) {
+		rs_latency_t *latency = &stats->exchange[rs_useful_codes[i]];
+
+		rs_stats_merge_latency(&interval->stats.exchange[rs_useful_codes[i]], latency);
+		memset(&latency->interval, 0, sizeof(latency->interval));
+	}
+	if (timercmp(&stats->quiet, &interval->stats.quiet, >)) interval->stats.quiet = stats->quiet;
+	interval->reported++;
+	pthread_mutex_unlock(&rs_intervals_mutex);
+}
+
+static void *rs_worker_thread(void *arg)
+{
+	rs_worker_t	*worker = arg;
+	TALLOC_CTX	*ctx;
+	rs_stats_t	*stats;
+	rs_event_t	event;
+	bool		done = false;
+
+	ctx = talloc_init_const("radsniff worker");
+	events = fr_event_list_alloc(ctx, NULL, NULL);
+	request_tree = fr_rb_inline_talloc_alloc(ctx, rs_request_t, request_node, rs_packet_cmp, _unmark_request);
+	stats = talloc_zero(ctx, rs_stats_t);
+	if (!events || !request_tree || !stats) {
+		ERROR("Failed initialising worker %u", worker->id);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	event = (rs_event_t) {
+		.list = events,
+		.stats = stats,
+		.ctx = ctx
+	};
+
+	while (!done) {
+		rs_batch_t	*batch;
+		size_t		i;
+
+		pthread_mutex_lock(&worker->mutex);
+		while (!(batch = fr_dlist_head(&worker->queue))) pthread_cond_wait(&worker->ready, &worker->mutex);
+		fr_dlist_remove(&worker->queue, batch);
+		worker->queued--;
+		pthread_cond_signal(&worker->space);
+		pthread_mutex_unlock(&worker->mutex);
+
+		for (i = 0; i < batch->num; i++) {
+			rs_record_t *record = &batch->record[i];
+
+			/*
+			 *	Fire the timers the single threaded
+			 *	code would have fired for the packets
+			 *	which went to other workers.
+			 */
+			rs_worker_timers(events, &record->clock);
+
+			switch (record->type) {
+			case RS_RECORD_PACKET:
+				event.in = record->in;
+				rs_packet_process(record->count, &event, &record->header, batch->data + record->offset);
+				break;
+
+			case RS_RECORD_INTERVAL:
+				rs_worker_timers(events, &record->interval->when);
+				rs_worker_interval(stats, record->interval);
+				break;
+
+			case RS_RECORD_DONE:
+				done = true;
+				break;
+			}
+		}
+
+		free(batch->data);
+		free(batch);
+	}
+
+	/*
+	 *	Same as the single threaded code, requests which are
+	 *	still outstanding aren't counted.
+	 */
+	cleanup = true;
+	talloc_free(ctx);
+
+	return NULL;
+}
+
+/** Hand a worker's current batch to it, waiting if its queue is full
+ *
+ */
+static void rs_worker_push(rs_worker_t *worker)
+{
+	rs_batch_t *batch = worker->batch;
+
+	if (!batch) return;
+	worker->batch = NULL;
+
+	pthread_mutex_lock(&worker->mutex);
+	while (worker->queued >= RS_BATCH_QUEUED) pthread_cond_wait(&worker->space, &worker->mutex);
+	fr_dlist_insert_tail(&worker->queue, batch);
+	worker->queued++;
+	pthread_cond_signal(&worker->ready);
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+/** Add a record to a worker's current batch
+ *
+ * The record carries the latest timestamp read since the worker's previous
+ * record, so it can fire its timers at the same point in the capture as
+ * the single threaded code does.
+ */
+static rs_record_t *rs_worker_record(rs_worker_t *worker, rs_record_type_t type)
+{
+	rs_record_t *record;
+
+	if (worker->batch && (worker->batch->num == NUM_ELEMENTS(worker->batch->record))) rs_worker_push(worker);
+
+	if (!worker->batch) {
+		worker->batch = calloc(1, sizeof(*worker->batch));
+		if (!worker->batch) {
+			ERROR("Out of memory");
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	record = &worker->batch->record[worker->batch->num++];
+	memset(record, 0, sizeof(*record));
+	record->type = type;
+	record->clock = worker->clock;
+	timerclear(&worker->clock);
+
+	return record;
+}
+
+static void rs_worker_packet(rs_worker_t *worker, uint64_t count, fr_pcap_t *in,
+			     struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	rs_record_t	*record = rs_worker_record(worker, RS_RECORD_PACKET);
+	rs_batch_t	*batch = worker->batch;
+
+	if ((batch->data_used + header->caplen) > batch->data_len) {
+		size_t	len = batch->data_len ? batch->data_len * 2 : 65536;
+		uint8_t	*data_p;
+
+		while (len < (batch->data_used + header->caplen)) len *= 2;
+
+		data_p = realloc(batch->data, len);
+		if (!data_p) {
+			ERROR("Out of memory");
+			fr_exit_now(EXIT_FAILURE);
+		}
+		batch->data = data_p;
+		batch->data_len = len;
+	}
+
+	record->count = count;
+	record->in = in;
+	record->header = *header;
+	record->offset = batch->data_used;
+	memcpy(batch->data + batch->data_used, data, header->caplen);
+	batch->data_used += header->caplen;
+}
+
+/** Write out the intervals all the workers have finished with
+ *
+ */
+static void rs_threads_stats_output(rs_update_t *update)
+{
+	for (;;) {
+		rs_interval_t	*interval;
+		size_t		i;
+
+		pthread_mutex_lock(&rs_intervals_mutex);
+		interval = fr_dlist_head(&rs_intervals);
+		if (interval && (interval->reported == (unsigned int) conf->threads)) {
+			fr_dlist_remove(&rs_intervals, interval);
+		} else {
+			interval = NULL;
+		}
+		pthread_mutex_unlock(&rs_intervals_mutex);
+
+		if (!interval) return;
+
+		/*
+		 *	The stats were restarted for a new file,
+		 *	so print the CSV header again.
+		 */
+		if (interval->restart) update->done_header = false;
+
+		for (i = 0; i < NUM_ELEMENTS(rs_useful_codes); i++) {
+			update->stats->exchange[rs_useful_codes[i]].interval =
+				interval->stats.exchange[rs_useful_codes[i]].interval;
+		}
+		update->stats->quiet = interval->stats.quiet;
+
+		rs_stats_output(update, &interval->now);
+		talloc_free(interval);
+	}
+}
+
+/** Process offline captures with worker threads
+ *
+ * Packets are partitioned by flow, so each worker can link requests and
+ * responses on its own.  The stats intervals are driven from here, using
+ * the same capture timestamps as the single threaded code, and each
+ * worker adds its stats for an interval before they're written out.
+ *
+ * @param[in] in	Capture files to read.
+ * @param[in] stats	to write out.
+ * @return
+ *	- 0 on success.
+ *	- -1 if reading one of the files failed.
+ */
+static int rs_threads_run(fr_pcap_t *in, rs_stats_t *stats)
+{
+	rs_worker_t	*workers;
+	rs_update_t	update;
+	fr_pcap_t	*in_p;
+	struct timeval	next = { 0, 0 };
+	bool		restart = false;
+	uint64_t	count = 0;
+	int		i, ret, rcode = 0;
+
+	fr_dlist_talloc_init(&rs_intervals, rs_interval_t, entry);
+	rs_stats_update_init(&update, NULL, stats, NULL);
+
+	workers = talloc_zero_array(conf, rs_worker_t, conf->threads);
+	for (i = 0; i < conf->threads; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		worker->id = i;
+		pthread_mutex_init(&worker->mutex, NULL);
+		pthread_cond_init(&worker->ready, NULL);
+		pthread_cond_init(&worker->space, NULL);
+		fr_dlist_init(&worker->queue, rs_batch_t, entry);
+
+		ret = pthread_create(&worker->thread, NULL, rs_worker_thread, worker);
+		if (ret != 0) {
+			ERROR("Failed creating worker thread: %s", fr_syserror(ret));
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	DEBUG("Processing capture with %i worker threads", conf->threads);
+
+	for (in_p = in; in_p; in_p = in_p->next) {
+		bool stats_started = false;
+
+		for (;;) {
+			struct pcap_pkthdr	*header;
+			uint8_t const		*data;
+
+			ret = fr_pcap_next(in_p, &header, &data);
+			if (ret == -2) {
+				DEBUG("Done reading packets (%s)", in_p->name);
+				break;
+			}
+			if (ret < 0) {
+				ERROR("Error requesting next packet, got (%i): %s", ret, fr_strerror());
+				rcode = -1;
+				break;
+			}
+			if (ret == 0) break;
+
+			/*
+			 *	Mirror the stats event the single threaded
+			 *	code inserts at the first packet of each
+			 *	file, and which fires at the first packet
+			 *	at or after the end of the interval.
+			 */
+			if (conf->stats.interval) {
+				if (!stats_started) {
+					next.tv_sec = header->ts.tv_sec + conf->stats.interval;
+					next.tv_usec = 0;
+					restart = true;
+					stats_started = true;
+
+				} else if (!timercmp(&header->ts, &next, <)) {
+					rs_interval_t *interval;
+
+					MEM(interval = talloc_zero(conf, rs_interval_t));
+					interval->when = next;
+					interval->now = header->ts;
+					interval->restart = restart;
+					restart = false;
+
+					pthread_mutex_lock(&rs_intervals_mutex);
+					fr_dlist_insert_tail(&rs_intervals, interval);
+					pthread_mutex_unlock(&rs_intervals_mutex);
+
+					for (i = 0; i < conf->threads; i++) {
+						rs_worker_record(&workers[i], RS_RECORD_INTERVAL)->interval = interval;
+					}
+
+					next.tv_sec = header->ts.tv_sec + conf->stats.interval;
+					next.tv_usec = 0;
+				}
+			}
+
+			for (i = 0; i < conf->threads; i++) {
+				if (timercmp(&header->ts, &workers[i].clock, >)) workers[i].clock = header->ts;
+			}
+
+			count++;
+			rs_worker_packet(&workers[rs_flow_worker(in_p, header, data)], count, in_p, header, data);
+
+			if ((count % RS_BATCH_PACKETS) == 0) rs_threads_stats_output(&update);
+		}
+	}
+
+	for (i = 0; i < conf->threads; i++) {
+		rs_worker_record(&workers[i], RS_RECORD_DONE);
+		rs_worker_push(&workers[i]);
+	}
+
+	for (i = 0; i < conf->threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		pthread_mutex_destroy(&workers[i].mutex);
+		pthread_cond_destroy(&workers[i].ready);
+		pthread_cond_destroy(&workers[i].space);
+	}
+
+	rs_threads_stats_output(&update);
+	talloc_free(workers);
+
+	return rcode;
+}
+
+
 #ifdef HAVE_COLLECTDC_H
 /** Re-open the collectd socket
  *
@@ -2295,6 +2778,8 @@ static NEVER_RETURNS void usage(int status)
 	fprintf(output, "stats options:\n");
 	fprintf(output, "  -W <interval>         Periodically write out statistics every <interval> seconds.\n");
 	fprintf(output, "  -E                    Print stats in CSV format.\n");
+	fprintf(output, "  -j <threads>          Split capture files across <threads> worker threads.  Only\n");
+	fprintf(output, "                        statistics are written out, individual packets are not logged.\n");
 	fprintf(output, "  -T <timeout>          How many milliseconds before the request is counted as lost "
 		"(defaults to %i).\n", RS_DEFAULT_TIMEOUT);
 #ifdef HAVE_COLLECTDC_H
@@ -2377,7 +2862,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:St:vw:xXW:T:P:N:O:Z:")) != -1) {
+	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:j:l:L:mp:P:qr:R:s:St:vw:xXW:T:P:N:O:Z:")) != -1) {
 		switch (c) {
 		case 'a':
 		{
@@ -2472,6 +2957,14 @@ int main(int argc, char *argv[])
 			conf->from_file = true;
 			break;
 
+		case 'j':
+			conf->threads = atoi(optarg);
+			if ((conf->threads <= 0) || (conf->threads > RS_MAX_THREADS)) {
+				ERROR("Number of worker threads must be between 1 and %i", RS_MAX_THREADS);
+				usage(64);
+			}
+			break;
+
 		case 'l':
 			conf->list_attributes = optarg;
 			break;
@@ -2645,6 +3138,25 @@ int main(int argc, char *argv[])
 		conf->to_stdout = false;
 	}
 
+	/* Workers only see part of the capture, and only produce stats */
+	if (conf->threads) {
+		if (!conf->from_file || conf->from_dev || conf->from_stdin) {
+			ERROR("Worker threads (-j) can only be used when reading from capture files");
+			usage(64);
+		}
+
+		if (!conf->stats.interval) {
+			ERROR("Worker threads (-j) require a statistics interval (-W)");
+			usage(64);
+		}
+
+		if (conf->limit || conf->list_attributes || conf->link_attributes ||
+		    conf->to_file || conf->to_stdout || conf->to_output_dir) {
+			ERROR("Worker threads (-j) can't be used with -c, -l, -L, -S, -w or -Z");
+			usage(64);
+		}
+	}
+
 	if (conf->to_stdout) {
 		out = fr_pcap_init(conf, "stdout", PCAP_STDIO_OUT);
 		if (!out) {
@@ -2685,6 +3197,12 @@ int main(int argc, char *argv[])
 		conf->logger = rs_packet_print_fancy;
 	}
 
+	/*
+	 *	The workers process packets out of order with
+	 *	respect to each other, so packets aren't logged.
+	 */
+	if (conf->threads) conf->logger = NULL;
+
 #if !defined(HAVE_PCAP_FOPEN_OFFLINE) || !defined(HAVE_PCAP_DUMP_FOPEN)
 	if (conf->from_stdin || conf->to_stdout) {
 		ERROR("PCAP streams not supported");
@@ -3068,6 +3586,15 @@ int main(int argc, char *argv[])
 			rs_install_stats_processor(stats, events, in, &now, false);
 		}
 
+		/*
+		 *  Offline captures split across worker threads
+		 *  don't need the event loop.
+		 */
+		if (conf->threads) {
+			if (rs_threads_run(in, stats) < 0) ret = EXIT_FAILURE;
+			goto finish;
+		}
+
 		/*
 		 *  Now add fd's for each of the pcap sessions we opened
 		 */
@@ -3081,6 +3608,7 @@ int main(int argc, char *argv[])
 			event->in = in_p;
 			event->out = out;
 			event->stats = stats;
+			event->ctx = conf;
 
 			/*
 			 *	kevent() doesn't indicate that the
@@ -28,7 +28,9 @@
 RCSIDH(radsniff_h, "$Id$")
 
 #include <sys/types.h>
+#include <pthread.h>
 
+#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/pcap.h>
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/radius/radius.h>
@@ -44,6 +46,9 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_MAX_THREADS		64		//!< Maximum number of worker threads for offline captures.
+#define RS_BATCH_PACKETS	256		//!< Packets handed to a worker thread at a time.
+#define RS_BATCH_QUEUED		8		//!< Batches queued for a worker before the reader waits.
 
 /*
  *	Logging macros
@@ -228,8 +233,81 @@ typedef struct {
 	fr_pcap_t		*out;			//!< Where to write output.
 
 	rs_stats_t		*stats;			//!< Where to write stats.
+
+	TALLOC_CTX		*ctx;			//!< Where to allocate packets and requests.
 } rs_event_t;
 
+/** Stats from all the worker threads for a single interval
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the list of intervals waiting for workers.
+
+	struct timeval		when;			//!< When the stats event would have fired.
+	struct timeval		now;			//!< Timestamp of the packet which ended the interval.
+	bool			restart;		//!< First interval after the stats were (re)started.
+
+	unsigned int		reported;		//!< How many workers have added their stats.
+	rs_stats_t		stats;			//!< Sum of the worker stats.
+} rs_interval_t;
+
+typedef enum {
+	RS_RECORD_PACKET = 0,				//!< A packet from the capture.
+	RS_RECORD_INTERVAL,				//!< End of a stats interval.
+	RS_RECORD_DONE					//!< End of the capture.
+} rs_record_type_t;
+
+/** A packet or event handed to a worker thread
+ *
+ */
+typedef struct {
+	rs_record_type_t	type;			//!< What this record is.
+
+	struct timeval		clock;			//!< Latest capture timestamp the worker should
+							//!< run its timers to, before handling the record.
+
+	uint64_t		count;			//!< Packet number in the capture.
+	fr_pcap_t		*in;			//!< PCAP handle the packet was read from.
+	struct pcap_pkthdr	header;			//!< PCAP packet header.
+	size_t			offset;			//!< Where the packet data starts in the batch.
+
+	rs_interval_t		*interval;		//!< Interval to add the worker's stats to.
+} rs_record_t;
+
+/** A set of records handed to a worker thread at once
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the worker's queue.
+
+	rs_record_t		record[RS_BATCH_PACKETS];
+	size_t			num;			//!< Number of records used.
+
+	uint8_t			*data;			//!< Copies of the packet data.
+	size_t			data_len;		//!< Size of the data buffer.
+	size_t			data_used;		//!< How much of the data buffer is used.
+} rs_batch_t;
+
+/** Worker thread for offline captures
+ *
+ * Each worker has its own request tree, timers and stats, and sees every packet
+ * belonging to the flows hashed to it.
+ */
+typedef struct {
+	unsigned int		id;			//!< Worker number.
+	pthread_t		thread;			//!< Worker thread.
+
+	pthread_mutex_t		mutex;			//!< Protects the queue.
+	pthread_cond_t		ready;			//!< Signalled when a batch is queued.
+	pthread_cond_t		space;			//!< Signalled when a batch is dequeued.
+	fr_dlist_head_t		queue;			//!< Batches waiting to be processed.
+	unsigned int		queued;			//!< Number of batches in the queue.
+
+	rs_batch_t		*batch;			//!< Batch being filled by the reader.
+	struct timeval		clock;			//!< Latest timestamp read since the last record
+							//!< was added for this worker.
+} rs_worker_t;
+
 typedef struct rs_update rs_update_t;
 
 /** Callback for printing stats header.
@@ -303,6 +381,8 @@ struct rs {
 	rs_packet_logger_t	logger;			//!< Packet logger
 
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
+	int			threads;		//!< Number of worker threads to split offline
+							//!< captures across.
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
 	struct {
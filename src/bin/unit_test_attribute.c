@@ -203,6 +203,8 @@ typedef struct {
 	char const		*dict_dir;
 	char const		*fuzzer_dir;		//!< Where to write fuzzer files.
 	CONF_SECTION		*features;		//!< Enabled features.
+	uint32_t		bench_rounds;		//!< How many times to repeat each decode-proto
+							///< and encode-proto command when benchmarking.
 } command_config_t;
 
 typedef struct {
@@ -1685,6 +1687,37 @@ static size_t command_decode_proto(command_result_t *result, command_file_ctx_t
 		RETURN_OK_WITH_ERROR();
 	}
 
+	/*
+	 *	Decode the same packet over and over to get an
+	 *	idea of how long it takes.  It's the output of the
+	 *	first decode which is printed and matched.
+	 */
+	if (cc->config->bench_rounds) {
+		fr_time_t	start, stop;
+		uint32_t	i;
+
+		start = fr_time();
+		for (i = 0; i < cc->config->bench_rounds; i++) {
+			fr_pair_t *bench;
+
+			bench = fr_pair_afrom_da(cc->tmp_ctx, da);
+			if (!bench) {
+				ASAN_UNPOISON_MEMORY_REGION(to_dec_end, COMMAND_OUTPUT_MAX - slen);
+				CLEAR_TEST_POINT(cc);
+				fr_strerror_const_push("Failed allocating memory");
+				RETURN_COMMAND_ERROR();
+			}
+
+			(void) tp->func(bench, &bench->vp_group, (uint8_t *)to_dec, (to_dec_end - to_dec), decode_ctx);
+			talloc_free(bench);
+		}
+		stop = fr_time();
+
+		INFO("%s[%u]: decode-proto %zu bytes, %" PRId64 " ns/packet", cc->filename, cc->lineno,
+		     (size_t)(to_dec_end - to_dec),
+		     fr_time_delta_unwrap(fr_time_sub(stop, start)) / cc->config->bench_rounds);
+	}
+
 	/*
 	 *	Clear any spurious errors
 	 */
@@ -2120,6 +2153,44 @@ static size_t command_encode_proto(command_result_t *result, command_file_ctx_t
 		RETURN_OK_WITH_ERROR();
 	}
 
+	/*
+	 *	Encode the same pairs over and over to get an idea of
+	 *	how long it takes.  This uses its own encoder context
+	 *	and buffer, so that any state the encoder keeps doesn't
+	 *	change the output we match against.
+	 */
+	if (cc->config->bench_rounds) {
+		void		*bench_ctx = NULL;
+		uint8_t		*bench_buff;
+		size_t		bench_len = cc->buffer_end - cc->buffer_start;
+		fr_time_t	start, stop;
+		uint32_t	i;
+
+		if (tp->test_ctx && (tp->test_ctx(&bench_ctx, cc->tmp_ctx) < 0)) {
+			fr_strerror_const_push("Failed initialising encoder testpoint");
+			CLEAR_TEST_POINT(cc);
+			RETURN_COMMAND_ERROR();
+		}
+
+		bench_buff = talloc_zero_array(cc->tmp_ctx, uint8_t, bench_len);
+		if (!bench_buff) {
+			fr_strerror_const_push("Failed allocating memory");
+			CLEAR_TEST_POINT(cc);
+			RETURN_COMMAND_ERROR();
+		}
+
+		start = fr_time();
+		for (i = 0; i < cc->config->bench_rounds; i++) {
+			(void) tp->func(cc->tmp_ctx, &head, bench_buff, bench_len, bench_ctx);
+		}
+		stop = fr_time();
+
+		INFO("%s[%u]: encode-proto %" PRId64 " ns/packet", cc->filename, cc->lineno,
+		     fr_time_delta_unwrap(fr_time_sub(stop, start)) / cc->config->bench_rounds);
+
+		talloc_free(bench_buff);
+	}
+
 	slen = tp->func(cc->tmp_ctx, &head, cc->buffer_start, cc->buffer_end - cc->buffer_start, encode_ctx);
 	fr_pair_list_free(&head);
 	cc->last_ret = slen;
@@ -3502,6 +3573,7 @@ static void usage(char const *name)
 	INFO("  -d <raddb>         Set user dictionary path (defaults to " RADDBDIR ").");
 	INFO("  -D <dictdir>       Set main dictionary path (defaults to " DICTDIR ").");
 	INFO("  -x                 Debugging mode.");
+	INFO("  -B <rounds>        Repeat each decode-proto and encode-proto command <rounds> times, printing the time taken.");
 	INFO("  -f                 Print features.");
 	INFO("  -c                 Print commands.");
 	INFO("  -h                 Print help text.");
@@ -3689,7 +3761,11 @@ int main(int argc, char *argv[])
 	default_log.fd = STDOUT_FILENO;
 	default_log.print_level = false;
 
-	while ((c = getopt(argc, argv, "cd:D:F:fxMhpr:")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "B:cd:D:F:fxMhpr:")) != -1) switch (c) {
+		case 'B':
+			config.bench_rounds = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+
 		case 'c':
 			do_commands = true;
 			break;
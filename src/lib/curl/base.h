@@ -92,6 +92,15 @@ typedef struct {
 	fr_event_timer_t const	*ev;			//!< Multi-Handle timer.
 	uint64_t		transfers;		//!< How many transfers are current in progress.
 	CURLM			*mandle;		//!< The multi handle.
+	CURLSH			*share;			//!< DNS, TLS session and connection caches shared
+							///< by all transfers on this thread.
+
+	uint64_t		completed;		//!< How many transfers have completed.
+	uint64_t		connects;		//!< How many new connections completed transfers needed.
+							///< completed - connects is the number of transfers which
+							///< reused an existing connection.
+	uint64_t		multiplexed;		//!< How many transfers reused an HTTP/2 (or later)
+							///< connection, and so may have shared it with others.
 } fr_curl_handle_t;
 
 /** Structure representing an individual request being passed to curl for processing
@@ -101,6 +110,7 @@ typedef struct {
 	CURL			*candle;		//!< Request specific handle.
 	CURLcode		result;			//!< Result of executing the request.
 	request_t		*request;		//!< Current request.
+	CURLSH			*share;			//!< Share handle the easy handle is using, if any.
 	void			*uctx;			//!< Private data for the module using the API.
 } fr_curl_io_request_t;
 
@@ -121,6 +131,8 @@ typedef struct {
 typedef struct {
 	fr_slab_config_t	reuse;
 	fr_time_delta_t		connect_timeout;
+	uint32_t		max_host_connections;	//!< Maximum connections to a single host, per thread.
+	uint32_t		max_total_connections;	//!< Maximum connections, per thread.
 } fr_curl_conn_config_t;
 
 extern conf_parser_t	 	fr_curl_tls_config[];
@@ -130,9 +142,12 @@ extern global_lib_autoinst_t	fr_curl_autoinst;
 int			fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle,
 						   request_t *request, fr_curl_io_request_t *creq);
 
+void			fr_curl_io_request_cancel(fr_curl_handle_t *mhandle, fr_curl_io_request_t *randle);
+
 fr_curl_io_request_t	*fr_curl_io_request_alloc(TALLOC_CTX *ctx);
 
-fr_curl_handle_t	*fr_curl_io_init(TALLOC_CTX *ctx, fr_event_list_t *el, bool multiplex);
+fr_curl_handle_t	*fr_curl_io_init(TALLOC_CTX *ctx, fr_event_list_t *el,
+					     fr_curl_conn_config_t const *conn_config, bool multiplex);
 
 int			fr_curl_response_certinfo(request_t *request, fr_curl_io_request_t *randle);
 
@@ -43,6 +43,22 @@ do {\
 	}\
 } while (0)
 
+/** Stop an easy handle using the thread's share handle
+ *
+ * Easy handles outlive transfers (they're slab allocated), and may outlive
+ * the mhandle, so they mustn't keep a reference to the share once they're
+ * no longer in the multi handle.  Otherwise the share can't be freed.
+ *
+ * @param[in] randle	to detach.  Must not be in a multi handle.
+ */
+static inline void _fr_curl_io_request_detach(fr_curl_io_request_t *randle)
+{
+	if (!randle->share) return;
+
+	curl_easy_setopt(randle->candle, CURLOPT_SHARE, NULL);
+	randle->share = NULL;
+}
+
 /** De-queue curl requests and wake up the requests that initiated them
  *
  * @param[in] mhandle	containing the event loop and request counter.
@@ -70,6 +86,7 @@ static inline void _fr_curl_io_demux(fr_curl_handle_t *mhandle, CURLM *mandle)
 			if (!fr_cond_assert_msg(ret == CURLE_OK,
 						"Failed retrieving request data from CURL easy handle (candle)")) {
 				curl_multi_remove_handle(mandle, candle);
+				curl_easy_setopt(candle, CURLOPT_SHARE, NULL);
 				return;
 			}
 			request = randle->request;
@@ -85,11 +102,34 @@ static inline void _fr_curl_io_demux(fr_curl_handle_t *mhandle, CURLM *mandle)
 			}
 			randle->result = m->data.result;
 
+			/*
+			 *	Record whether the transfer needed a new
+			 *	connection, or reused an existing one.
+			 */
+			{
+				long connects = 0;
+
+				mhandle->completed++;
+				if (curl_easy_getinfo(candle, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) {
+					mhandle->connects += connects;
+					RDEBUG3("Transfer %s", connects ? "opened a new connection" : "reused a connection");
+				}
+#if CURL_AT_LEAST_VERSION(7,50,0)
+				if (!connects) {
+					long version = 0;
+
+					if ((curl_easy_getinfo(candle, CURLINFO_HTTP_VERSION, &version) == CURLE_OK) &&
+					    (version >= CURL_HTTP_VERSION_2_0)) mhandle->multiplexed++;
+				}
+#endif
+			}
+
 			/*
 			 *	Looks like this needs to be done last,
 			 *	else m->data.result ends up being junk.
 			 */
 			curl_multi_remove_handle(mandle, candle);
+			_fr_curl_io_request_detach(randle);
 
 			unlang_interpret_mark_runnable(request);
 		}
@@ -498,6 +538,16 @@ int fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle, request_t *request, fr
 		return -1;
 	}
 
+	/*
+	 *	Use the thread's DNS, TLS session and connection
+	 *	caches, so transfers don't repeat lookups and
+	 *	handshakes other transfers have already done.
+	 */
+	if (mhandle->share) {
+		FR_CURL_REQUEST_SET_OPTION(CURLOPT_SHARE, mhandle->share);
+		randle->share = mhandle->share;
+	}
+
 	/*
 	 *	Increment here, else the debug output looks
 	 *	messed up is curl_multi_add_handle triggers
@@ -508,17 +558,42 @@ int fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle, request_t *request, fr
 	if (mret != CURLM_OK) {
 		mhandle->transfers--;
 		REDEBUG("Request failed: %i - %s", mret, curl_multi_strerror(mret));
-		return -1;
+		goto error;
 	}
 
 	return 0;
 
 error:
+	_fr_curl_io_request_detach(randle);
 	return -1;
 }
 
+/** Stop a transfer before it completes
+ *
+ * Used when the request that started the transfer is cancelled.  The
+ * easy handle can be reused, or freed, afterwards.
+ *
+ * @param[in] mhandle	the transfer was enqueued with.
+ * @param[in] randle	to stop.
+ */
+void fr_curl_io_request_cancel(fr_curl_handle_t *mhandle, fr_curl_io_request_t *randle)
+{
+	request_t	*request = randle->request;
+	CURLMcode	ret;
+
+	ret = curl_multi_remove_handle(mhandle->mandle, randle->candle);	/* Gracefully terminate the request */
+	if (ret != CURLM_OK) {
+		RERROR("Failed removing curl handle from multi-handle: %s (%i)", curl_multi_strerror(ret), ret);
+		/* Not much we can do */
+	}
+	mhandle->transfers--;
+
+	_fr_curl_io_request_detach(randle);
+}
+
 static int _fr_curl_io_request_free(fr_curl_io_request_t *randle)
 {
+	_fr_curl_io_request_detach(randle);
 	curl_easy_cleanup(randle->candle);
 
 	return 0;
@@ -550,15 +625,71 @@ fr_curl_io_request_t *fr_curl_io_request_alloc(TALLOC_CTX *ctx)
  */
 static int _mhandle_free(fr_curl_handle_t *mhandle)
 {
+	DEBUG2("curl - %" PRIu64 " transfers completed, %" PRIu64 " used new connections, "
+	       "%" PRIu64 " reused HTTP/2 connections",
+	       mhandle->completed, mhandle->connects, mhandle->multiplexed);
+
 	curl_multi_cleanup(mhandle->mandle);
+	if (mhandle->share) {
+		CURLSHcode ret;
+
+		/*
+		 *	An easy handle still has a reference, which
+		 *	shouldn't happen.  Leak the share rather than
+		 *	leaving the easy handle pointing at freed memory.
+		 */
+		ret = curl_share_cleanup(mhandle->share);
+		if (ret != CURLSHE_OK) {
+			ERROR("Failed freeing curl share handle: %s (%i)", curl_share_strerror(ret), ret);
+		}
+	}
 
 	return 0;
 }
 
+/** Create a share handle for a thread's caches
+ *
+ * No locking callbacks are set, the handle is only used by transfers
+ * running on a single thread.
+ *
+ * @return
+ *	- A new share handle.
+ *	- NULL on error.
+ */
+static CURLSH *fr_curl_share_alloc(void)
+{
+	CURLSH		*share;
+	CURLSHcode	ret;
+
+	share = curl_share_init();
+	if (!share) {
+		ERROR("Curl share-handle instantiation failed");
+		return NULL;
+	}
+
+#define SET_SHOPTION(_opt, _val) \
+do { \
+	if ((ret = curl_share_setopt(share, _opt, _val)) != CURLSHE_OK) { \
+		ERROR("Failed setting curl share option %s: %s (%i)", STRINGIFY(_val), curl_share_strerror(ret), ret); \
+		curl_share_cleanup(share); \
+		return NULL; \
+	} \
+} while (0)
+
+	SET_SHOPTION(CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	SET_SHOPTION(CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if CURL_AT_LEAST_VERSION(7,57,0)
+	SET_SHOPTION(CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+	return share;
+}
+
 /** Performs the libcurl initialisation of the thread
  *
  * @param[in] ctx		to alloc handle in.
  * @param[in] el		to initial.
+ * @param[in] conn_config	Connection limits.  May be NULL.
  * @param[in] multiplex		Run multiple requests over the same connection simultaneously.
  *				HTTP/2 only.
  * @return
@@ -567,6 +698,7 @@ static int _mhandle_free(fr_curl_handle_t *mhandle)
  */
 fr_curl_handle_t *fr_curl_io_init(TALLOC_CTX *ctx,
 				   fr_event_list_t *el,
+				   fr_curl_conn_config_t const *conn_config,
 #ifndef CURLPIPE_MULTIPLEX
 				   UNUSED
 #endif
@@ -605,6 +737,26 @@ fr_curl_handle_t *fr_curl_io_init(TALLOC_CTX *ctx,
 	SET_MOPTION(mandle, CURLMOPT_PIPELINING, multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
 #endif
 
+	/*
+	 *	Bound the number of connections.  With multiplexing
+	 *	enabled, transfers over the limit are added as
+	 *	streams on existing connections.
+	 */
+	if (conn_config) {
+		if (conn_config->max_host_connections) {
+			SET_MOPTION(mandle, CURLMOPT_MAX_HOST_CONNECTIONS, (long)conn_config->max_host_connections);
+		}
+		if (conn_config->max_total_connections) {
+			SET_MOPTION(mandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)conn_config->max_total_connections);
+		}
+	}
+
+	mhandle->share = fr_curl_share_alloc();
+	if (!mhandle->share) {
+		talloc_free(mhandle);
+		return NULL;
+	}
+
 	return mhandle;
 
 error:
@@ -0,0 +1,783 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Write to files from a dedicated thread.
+ * @file io/file_writer.c
+ *
+ * Writing to a file from a worker means the worker stops processing
+ * requests whenever the disk is slow.  Instead, each worker copies
+ * the data to be written into an entry, and pushes it onto its own
+ * atomic queue.  A single writer thread per file writer pops entries
+ * from all of the queues, groups them by file, and writes each group
+ * with as few calls to writev() as possible.
+ *
+ * Entries can also be "durable".  The writer fsync()s the file before
+ * passing a durable entry back to the worker which queued it, and
+ * the worker then resumes the request that was waiting for it.
+ *
+ * Entries are allocated with malloc(), as they're freed by a
+ * different thread to the one which allocated them.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/io/file_writer.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/iovec.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+/*
+ *	The unit tests don't have an interpreter, so they provide their
+ *	own function for resuming requests.  They can also hold the
+ *	writer at the start of each batch.
+ */
+#ifdef FILE_WRITER_TESTS
+#  define FILE_WRITER_RESUME(_request)	file_writer_test_resume(_request)
+#  define FILE_WRITER_BATCH(_num)	file_writer_test_batch(_num)
+#else
+#  define FILE_WRITER_RESUME(_request)	unlang_interpret_mark_runnable(_request)
+#  define FILE_WRITER_BATCH(_num)
+#endif
+
+struct fr_file_writer_s {
+	fr_file_writer_conf_t const	*conf;		//!< How we write.
+	char const		*name;			//!< For log messages.
+	mode_t			permissions;		//!< For new files.
+	gid_t			group;			//!< For new files, or -1 to leave it alone.
+	exfile_t		*ef;			//!< Only used by the writer thread.
+
+	pthread_t		pthread_id;		//!< Of the writer thread.
+	bool			running;		//!< Whether the writer thread was started.
+
+	pthread_mutex_t		mutex;			//!< Protects the fields below.
+	pthread_cond_t		cond;			//!< Signalled when there's work for the writer.
+	atomic_bool		sleeping;		//!< Whether the writer is waiting on cond.
+	bool			stop;			//!< Tell the writer to exit.
+	fr_dlist_head_t		threads;		//!< Workers which can queue entries.
+
+	uint64_t		written;		//!< Entries written.
+	uint64_t		failed;			//!< Entries which couldn't be written.
+	uint64_t		bytes;			//!< Bytes written.
+	uint64_t		batches;		//!< Batches written.
+	uint64_t		fsyncs;			//!< Calls to fsync().
+};
+
+struct fr_file_writer_thread_s {
+	fr_dlist_t		entry;			//!< In the writer's list of threads.
+	fr_file_writer_t	*fw;			//!< We queue entries for.
+	fr_event_list_t		*el;			//!< Of the worker.
+
+	fr_atomic_queue_t	*queue;			//!< Entries from the worker to the writer.
+	fr_atomic_queue_t	*done;			//!< Durable entries from the writer to the worker.
+	int			pipe[2];		//!< Wakes the worker when there's something in done.
+
+	atomic_uint_fast64_t	pending;		//!< Entries the writer hasn't finished with.
+	atomic_uint_fast64_t	queued;			//!< Entries queued.
+	atomic_uint_fast64_t	dropped;		//!< Entries dropped because the queue was full.
+};
+
+struct fr_file_writer_entry_s {
+	fr_file_writer_thread_t	*t;			//!< Which queued the entry.
+	request_t		*request;		//!< Waiting for a durable entry, or NULL.
+	bool			durable;		//!< fsync() before returning the entry.
+	bool			returned;		//!< The worker has the entry back.
+	int			error;			//!< errno of the failed write, or 0.
+
+	char const		*path;			//!< To write to.
+	char const		*header;		//!< Written first if the file is empty.
+	size_t			header_len;
+	char const		*data;			//!< To write.
+	size_t			data_len;
+};
+
+/** A file which has been written to since the last fsync()
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;
+	char			path[];
+} file_writer_dirty_t;
+
+static fr_table_num_sorted_t const file_writer_fsync_table[] = {
+	{ L("batch"),		FR_FILE_WRITER_FSYNC_BATCH	},
+	{ L("interval"),	FR_FILE_WRITER_FSYNC_INTERVAL	},
+	{ L("none"),		FR_FILE_WRITER_FSYNC_NONE	}
+};
+static size_t file_writer_fsync_table_len = NUM_ELEMENTS(file_writer_fsync_table);
+
+conf_parser_t const fr_file_writer_config[] = {
+	{ FR_CONF_OFFSET("enable", fr_file_writer_conf_t, enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("queue_size", fr_file_writer_conf_t, queue_size), .dflt = "1024" },
+	{ FR_CONF_OFFSET("batch_size", fr_file_writer_conf_t, batch_size), .dflt = "256" },
+	{ FR_CONF_OFFSET("fsync", fr_file_writer_conf_t, fsync),
+	  .func = cf_table_parse_int,
+	  .uctx = &(cf_table_parse_ctx_t){ .table = file_writer_fsync_table, .len = &file_writer_fsync_table_len },
+	  .dflt = "none" },
+	{ FR_CONF_OFFSET("fsync_interval", fr_file_writer_conf_t, fsync_interval), .dflt = "1.0" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Wake the writer thread
+ *
+ */
+static void file_writer_wake(fr_file_writer_t *fw)
+{
+	pthread_mutex_lock(&fw->mutex);
+	pthread_cond_signal(&fw->cond);
+	pthread_mutex_unlock(&fw->mutex);
+}
+
+/** Resume the requests waiting for durable entries
+ *
+ * Entries for requests which have gone away are freed here.
+ */
+static void file_writer_done(fr_file_writer_thread_t *t)
+{
+	void *data;
+
+	while (fr_atomic_queue_pop(t->done, &data)) {
+		fr_file_writer_entry_t *entry = data;
+
+		if (!entry->request) {
+			free(entry);
+			continue;
+		}
+
+		entry->returned = true;
+		FILE_WRITER_RESUME(entry->request);
+	}
+}
+
+static void _file_writer_pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_file_writer_thread_t	*t = talloc_get_type_abort(uctx, fr_file_writer_thread_t);
+	char			buff[64];
+
+	while (read(fd, buff, sizeof(buff)) > 0);
+
+	file_writer_done(t);
+}
+
+/** Take a batch of entries from the workers' queues
+ *
+ * Must be called with the mutex held.  Entries are taken from each
+ * queue in turn, so one busy worker can't starve the others.
+ */
+static size_t file_writer_collect(fr_file_writer_t *fw, fr_file_writer_entry_t **batch)
+{
+	size_t	num = 0;
+	bool	more = true;
+
+	while (more && (num < fw->conf->batch_size)) {
+		more = false;
+
+		fr_dlist_foreach(&fw->threads, fr_file_writer_thread_t, t) {
+			void *data;
+
+			if (num >= fw->conf->batch_size) break;
+			if (!fr_atomic_queue_pop(t->queue, &data)) continue;
+
+			batch[num++] = data;
+			more = true;
+		}
+	}
+
+	return num;
+}
+
+/** Remember that a file needs to be fsync()'d
+ *
+ */
+static void file_writer_dirty_add(fr_dlist_head_t *dirty, char const *path)
+{
+	file_writer_dirty_t	*d;
+	size_t			len;
+
+	fr_dlist_foreach(dirty, file_writer_dirty_t, existing) {
+		if (strcmp(existing->path, path) == 0) return;
+	}
+
+	len = strlen(path);
+	d = malloc(sizeof(*d) + len + 1);
+	if (!d) return;
+
+	memcpy(d->path, path, len + 1);
+	fr_dlist_insert_tail(dirty, d);
+}
+
+/** fsync() all of the files written to since the last call
+ *
+ * The files are opened again rather than going through the exfile
+ * handle, so that files which have been rotated away aren't created.
+ *
+ * @return the number of files fsync()'d.
+ */
+static uint64_t file_writer_dirty_sync(fr_file_writer_t *fw, fr_dlist_head_t *dirty)
+{
+	file_writer_dirty_t	*d;
+	uint64_t		num = 0;
+
+	while ((d = fr_dlist_pop_head(dirty))) {
+		int fd;
+
+		fd = open(d->path, O_WRONLY);
+		if (fd >= 0) {
+			if (fsync(fd) < 0) {
+				ERROR("%s - Failed syncing \"%s\": %s", fw->name, d->path, fr_syserror(errno));
+			}
+			close(fd);
+			num++;
+		}
+
+		free(d);
+	}
+
+	return num;
+}
+
+/** Write a group of entries for the same file
+ *
+ * @return the number of bytes written, or -1 on error.
+ */
+static ssize_t file_writer_group(fr_file_writer_t *fw, fr_file_writer_entry_t **group, size_t num,
+				 bool *synced, int *error, struct iovec *vector)
+{
+	char const	*path = group[0]->path;
+	bool		durable = false;
+	int		fd;
+	off_t		offset;
+	size_t		i, used = 0;
+	ssize_t		total = 0, slen;
+
+	fd = exfile_open(fw->ef, path, fw->permissions, &offset);
+	if (fd < 0) {
+		*error = errno ? errno : EIO;
+		ERROR("%s - Failed opening \"%s\": %s", fw->name, path, fr_strerror());
+		return -1;
+	}
+
+	if ((fw->group != (gid_t) -1) && (chown(path, -1, fw->group) < 0)) {
+		WARN("%s - Unable to change system group of \"%s\": %s", fw->name, path, fr_syserror(errno));
+	}
+
+	if ((offset == 0) && group[0]->header_len) {
+		vector[used].iov_base = UNCONST(char *, group[0]->header);
+		vector[used].iov_len = group[0]->header_len;
+		used++;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (group[i]->durable) durable = true;
+
+		vector[used].iov_base = UNCONST(char *, group[i]->data);
+		vector[used].iov_len = group[i]->data_len;
+		used++;
+
+		if ((used < IOV_MAX) && (i < (num - 1))) continue;
+
+		slen = fr_writev(fd, vector, used, fr_time_delta_wrap(0));
+		if (slen < 0) {
+		error:
+			*error = errno;
+			ERROR("%s - Failed writing to \"%s\": %s", fw->name, path, fr_syserror(errno));
+			exfile_close(fw->ef, fd);
+			return -1;
+		}
+		total += slen;
+		used = 0;
+	}
+
+	if (durable || (fw->conf->fsync == FR_FILE_WRITER_FSYNC_BATCH)) {
+		if (fsync(fd) < 0) goto error;
+		*synced = true;
+	}
+
+	exfile_close(fw->ef, fd);
+
+	return total;
+}
+
+/** Write a batch of entries
+ *
+ * Entries are grouped by file, keeping the order they were queued in,
+ * and each group is written with as few calls to writev() as possible.
+ */
+static void file_writer_batch(fr_file_writer_t *fw, fr_file_writer_entry_t **batch, size_t num,
+			      fr_dlist_head_t *dirty, struct iovec *vector)
+{
+	size_t		i, j, k;
+	uint64_t	written = 0, failed = 0, bytes = 0, fsyncs = 0;
+
+	FILE_WRITER_BATCH(num);
+
+	for (i = 0; i < num; i = j) {
+		bool	synced = false;
+		int	error = 0;
+		ssize_t	slen;
+
+		/*
+		 *	Move the other entries for this file up
+		 *	behind the first one.
+		 */
+		for (j = i + 1, k = i + 1; k < num; k++) {
+			fr_file_writer_entry_t *tmp;
+
+			if (strcmp(batch[k]->path, batch[i]->path) != 0) continue;
+
+			tmp = batch[k];
+			memmove(&batch[j + 1], &batch[j], (k - j) * sizeof(batch[0]));
+			batch[j++] = tmp;
+		}
+
+		slen = file_writer_group(fw, &batch[i], j - i, &synced, &error, vector);
+		for (k = i; k < j; k++) batch[k]->error = error;
+
+		if (slen < 0) {
+			failed += j - i;
+			continue;
+		}
+
+		written += j - i;
+		bytes += slen;
+
+		if (synced) {
+			fsyncs++;
+		} else if (fw->conf->fsync == FR_FILE_WRITER_FSYNC_INTERVAL) {
+			file_writer_dirty_add(dirty, batch[i]->path);
+		}
+	}
+
+	/*
+	 *	Return the durable entries to their workers, and
+	 *	free the rest.
+	 */
+	for (i = 0; i < num; i++) {
+		fr_file_writer_entry_t	*entry = batch[i];
+		fr_file_writer_thread_t	*t = entry->t;
+
+		if (!entry->durable) {
+			free(entry);
+		} else {
+			while (!fr_atomic_queue_push(t->done, entry)) usleep(100);
+
+			while (write(t->pipe[1], ".", 1) == 0) {
+				/* nothing */
+			}
+		}
+
+		atomic_fetch_sub_explicit(&t->pending, 1, memory_order_release);
+	}
+
+	pthread_mutex_lock(&fw->mutex);
+	fw->written += written;
+	fw->failed += failed;
+	fw->bytes += bytes;
+	fw->fsyncs += fsyncs;
+	fw->batches++;
+	pthread_mutex_unlock(&fw->mutex);
+}
+
+static void *file_writer_thread(void *arg)
+{
+	fr_file_writer_t	*fw = arg;
+	fr_file_writer_entry_t	**batch;
+	struct iovec		*vector;
+	fr_dlist_head_t		dirty;
+	fr_time_t		next_sync = fr_time_add(fr_time(), fw->conf->fsync_interval);
+
+	batch = malloc(sizeof(batch[0]) * fw->conf->batch_size);
+	vector = malloc(sizeof(vector[0]) * (IOV_MAX + 1));
+	if (!batch || !vector) {
+		ERROR("%s - Out of memory starting writer thread", fw->name);
+		free(batch);
+		free(vector);
+		return NULL;
+	}
+	fr_dlist_init(&dirty, file_writer_dirty_t, entry);
+
+	pthread_mutex_lock(&fw->mutex);
+	while (true) {
+		size_t num;
+
+		num = file_writer_collect(fw, batch);
+		if (num == 0) {
+			/*
+			 *	Workers check 'sleeping' after pushing an
+			 *	entry, so they either see it set, or we see
+			 *	their entry on the second pass.
+			 */
+			atomic_store(&fw->sleeping, true);
+			atomic_thread_fence(memory_order_seq_cst);
+
+			num = file_writer_collect(fw, batch);
+			if ((num == 0) && fw->stop) break;
+
+			if (num == 0) {
+				if (fr_dlist_num_elements(&dirty) > 0) {
+					struct timespec ts;
+					fr_time_delta_t left = fr_time_sub(next_sync, fr_time());
+
+					clock_gettime(CLOCK_REALTIME, &ts);
+					if (fr_time_delta_ispos(left)) {
+						int64_t ns = fr_time_delta_unwrap(left) + ts.tv_nsec;
+
+						ts.tv_sec += ns / NSEC;
+						ts.tv_nsec = ns % NSEC;
+						(void) pthread_cond_timedwait(&fw->cond, &fw->mutex, &ts);
+					}
+				} else {
+					pthread_cond_wait(&fw->cond, &fw->mutex);
+				}
+			}
+			atomic_store(&fw->sleeping, false);
+		}
+
+		pthread_mutex_unlock(&fw->mutex);
+
+		if (num > 0) file_writer_batch(fw, batch, num, &dirty, vector);
+
+		if ((fr_dlist_num_elements(&dirty) > 0) && fr_time_gteq(fr_time(), next_sync)) {
+			uint64_t fsyncs = file_writer_dirty_sync(fw, &dirty);
+
+			next_sync = fr_time_add(fr_time(), fw->conf->fsync_interval);
+
+			pthread_mutex_lock(&fw->mutex);
+			fw->fsyncs += fsyncs;
+			pthread_mutex_unlock(&fw->mutex);
+		}
+
+		pthread_mutex_lock(&fw->mutex);
+	}
+	pthread_mutex_unlock(&fw->mutex);
+
+	(void) file_writer_dirty_sync(fw, &dirty);
+
+	free(batch);
+	free(vector);
+
+	return NULL;
+}
+
+static int _file_writer_free(fr_file_writer_t *fw)
+{
+	if (fw->running) {
+		pthread_mutex_lock(&fw->mutex);
+		fw->stop = true;
+		pthread_cond_signal(&fw->cond);
+		pthread_mutex_unlock(&fw->mutex);
+
+		pthread_join(fw->pthread_id, NULL);
+	}
+
+	pthread_cond_destroy(&fw->cond);
+	pthread_mutex_destroy(&fw->mutex);
+
+	return 0;
+}
+
+/** Allocate a file writer, and start its thread
+ *
+ * @param[in] ctx		to allocate the writer in.
+ * @param[in] conf		How to write.  Must remain valid for the lifetime of the writer.
+ * @param[in] name		to use in log messages.
+ * @param[in] permissions	for new files.
+ * @param[in] group		to set on files, or -1 to leave it alone.
+ * @param[in] locking		whether files should be locked while they're written to.
+ * @return
+ *	- A new file writer on success.
+ *	- NULL on failure.
+ */
+fr_file_writer_t *fr_file_writer_alloc(TALLOC_CTX *ctx, fr_file_writer_conf_t const *conf, char const *name,
+				       mode_t permissions, gid_t group, bool locking)
+{
+	fr_file_writer_t *fw;
+
+	MEM(fw = talloc_zero(ctx, fr_file_writer_t));
+	fw->conf = conf;
+	fw->name = talloc_typed_strdup(fw, name);
+	fw->permissions = permissions;
+	fw->group = group;
+
+	fw->ef = exfile_init(fw, 256, fr_time_delta_from_sec(30), locking);
+	if (!fw->ef) {
+		talloc_free(fw);
+		return NULL;
+	}
+
+	pthread_mutex_init(&fw->mutex, NULL);
+	pthread_cond_init(&fw->cond, NULL);
+	atomic_init(&fw->sleeping, false);
+	fr_dlist_talloc_init(&fw->threads, fr_file_writer_thread_t, entry);
+	talloc_set_destructor(fw, _file_writer_free);
+
+	if (fr_schedule_pthread_create(&fw->pthread_id, file_writer_thread, fw) < 0) {
+		talloc_free(fw);
+		return NULL;
+	}
+	fw->running = true;
+
+	return fw;
+}
+
+/** Wait for the writer to finish with this thread's entries, and unregister it
+ *
+ */
+static int _file_writer_thread_free(fr_file_writer_thread_t *t)
+{
+	fr_file_writer_t	*fw = t->fw;
+	void			*data;
+
+	while (atomic_load_explicit(&t->pending, memory_order_acquire) > 0) {
+		file_writer_wake(fw);
+		file_writer_done(t);
+		usleep(1000);
+	}
+
+	pthread_mutex_lock(&fw->mutex);
+	fr_dlist_remove(&fw->threads, t);
+	pthread_mutex_unlock(&fw->mutex);
+
+	/*
+	 *	The requests have all gone by now.
+	 */
+	while (fr_atomic_queue_pop(t->done, &data)) free(data);
+
+	(void) fr_event_fd_delete(t->el, t->pipe[0], FR_EVENT_FILTER_IO);
+	close(t->pipe[0]);
+	close(t->pipe[1]);
+
+	return 0;
+}
+
+/** Register a worker with a file writer
+ *
+ * @param[in] ctx	to allocate the thread's queues in.
+ * @param[in] fw	to register with.
+ * @param[in] el	of the worker.
+ * @return
+ *	- The worker's handle for queueing entries.
+ *	- NULL on failure.
+ */
+fr_file_writer_thread_t *fr_file_writer_thread_alloc(TALLOC_CTX *ctx, fr_file_writer_t *fw, fr_event_list_t *el)
+{
+	fr_file_writer_thread_t *t;
+
+	MEM(t = talloc_zero(ctx, fr_file_writer_thread_t));
+	t->fw = fw;
+	t->el = el;
+
+	t->queue = fr_atomic_queue_alloc(t, fw->conf->queue_size);
+	t->done = fr_atomic_queue_alloc(t, fw->conf->queue_size);
+	if (!t->queue || !t->done) {
+		fr_strerror_const("Failed allocating queues");
+		talloc_free(t);
+		return NULL;
+	}
+
+	if (pipe(t->pipe) < 0) {
+		fr_strerror_printf("Failed opening pipe: %s", fr_syserror(errno));
+		talloc_free(t);
+		return NULL;
+	}
+	(void) fcntl(t->pipe[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+	(void) fcntl(t->pipe[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+
+	if (fr_event_fd_insert(t, el, t->pipe[0], _file_writer_pipe_read, NULL, NULL, t) < 0) {
+		fr_strerror_const_push("Failed adding pipe to event list");
+		close(t->pipe[0]);
+		close(t->pipe[1]);
+		talloc_free(t);
+		return NULL;
+	}
+
+	atomic_init(&t->pending, 0);
+	atomic_init(&t->queued, 0);
+	atomic_init(&t->dropped, 0);
+
+	pthread_mutex_lock(&fw->mutex);
+	fr_dlist_insert_tail(&fw->threads, t);
+	pthread_mutex_unlock(&fw->mutex);
+
+	talloc_set_destructor(t, _file_writer_thread_free);
+
+	return t;
+}
+
+/** Queue data to be written to a file
+ *
+ * The data is copied, so the caller can free it as soon as this returns.
+ *
+ * If the worker's queue is full, the entry is dropped, and counted in
+ * the statistics.  The worker never waits for the writer, so a slow
+ * disk can't stop it processing requests.
+ *
+ * @param[in] t		Thread specific handle of the writer.
+ * @param[out] durable	If not NULL, the entry is fsync()'d once written, and
+ *			request is marked runnable.  The caller must then
+ *			check the result with #fr_file_writer_entry_error,
+ *			and free the entry with #fr_file_writer_entry_free.
+ * @param[in] request	to resume when a durable entry has been written.
+ * @param[in] path	of the file to write to.
+ * @param[in] header	written before the data, if the file is empty.
+ * @param[in] header_len	Number of elements in header.
+ * @param[in] vector	to write.
+ * @param[in] vector_len	Number of elements in vector.
+ * @return
+ *	- The number of bytes queued.
+ *	- -1 on failure, including when the queue is full.
+ */
+ssize_t fr_file_writer_write(fr_file_writer_thread_t *t, fr_file_writer_entry_t **durable,
+			     request_t *request, char const *path,
+			     struct iovec const *header, size_t header_len,
+			     struct iovec const *vector, size_t vector_len)
+{
+	fr_file_writer_entry_t	*entry;
+	size_t			path_len = strlen(path), head_total = 0, data_total = 0, i;
+	char			*p;
+
+	for (i = 0; i < header_len; i++) head_total += header[i].iov_len;
+	for (i = 0; i < vector_len; i++) data_total += vector[i].iov_len;
+
+	entry = malloc(sizeof(*entry) + path_len + 1 + head_total + data_total);
+	if (!entry) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	*entry = (fr_file_writer_entry_t) {
+		.t = t,
+		.request = durable ? request : NULL,
+		.durable = (durable != NULL),
+		.header_len = head_total,
+		.data_len = data_total
+	};
+
+	p = (char *)(entry + 1);
+	memcpy(p, path, path_len + 1);
+	entry->path = p;
+	p += path_len + 1;
+
+	entry->header = p;
+	for (i = 0; i < header_len; i++) {
+		memcpy(p, header[i].iov_base, header[i].iov_len);
+		p += header[i].iov_len;
+	}
+
+	entry->data = p;
+	for (i = 0; i < vector_len; i++) {
+		memcpy(p, vector[i].iov_base, vector[i].iov_len);
+		p += vector[i].iov_len;
+	}
+
+	atomic_fetch_add_explicit(&t->pending, 1, memory_order_relaxed);
+
+	if (!fr_atomic_queue_push(t->queue, entry)) {
+		atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+		atomic_fetch_sub_explicit(&t->pending, 1, memory_order_relaxed);
+		free(entry);
+
+		/*
+		 *	The writer may be asleep, or waiting for us
+		 *	to make space in the done queue.
+		 */
+		file_writer_wake(t->fw);
+		file_writer_done(t);
+
+		fr_strerror_printf("Queue full, dropping entry for \"%s\"", path);
+		return -1;
+	}
+
+	atomic_fetch_add_explicit(&t->queued, 1, memory_order_relaxed);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&t->fw->sleeping)) file_writer_wake(t->fw);
+
+	if (durable) *durable = entry;
+
+	return data_total;
+}
+
+/** Get the result of writing a durable entry
+ *
+ * @return
+ *	- 0 if the entry was written and synced.
+ *	- An errno value on failure.
+ */
+int fr_file_writer_entry_error(fr_file_writer_entry_t const *entry)
+{
+	return entry->error;
+}
+
+/** Stop waiting for a durable entry
+ *
+ * Used when the request waiting for the entry is cancelled.  The
+ * entry is still written, and is freed once it has been.
+ */
+void fr_file_writer_entry_cancel(fr_file_writer_entry_t *entry)
+{
+	if (entry->returned) {
+		free(entry);
+		return;
+	}
+
+	entry->request = NULL;
+}
+
+/** Free a durable entry once its request has resumed
+ *
+ */
+void fr_file_writer_entry_free(fr_file_writer_entry_t *entry)
+{
+	free(entry);
+}
+
+/** Get statistics for a file writer
+ *
+ */
+void fr_file_writer_stats(fr_file_writer_stats_t *stats, fr_file_writer_t *fw)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&fw->mutex);
+	fr_dlist_foreach(&fw->threads, fr_file_writer_thread_t, t) {
+		stats->queued += atomic_load_explicit(&t->queued, memory_order_relaxed);
+		stats->pending += atomic_load_explicit(&t->pending, memory_order_relaxed);
+		stats->dropped += atomic_load_explicit(&t->dropped, memory_order_relaxed);
+	}
+	stats->written = fw->written;
+	stats->failed = fw->failed;
+	stats->bytes = fw->bytes;
+	stats->batches = fw->batches;
+	stats->fsyncs = fw->fsyncs;
+	pthread_mutex_unlock(&fw->mutex);
+}
@@ -0,0 +1,101 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file io/file_writer.h
+ * @brief Write to files from a dedicated thread.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(file_writer_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/time.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** When the writer calls fsync()
+ *
+ */
+typedef enum {
+	FR_FILE_WRITER_FSYNC_NONE = 0,			//!< Leave it to the OS.
+	FR_FILE_WRITER_FSYNC_INTERVAL,			//!< Every fsync_interval.
+	FR_FILE_WRITER_FSYNC_BATCH			//!< After every batch of writes.
+} fr_file_writer_fsync_t;
+
+/** Configuration for a file writer
+ *
+ */
+typedef struct {
+	bool			enable;			//!< Write from a dedicated thread.
+	uint32_t		queue_size;		//!< Entries each worker can have queued.
+	uint32_t		batch_size;		//!< Maximum number of entries written at once.
+	fr_file_writer_fsync_t	fsync;			//!< When to fsync() files.
+	fr_time_delta_t		fsync_interval;		//!< How often to fsync() files with
+							///< FR_FILE_WRITER_FSYNC_INTERVAL.
+} fr_file_writer_conf_t;
+
+/** Statistics for a file writer
+ *
+ */
+typedef struct {
+	uint64_t		queued;			//!< Entries queued by workers.
+	uint64_t		pending;		//!< Entries queued, but not yet written.
+	uint64_t		written;		//!< Entries written.
+	uint64_t		failed;			//!< Entries which couldn't be written.
+	uint64_t		bytes;			//!< Bytes written.
+	uint64_t		batches;		//!< Batches written.
+	uint64_t		fsyncs;			//!< Calls to fsync().
+	uint64_t		dropped;		//!< Entries dropped because a worker's queue was full.
+} fr_file_writer_stats_t;
+
+extern conf_parser_t const fr_file_writer_config[];
+
+typedef struct fr_file_writer_s fr_file_writer_t;
+typedef struct fr_file_writer_thread_s fr_file_writer_thread_t;
+typedef struct fr_file_writer_entry_s fr_file_writer_entry_t;
+
+fr_file_writer_t	*fr_file_writer_alloc(TALLOC_CTX *ctx, fr_file_writer_conf_t const *conf, char const *name,
+					      mode_t permissions, gid_t group, bool locking);
+
+fr_file_writer_thread_t	*fr_file_writer_thread_alloc(TALLOC_CTX *ctx, fr_file_writer_t *fw, fr_event_list_t *el);
+
+ssize_t			fr_file_writer_write(fr_file_writer_thread_t *t, fr_file_writer_entry_t **durable,
+					     request_t *request, char const *path,
+					     struct iovec const *header, size_t header_len,
+					     struct iovec const *vector, size_t vector_len);
+
+int			fr_file_writer_entry_error(fr_file_writer_entry_t const *entry);
+
+void			fr_file_writer_entry_cancel(fr_file_writer_entry_t *entry);
+
+void			fr_file_writer_entry_free(fr_file_writer_entry_t *entry);
+
+void			fr_file_writer_stats(fr_file_writer_stats_t *stats, fr_file_writer_t *fw);
+
+#ifdef __cplusplus
+}
+#endif
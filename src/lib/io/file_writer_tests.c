@@ -0,0 +1,558 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for writing files from a dedicated thread
+ *
+ * @file src/lib/io/file_writer_tests.c
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+#include <freeradius-devel/server/request.h>
+
+static void file_writer_test_resume(request_t *request);
+static void file_writer_test_batch(size_t num);
+
+#define FILE_WRITER_TESTS 1
+#include "file_writer.c"
+
+#include <dirent.h>
+
+static pthread_mutex_t	test_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	test_cond = PTHREAD_COND_INITIALIZER;
+static bool		test_hold;		//!< Hold the writer at the start of its next batch.
+static bool		test_held;		//!< The writer is being held.
+static size_t		test_last_batch;	//!< Number of entries in the last batch.
+
+static request_t	*test_resumed;		//!< The last request resumed.
+static unsigned int	test_resumed_count;	//!< How many requests were resumed.
+
+typedef struct {
+	TALLOC_CTX		*ctx;
+	char			dir[64];
+	fr_file_writer_conf_t	conf;
+	fr_event_list_t		*el;
+	fr_file_writer_t	*fw;
+	fr_file_writer_thread_t	*t;
+} test_ctx_t;
+
+/*
+ *	Called by file_writer_done() instead of marking the request runnable.
+ */
+static void file_writer_test_resume(request_t *request)
+{
+	test_resumed = request;
+	test_resumed_count++;
+}
+
+/*
+ *	Called by the writer thread at the start of each batch.
+ */
+static void file_writer_test_batch(size_t num)
+{
+	pthread_mutex_lock(&test_mutex);
+	test_last_batch = num;
+	while (test_hold) {
+		test_held = true;
+		pthread_cond_broadcast(&test_cond);
+		pthread_cond_wait(&test_cond, &test_mutex);
+	}
+	test_held = false;
+	pthread_mutex_unlock(&test_mutex);
+}
+
+static void test_init(test_ctx_t *tc, uint32_t queue_size, fr_file_writer_fsync_t fsync)
+{
+	*tc = (test_ctx_t) {
+		.dir = "/tmp/file_writer_tests.XXXXXX",
+		.conf = {
+			.enable = true,
+			.queue_size = queue_size,
+			.batch_size = 256,
+			.fsync = fsync,
+			.fsync_interval = fr_time_delta_from_sec(1)
+		}
+	};
+
+	test_hold = false;
+	test_held = false;
+	test_last_batch = 0;
+	test_resumed = NULL;
+	test_resumed_count = 0;
+
+	TEST_ASSERT(mkdtemp(tc->dir) != NULL);
+
+	tc->ctx = talloc_init_const("file_writer_tests");
+	TEST_ASSERT(tc->ctx != NULL);
+
+	tc->el = fr_event_list_alloc(tc->ctx, NULL, NULL);
+	TEST_ASSERT(tc->el != NULL);
+
+	tc->fw = fr_file_writer_alloc(tc->ctx, &tc->conf, "file_writer_tests", 0600, (gid_t) -1, false);
+	TEST_ASSERT(tc->fw != NULL);
+
+	tc->t = fr_file_writer_thread_alloc(tc->ctx, tc->fw, tc->el);
+	TEST_ASSERT(tc->t != NULL);
+}
+
+static void test_free(test_ctx_t *tc)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	char		path[PATH_MAX];
+
+	talloc_free(tc->t);
+	talloc_free(tc->fw);
+	talloc_free(tc->ctx);
+
+	dir = opendir(tc->dir);
+	if (!dir) return;
+
+	while ((dp = readdir(dir))) {
+		if (dp->d_name[0] == '.') continue;
+
+		snprintf(path, sizeof(path), "%s/%s", tc->dir, dp->d_name);
+		(void) unlink(path);
+	}
+	closedir(dir);
+
+	(void) rmdir(tc->dir);
+}
+
+static ssize_t test_write(test_ctx_t *tc, fr_file_writer_entry_t **durable, request_t *request,
+			  char const *name, char const *header, char const *data)
+{
+	char		path[PATH_MAX];
+	struct iovec	head = { .iov_base = UNCONST(char *, header), .iov_len = header ? strlen(header) : 0 };
+
+	snprintf(path, sizeof(path), "%s/%s", tc->dir, name);
+
+	return fr_file_writer_write(tc->t, durable, request, path, &head, header ? 1 : 0,
+				    &(struct iovec){ .iov_base = UNCONST(char *, data), .iov_len = strlen(data) }, 1);
+}
+
+static char const *test_read(test_ctx_t *tc, char const *name, char *buff, size_t bufflen)
+{
+	char	path[PATH_MAX];
+	int	fd;
+	ssize_t	len;
+
+	snprintf(path, sizeof(path), "%s/%s", tc->dir, name);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return "";
+
+	len = read(fd, buff, bufflen - 1);
+	close(fd);
+	if (len < 0) return "";
+
+	buff[len] = '\0';
+	return buff;
+}
+
+/*
+ *	Wait for the writer to finish with all of the entries.
+ */
+static bool test_wait_pending(test_ctx_t *tc)
+{
+	int i;
+
+	for (i = 0; i < 5000; i++) {
+		if (atomic_load_explicit(&tc->t->pending, memory_order_acquire) == 0) return true;
+		usleep(1000);
+	}
+
+	return false;
+}
+
+/*
+ *	Run the worker's event loop, which picks up returned durable entries.
+ */
+static void test_service(test_ctx_t *tc)
+{
+	if (fr_event_corral(tc->el, fr_time(), false) > 0) fr_event_service(tc->el);
+}
+
+static bool test_wait_resumed(test_ctx_t *tc, unsigned int count)
+{
+	int i;
+
+	for (i = 0; i < 5000; i++) {
+		test_service(tc);
+		if (test_resumed_count >= count) return true;
+		usleep(1000);
+	}
+
+	return false;
+}
+
+/*
+ *	Queue an entry for a file of its own, and wait until the writer
+ *	is holding it, so that later entries pile up in the queue.
+ */
+static void test_writer_hold(test_ctx_t *tc)
+{
+	int	i;
+	bool	held = false;
+
+	pthread_mutex_lock(&test_mutex);
+	test_hold = true;
+	pthread_mutex_unlock(&test_mutex);
+
+	TEST_ASSERT(test_write(tc, NULL, NULL, "hold", NULL, "hold\n") == 5);
+
+	for (i = 0; (i < 5000) && !held; i++) {
+		pthread_mutex_lock(&test_mutex);
+		held = test_held;
+		pthread_mutex_unlock(&test_mutex);
+		if (!held) usleep(1000);
+	}
+	TEST_ASSERT(held);
+}
+
+static void test_writer_release(void)
+{
+	pthread_mutex_lock(&test_mutex);
+	test_hold = false;
+	pthread_cond_broadcast(&test_cond);
+	pthread_mutex_unlock(&test_mutex);
+}
+
+/*
+ *	Entries for the same file are written together, in the order
+ *	they were queued, and the header is only written to empty files.
+ */
+static void test_group_order(void)
+{
+	test_ctx_t		tc;
+	fr_file_writer_stats_t	stats;
+	char			buff[256];
+
+	test_init(&tc, 64, FR_FILE_WRITER_FSYNC_NONE);
+
+	test_writer_hold(&tc);
+
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", "#\n", "a1\n") == 3);
+	TEST_CHECK(test_write(&tc, NULL, NULL, "b", "#\n", "b1\n") == 3);
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", "#\n", "a2\n") == 3);
+	TEST_CHECK(test_write(&tc, NULL, NULL, "b", "#\n", "b2\n") == 3);
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", "#\n", "a3\n") == 3);
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.queued == 6);
+	TEST_CHECK(stats.pending == 6);
+	TEST_CHECK(stats.written == 0);
+
+	test_writer_release();
+	TEST_ASSERT(test_wait_pending(&tc));
+
+	/*
+	 *	Everything queued while the writer was held is
+	 *	written in one batch.
+	 */
+	TEST_CHECK(test_last_batch == 5);
+	TEST_MSG("Expected 5 entries in the batch, got %zu", test_last_batch);
+
+	TEST_CHECK(strcmp(test_read(&tc, "a", buff, sizeof(buff)), "#\na1\na2\na3\n") == 0);
+	TEST_MSG("a contains \"%s\"", buff);
+	TEST_CHECK(strcmp(test_read(&tc, "b", buff, sizeof(buff)), "#\nb1\nb2\n") == 0);
+	TEST_MSG("b contains \"%s\"", buff);
+
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", "#\n", "a4\n") == 3);
+	TEST_ASSERT(test_wait_pending(&tc));
+
+	TEST_CHECK(strcmp(test_read(&tc, "a", buff, sizeof(buff)), "#\na1\na2\na3\na4\n") == 0);
+	TEST_MSG("a contains \"%s\"", buff);
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.queued == 7);
+	TEST_CHECK(stats.pending == 0);
+	TEST_CHECK(stats.written == 7);
+	TEST_CHECK(stats.failed == 0);
+	TEST_CHECK(stats.batches == 3);
+	TEST_CHECK(stats.bytes == (5 + 11 + 8 + 3));
+	TEST_CHECK(stats.fsyncs == 0);
+
+	test_free(&tc);
+}
+
+static void test_fsync_none(void)
+{
+	test_ctx_t		tc;
+	fr_file_writer_stats_t	stats;
+
+	test_init(&tc, 64, FR_FILE_WRITER_FSYNC_NONE);
+
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", NULL, "a1\n") == 3);
+	TEST_CHECK(test_write(&tc, NULL, NULL, "b", NULL, "b1\n") == 3);
+	TEST_ASSERT(test_wait_pending(&tc));
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.written == 2);
+	TEST_CHECK(stats.fsyncs == 0);
+
+	test_free(&tc);
+}
+
+/*
+ *	Each file in a batch is synced once, however many entries it has.
+ */
+static void test_fsync_batch(void)
+{
+	test_ctx_t		tc;
+	fr_file_writer_stats_t	stats;
+
+	test_init(&tc, 64, FR_FILE_WRITER_FSYNC_BATCH);
+
+	test_writer_hold(&tc);
+
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", NULL, "a1\n") == 3);
+	TEST_CHECK(test_write(&tc, NULL, NULL, "b", NULL, "b1\n") == 3);
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", NULL, "a2\n") == 3);
+
+	test_writer_release();
+	TEST_ASSERT(test_wait_pending(&tc));
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.written == 4);
+	TEST_CHECK(stats.batches == 2);
+	TEST_CHECK(stats.fsyncs == 3);
+	TEST_MSG("Expected 3 fsyncs, got %" PRIu64, stats.fsyncs);
+
+	test_free(&tc);
+}
+
+/*
+ *	Files are synced once the interval has passed, not when they're written.
+ */
+static void test_fsync_interval(void)
+{
+	test_ctx_t		tc;
+	fr_file_writer_stats_t	stats;
+	int			i;
+
+	test_init(&tc, 64, FR_FILE_WRITER_FSYNC_INTERVAL);
+
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", NULL, "a1\n") == 3);
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", NULL, "a2\n") == 3);
+	TEST_CHECK(test_write(&tc, NULL, NULL, "b", NULL, "b1\n") == 3);
+	TEST_ASSERT(test_wait_pending(&tc));
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.written == 3);
+	TEST_CHECK(stats.fsyncs == 0);
+
+	for (i = 0; i < 5000; i++) {
+		fr_file_writer_stats(&stats, tc.fw);
+		if (stats.fsyncs > 0) break;
+		usleep(1000);
+	}
+	TEST_CHECK(stats.fsyncs == 2);
+	TEST_MSG("Expected 2 fsyncs, got %" PRIu64, stats.fsyncs);
+
+	test_free(&tc);
+}
+
+/*
+ *	A worker whose queue is full drops the entry straight away,
+ *	rather than waiting for the writer, and the entry is counted.
+ */
+static void test_queue_full(void)
+{
+	test_ctx_t		tc;
+	fr_file_writer_stats_t	stats;
+	fr_time_t		start;
+	char			buff[256];
+	int			i;
+
+	test_init(&tc, 4, FR_FILE_WRITER_FSYNC_NONE);
+
+	test_writer_hold(&tc);
+
+	for (i = 0; i < 4; i++) TEST_CHECK(test_write(&tc, NULL, NULL, "a", NULL, "ok\n") == 3);
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.dropped == 0);
+
+	/*
+	 *	The writer is still held, so waiting for
+	 *	space would never return.
+	 */
+	start = fr_time();
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", NULL, "dropped\n") < 0);
+	TEST_CHECK(fr_time_delta_lt(fr_time_sub(fr_time(), start), fr_time_delta_from_msec(100)));
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.queued == 5);
+	TEST_CHECK(stats.pending == 5);
+	TEST_CHECK(stats.dropped == 1);
+
+	test_writer_release();
+	TEST_ASSERT(test_wait_pending(&tc));
+
+	TEST_CHECK(strcmp(test_read(&tc, "a", buff, sizeof(buff)), "ok\nok\nok\nok\n") == 0);
+	TEST_MSG("a contains \"%s\"", buff);
+
+	/*
+	 *	Once the writer has caught up, entries are
+	 *	queued again.
+	 */
+	TEST_CHECK(test_write(&tc, NULL, NULL, "a", NULL, "again\n") == 6);
+	TEST_ASSERT(test_wait_pending(&tc));
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.written == 6);
+	TEST_CHECK(stats.dropped == 1);
+
+	test_free(&tc);
+}
+
+/*
+ *	Durable entries are synced, and returned to the worker, which
+ *	resumes the request waiting for them.
+ */
+static void test_durable(void)
+{
+	test_ctx_t		tc;
+	fr_file_writer_stats_t	stats;
+	fr_file_writer_entry_t	*entry = NULL;
+	request_t		*request;
+	int			fd;
+	char			path[PATH_MAX];
+
+	test_init(&tc, 64, FR_FILE_WRITER_FSYNC_NONE);
+	request = talloc_zero(tc.ctx, request_t);
+
+	TEST_CHECK(test_write(&tc, &entry, request, "a", NULL, "durable\n") == 8);
+	TEST_ASSERT(entry != NULL);
+
+	TEST_ASSERT(test_wait_pending(&tc));
+	TEST_ASSERT(test_wait_resumed(&tc, 1));
+
+	TEST_CHECK(test_resumed == request);
+	TEST_CHECK(entry->returned);
+	TEST_CHECK(fr_file_writer_entry_error(entry) == 0);
+	fr_file_writer_entry_free(entry);
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.written == 1);
+	TEST_CHECK(stats.fsyncs == 1);
+
+	/*
+	 *	The directory can't be created, so the write fails,
+	 *	and the worker gets the error.
+	 */
+	snprintf(path, sizeof(path), "%s/file", tc.dir);
+	fd = open(path, O_WRONLY | O_CREAT, 0600);
+	TEST_ASSERT(fd >= 0);
+	close(fd);
+
+	entry = NULL;
+	TEST_CHECK(test_write(&tc, &entry, request, "file/a", NULL, "durable\n") == 8);
+	TEST_ASSERT(entry != NULL);
+
+	TEST_ASSERT(test_wait_pending(&tc));
+	TEST_ASSERT(test_wait_resumed(&tc, 2));
+
+	TEST_CHECK(fr_file_writer_entry_error(entry) != 0);
+	fr_file_writer_entry_free(entry);
+
+	fr_file_writer_stats(&stats, tc.fw);
+	TEST_CHECK(stats.failed == 1);
+
+	test_free(&tc);
+}
+
+/*
+ *	Cancelling a durable entry before, during, or after the writer
+ *	returns it never resumes the request, and the entry is freed
+ *	exactly once.
+ */
+static void test_cancel(void)
+{
+	test_ctx_t		tc;
+	fr_file_writer_entry_t	*entry = NULL;
+	request_t		*request;
+	void			*data;
+	char			buff[256];
+
+	test_init(&tc, 64, FR_FILE_WRITER_FSYNC_NONE);
+	request = talloc_zero(tc.ctx, request_t);
+
+	/*
+	 *	Cancelled while the entry is still queued.
+	 */
+	test_writer_hold(&tc);
+
+	TEST_CHECK(test_write(&tc, &entry, request, "a", NULL, "queued\n") == 7);
+	TEST_ASSERT(entry != NULL);
+	fr_file_writer_entry_cancel(entry);
+
+	test_writer_release();
+	TEST_ASSERT(test_wait_pending(&tc));
+	test_service(&tc);
+
+	TEST_CHECK(test_resumed_count == 0);
+	TEST_CHECK(!fr_atomic_queue_pop(tc.t->done, &data));
+
+	/*
+	 *	Cancelled after the writer has returned the entry, but
+	 *	before the worker has picked it up.
+	 */
+	entry = NULL;
+	TEST_CHECK(test_write(&tc, &entry, request, "a", NULL, "done\n") == 5);
+	TEST_ASSERT(entry != NULL);
+
+	TEST_ASSERT(test_wait_pending(&tc));
+	fr_file_writer_entry_cancel(entry);
+	test_service(&tc);
+
+	TEST_CHECK(test_resumed_count == 0);
+	TEST_CHECK(!fr_atomic_queue_pop(tc.t->done, &data));
+
+	/*
+	 *	Cancelled after the request was resumed.
+	 */
+	entry = NULL;
+	TEST_CHECK(test_write(&tc, &entry, request, "a", NULL, "resumed\n") == 8);
+	TEST_ASSERT(entry != NULL);
+
+	TEST_ASSERT(test_wait_pending(&tc));
+	TEST_ASSERT(test_wait_resumed(&tc, 1));
+	TEST_CHECK(entry->returned);
+	fr_file_writer_entry_cancel(entry);
+
+	/*
+	 *	Cancelled entries are still written.
+	 */
+	TEST_CHECK(strcmp(test_read(&tc, "a", buff, sizeof(buff)), "queued\ndone\nresumed\n") == 0);
+	TEST_MSG("a contains \"%s\"", buff);
+
+	test_free(&tc);
+}
+
+TEST_LIST = {
+	{ "group_order",		test_group_order },
+	{ "fsync_none",			test_fsync_none },
+	{ "fsync_batch",		test_fsync_batch },
+	{ "fsync_interval",		test_fsync_interval },
+	{ "queue_full",			test_queue_full },
+	{ "durable",			test_durable },
+	{ "cancel",			test_cancel },
+
+	{ NULL }
+};
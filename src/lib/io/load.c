@@ -25,6 +25,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/io/load.h>
+#include <freeradius-devel/util/math.h>
 
 /*
  *	We use *inverse* numbers to avoid numerical calculation issues.
@@ -55,6 +56,20 @@ RCSID("$Id$")
 
 #define RTT(_old, _new) fr_time_delta_wrap((fr_time_delta_unwrap(_new) + (fr_time_delta_unwrap(_old) * (IALPHA - 1))) / IALPHA)
 
+/*
+ *	Packets without replies are counted by when they were sent, in
+ *	slots of "timeout / LOAD_SLOTS_PER_TIMEOUT".  Once the newest
+ *	packet in a slot has been waiting longer than the timeout, the
+ *	whole slot is counted as timeouts.  So packets are counted to
+ *	within 1/16 of the timeout, using a fixed amount of memory.
+ *
+ *	A slot is live from when it starts, until "timeout" after it
+ *	ends, so there are at most LOAD_SLOTS_PER_TIMEOUT + 2 live
+ *	slots.
+ */
+#define LOAD_SLOTS_PER_TIMEOUT	(16)
+#define LOAD_SLOTS		(32)
+
 typedef enum {
 	FR_LOAD_STATE_INIT = 0,
 	FR_LOAD_STATE_SENDING,
@@ -82,8 +97,195 @@ struct fr_load_s {
 
 	fr_time_t		next;			//!< The next time we're supposed to send a packet
 	fr_event_timer_t const	*ev;
+
+	fr_time_delta_t		slot_width;		//!< How long each slot covers.
+	uint64_t		slot_next;		//!< Oldest slot which hasn't timed out.
+	uint64_t		slots[LOAD_SLOTS];	//!< Packets without replies, by when they were sent.
 };
 
+/** Map a latency in microseconds to a histogram bucket.
+ *
+ *  Values below FR_LOAD_HIST_SUB get one bucket each.  Above that,
+ *  each power of two is split into FR_LOAD_HIST_SUB linear buckets.
+ */
+static inline unsigned int load_hist_index(uint64_t usec)
+{
+	unsigned int shift, idx;
+
+	if (usec < FR_LOAD_HIST_SUB) return usec;
+
+	shift = fr_high_bit_pos(usec) - 1 - FR_LOAD_HIST_SUB_BITS;
+	idx = ((shift + 1) * FR_LOAD_HIST_SUB) + ((usec >> shift) & (FR_LOAD_HIST_SUB - 1));
+
+	if (idx >= FR_LOAD_HIST_BUCKETS) return FR_LOAD_HIST_BUCKETS - 1;
+
+	return idx;
+}
+
+/** Return the lowest value recorded in a histogram bucket.
+ *
+ */
+static inline uint64_t load_hist_lowest(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < FR_LOAD_HIST_SUB) return idx;
+
+	shift = (idx / FR_LOAD_HIST_SUB) - 1;
+
+	return ((uint64_t) (FR_LOAD_HIST_SUB + (idx % FR_LOAD_HIST_SUB))) << shift;
+}
+
+/** Return the highest value recorded in a histogram bucket.
+ *
+ */
+static inline uint64_t load_hist_highest(unsigned int idx)
+{
+	if (idx == (FR_LOAD_HIST_BUCKETS - 1)) return UINT64_MAX;
+
+	return load_hist_lowest(idx + 1) - 1;
+}
+
+/** Record a latency, correcting for coordinated omission.
+ *
+ *  If a reply took longer than the interval between two packets,
+ *  then an open-loop client would have sent more packets during that
+ *  time, and those packets would have seen latencies of "usec -
+ *  interval", "usec - 2 * interval", etc.  The load generator may not
+ *  have sent them (e.g. we were gated on the backlog), so we back-fill
+ *  the histogram with the latencies they would have seen.
+ *
+ *  Doing that one value at a time is O(usec / interval), which is
+ *  far too slow for long stalls at high packet rates.  Instead, we
+ *  count how many of the synthetic values land in each bucket, which
+ *  is bounded by the number of buckets.
+ */
+static void load_hist_record_corrected(uint64_t *hist, uint64_t usec, uint64_t interval)
+{
+	unsigned int idx, last;
+
+	hist[load_hist_index(usec)]++;
+
+	if (!interval || (usec <= interval)) return;
+
+	/*
+	 *	The synthetic values are "usec - k * interval", for
+	 *	k >= 1, down to a minimum value of "interval".
+	 */
+	last = load_hist_index(usec - interval);
+	for (idx = load_hist_index(interval); idx <= last; idx++) {
+		uint64_t lo, hi, k_min, k_max;
+
+		lo = load_hist_lowest(idx);
+		hi = load_hist_highest(idx);
+
+		if (lo < interval) lo = interval;
+		if (hi > (usec - interval)) hi = usec - interval;
+		if (lo > hi) continue;
+
+		k_min = ((usec - hi) + interval - 1) / interval;
+		k_max = (usec - lo) / interval;
+		if (k_max < k_min) continue;
+
+		hist[idx] += k_max - k_min + 1;
+	}
+}
+
+/** Walk a histogram to find a percentile.
+ *
+ */
+static uint64_t load_hist_percentile(uint64_t const *hist, double percentile)
+{
+	unsigned int idx;
+	uint64_t total = 0, count = 0, target;
+
+	for (idx = 0; idx < FR_LOAD_HIST_BUCKETS; idx++) total += hist[idx];
+	if (!total) return 0;
+
+	target = (uint64_t) ((percentile * total) / 100.0);
+	if (target < 1) target = 1;
+	if (target > total) target = total;
+
+	for (idx = 0; idx < FR_LOAD_HIST_BUCKETS; idx++) {
+		count += hist[idx];
+		if (count >= target) break;
+	}
+
+	/*
+	 *	Report the highest value which is equivalent to the
+	 *	bucket, the same as HdrHistogram does.
+	 */
+	if (idx >= (FR_LOAD_HIST_BUCKETS - 1)) return load_hist_lowest(FR_LOAD_HIST_BUCKETS - 1);
+
+	return load_hist_highest(idx);
+}
+
+/** Count the packets which have been waiting longer than the timeout
+ *
+ */
+static void load_timeout_sweep(fr_load_t *l, fr_time_t now)
+{
+	int64_t		elapsed;
+	uint64_t	limit;
+	unsigned int	i;
+
+	if (!fr_time_delta_ispos(l->config->timeout)) return;
+
+	/*
+	 *	Every packet in slot N has timed out once we're past
+	 *	the end of the slot, plus the timeout.
+	 */
+	elapsed = fr_time_delta_unwrap(fr_time_sub(now, l->stats.start)) - fr_time_delta_unwrap(l->config->timeout);
+	if (elapsed <= 0) return;
+
+	limit = elapsed / fr_time_delta_unwrap(l->slot_width);
+
+	/*
+	 *	All of the live slots are within LOAD_SLOTS of
+	 *	slot_next, so after a long gap there's no need to walk
+	 *	every slot up to the limit.
+	 */
+	for (i = 0; (i < LOAD_SLOTS) && (l->slot_next < limit); i++, l->slot_next++) {
+		uint64_t *slot = &l->slots[l->slot_next & (LOAD_SLOTS - 1)];
+
+		l->stats.timeouts += *slot;
+		l->stats.step_timeouts += *slot;
+		l->stats.lost += *slot;
+		*slot = 0;
+	}
+	if (l->slot_next < limit) l->slot_next = limit;
+}
+
+/** Find the slot for a packet sent at a particular time
+ *
+ * @return
+ *	- The slot.
+ *	- NULL if the packet was sent before the test started, or it has
+ *	  already been counted as a timeout.
+ */
+static uint64_t *load_timeout_slot(fr_load_t *l, fr_time_t when)
+{
+	uint64_t idx;
+
+	if (!fr_time_delta_ispos(l->config->timeout) || fr_time_lt(when, l->stats.start)) return NULL;
+
+	idx = fr_time_delta_unwrap(fr_time_sub(when, l->stats.start)) / fr_time_delta_unwrap(l->slot_width);
+	if (idx < l->slot_next) return NULL;
+
+	return &l->slots[idx & (LOAD_SLOTS - 1)];
+}
+
+/** Reset the statistics for the current step
+ *
+ */
+static void load_step_reset(fr_load_t *l)
+{
+	l->stats.step_timeouts = 0;
+	l->stats.step_rtt_max = fr_time_delta_wrap(0);
+	memset(l->stats.step_latency, 0, sizeof(l->stats.step_latency));
+	memset(l->stats.step_latency_co, 0, sizeof(l->stats.step_latency_co));
+}
+
 fr_load_t *fr_load_generator_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_load_config_t *config,
 				    fr_load_callback_t callback, void *uctx)
 {
@@ -122,7 +324,12 @@ static void fr_load_generator_send(fr_load_t *l, fr_time_t now, int count)
 	 *	it more likely that the next timer fires on time.
 	 */
 	for (i = 0; i < count; i++) {
-		l->callback(fr_time_add(now, fr_time_delta_from_nsec(i)), l->uctx);
+		fr_time_t	when = fr_time_add(now, fr_time_delta_from_nsec(i));
+		uint64_t	*slot = load_timeout_slot(l, when);
+
+		if (slot) (*slot)++;
+
+		l->callback(when, l->uctx);
 	}
 }
 
@@ -132,11 +339,14 @@ static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 	fr_time_delta_t delta;
 	int count;
 
+	load_timeout_sweep(l, now);
+
 	/*
 	 *	Keep track of the overall maximum backlog for the
-	 *	duration of the entire test run.
+	 *	duration of the entire test run.  Packets which have
+	 *	timed out aren't part of the backlog.
 	 */
-	l->stats.backlog = l->stats.sent - l->stats.received;
+	l->stats.backlog = l->stats.sent - l->stats.received - (int) l->stats.lost;
 	if (l->stats.backlog > l->stats.max_backlog) l->stats.max_backlog = l->stats.backlog;
 
 	/*
@@ -150,6 +360,7 @@ static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 		l->stats.pps = l->pps;
 		l->stats.skipped = 0;
 		l->delta = fr_time_delta_div(fr_time_delta_from_sec(l->config->parallel), fr_time_delta_wrap(l->pps));
+		load_step_reset(l);
 
 		/*
 		 *	Stop at max PPS, if it's set.  Otherwise
@@ -240,6 +451,12 @@ int fr_load_generator_start(fr_load_t *l)
 	l->delta = fr_time_delta_div(fr_time_delta_from_sec(l->config->parallel), fr_time_delta_wrap(l->pps));
 	l->next = fr_time_add(l->step_start, l->delta);
 
+	l->slot_width = fr_time_delta_div(l->config->timeout, fr_time_delta_wrap(LOAD_SLOTS_PER_TIMEOUT));
+	if (!fr_time_delta_ispos(l->slot_width)) l->slot_width = fr_time_delta_wrap(1);
+	l->slot_next = 0;
+	memset(l->slots, 0, sizeof(l->slots));
+	load_step_reset(l);
+
 	load_timer(l->el, l->step_start, l);
 	return 0;
 }
@@ -262,8 +479,9 @@ int fr_load_generator_stop(fr_load_t *l)
  */
 fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_time)
 {
-	fr_time_t now;
-	fr_time_delta_t t;
+	fr_time_t	now;
+	fr_time_delta_t	t;
+	uint64_t	*slot;
 
 	/*
 	 *	Note that the replies may come out of order with
@@ -273,6 +491,8 @@ fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_tim
 	now = fr_time();
 	t = fr_time_sub(now, request_time);
 
+	load_timeout_sweep(l, now);
+
 	l->stats.rttvar = RTTVAR(l->stats.rtt, l->stats.rttvar, t);
 	l->stats.rtt = RTT(l->stats.rtt, t);
 
@@ -299,6 +519,45 @@ fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_tim
 	       l->stats.times[7]++; /* seconds */
 	}
 
+	if (fr_time_delta_gt(t, l->stats.rtt_max)) l->stats.rtt_max = t;
+	if (fr_time_delta_gt(t, l->stats.step_rtt_max)) l->stats.step_rtt_max = t;
+
+	/*
+	 *	Each packet is counted as a timeout once.  Either the
+	 *	sweep has already counted it, or it's late, but its
+	 *	slot hasn't been swept yet.
+	 */
+	slot = load_timeout_slot(l, request_time);
+	if (slot) {
+		if (*slot) (*slot)--;
+
+		if (fr_time_delta_gt(t, l->config->timeout)) {
+			l->stats.timeouts++;
+			l->stats.step_timeouts++;
+		}
+
+	} else if (fr_time_delta_ispos(l->config->timeout) && fr_time_gteq(request_time, l->stats.start) &&
+		   (l->stats.lost > 0)) {
+		l->stats.lost--;
+	}
+
+	/*
+	 *	Record the raw latency, and the latency corrected for
+	 *	coordinated omission.  The expected interval between
+	 *	two packets is "delta / parallel".
+	 */
+	{
+		uint64_t usec = fr_time_delta_to_usec(t);
+
+		uint64_t interval = fr_time_delta_to_usec(l->delta) / l->config->parallel;
+
+		l->stats.latency[load_hist_index(usec)]++;
+		load_hist_record_corrected(l->stats.latency_co, usec, interval);
+
+		l->stats.step_latency[load_hist_index(usec)]++;
+		load_hist_record_corrected(l->stats.step_latency_co, usec, interval);
+	}
+
 	/*
 	 *	Still sending packets.  Rely on the timer to send more
 	 *	packets.
@@ -329,7 +588,7 @@ fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_tim
 	 *	Not yet received all replies.  Wait until we have all
 	 *	replies.
 	 */
-	if (l->stats.received < l->stats.sent) return FR_LOAD_CONTINUE;
+	if ((l->stats.received + l->stats.lost) < (uint64_t) l->stats.sent) return FR_LOAD_CONTINUE;
 
 	l->stats.end = now;
 	return FR_LOAD_DONE;
@@ -337,6 +596,8 @@ fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_tim
 
 /** Print load generator statistics in CVS format.
  *
+ *  The latency percentiles, maximum, and timeouts are for the current
+ *  step.  The other counters are for the whole test.
  */
 size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer, size_t buflen)
 {
@@ -344,7 +605,7 @@ size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer,
 
 	if (!l->header) {
 		l->header = true;
-		return snprintf(buffer, buflen, "\"time\",\"last_packet\",\"rtt\",\"rttvar\",\"pps\",\"pps_accepted\",\"sent\",\"received\",\"backlog\",\"max_backlog\",\"<usec\",\"us\",\"10us\",\"100us\",\"ms\",\"10ms\",\"100ms\",\"s\",\"blocked\"\n");
+		return snprintf(buffer, buflen, "\"time\",\"last_packet\",\"rtt\",\"rttvar\",\"pps\",\"pps_accepted\",\"sent\",\"received\",\"backlog\",\"max_backlog\",\"<usec\",\"us\",\"10us\",\"100us\",\"ms\",\"10ms\",\"100ms\",\"s\",\"blocked\",\"p50\",\"p90\",\"p99\",\"p99.9\",\"max\",\"co_p99\",\"co_p99.9\",\"timeouts\"\n");
 	}
 
 
@@ -373,7 +634,10 @@ size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer,
 			"%d,%d,"
 			"%d,%d,"
 			"%d,%d,%d,%d,%d,%d,%d,%d,"
-			"%d\n",
+			"%d,"
+			"%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ","
+			"%" PRIu64 ",%" PRIu64 ","
+			"%" PRIu64 "\n",
 			now_f, last_send_f,
 			fr_time_delta_unwrap(l->stats.rtt), fr_time_delta_unwrap(l->stats.rttvar),
 			l->stats.pps, l->stats.pps_accepted,
@@ -381,10 +645,47 @@ size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer,
 			l->stats.backlog, l->stats.max_backlog,
 			l->stats.times[0], l->stats.times[1], l->stats.times[2], l->stats.times[3],
 			l->stats.times[4], l->stats.times[5], l->stats.times[6], l->stats.times[7],
-			l->stats.blocked);
+			l->stats.blocked,
+			load_hist_percentile(l->stats.step_latency, 50), load_hist_percentile(l->stats.step_latency, 90),
+			load_hist_percentile(l->stats.step_latency, 99), load_hist_percentile(l->stats.step_latency, 99.9),
+			(uint64_t) fr_time_delta_to_usec(l->stats.step_rtt_max),
+			load_hist_percentile(l->stats.step_latency_co, 99), load_hist_percentile(l->stats.step_latency_co, 99.9),
+			l->stats.step_timeouts);
 }
 
 fr_load_stats_t const * fr_load_generator_stats(fr_load_t const *l)
 {
 	return &l->stats;
 }
+
+/** Return a latency percentile for all replies received so far.
+ *
+ * @param[in] l		the load generator.
+ * @param[in] percentile	to return, e.g. 99.9
+ * @param[in] corrected	whether to use the histogram which is corrected
+ *			for coordinated omission.
+ * @return the latency, with ~6% precision.
+ */
+fr_time_delta_t fr_load_generator_percentile(fr_load_t const *l, double percentile, bool corrected)
+{
+	return fr_time_delta_from_usec(load_hist_percentile(corrected ? l->stats.latency_co : l->stats.latency,
+							    percentile));
+}
+
+/** Print a one line summary of the latency distribution.
+ *
+ *  Latencies are in microseconds.
+ */
+size_t fr_load_generator_summary_sprint(fr_load_t const *l, char *buffer, size_t buflen)
+{
+	return snprintf(buffer, buflen,
+			"sent %d received %d timeouts %" PRIu64 " - "
+			"latency (us) p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " p99.9 %" PRIu64 " max %" PRIu64 " - "
+			"corrected p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " p99.9 %" PRIu64,
+			l->stats.sent, l->stats.received, l->stats.timeouts,
+			load_hist_percentile(l->stats.latency, 50), load_hist_percentile(l->stats.latency, 90),
+			load_hist_percentile(l->stats.latency, 99), load_hist_percentile(l->stats.latency, 99.9),
+			(uint64_t) fr_time_delta_to_usec(l->stats.rtt_max),
+			load_hist_percentile(l->stats.latency_co, 50), load_hist_percentile(l->stats.latency_co, 90),
+			load_hist_percentile(l->stats.latency_co, 99), load_hist_percentile(l->stats.latency_co, 99.9));
+}
@@ -76,8 +76,21 @@ typedef struct {
 	uint32_t	step;		//!< how much to increase each load test by
 	uint32_t	parallel;	//!< how many packets in parallel to send
 	uint32_t	milliseconds;	//!< how many milliseconds of backlog to top out at
+	fr_time_delta_t	timeout;	//!< packets without a reply after this are counted as timeouts,
+					///< 0 for "never".
 } fr_load_config_t;
 
+/** Latency histogram layout.
+ *
+ *  Latencies are recorded in microseconds, in a log-linear histogram
+ *  similar to HdrHistogram.  Each power of two is split into
+ *  FR_LOAD_HIST_SUB linear sub-buckets, which gives ~6% precision
+ *  from 1us up to ~70 minutes, in a fixed amount of memory.
+ */
+#define FR_LOAD_HIST_SUB_BITS	(4)
+#define FR_LOAD_HIST_SUB	(1 << FR_LOAD_HIST_SUB_BITS)
+#define FR_LOAD_HIST_BUCKETS	((32 - FR_LOAD_HIST_SUB_BITS + 1) * FR_LOAD_HIST_SUB)
+
 typedef struct {
 	fr_time_t	start;		//! when the test started
 	fr_time_t	end;		//!< when the test ended, due to last reply received
@@ -93,6 +106,21 @@ typedef struct {
 	int		max_backlog;	//!< maximum backlog we saw during the test
 	bool		blocked;	//!< whether or not we're blocked
 	int		times[8];	//!< response time in microseconds to tens of seconds
+	uint64_t	timeouts;	//!< packets which didn't get a reply within config->timeout
+	uint64_t	lost;		//!< packets which timed out, and still haven't had a reply
+	fr_time_delta_t	rtt_max;	//!< slowest reply we saw during the test
+
+	uint64_t	latency[FR_LOAD_HIST_BUCKETS];		//!< response time histogram, in microseconds
+	uint64_t	latency_co[FR_LOAD_HIST_BUCKETS];	//!< the same histogram, corrected for
+								///< coordinated omission.
+
+	/*
+	 *	The same statistics, for the current step only.
+	 */
+	uint64_t	step_timeouts;
+	fr_time_delta_t	step_rtt_max;
+	uint64_t	step_latency[FR_LOAD_HIST_BUCKETS];
+	uint64_t	step_latency_co[FR_LOAD_HIST_BUCKETS];
 } fr_load_stats_t;
 
 typedef struct fr_load_s fr_load_t;
@@ -120,3 +148,7 @@ fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_tim
 size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer, size_t buflen);
 
 fr_load_stats_t const * fr_load_generator_stats(fr_load_t const *l) CC_HINT(nonnull);
+
+fr_time_delta_t fr_load_generator_percentile(fr_load_t const *l, double percentile, bool corrected) CC_HINT(nonnull);
+
+size_t fr_load_generator_summary_sprint(fr_load_t const *l, char *buffer, size_t buflen) CC_HINT(nonnull);
@@ -0,0 +1,237 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the load generator's latency histograms and timeouts
+ *
+ * @file src/lib/io/load_tests.c
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include "load.c"
+
+/*
+ *	Every value lands in a bucket whose range contains it, the
+ *	buckets are in order, and the precision is ~6%.
+ */
+static void test_load_hist_index(void)
+{
+	uint64_t	usec;
+	unsigned int	idx, prev = 0;
+
+	for (usec = 0; usec < (1 << 20); usec++) {
+		idx = load_hist_index(usec);
+
+		TEST_MSG("usec %" PRIu64 " idx %u", usec, idx);
+		TEST_ASSERT(idx < FR_LOAD_HIST_BUCKETS);
+		TEST_CHECK(load_hist_lowest(idx) <= usec);
+		TEST_CHECK(load_hist_highest(idx) >= usec);
+		TEST_CHECK(idx >= prev);
+		TEST_CHECK((load_hist_highest(idx) - load_hist_lowest(idx)) <= (load_hist_lowest(idx) / FR_LOAD_HIST_SUB));
+		prev = idx;
+	}
+
+	/*
+	 *	Values past the end all go in the last bucket.
+	 */
+	TEST_CHECK(load_hist_index(UINT64_MAX) == (FR_LOAD_HIST_BUCKETS - 1));
+	TEST_CHECK(load_hist_index(UINT64_MAX >> 1) == (FR_LOAD_HIST_BUCKETS - 1));
+	TEST_CHECK(load_hist_highest(FR_LOAD_HIST_BUCKETS - 1) == UINT64_MAX);
+
+	for (idx = 1; idx < FR_LOAD_HIST_BUCKETS; idx++) {
+		TEST_MSG("idx %u", idx);
+		TEST_CHECK(load_hist_lowest(idx) == (load_hist_highest(idx - 1) + 1));
+	}
+}
+
+static void test_load_hist_percentile(void)
+{
+	uint64_t	hist[FR_LOAD_HIST_BUCKETS] = { 0 };
+	uint64_t	usec;
+
+	TEST_CHECK(load_hist_percentile(hist, 50) == 0);
+
+	/*
+	 *	1..100us, each value exactly representable.
+	 */
+	for (usec = 1; usec <= 100; usec++) hist[load_hist_index(usec)]++;
+
+	TEST_CHECK(load_hist_percentile(hist, 0) == load_hist_highest(load_hist_index(1)));
+	TEST_CHECK(load_hist_percentile(hist, 50) == load_hist_highest(load_hist_index(50)));
+	TEST_CHECK(load_hist_percentile(hist, 99) == load_hist_highest(load_hist_index(99)));
+	TEST_CHECK(load_hist_percentile(hist, 100) == load_hist_highest(load_hist_index(100)));
+
+	/*
+	 *	One slow outlier only shows up in the tail.
+	 */
+	hist[load_hist_index(1000000)]++;
+	TEST_CHECK(load_hist_percentile(hist, 50) == load_hist_highest(load_hist_index(50)));
+	TEST_CHECK(load_hist_percentile(hist, 100) >= 1000000);
+}
+
+/*
+ *	The per-bucket back-fill has to match adding the synthetic
+ *	samples one at a time.
+ */
+static void test_load_hist_corrected(void)
+{
+	static uint64_t const	cases[][2] = {
+		{ 5, 10 }, { 10, 10 }, { 11, 10 }, { 100, 10 }, { 1000, 7 },
+		{ 12345, 3 }, { 200000, 100 }, { 1000000, 1 }
+	};
+	uint64_t		hist[FR_LOAD_HIST_BUCKETS], expected[FR_LOAD_HIST_BUCKETS];
+	size_t			i;
+
+	for (i = 0; i < NUM_ELEMENTS(cases); i++) {
+		uint64_t usec = cases[i][0], interval = cases[i][1], v;
+
+		memset(hist, 0, sizeof(hist));
+		memset(expected, 0, sizeof(expected));
+
+		load_hist_record_corrected(hist, usec, interval);
+
+		expected[load_hist_index(usec)]++;
+		if (usec > interval) {
+			for (v = usec - interval; v >= interval; v -= interval) expected[load_hist_index(v)]++;
+		}
+
+		TEST_MSG("usec %" PRIu64 " interval %" PRIu64, usec, interval);
+		TEST_CHECK(memcmp(hist, expected, sizeof(hist)) == 0);
+	}
+
+	/*
+	 *	A long stall at a high packet rate back-fills more than
+	 *	UINT32_MAX samples.
+	 */
+	{
+		uint64_t usec = (uint64_t) 1 << 34, total = 0;
+		unsigned int idx;
+
+		memset(hist, 0, sizeof(hist));
+		load_hist_record_corrected(hist, usec, 1);
+
+		for (idx = 0; idx < FR_LOAD_HIST_BUCKETS; idx++) total += hist[idx];
+		TEST_CHECK(total == usec);
+		TEST_MSG("total %" PRIu64, total);
+	}
+}
+
+/*
+ *	Packets without replies are counted as timeouts once the
+ *	timeout has passed, and only once.
+ */
+static void test_load_timeouts(void)
+{
+	fr_load_config_t	config = { .timeout = fr_time_delta_from_sec(1) };
+	fr_load_t		l = { .config = &config };
+	fr_time_t		start = fr_time_wrap((int64_t) NSEC * 1000);
+	fr_time_delta_t		width;
+	uint64_t		*slot;
+	int			i;
+
+	l.stats.start = start;
+	l.slot_width = width = fr_time_delta_div(config.timeout, fr_time_delta_wrap(LOAD_SLOTS_PER_TIMEOUT));
+
+	for (i = 0; i < 10; i++) {
+		slot = load_timeout_slot(&l, start);
+		TEST_ASSERT(slot != NULL);
+		(*slot)++;
+	}
+
+	/*
+	 *	Not there yet.
+	 */
+	load_timeout_sweep(&l, fr_time_add(start, fr_time_delta_from_msec(500)));
+	TEST_CHECK(l.stats.timeouts == 0);
+
+	load_timeout_sweep(&l, fr_time_add(fr_time_add(start, config.timeout), width));
+	TEST_CHECK(l.stats.timeouts == 10);
+	TEST_CHECK(l.stats.step_timeouts == 10);
+	TEST_CHECK(l.stats.lost == 10);
+
+	/*
+	 *	They've been counted, so a late reply doesn't count
+	 *	them again.
+	 */
+	TEST_CHECK(load_timeout_slot(&l, start) == NULL);
+
+	/*
+	 *	Sweeping again doesn't change anything.
+	 */
+	load_timeout_sweep(&l, fr_time_add(start, fr_time_delta_from_sec(2)));
+	TEST_CHECK(l.stats.timeouts == 10);
+
+	/*
+	 *	A long gap doesn't walk every slot, or lose packets
+	 *	in live slots.
+	 */
+	slot = load_timeout_slot(&l, fr_time_add(start, fr_time_delta_from_sec(2)));
+	TEST_ASSERT(slot != NULL);
+	(*slot)++;
+
+	load_timeout_sweep(&l, fr_time_add(start, fr_time_delta_from_sec(3600)));
+	TEST_CHECK(l.stats.timeouts == 11);
+	TEST_CHECK(l.stats.lost == 11);
+
+	/*
+	 *	Packets from before the test started aren't tracked.
+	 */
+	TEST_CHECK(load_timeout_slot(&l, fr_time_wrap(1)) == NULL);
+
+	/*
+	 *	No timeout, no tracking.
+	 */
+	config.timeout = fr_time_delta_wrap(0);
+	TEST_CHECK(load_timeout_slot(&l, fr_time_add(start, fr_time_delta_from_sec(3600))) == NULL);
+}
+
+static void test_load_step_reset(void)
+{
+	fr_load_config_t	config = { 0 };
+	fr_load_t		l = { .config = &config };
+
+	l.stats.step_timeouts = 3;
+	l.stats.timeouts = 3;
+	l.stats.step_latency[5] = 1;
+	l.stats.latency[5] = 1;
+	l.stats.step_latency_co[7] = 2;
+	l.stats.step_rtt_max = fr_time_delta_from_sec(1);
+
+	load_step_reset(&l);
+
+	TEST_CHECK(l.stats.step_timeouts == 0);
+	TEST_CHECK(l.stats.step_latency[5] == 0);
+	TEST_CHECK(l.stats.step_latency_co[7] == 0);
+	TEST_CHECK(fr_time_delta_unwrap(l.stats.step_rtt_max) == 0);
+
+	/*
+	 *	The totals for the whole test are left alone.
+	 */
+	TEST_CHECK(l.stats.timeouts == 3);
+	TEST_CHECK(l.stats.latency[5] == 1);
+}
+
+TEST_LIST = {
+	{ "hist_index",		test_load_hist_index },
+	{ "hist_percentile",	test_load_hist_percentile },
+	{ "hist_corrected",	test_load_hist_corrected },
+	{ "timeouts",		test_load_timeouts },
+	{ "step_reset",		test_load_step_reset },
+
+	{ NULL }
+};
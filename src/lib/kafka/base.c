@@ -68,6 +68,23 @@ fr_kafka_conf_t *kafka_conf_from_cs(CONF_SECTION *cs)
 {
 	CONF_DATA const	*cd;
 	fr_kafka_conf_t	*kc;
+	CONF_SECTION	*root = cs;
+
+	/*
+	 *	Items in subsections (tls, sasl, etc...) configure
+	 *	the same client, so the conf is stored in the section
+	 *	containing the "server" pair.
+	 */
+	while (!cf_pair_find(root, "server")) {
+		CONF_ITEM *parent = cf_parent(root);
+
+		if (!parent) {
+			root = cs;
+			break;
+		}
+		root = cf_item_to_section(parent);
+	}
+	cs = root;
 
 	cd = cf_data_find(cs, fr_kafka_conf_t, "conf");
 	if (cd) {
@@ -112,6 +129,46 @@ fr_kafka_topic_conf_t *kafka_topic_conf_from_cs(CONF_SECTION *cs)
 	return ktc;
 }
 
+/** Return a copy of the kafka configuration built from a config section
+ *
+ * The copy is suitable for passing to rd_kafka_new(), which takes
+ * ownership of it.
+ *
+ * @param[in] cs	The section #kafka_base_producer_config or
+ *			#kafka_base_consumer_config was parsed from.
+ * @return
+ *	- A new rd_kafka_conf_t on success.
+ *	- NULL if the section hasn't been parsed.
+ */
+rd_kafka_conf_t *fr_kafka_conf_dup(CONF_SECTION *cs)
+{
+	CONF_DATA const	*cd;
+
+	cd = cf_data_find(cs, fr_kafka_conf_t, "conf");
+	if (!cd) {
+		fr_strerror_printf("No kafka configuration found in \"%s\"", cf_section_name1(cs));
+		return NULL;
+	}
+
+	return rd_kafka_conf_dup(((fr_kafka_conf_t *)cf_data_value(cd))->conf);
+}
+
+/** Return a copy of the kafka topic configuration built from a topic section
+ *
+ * @param[in] cs	A topic section i.e. `topic { <name> { ... } }`.
+ * @return A new rd_kafka_topic_conf_t, using defaults if the section contained
+ *	no topic configuration.
+ */
+rd_kafka_topic_conf_t *fr_kafka_topic_conf_dup(CONF_SECTION *cs)
+{
+	CONF_DATA const	*cd;
+
+	cd = cf_data_find(cs, fr_kafka_topic_conf_t, "conf");
+	if (!cd) return rd_kafka_topic_conf_new();
+
+	return rd_kafka_topic_conf_dup(((fr_kafka_topic_conf_t *)cf_data_value(cd))->conf);
+}
+
 /** Perform any conversions necessary to map kafka defaults to our values
  *
  * @param[out] out	Where to write the pair.
@@ -1165,6 +1222,12 @@ conf_parser_t const kafka_base_producer_config[] = {
 	{ FR_CONF_FUNC("batch_size", FR_TYPE_SIZE, 0, kafka_config_parse, kafka_config_dflt),
 	  .uctx = &(fr_kafka_conf_ctx_t){ .property = "batch.size" }},
 
+	/*
+	 *	Maximum number of messages batched in one MessageSet
+	 */
+	{ FR_CONF_FUNC("batch_max_messages", FR_TYPE_UINT32, 0, kafka_config_parse, kafka_config_dflt),
+	  .uctx = &(fr_kafka_conf_ctx_t){ .property = "batch.num.messages" }},
+
 	/*
 	 *	Delay in milliseconds to wait to assign new sticky partitions for each topic
 	 */
@@ -610,6 +610,180 @@ static void ldap_trunk_search_results_debug(request_t *request, fr_ldap_query_t
 	REXDENT();
 }
 
+/** Compare two searches to see if one can wait on the results of the other
+ *
+ */
+static int8_t ldap_search_coalesce_cmp(void const *one, void const *two)
+{
+	fr_ldap_query_t const	*a = one, *b = two;
+	int			ret;
+	size_t			i;
+
+	ret = CMP(a->search.scope, b->search.scope);
+	if (ret != 0) return ret;
+
+	ret = strcmp(a->dn, b->dn);
+	if (ret != 0) return CMP(ret, 0);
+
+	ret = strcmp(a->search.filter, b->search.filter);
+	if (ret != 0) return CMP(ret, 0);
+
+	if (!a->search.attrs || !b->search.attrs) return CMP(a->search.attrs != NULL, b->search.attrs != NULL);
+
+	for (i = 0; a->search.attrs[i] && b->search.attrs[i]; i++) {
+		ret = strcmp(a->search.attrs[i], b->search.attrs[i]);
+		if (ret != 0) return CMP(ret, 0);
+	}
+
+	return CMP(a->search.attrs[i] != NULL, b->search.attrs[i] != NULL);
+}
+
+/** Attach a search to an identical in-flight search, or start a new one
+ *
+ * The search actually sent to the directory isn't associated with any request, so
+ * it outlives whichever request happened to start it.  All requests wanting the
+ * results, including the first, are followers of it, and it is freed once the last
+ * of them is done with the results.
+ *
+ * @param[in] request	the search is being performed for.
+ * @param[in] ttrunk	to submit the search to.
+ * @param[in] query	search to attach.
+ * @return
+ *	- 0 on success.
+ *	- -1 if a new search could not be enqueued.
+ */
+static int ldap_search_coalesce(request_t *request, fr_ldap_thread_trunk_t *ttrunk, fr_ldap_query_t *query)
+{
+	fr_ldap_query_t	*leader;
+
+	if (!ttrunk->searches) {
+		MEM(ttrunk->searches = fr_rb_inline_talloc_alloc(ttrunk, fr_ldap_query_t, coalesce_node,
+								 ldap_search_coalesce_cmp, NULL));
+	}
+
+	leader = fr_rb_find(ttrunk->searches, query);
+	if (leader) {
+		ttrunk->searches_coalesced++;
+		RDEBUG2("Waiting on identical in-flight search in \"%s\" with filter \"%s\"",
+			query->dn, query->search.filter);
+		RDEBUG3("%" PRIu64 " searches issued, %" PRIu64 " coalesced",
+			ttrunk->searches_issued, ttrunk->searches_coalesced);
+		goto attach;
+	}
+
+	/*
+	 *	The search is sent without a request, so log
+	 *	it here where it'll be seen.
+	 */
+	RDEBUG2("Queueing search in \"%s\" with filter \"%s\"", query->dn, query->search.filter);
+
+	/*
+	 *	The search parameters belong to the caller, so the
+	 *	leader needs its own copies.
+	 */
+	leader = fr_ldap_search_alloc(ttrunk->t, NULL, query->search.scope, NULL, NULL, NULL, NULL);
+	leader->dn = talloc_strdup(leader, query->dn);
+	leader->search.filter = talloc_strdup(leader, query->search.filter);
+	if (query->search.attrs) {
+		char const	**attrs;
+		size_t		i, num = 0;
+
+		while (query->search.attrs[num]) num++;
+
+		MEM(attrs = talloc_array(leader, char const *, num + 1));
+		for (i = 0; i < num; i++) attrs[i] = talloc_strdup(attrs, query->search.attrs[i]);
+		attrs[num] = NULL;
+
+		leader->search.attrs = attrs;
+	}
+
+	switch (fr_trunk_request_enqueue(&leader->treq, ttrunk->trunk, NULL, leader, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		talloc_free(leader);
+		return -1;
+	}
+
+	leader->coalesce_ttrunk = ttrunk;
+	fr_rb_insert(ttrunk->searches, leader);
+	ttrunk->searches_issued++;
+
+attach:
+	query->leader = leader;
+	query->request = request;
+	fr_dlist_insert_tail(&leader->followers, query);
+
+	return 0;
+}
+
+/** Detach a search from the search it was waiting on
+ *
+ * If nothing else is waiting on the leader it is cancelled if still in flight,
+ * or freed if it has completed.
+ */
+static void ldap_search_coalesce_detach(fr_ldap_query_t *query)
+{
+	fr_ldap_query_t	*leader = query->leader;
+
+	fr_dlist_remove(&leader->followers, query);
+	query->leader = NULL;
+	query->result = NULL;	/* Belongs to the leader */
+
+	if (fr_dlist_num_elements(&leader->followers) > 0) return;
+
+	if (leader->coalesce_ttrunk) {
+		fr_rb_remove(leader->coalesce_ttrunk->searches, leader);
+		leader->coalesce_ttrunk = NULL;
+	}
+
+	if (leader->treq) {
+		talloc_steal(leader->treq, leader);
+		fr_trunk_request_signal_cancel(leader->treq);
+		leader->treq = NULL;
+		return;
+	}
+
+	talloc_free(leader);
+}
+
+/** Pass the result of a search on to all the searches waiting on it
+ *
+ * Must be called whenever the result code of a query is set to something
+ * other than LDAP_RESULT_PENDING.  Does nothing for queries which have no
+ * followers.
+ *
+ * @param[in] query	which has completed.
+ */
+void fr_ldap_search_coalesce_complete(fr_ldap_query_t *query)
+{
+	/*
+	 *	Any new identical searches need to go to the directory.
+	 */
+	if (query->coalesce_ttrunk) {
+		fr_rb_remove(query->coalesce_ttrunk->searches, query);
+		query->coalesce_ttrunk = NULL;
+	}
+
+	fr_dlist_foreach(&query->followers, fr_ldap_query_t, follower) {
+		follower->ret = query->ret;
+
+		/*
+		 *	Followers hold a reference to the connection,
+		 *	as they need its handle to parse the result.
+		 */
+		if (query->result && query->ldap_conn) {
+			follower->result = query->result;
+			follower->ldap_conn = query->ldap_conn;
+			fr_dlist_insert_tail(&query->ldap_conn->refs, follower);
+		}
+
+		unlang_interpret_mark_runnable(follower->request);
+	}
+}
+
 /** Handle the return code from parsed LDAP results to set the module rcode
  *
  */
@@ -643,6 +817,15 @@ static void ldap_trunk_query_cancel(UNUSED request_t *request, UNUSED fr_signal_
 {
 	fr_ldap_query_t	*query = talloc_get_type_abort(uctx, fr_ldap_query_t);
 
+	/*
+	 *	Only this request is done waiting, the search
+	 *	itself may still be wanted by others.
+	 */
+	if (query->leader) {
+		ldap_search_coalesce_detach(query);
+		return;
+	}
+
 	/*
 	 *	Query may have completed, but the request
 	 *	not yet have been resumed.
@@ -701,6 +884,16 @@ unlang_action_t fr_ldap_trunk_search(TALLOC_CTX *ctx,
 
 	query = fr_ldap_search_alloc(ctx, base_dn, scope, filter, attrs, serverctrls, clientctrls);
 
+	/*
+	 *	Identical concurrent searches share a single search sent
+	 *	to the directory.  Searches with controls aren't shared,
+	 *	as the controls may change what the server returns.
+	 */
+	if (request && base_dn && filter && !query->serverctrls[0].control && !query->clientctrls[0].control) {
+		if (ldap_search_coalesce(request, ttrunk, query) < 0) goto error;
+		goto push;
+	}
+
 	switch (fr_trunk_request_enqueue(&query->treq, ttrunk->trunk, request, query, NULL)) {
 	case FR_TRUNK_ENQUEUE_OK:
 	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
@@ -712,7 +905,9 @@ unlang_action_t fr_ldap_trunk_search(TALLOC_CTX *ctx,
 		talloc_free(query);
 		return UNLANG_ACTION_FAIL;
 	}
+	ttrunk->searches_issued++;
 
+push:
 	action = unlang_function_push(request, NULL, ldap_trunk_query_results,
 				      ldap_trunk_query_cancel, ~FR_SIGNAL_CANCEL, UNLANG_SUB_FRAME, query);
 
@@ -888,7 +1083,29 @@ fr_ldap_rcode_t fr_ldap_extended_async(int *msgid, request_t *request, fr_ldap_c
  */
 static int _ldap_query_free(fr_ldap_query_t *query)
 {
-	int 	i;
+	int 		i;
+	fr_ldap_query_t	*follower;
+
+	/*
+	 *	Stop waiting on any search we were coalesced with
+	 */
+	if (query->leader) ldap_search_coalesce_detach(query);
+
+	/*
+	 *	Anything still waiting on this search won't get any
+	 *	results, so fail it, and resume the request.  Any which
+	 *	were already given the results have now lost them.
+	 */
+	if (query->coalesce_ttrunk) fr_rb_remove(query->coalesce_ttrunk->searches, query);
+	while ((follower = fr_dlist_pop_head(&query->followers))) {
+		bool	pending = (follower->ret == LDAP_RESULT_PENDING);
+
+		follower->leader = NULL;
+		follower->result = NULL;
+		follower->ret = LDAP_RESULT_ERROR;
+
+		if (pending) unlang_interpret_mark_runnable(follower->request);
+	}
 
 	/*
 	 *	Free any results which were retrieved
@@ -955,6 +1172,7 @@ fr_ldap_query_t *ldap_query_alloc(TALLOC_CTX *ctx, fr_ldap_request_type_t type)
 
 	query->ret = LDAP_RESULT_PENDING;
 	query->type = type;
+	fr_dlist_talloc_init(&query->followers, fr_ldap_query_t, follower_entry);
 
 	return query;
 }
@@ -384,6 +384,8 @@ typedef struct {
 	fr_event_list_t		*el;		//!< Thread event list for callbacks / timeouts
 	fr_ldap_thread_trunk_t	*bind_trunk;	//!< LDAP trunk used for bind auths
 	fr_rb_tree_t		*binds;		//!< Tree of outstanding bind auths
+	uint64_t		searches_issued;	//!< Searches sent by trunks which have since been freed.
+	uint64_t		searches_coalesced;	//!< Searches coalesced by trunks which have since been freed.
 } fr_ldap_thread_t;
 
 /** Thread LDAP trunk structure
@@ -403,6 +405,10 @@ typedef struct fr_ldap_thread_trunk_s {
 	fr_trunk_t		*trunk;		//!< Connection trunk
 	fr_ldap_thread_t	*t;		//!< Thread this connection is associated with
 	fr_event_timer_t const	*ev;		//!< Event to close the thread when it has been idle.
+
+	fr_rb_tree_t		*searches;	//!< In-flight searches which identical searches can share.
+	uint64_t		searches_issued;	//!< Searches sent to the directory.
+	uint64_t		searches_coalesced;	//!< Searches which waited on an identical in-flight search.
 } fr_ldap_thread_trunk_t;
 
 typedef struct fr_ldap_referral_s fr_ldap_referral_t;
@@ -463,6 +469,15 @@ struct fr_ldap_query_s {
 	LDAPMessage		*result;	//!< Head of LDAP results list.
 
 	fr_ldap_result_code_t	ret;		//!< Result code
+
+	fr_rb_node_t		coalesce_node;	//!< Entry in the trunk's tree of in-flight searches.
+	fr_ldap_thread_trunk_t	*coalesce_ttrunk;	//!< Trunk whose tree of in-flight searches this query is in.
+	fr_dlist_head_t		followers;	//!< Queries waiting on the results of this search.
+
+	fr_ldap_query_t		*leader;	//!< Search this query is waiting on.  If set, result
+						///< belongs to the leader and must not be freed.
+	fr_dlist_t		follower_entry;	//!< Entry in the leader's list of followers.
+	request_t		*request;	//!< Request waiting on the leader.
 };
 
 /** Parsed LDAP referral structure
@@ -738,6 +753,8 @@ unlang_action_t fr_ldap_trunk_search(TALLOC_CTX *ctx,
 				     char const *base_dn, int scope, char const *filter, char const * const *attrs,
 				     LDAPControl **serverctrls, LDAPControl **clientctrls);
 
+void fr_ldap_search_coalesce_complete(fr_ldap_query_t *query);
+
 unlang_action_t fr_ldap_trunk_modify(TALLOC_CTX *ctx,
 				     fr_ldap_query_t **out, request_t *request, fr_ldap_thread_trunk_t *ttrunk,
 				     char const *dn, LDAPMod *mods[],
@@ -872,6 +889,8 @@ fr_ldap_thread_trunk_t	*fr_thread_ldap_trunk_get(fr_ldap_thread_t *thread, char
 
 fr_trunk_state_t fr_thread_ldap_trunk_state(fr_ldap_thread_t *thread, char const *uri, char const *bind_dn);
 
+void		fr_thread_ldap_search_stats(uint64_t *issued, uint64_t *coalesced, fr_ldap_thread_t const *thread);
+
 fr_ldap_thread_trunk_t	*fr_thread_ldap_bind_trunk_get(fr_ldap_thread_t *thread);
 
 /*
@@ -452,7 +452,8 @@ static void _ldap_trunk_idle_timeout(fr_event_list_t *el, UNUSED fr_time_t now,
 	fr_ldap_thread_trunk_t	*ttrunk = talloc_get_type_abort(uctx, fr_ldap_thread_trunk_t);
 
 	if (ttrunk->trunk->req_alloc == 0) {
-		DEBUG2("Removing idle LDAP trunk to \"%s\"", ttrunk->uri);
+		DEBUG2("Removing idle LDAP trunk to \"%s\" (%" PRIu64 " searches issued, %" PRIu64 " coalesced)",
+		       ttrunk->uri, ttrunk->searches_issued, ttrunk->searches_coalesced);
 		talloc_free(ttrunk->trunk);
 		talloc_free(ttrunk);
 	} else {
@@ -520,6 +521,7 @@ static void ldap_request_fail(request_t *request, void *preq, UNUSED void *rctx,
 	 *	Ensure request is runnable.
 	 */
 	if (request) unlang_interpret_mark_runnable(request);
+	fr_ldap_search_coalesce_complete(query);
 }
 
 /** I/O read function
@@ -953,6 +955,7 @@ static void ldap_trunk_request_demux(fr_event_list_t *el, fr_trunk_connection_t
 		 *	Set the request as runnable
 		 */
 		if (request) unlang_interpret_mark_runnable(request);
+		fr_ldap_search_coalesce_complete(query);
 
 		/*
 		 *	If referral following failed, there is no active trunk request.
@@ -973,6 +976,29 @@ static int _thread_ldap_trunk_free(fr_ldap_thread_trunk_t *ttrunk)
 {
 	if (ttrunk->t && fr_rb_node_inline_in_tree(&ttrunk->node)) fr_rb_remove(ttrunk->t->trunks, ttrunk);
 
+	/*
+	 *	Idle trunks come and go, the totals for the thread
+	 *	shouldn't.
+	 */
+	if (ttrunk->t) {
+		ttrunk->t->searches_issued += ttrunk->searches_issued;
+		ttrunk->t->searches_coalesced += ttrunk->searches_coalesced;
+	}
+
+	/*
+	 *	In-flight searches are parented by the thread, so may
+	 *	outlive the trunk.  Stop them referencing it.
+	 */
+	if (ttrunk->searches) {
+		fr_rb_iter_inorder_t	iter;
+		fr_ldap_query_t		*query;
+
+		while ((query = fr_rb_iter_init_inorder(&iter, ttrunk->searches))) {
+			fr_rb_iter_delete_inorder(&iter);
+			query->coalesce_ttrunk = NULL;
+		}
+	}
+
 	return 0;
 }
 
@@ -1077,6 +1103,33 @@ fr_trunk_state_t fr_thread_ldap_trunk_state(fr_ldap_thread_t *thread, char const
 	return (found) ? found->trunk->state : FR_TRUNK_STATE_MAX;
 }
 
+/** Return how many searches a thread has sent, and how many waited on identical searches
+ *
+ * Includes searches sent by trunks which have since been closed.
+ *
+ * @param[out] issued		Searches sent to the directory.
+ * @param[out] coalesced	Searches which were given the results of an identical
+ *				in-flight search instead.
+ * @param[in] thread		to return the totals for.
+ */
+void fr_thread_ldap_search_stats(uint64_t *issued, uint64_t *coalesced, fr_ldap_thread_t const *thread)
+{
+	fr_rb_iter_inorder_t	iter;
+	fr_ldap_thread_trunk_t	*ttrunk;
+
+	*issued = thread->searches_issued;
+	*coalesced = thread->searches_coalesced;
+
+	if (!thread->trunks) return;
+
+	for (ttrunk = fr_rb_iter_init_inorder(&iter, thread->trunks);
+	     ttrunk;
+	     ttrunk = fr_rb_iter_next_inorder(&iter)) {
+		*issued += ttrunk->searches_issued;
+		*coalesced += ttrunk->searches_coalesced;
+	}
+}
+
 /** Take pending LDAP bind auths from the queue and send them.
  *
  * @param[in] el	Event list for timers.
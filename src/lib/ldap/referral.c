@@ -89,6 +89,7 @@ static void _ldap_referral_send(UNUSED fr_trunk_t *trunk, UNUSED fr_trunk_state_
 		ROPTIONAL(RERROR, ERROR, "Failed enqueueing pending LDAP referral");
 		query->ret = LDAP_RESULT_ERROR;
 		if (request) unlang_interpret_mark_runnable(request);
+		fr_ldap_search_coalesce_complete(query);
 		return;
 	}
 
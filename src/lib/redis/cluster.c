@@ -119,8 +119,10 @@
  *   The cluster client can continue to operate, albeit inefficiently, with a stale cluster map
  *   by following '-ASK' and '-MOVE' redirects.
  *
- *   Remaps are limited to one per second.  If any operation sets the remap_needed flag, or
- *   attempts a remap directly, the remap may be skipped if one occurred recently.
+ *   Remaps are limited to one per second, and failed remap attempts count towards that limit.
+ *   If any operation sets the remap_needed flag, or attempts a remap directly, the remap may be
+ *   skipped if one occurred or was attempted recently.  Only one thread fetches the new map at a
+ *   time, the others continue using the current map and follow redirects until it's applied.
  *
  *
  * Processing '-ASK' and '-MOVE' redirects
@@ -144,6 +146,25 @@
  *   should attempt the operation again.  The cluster spec says we should attempt the operation
  *   after some time.  This time is configurable.
  *
+ *
+ * Synchronous operation
+ * ---------------------
+ *
+ *   The cluster client is synchronous.  Connections are reserved from per-node #fr_pool_t
+ *   pools, and each command blocks the calling thread for a full round trip, as does any
+ *   remap the request triggers.  rlm_redis, rlm_redis_ippool and rlm_cache_redis all use
+ *   this interface.
+ *
+ *   pipeline.c contains the start of an asynchronous replacement, with per-thread
+ *   #fr_trunk_t connections (#fr_redis_cluster_thread_alloc, #fr_redis_trunk_alloc) and
+ *   pipelined command sets.  It isn't used yet.  It still needs:
+ *
+ *     - Per-thread trunks for each node in the cluster map, selected by key slot.
+ *     - '-ASK' and '-MOVE' redirects handled by re-enqueueing the command set on another
+ *       trunk, rather than by reserving a connection from another pool.
+ *     - Remaps done from an event, rather than on the request path.
+ *     - The modules converted to enqueue command sets and yield until they complete.
+ *
  */
 
 #include <freeradius-devel/util/debug.h>
@@ -254,6 +275,7 @@ struct fr_redis_cluster {
 	bool			remap_needed;		//!< Set true if at least one cluster node is definitely
 							//!< unreachable. Set false on successful remap.
 	fr_time_t      		last_updated;		//!< Last time the cluster mappings were updated.
+	fr_time_t		last_attempt;		//!< Last time a remap was attempted, successful or not.
 	CONF_SECTION		*module;		//!< Module configuration.
 
 	fr_redis_conf_t		*conf;			//!< Base configuration data such as the database number
@@ -1021,14 +1043,39 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(request_t *request, fr_redis_clu
 
 	/*
 	 *	The remap times are _our_ times, not the _request_ time.
+	 *
+	 *	Failed attempts are rate limited the same as successful
+	 *	ones.  Otherwise while a node is down every request
+	 *	that sees remap_needed would pay for an extra
+	 *	'cluster slots' round trip.
 	 */
 	now = fr_time();
-	if (fr_time_to_sec(now) == fr_time_to_sec(cluster->last_updated)) {
+	if ((fr_time_to_sec(now) == fr_time_to_sec(cluster->last_updated)) ||
+	    (fr_time_to_sec(now) == fr_time_to_sec(cluster->last_attempt))) {
 	too_soon:
 		ROPTIONAL(RWARN, WARN, "Cluster was updated less than a second ago, ignoring remap request");
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 	}
 
+	/*
+	 *	Claim the remap, so only one worker issues 'cluster slots'.
+	 *	Everyone else continues with the current map, following
+	 *	redirects, until the new map is applied.
+	 */
+	pthread_mutex_lock(&cluster->mutex);
+	if (cluster->remapping) {
+		pthread_mutex_unlock(&cluster->mutex);
+		goto in_progress;
+	}
+	if ((fr_time_to_sec(now) == fr_time_to_sec(cluster->last_updated)) ||
+	    (fr_time_to_sec(now) == fr_time_to_sec(cluster->last_attempt))) {
+		pthread_mutex_unlock(&cluster->mutex);
+		goto too_soon;
+	}
+	cluster->remapping = true;
+	cluster->last_attempt = now;
+	pthread_mutex_unlock(&cluster->mutex);
+
 	ROPTIONAL(RINFO, INFO, "Initiating cluster remap");
 
 	/*
@@ -1039,10 +1086,16 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(request_t *request, fr_redis_clu
 	case FR_REDIS_CLUSTER_RCODE_BAD_INPUT:		/* Validation error */
 	case FR_REDIS_CLUSTER_RCODE_NO_CONNECTION:		/* Connection error */
 	case FR_REDIS_CLUSTER_RCODE_FAILED:			/* Error issuing command */
+		pthread_mutex_lock(&cluster->mutex);
+		cluster->remapping = false;
+		pthread_mutex_unlock(&cluster->mutex);
 		return ret;
 
 	case FR_REDIS_CLUSTER_RCODE_IGNORED:		/* Clustering not enabled, or not supported */
+		pthread_mutex_lock(&cluster->mutex);
+		cluster->remapping = false;
 		cluster->remap_needed = false;
+		pthread_mutex_unlock(&cluster->mutex);
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 
 	case FR_REDIS_CLUSTER_RCODE_SUCCESS:		/* Success */
@@ -1073,22 +1126,11 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(request_t *request, fr_redis_clu
 	}
 
 	/*
-	 *	Check again that the cluster isn't being
-	 *	remapped, or was remapped too recently,
-	 *	now we hold the mutex and the state of
-	 *	those variables is synchronized.
+	 *	We hold the remap claim, so nothing else can have
+	 *	applied a map since we checked.  cluster_map_apply
+	 *	releases the claim on success and failure.
 	 */
 	pthread_mutex_lock(&cluster->mutex);
-	if (cluster->remapping) {
-		pthread_mutex_unlock(&cluster->mutex);
-		fr_redis_reply_free(&map);	/* Free the map */
-		goto in_progress;
-	}
-	if (fr_time_to_sec(now) == fr_time_to_sec(cluster->last_updated)) {
-		pthread_mutex_unlock(&cluster->mutex);
-		fr_redis_reply_free(&map);	/* Free the map */
-		goto too_soon;
-	}
 	ret = cluster_map_apply(cluster, map);
 	if (ret == FR_REDIS_CLUSTER_RCODE_SUCCESS) cluster->remap_needed = false;	/* Change on successful remap */
 	pthread_mutex_unlock(&cluster->mutex);
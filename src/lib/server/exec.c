@@ -34,6 +34,19 @@ RCSID("$Id$")
 #include <freeradius-devel/server/util.h>
 #include <freeradius-devel/util/debug.h>
 
+#ifdef HAVE_SPAWN_H
+#  include <spawn.h>
+#endif
+
+/*
+ *	posix_spawn() is only safe to use if it can close all the
+ *	server's file descriptors in the child, the same as
+ *	exec_child() does.
+ */
+#if defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWN) && defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+#  define EXEC_USE_SPAWN
+#endif
+
 #define MAX_ENVP 1024
 
 static _Thread_local char *env_exec_arr[MAX_ENVP];	/* Avoid allocing 8k on the stack */
@@ -268,6 +281,7 @@ char **fr_exec_pair_to_env(request_t *request, fr_pair_list_t *env_pairs, bool e
 	return env_arr;
 }
 
+#ifndef EXEC_USE_SPAWN
 /** Start a child process
  *
  * We try to be fail-safe here. So if ANYTHING goes wrong, we exit with status 1.
@@ -391,6 +405,126 @@ static NEVER_RETURNS void exec_child(char **argv, char **envp,
 	exit(2);
 }
 
+/** Start a child process with fork() and exec_child()
+ *
+ * @return
+ *	- The PID of the child.
+ *	- -1 on error.  Error retrievable fr_strerror().
+ */
+static pid_t exec_start(char **argv, char **envp,
+			bool exec_wait, bool debug,
+			int stdin_pipe[static 2], int stdout_pipe[static 2], int stderr_pipe[static 2])
+{
+	pid_t pid;
+
+	pid = fork();
+
+	/*
+	 *	The child never returns from calling exec_child();
+	 */
+	if (pid == 0) exec_child(argv, envp, exec_wait, debug, stdin_pipe, stdout_pipe, stderr_pipe);
+	if (pid < 0) fr_strerror_printf("Couldn't fork %s", argv[0]);
+
+	return pid;
+}
+#else
+/** Point one of the child's stdio descriptors at a pipe or /dev/null
+ *
+ */
+static inline CC_HINT(always_inline)
+int exec_spawn_stdio(posix_spawn_file_actions_t *fa, int fd, int pipe_fd)
+{
+	if (pipe_fd >= 0) return posix_spawn_file_actions_adddup2(fa, pipe_fd, fd);
+
+	return posix_spawn_file_actions_addopen(fa, fd, "/dev/null", O_RDWR, 0);
+}
+
+/** Start a child process with posix_spawn()
+ *
+ * fork() copies the page tables of the whole server, which gets
+ * slower the more memory the server uses, and stalls the calling
+ * thread while it runs.  posix_spawn() does not copy the address
+ * space, so the cost of starting a program doesn't depend on the
+ * size of the server.
+ *
+ * The child's file descriptors are set up as exec_child() does.
+ *
+ * @return
+ *	- The PID of the child.
+ *	- -1 on error.  Error retrievable fr_strerror().
+ */
+static pid_t exec_start(char **argv, char **envp,
+			bool exec_wait, bool debug,
+			int stdin_pipe[static 2], int stdout_pipe[static 2], int stderr_pipe[static 2])
+{
+	posix_spawn_file_actions_t	fa;
+	posix_spawnattr_t		attr;
+	pid_t				pid = -1;
+	int				ret;
+
+	ret = posix_spawn_file_actions_init(&fa);
+	if (ret != 0) {
+		fr_strerror_printf("Failed initialising spawn actions: %s", fr_syserror(ret));
+		return -1;
+	}
+
+	ret = posix_spawnattr_init(&attr);
+	if (ret != 0) {
+		fr_strerror_printf("Failed initialising spawn attributes: %s", fr_syserror(ret));
+		posix_spawn_file_actions_destroy(&fa);
+		return -1;
+	}
+
+#ifdef POSIX_SPAWN_USEVFORK
+	/*
+	 *	Older glibc versions only avoid copying the
+	 *	address space if asked to.
+	 */
+	ret = posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+	if (ret != 0) goto error;
+#endif
+
+	if (exec_wait) {
+		if ((ret = exec_spawn_stdio(&fa, STDIN_FILENO, stdin_pipe[0])) != 0) goto error;
+		if ((ret = exec_spawn_stdio(&fa, STDOUT_FILENO, stdout_pipe[1])) != 0) goto error;
+		if ((ret = exec_spawn_stdio(&fa, STDERR_FILENO, stderr_pipe[1])) != 0) goto error;
+	} else {
+		if ((ret = exec_spawn_stdio(&fa, STDIN_FILENO, -1)) != 0) goto error;
+		if ((ret = exec_spawn_stdio(&fa, STDOUT_FILENO, -1)) != 0) goto error;
+		if (!debug && ((ret = exec_spawn_stdio(&fa, STDERR_FILENO, -1)) != 0)) goto error;
+	}
+
+	/*
+	 *	Closes the pipes as well, as the child only
+	 *	needs the copies in 0, 1 and 2.
+	 */
+	ret = posix_spawn_file_actions_addclosefrom_np(&fa, STDERR_FILENO + 1);
+	if (ret != 0) {
+	error:
+		fr_strerror_printf("Failed setting up spawn of \"%s\": %s", argv[0], fr_syserror(ret));
+		pid = -1;
+		goto finish;
+	}
+
+	/*
+	 *	Unlike exec_child(), a failure to execute the
+	 *	program is returned here rather than as the exit
+	 *	status of the child.
+	 */
+	ret = posix_spawn(&pid, argv[0], &fa, &attr, argv, envp ? envp : (char *[]){ NULL });
+	if (ret != 0) {
+		fr_strerror_printf("Failed to execute \"%s\": %s", argv[0], fr_syserror(ret));
+		pid = -1;
+	}
+
+finish:
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+
+	return pid;
+}
+#endif
+
 /** Merge extra environmental variables and potentially the inherited environment
  *
  * @param[in] env_in		to merge.
@@ -462,20 +596,11 @@ int fr_exec_fork_nowait(fr_event_list_t *el, char **argv_in, char **env_in, bool
 {
 	char		**env;
 	pid_t		pid;
+	int		unused[2] = { -1, -1 };
 
 	env = exec_build_env(env_in, env_inherit);
-	pid = fork();
-	/*
-	 *	The child never returns from calling exec_child();
-	 */
-	if (pid == 0) {
-		int unused[2] = { -1, -1 };
-
-		exec_child(argv_in, env, false, debug, unused, unused, unused);
-	}
-
+	pid = exec_start(argv_in, env, false, debug, unused, unused, unused);
 	if (pid < 0) {
-		fr_strerror_printf("Couldn't fork %s", argv_in[0]);
 	error:
 		return -1;
 	}
@@ -570,14 +695,8 @@ int fr_exec_fork_wait(pid_t *pid_p,
 	}
 
 	env = exec_build_env(env_in, env_inherit);
-	pid = fork();
-
-	/*
-	 *	The child never returns from calling exec_child();
-	 */
-	if (pid == 0) exec_child(argv_in, env, true, debug, stdin_pipe, stdout_pipe, stderr_pipe);
+	pid = exec_start(argv_in, env, true, debug, stdin_pipe, stdout_pipe, stderr_pipe);
 	if (pid < 0) {
-		fr_strerror_printf("Couldn't fork %s", argv_in[0]);
 		*pid_p = -1;	/* Ensure the PID is set even if the caller didn't check the return code */
 		goto error3;
 	}
@@ -0,0 +1,317 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/module_reload.c
+ * @brief Module data which can be re-read while the workers are using it.
+ *
+ * The radmin command 'set module <name> reload' reads a new copy of the
+ * data in the thread running the command, and swaps it in under a short
+ * lock.  Each worker holds a reference to the copy it's using, and picks
+ * up the new one the next time it asks for the data, so workers never
+ * wait for a reload.  Old copies are freed by whichever thread drops the
+ * last reference to them.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/server/module_reload.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** One copy of the data, and the references to it
+ *
+ */
+struct module_reload_data_s {
+	void			*data;			//!< Returned by the read callback.
+	unsigned int		refs;			//!< The current data, and each thread using it.
+							///< Protected by the mutex.
+};
+
+struct module_reload_s {
+	char const		*name;			//!< Of the module instance.
+	module_reload_read_t	read;			//!< Reads a new copy of the data.
+	module_reload_print_t	print;			//!< Prints module specific information.
+	void			*uctx;			//!< Passed to the callbacks.
+
+	pthread_mutex_t		mutex;			//!< Protects the current data, the reference
+							///< counts and the statistics.
+	module_reload_data_t	*current;		//!< The data workers switch to.
+	module_reload_data_t	*first;			//!< The data read at startup, if it's kept.
+	bool			keep_first;		//!< Keep the data read at startup until
+							///< the module is freed.
+	atomic_uint_fast32_t	generation;		//!< Incremented each time the data is replaced.
+	unsigned int		in_use;			//!< Copies of the data which haven't been freed.
+
+	fr_time_t		loaded;			//!< When the current data was read.
+	fr_time_delta_t		load_time;		//!< How long it took to read the current data.
+	size_t			size;			//!< Memory used by the current data.
+	uint64_t		reloads;		//!< Successful reloads.
+	uint64_t		failures;		//!< Failed reloads.
+};
+
+/** Drop a reference to a copy of the data
+ *
+ * Must be called with the mutex held.
+ *
+ * @return the copy if it should now be freed, else NULL.
+ */
+static inline module_reload_data_t *module_reload_unref(module_reload_t *mr, module_reload_data_t *rd)
+{
+	if (!rd) return NULL;
+
+	fr_assert(rd->refs > 0);
+	if (--rd->refs > 0) return NULL;
+
+	fr_assert(mr->in_use > 0);
+	mr->in_use--;
+
+	return rd;
+}
+
+static int _module_reload_free(module_reload_t *mr)
+{
+	pthread_mutex_lock(&mr->mutex);
+	talloc_free(module_reload_unref(mr, mr->current));
+	talloc_free(module_reload_unref(mr, mr->first));
+	mr->current = NULL;
+	mr->first = NULL;
+	pthread_mutex_unlock(&mr->mutex);
+
+	pthread_mutex_destroy(&mr->mutex);
+
+	return 0;
+}
+
+/** Allocate the state for a module's reloadable data
+ *
+ * The data isn't read until module_reload() is called.
+ *
+ * @param[in] ctx		to allocate the state in.  Usually the module instance data.
+ *				The data is freed with it.
+ * @param[in] name		of the module instance.
+ * @param[in] read		callback to read a new copy of the data.
+ * @param[in] print		callback to print information about the data.  May be NULL.
+ * @param[in] uctx		passed to the callbacks.
+ * @param[in] keep_first	Keep the data read at startup until the module is freed,
+ *				e.g. if it contains xlats which were registered globally,
+ *				and so can't be freed by a worker.
+ * @return the new state.
+ */
+module_reload_t *module_reload_alloc(TALLOC_CTX *ctx, char const *name,
+				     module_reload_read_t read, module_reload_print_t print, void *uctx,
+				     bool keep_first)
+{
+	module_reload_t *mr;
+
+	MEM(mr = talloc_zero(ctx, module_reload_t));
+	MEM(mr->name = talloc_strdup(mr, name));
+	mr->read = read;
+	mr->print = print;
+	mr->uctx = uctx;
+	mr->keep_first = keep_first;
+
+	pthread_mutex_init(&mr->mutex, NULL);
+	atomic_init(&mr->generation, 0);
+	talloc_set_destructor(mr, _module_reload_free);
+
+	return mr;
+}
+
+/** Read a new copy of the data, and make it the current one
+ *
+ * If reading fails, the current data is left in place.
+ *
+ * @param[in] mr	to reload.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int module_reload(module_reload_t *mr)
+{
+	module_reload_data_t	*rd, *old;
+	void			*data;
+	fr_time_t		start, now;
+	size_t			size;
+
+	start = fr_time();
+	data = mr->read(mr->uctx, (atomic_load_explicit(&mr->generation, memory_order_relaxed) > 0));
+	if (!data) {
+		pthread_mutex_lock(&mr->mutex);
+		mr->failures++;
+		pthread_mutex_unlock(&mr->mutex);
+		return -1;
+	}
+	now = fr_time();
+	size = talloc_total_size(data);
+
+	/*
+	 *	Not parented from the state, as the
+	 *	data may be freed by any worker thread.
+	 */
+	MEM(rd = talloc_zero(NULL, module_reload_data_t));
+	rd->data = talloc_steal(rd, data);
+	rd->refs = 1;
+
+	pthread_mutex_lock(&mr->mutex);
+	if (!mr->current && mr->keep_first) {
+		rd->refs++;
+		mr->first = rd;
+	}
+	mr->in_use++;
+	old = module_reload_unref(mr, mr->current);
+	if (mr->current) mr->reloads++;
+	mr->current = rd;
+	mr->loaded = now;
+	mr->load_time = fr_time_sub(now, start);
+	mr->size = size;
+	atomic_fetch_add_explicit(&mr->generation, 1, memory_order_release);
+	pthread_mutex_unlock(&mr->mutex);
+
+	talloc_free(old);
+
+	DEBUG2("%s - Read data in %"PRIu64" ms, using %zu bytes",
+	       mr->name, fr_time_delta_to_msec(mr->load_time), size);
+
+	return 0;
+}
+
+/** Get the data a worker should use, switching to a new copy after a reload
+ *
+ * If the data hasn't changed, this is a single atomic load.
+ *
+ * @param[in] mr	to get the data from.
+ * @param[in] t		the worker's state.
+ * @return the data.
+ */
+void *module_reload_thread_data(module_reload_t *mr, module_reload_thread_t *t)
+{
+	module_reload_data_t	*old;
+	uint32_t		generation;
+
+	generation = atomic_load_explicit(&mr->generation, memory_order_acquire);
+	if (likely(generation == t->generation)) return t->data->data;
+
+	pthread_mutex_lock(&mr->mutex);
+	old = module_reload_unref(mr, t->data);
+	t->data = mr->current;
+	t->data->refs++;
+	t->generation = atomic_load_explicit(&mr->generation, memory_order_relaxed);
+	pthread_mutex_unlock(&mr->mutex);
+
+	talloc_free(old);
+
+	return t->data->data;
+}
+
+/** Drop a worker's reference to the data
+ *
+ * @param[in] mr	the data is from.
+ * @param[in] t		the worker's state.
+ */
+void module_reload_thread_detach(module_reload_t *mr, module_reload_thread_t *t)
+{
+	module_reload_data_t *old;
+
+	pthread_mutex_lock(&mr->mutex);
+	old = module_reload_unref(mr, t->data);
+	pthread_mutex_unlock(&mr->mutex);
+
+	talloc_free(old);
+	t->data = NULL;
+	t->generation = 0;
+}
+
+static int cmd_show_module_data(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	module_reload_t *mr = talloc_get_type_abort(ctx, module_reload_t);
+
+	pthread_mutex_lock(&mr->mutex);
+	fprintf(fp, "generation\t%u\n", (unsigned int)atomic_load_explicit(&mr->generation, memory_order_relaxed));
+	fprintf(fp, "age\t%"PRIu64"\n", fr_time_delta_to_sec(fr_time_sub(fr_time(), mr->loaded)));
+	fprintf(fp, "load_time\t%"PRIu64" ms\n", fr_time_delta_to_msec(mr->load_time));
+	fprintf(fp, "memory\t%zu\n", mr->size);
+	if (mr->print) mr->print(fp, mr->current->data, mr->uctx);
+	fprintf(fp, "refs\t%u\n", mr->current->refs);
+	fprintf(fp, "in_use\t%u\n", mr->in_use);
+	fprintf(fp, "reloads\t%"PRIu64"\n", mr->reloads);
+	fprintf(fp, "failures\t%"PRIu64"\n", mr->failures);
+	pthread_mutex_unlock(&mr->mutex);
+
+	return 0;
+}
+
+static int cmd_set_module_reload(FILE *fp, FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	module_reload_t *mr = talloc_get_type_abort(ctx, module_reload_t);
+
+	if (module_reload(mr) < 0) {
+		fprintf(fp_err, "Failed reloading %s, see the server log for details\n", mr->name);
+		return -1;
+	}
+
+	fprintf(fp, "ok\n");
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_module_reload_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "data",
+		.func = cmd_show_module_data,
+		.help = "Show when the module's data was last read, and the memory it uses.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "set module",
+		.add_name = true,
+		.name = "reload",
+		.func = cmd_set_module_reload,
+		.help = "Re-read the module's data, without interrupting requests.",
+		.read_only = false,
+	},
+
+	CMD_TABLE_END
+};
+
+/** Register the 'show module <name> data' and 'set module <name> reload' commands
+ *
+ * @param[in] mr	to register the commands for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int module_reload_register(module_reload_t *mr)
+{
+	if (fr_command_register_hook(NULL, mr->name, mr, cmd_module_reload_table) < 0) {
+		PERROR("Failed registering radmin commands for module %s", mr->name);
+		return -1;
+	}
+
+	return 0;
+}
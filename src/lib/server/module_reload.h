@@ -0,0 +1,83 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/module_reload.h
+ * @brief Module data which can be re-read while the workers are using it.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(module_reload_h, "$Id$")
+
+#include <freeradius-devel/util/talloc.h>
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct module_reload_s module_reload_t;
+typedef struct module_reload_data_s module_reload_data_t;
+
+/** The data a worker thread is using
+ *
+ * Should be embedded in the module's thread instance data, and zeroed.
+ */
+typedef struct {
+	module_reload_data_t	*data;			//!< Data this thread is using.
+	uint32_t		generation;		//!< Of the data.
+} module_reload_thread_t;
+
+/** Read a new copy of the module's data
+ *
+ * @param[in] uctx		passed to module_reload_alloc().
+ * @param[in] at_runtime	The data is being read after the server has started,
+ *				and not by the main thread.
+ * @return
+ *	- The data, talloced with a NULL parent, as it may be freed by any worker.
+ *	- NULL on error.
+ */
+typedef void *(*module_reload_read_t)(void *uctx, bool at_runtime);
+
+/** Print module specific information about the current data
+ *
+ * Called with the data locked by "show module <name> data".
+ *
+ * @param[in] fp	to print to.
+ * @param[in] data	returned by the read callback.
+ * @param[in] uctx	passed to module_reload_alloc().
+ */
+typedef void (*module_reload_print_t)(FILE *fp, void const *data, void *uctx);
+
+module_reload_t	*module_reload_alloc(TALLOC_CTX *ctx, char const *name,
+				     module_reload_read_t read, module_reload_print_t print, void *uctx,
+				     bool keep_first) CC_HINT(nonnull(2,3));
+
+int		module_reload(module_reload_t *mr) CC_HINT(nonnull);
+
+void		*module_reload_thread_data(module_reload_t *mr, module_reload_thread_t *t) CC_HINT(nonnull);
+
+void		module_reload_thread_detach(module_reload_t *mr, module_reload_thread_t *t) CC_HINT(nonnull);
+
+int		module_reload_register(module_reload_t *mr) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
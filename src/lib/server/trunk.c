@@ -42,6 +42,9 @@ typedef struct fr_trunk_s fr_trunk_t;
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/table.h>
 #include <freeradius-devel/util/minmax_heap.h>
+#include <freeradius-devel/util/rb.h>
+
+#include <pthread.h>
 
 #ifdef HAVE_STDATOMIC_H
 #  include <stdatomic.h>
@@ -51,6 +54,21 @@ typedef struct fr_trunk_s fr_trunk_t;
 
 static atomic_uint_fast64_t request_counter = ATOMIC_VAR_INIT(1);
 
+/** Connection count shared by all trunks allocated with the same configuration
+ *
+ * Trunks are per-thread, so without a shared count the number of connections
+ * to a backend grows with the number of workers, not with load.
+ */
+typedef struct {
+	fr_rb_node_t		node;			//!< Entry in the tree of shared counts.
+	fr_trunk_conf_t const	*conf;			//!< Configuration the trunks were allocated with.
+	unsigned int		refs;			//!< How many trunks use this count.
+	atomic_uint_fast32_t	conns;			//!< Connections across all of those trunks.
+} trunk_shared_t;
+
+static pthread_mutex_t	trunk_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_rb_tree_t	*trunk_shared_tree;		//!< Shared counts, keyed on configuration.
+
 #ifdef TESTING_TRUNK
 static fr_time_t test_time_base = fr_time_wrap(1);
 
@@ -285,6 +303,17 @@ struct fr_trunk_s {
 
 	uint64_t		last_req_per_conn;	//!< The last request to connection ratio we calculated.
 	/** @} */
+
+	/** @name Shared connection limit
+	 * @{
+ 	 */
+	trunk_shared_t		*shared;		//!< Connection count shared with other trunks using
+							///< the same configuration.  Only set if max_total
+							///< is non-zero.
+
+	uint32_t		shared_conns;		//!< How many connections this trunk has added
+							///< to the shared count.
+	/** @} */
 };
 
 static conf_parser_t const fr_trunk_config_request[] = {
@@ -307,6 +336,7 @@ conf_parser_t const fr_trunk_config[] = {
 	{ FR_CONF_OFFSET("start", fr_trunk_conf_t, start), .dflt = "5" },
 	{ FR_CONF_OFFSET("min", fr_trunk_conf_t, min), .dflt = "1" },
 	{ FR_CONF_OFFSET("max", fr_trunk_conf_t, max), .dflt = "5" },
+	{ FR_CONF_OFFSET("max_total", fr_trunk_conf_t, max_total), .dflt = "0" },
 	{ FR_CONF_OFFSET("connecting", fr_trunk_conf_t, connecting), .dflt = "2" },
 	{ FR_CONF_OFFSET("uses", fr_trunk_conf_t, max_uses), .dflt = "0" },
 	{ FR_CONF_OFFSET("lifetime", fr_trunk_conf_t, lifetime), .dflt = "0" },
@@ -903,6 +933,100 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now);
 static void _trunk_timer(fr_event_list_t *el, fr_time_t now, void *uctx);
 static void trunk_backlog_drain(fr_trunk_t *trunk);
 
+/** Compare two shared connection counts by the configuration they belong to
+ *
+ */
+static int8_t _trunk_shared_cmp(void const *one, void const *two)
+{
+	trunk_shared_t const *a = one, *b = two;
+
+	return CMP(a->conf, b->conf);
+}
+
+/** Find or create the connection count shared by trunks using a configuration
+ *
+ * @param[in] conf	the trunk was allocated with.
+ * @return The shared count.
+ */
+static trunk_shared_t *trunk_shared_acquire(fr_trunk_conf_t const *conf)
+{
+	trunk_shared_t	*shared, find = { .conf = conf };
+
+	pthread_mutex_lock(&trunk_shared_mutex);
+	if (!trunk_shared_tree) {
+		MEM(trunk_shared_tree = fr_rb_inline_talloc_alloc(NULL, trunk_shared_t, node, _trunk_shared_cmp, NULL));
+	}
+
+	shared = fr_rb_find(trunk_shared_tree, &find);
+	if (!shared) {
+		MEM(shared = talloc_zero(trunk_shared_tree, trunk_shared_t));
+		shared->conf = conf;
+		atomic_init(&shared->conns, 0);
+		fr_rb_insert(trunk_shared_tree, shared);
+	}
+	shared->refs++;
+	pthread_mutex_unlock(&trunk_shared_mutex);
+
+	return shared;
+}
+
+/** Release a trunk's reference to a shared connection count
+ *
+ * @param[in] trunk	to release the shared count of.
+ */
+static void trunk_shared_release(fr_trunk_t *trunk)
+{
+	trunk_shared_t	*shared = trunk->shared;
+
+	/*
+	 *	Give back any connections which weren't freed
+	 *	individually.
+	 */
+	atomic_fetch_sub_explicit(&shared->conns, trunk->shared_conns, memory_order_relaxed);
+	trunk->shared_conns = 0;
+	trunk->shared = NULL;
+
+	pthread_mutex_lock(&trunk_shared_mutex);
+	if (--shared->refs == 0) {
+		fr_rb_remove(trunk_shared_tree, shared);
+		talloc_free(shared);
+		if (fr_rb_num_elements(trunk_shared_tree) == 0) TALLOC_FREE(trunk_shared_tree);
+	}
+	pthread_mutex_unlock(&trunk_shared_mutex);
+}
+
+/** Whether trunks using this configuration have reached max_total connections
+ *
+ */
+static inline bool trunk_shared_full(fr_trunk_t const *trunk)
+{
+	if (!trunk->shared) return false;
+
+	return atomic_load_explicit(&trunk->shared->conns, memory_order_relaxed) >= trunk->conf.max_total;
+}
+
+/** Reserve one of the max_total connections for this trunk
+ *
+ * Threads may race between trunk_shared_full() and spawning a connection,
+ * so the count is only incremented if it's still below the limit.
+ *
+ * @return
+ *	- true if a connection was reserved.
+ *	- false if max_total has been reached.
+ */
+static inline bool trunk_shared_reserve(fr_trunk_t *trunk)
+{
+	uint_fast32_t conns = atomic_load_explicit(&trunk->shared->conns, memory_order_relaxed);
+
+	do {
+		if (conns >= trunk->conf.max_total) return false;
+	} while (!atomic_compare_exchange_weak_explicit(&trunk->shared->conns, &conns, conns + 1,
+							memory_order_relaxed, memory_order_relaxed));
+	trunk->shared_conns++;
+
+	return true;
+}
+
 /** Compare two protocol requests
  *
  * Allows protocol requests to be prioritised with a function
@@ -3608,6 +3732,11 @@ static int _trunk_connection_free(fr_trunk_connection_t *tconn)
 	(void)talloc_free(tconn->pub.conn);
 	tconn->pub.conn = NULL;
 
+	if (tconn->pub.trunk->shared) {
+		tconn->pub.trunk->shared_conns--;
+		atomic_fetch_sub_explicit(&tconn->pub.trunk->shared->conns, 1, memory_order_relaxed);
+	}
+
 	return 0;
 }
 
@@ -3618,12 +3747,15 @@ static int _trunk_connection_free(fr_trunk_connection_t *tconn)
  *
  * @param[in] trunk	to spawn connection in.
  * @param[in] now	The current time.
+ * @return
+ *	- 0 on success.
+ *	- 1 if max_total connections are already open across all threads.
+ *	- -1 on failure.
  */
 static int trunk_connection_spawn(fr_trunk_t *trunk, fr_time_t now)
 {
 	fr_trunk_connection_t	*tconn;
 
-
 	/*
 	 *	Call the API client's callback to create
 	 *	a new fr_connection_t.
@@ -3637,6 +3769,12 @@ static int trunk_connection_spawn(fr_trunk_t *trunk, fr_time_t now)
 	 */
 	DO_CONNECTION_ALLOC(tconn);
 
+	if (trunk->shared && !trunk_shared_reserve(trunk)) {
+		DEBUG4("Not opening connection - Reached max_total (%u) across all threads", trunk->conf.max_total);
+		talloc_free(tconn);
+		return 1;
+	}
+
 	MEM(tconn->pending = fr_heap_talloc_alloc(tconn, _trunk_request_prioritise, fr_trunk_request_t, heap_id, 0));
 	fr_dlist_talloc_init(&tconn->sent, fr_trunk_request_t, entry);
 	fr_dlist_talloc_init(&tconn->cancel, fr_trunk_request_t, entry);
@@ -4169,6 +4307,18 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 				return;
 			}
 		} else {
+			/*
+			 *	Requests wait in the backlog until
+			 *	another thread's trunk closes a
+			 *	connection.
+			 */
+			if (trunk_shared_full(trunk)) {
+				DEBUG4("Not opening connection - Have %u connections across all threads, "
+				       "need %u or below",
+				       (unsigned int)atomic_load_explicit(&trunk->shared->conns, memory_order_relaxed),
+				       trunk->conf.max_total);
+				return;
+			}
 			(void)trunk_connection_spawn(trunk, now);
 			return;
 		}
@@ -4188,6 +4338,17 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 			return;
 		}
 
+		/*
+		 *	Other threads' trunks may have used up the
+		 *	connections we're allowed in total.
+		 */
+		if (trunk_shared_full(trunk)) {
+			DEBUG4("Not opening connection - Have %u connections across all threads, need %u or below",
+			       (unsigned int)atomic_load_explicit(&trunk->shared->conns, memory_order_relaxed),
+			       trunk->conf.max_total);
+			return;
+		}
+
 		/*
 		 *	Implement delay if there's no connections that
 		 *	could be immediately re-activated.
@@ -4225,7 +4386,12 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 			return;
 		}
 
-		if ((trunk->conf.min > 0) && ((conn_count - 1) < trunk->conf.min)) {
+		/*
+		 *	Once max_total has been reached, idle
+		 *	connections are closed regardless of min,
+		 *	so trunks in other threads can open them.
+		 */
+		if ((trunk->conf.min > 0) && ((conn_count - 1) < trunk->conf.min) && !trunk_shared_full(trunk)) {
 			DEBUG4("Not closing connection - Have %u connections, need %u or above",
 			       conn_count, trunk->conf.min);
 			return;
@@ -4595,7 +4761,8 @@ do { \
  */
 int fr_trunk_start(fr_trunk_t *trunk)
 {
-	uint16_t i;
+	uint16_t	i;
+	int		ret;
 
 	if (unlikely(trunk->started)) return 0;
 
@@ -4603,8 +4770,20 @@ int fr_trunk_start(fr_trunk_t *trunk)
 	 *	Spawn the initial set of connections
 	 */
 	for (i = 0; i < trunk->conf.start; i++) {
+		/*
+		 *	Requests will wait in the backlog until
+		 *	another thread's trunk closes a connection.
+		 */
+		if (trunk_shared_full(trunk)) {
+			DEBUG("Not starting more connections - Reached max_total (%u) across all threads",
+			      trunk->conf.max_total);
+			break;
+		}
+
 		DEBUG("[%i] Starting initial connection", i);
-		if (trunk_connection_spawn(trunk, fr_time()) != 0) return -1;
+		ret = trunk_connection_spawn(trunk, fr_time());
+		if (ret < 0) return -1;
+		if (ret > 0) break;
 	}
 
 	if (fr_time_delta_ispos(trunk->conf.manage_interval)) {
@@ -4735,6 +4914,8 @@ static int _trunk_free(fr_trunk_t *trunk)
 		while ((watch = fr_dlist_pop_head(&trunk->watch[i]))) talloc_free(watch);
 	}
 
+	if (trunk->shared) trunk_shared_release(trunk);
+
 	return 0;
 }
 
@@ -4788,6 +4969,12 @@ fr_trunk_t *fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 
 	memcpy(&trunk->conf, conf, sizeof(trunk->conf));
 
+	/*
+	 *	Trunks allocated with the same configuration
+	 *	share a limit on the total number of connections.
+	 */
+	if (trunk->conf.max_total > 0) trunk->shared = trunk_shared_acquire(conf);
+
 	memcpy(&trunk->uctx, &uctx, sizeof(trunk->uctx));
 	talloc_set_destructor(trunk, _trunk_free);
 
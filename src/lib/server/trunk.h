@@ -219,6 +219,11 @@ typedef struct {
 
 	uint16_t		max;			//!< Maximum number of connections in the trunk.
 
+	uint32_t		max_total;		//!< Maximum number of connections across all trunks
+							///< allocated with this configuration, i.e. across
+							///< all worker threads.  Trunks may have no connections
+							///< when this limit has been reached.
+
 	uint16_t		connecting;		//!< Maximum number of connections that can be in the
 							///< connecting state.  Used to throttle connection spawning.
 
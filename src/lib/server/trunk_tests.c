@@ -1644,6 +1644,72 @@ static void test_connection_levels_max(void)
 	talloc_free(ctx);
 }
 
+static void test_connection_levels_max_total(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_trunk_t		*trunk_a, *trunk_b, *trunk_c;
+	fr_event_list_t		*el;
+	fr_trunk_conf_t		conf = {
+					.start = 2,
+					.min = 0,
+					.max = 2,
+					.max_total = 3,
+					.manage_interval = fr_time_delta_from_nsec(NSEC * 0.5)
+				};
+	test_proto_request_t	*preq;
+	fr_trunk_request_t	*treq = NULL;
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	/* Need to provide a timer starting value above zero */
+	test_time_base = fr_time_add_time_delta(test_time_base, fr_time_delta_from_nsec(NSEC * 0.5));
+
+	TEST_CASE("T1 - Starts all connections");
+	trunk_a = test_setup_trunk(ctx, el, &conf, true, NULL);
+	TEST_CHECK_LEN(fr_trunk_connection_count_by_state(trunk_a, FR_TRUNK_CONN_CONNECTING), 2);
+
+	TEST_CASE("T2 - Starts one connection, MUST NOT exceed max_total");
+	trunk_b = test_setup_trunk(ctx, el, &conf, true, NULL);
+	TEST_CHECK_LEN(fr_trunk_connection_count_by_state(trunk_b, FR_TRUNK_CONN_CONNECTING), 1);
+
+	TEST_CASE("T3 - Starts no connections, max_total has been reached");
+	trunk_c = test_setup_trunk(ctx, el, &conf, true, NULL);
+	TEST_CHECK_LEN(fr_trunk_connection_count_by_state(trunk_c, FR_TRUNK_CONN_ALL), 0);
+
+	TEST_CASE("T3, R1 - Enqueue MUST NOT spawn");
+	preq = talloc_zero(ctx, test_proto_request_t);
+	treq = fr_trunk_request_alloc(trunk_c, NULL);
+	preq->treq = treq;
+	TEST_CHECK(fr_trunk_request_enqueue(&treq, trunk_c, NULL, preq, NULL) == FR_TRUNK_ENQUEUE_IN_BACKLOG);
+
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+
+	TEST_CHECK_LEN(fr_trunk_connection_count_by_state(trunk_c, FR_TRUNK_CONN_ALL), 0);
+	TEST_CHECK_LEN(fr_trunk_request_count_by_state(trunk_c, FR_TRUNK_CONN_ALL, FR_TRUNK_REQUEST_STATE_BACKLOG), 1);
+
+	TEST_CASE("T2 freed - T3 spawns for its backlog");
+	talloc_free(trunk_b);
+
+	test_time_base = fr_time_add_time_delta(test_time_base, fr_time_delta_from_sec(1));
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+
+	TEST_CHECK_LEN(fr_trunk_connection_count_by_state(trunk_c, FR_TRUNK_CONN_ALL), 1);
+
+	TEST_CASE("T1 freed - Connections are returned to the shared count");
+	talloc_free(trunk_a);
+	talloc_free(trunk_c);
+	trunk_c = test_setup_trunk(ctx, el, &conf, true, NULL);
+	TEST_CHECK_LEN(fr_trunk_connection_count_by_state(trunk_c, FR_TRUNK_CONN_CONNECTING), 2);
+
+	talloc_free(trunk_c);
+	talloc_free(ctx);
+}
+
 static void test_connection_levels_alternating_edges(void)
 {
 	TALLOC_CTX		*ctx = talloc_init_const("test");
@@ -1947,6 +2013,7 @@ TEST_LIST = {
 	 */
 	{ "Spawn - Test connection start on enqueue",	test_connection_start_on_enqueue },
 	{ "Spawn - Connection levels max",		test_connection_levels_max },
+	{ "Spawn - Connection levels max total",	test_connection_levels_max_total },
 	{ "Spawn - Connection levels alternating edges",test_connection_levels_alternating_edges },
 
 	/*
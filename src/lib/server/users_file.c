@@ -38,7 +38,7 @@ RCSID("$Id$")
 #include <fcntl.h>
 
 static int pairlist_read_internal(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST_LIST *list,
-				  bool complain, int *order);
+				  fr_event_list_t *runtime_el, bool complain, int *order);
 
 static inline void line_error_marker(char const *src_file, int src_line,
 				     char const *user_file, int user_line,
@@ -149,7 +149,7 @@ static fr_sbuff_parse_rules_t const rhs_term = {
  *	Caller saw a $INCLUDE at the start of a line.
  */
 static int users_include(TALLOC_CTX *ctx, fr_dict_t const *dict, fr_sbuff_t *sbuff, PAIR_LIST_LIST *list,
-			 char const *file, int lineno, int *order)
+			 fr_event_list_t *runtime_el, char const *file, int lineno, int *order)
 {
 	size_t		len;
 	char		*newfile, *p, c;
@@ -229,7 +229,7 @@ static int users_include(TALLOC_CTX *ctx, fr_dict_t const *dict, fr_sbuff_t *sbu
 	/*
 	 *	Read the $INCLUDEd file recursively.
 	 */
-	if (pairlist_read_internal(ctx, dict, newfile, list, false, order) != 0) {
+	if (pairlist_read_internal(ctx, dict, newfile, list, runtime_el, false, order) != 0) {
 		ERROR("%s[%d]: Could not read included file %s: %s",
 		      file, lineno, newfile, fr_syserror(errno));
 		talloc_free(newfile);
@@ -240,17 +240,33 @@ static int users_include(TALLOC_CTX *ctx, fr_dict_t const *dict, fr_sbuff_t *sbu
 	return 0;
 }
 
-int pairlist_read(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST_LIST *list)
+/** Read a users file
+ *
+ * @param[in] ctx		to allocate the entries in.
+ * @param[in] dict		to resolve attributes in.
+ * @param[in] file		to read.
+ * @param[out] list		to add the entries to.
+ * @param[in] runtime_el	If the file is being read after the server has started,
+ *				the event list to instantiate functions in expansions
+ *				with.  The expansions are then ephemeral, and are not
+ *				added to the global instance tree.  NULL at startup.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int pairlist_read(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST_LIST *list,
+		  fr_event_list_t *runtime_el)
 {
 	int order = 0;
 
-	return pairlist_read_internal(ctx, dict, file, list, true, &order);
+	return pairlist_read_internal(ctx, dict, file, list, runtime_el, true, &order);
 }
 
 /*
  *	Read the users file. Return a PAIR_LIST.
  */
-static int pairlist_read_internal(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST_LIST *list, bool complain, int *order)
+static int pairlist_read_internal(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST_LIST *list,
+				  fr_event_list_t *runtime_el, bool complain, int *order)
 {
 	char			*q;
 	int			lineno		= 1;
@@ -290,7 +306,11 @@ static int pairlist_read_internal(TALLOC_CTX *ctx, fr_dict_t const *dict, char c
 			 *	thing isn't known.
 			 */
 			.allow_unresolved = true
-		}
+		},
+		.xlat = {
+			.runtime_el = runtime_el
+		},
+		.at_runtime = (runtime_el != NULL)
 	};
 	rhs_rules = (tmpl_rules_t) {
 		.attr = {
@@ -298,7 +318,11 @@ static int pairlist_read_internal(TALLOC_CTX *ctx, fr_dict_t const *dict, char c
 			.prefix = TMPL_ATTR_REF_PREFIX_YES,
 			.list_def = request_attr_request,
 			.list_presence = TMPL_ATTR_LIST_ALLOW,
-		}
+		},
+		.xlat = {
+			.runtime_el = runtime_el
+		},
+		.at_runtime = (runtime_el != NULL)
 	};
 
 	while (true) {
@@ -338,7 +362,7 @@ static int pairlist_read_internal(TALLOC_CTX *ctx, fr_dict_t const *dict, char c
 		 *	the tail of the current list.
 		 */
 		if (fr_sbuff_is_str(&sbuff, "$INCLUDE", 8)) {
-			if (users_include(ctx, dict, &sbuff, list, file, lineno, order) < 0) goto fail;
+			if (users_include(ctx, dict, &sbuff, list, runtime_el, file, lineno, order) < 0) goto fail;
 
 			if (fr_sbuff_next_if_char(&sbuff, '\n')) {
 				lineno++;
@@ -54,7 +54,8 @@ typedef struct pair_list_list {
 } PAIR_LIST_LIST;
 
 /* users_file.c */
-int		pairlist_read(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST_LIST *list);
+int		pairlist_read(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST_LIST *list,
+			      fr_event_list_t *runtime_el);
 void		pairlist_free(PAIR_LIST_LIST *);
 
 static inline void pairlist_list_init(PAIR_LIST_LIST *list)
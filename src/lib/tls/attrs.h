@@ -54,6 +54,8 @@ extern HIDDEN fr_dict_attr_t const *attr_tls_client_error_code;
 extern HIDDEN fr_dict_attr_t const *attr_tls_ocsp_cert_valid;
 extern HIDDEN fr_dict_attr_t const *attr_tls_ocsp_next_update;
 extern HIDDEN fr_dict_attr_t const *attr_tls_ocsp_response;
+extern HIDDEN fr_dict_attr_t const *attr_tls_ocsp_request;
+extern HIDDEN fr_dict_attr_t const *attr_tls_ocsp_responder_uri;
 extern HIDDEN fr_dict_attr_t const *attr_tls_psk_identity;
 
 extern HIDDEN fr_dict_attr_t const *attr_tls_session_cert_file;
@@ -102,6 +102,8 @@ fr_dict_attr_t const *attr_tls_client_error_code;
 fr_dict_attr_t const *attr_tls_ocsp_cert_valid;
 fr_dict_attr_t const *attr_tls_ocsp_next_update;
 fr_dict_attr_t const *attr_tls_ocsp_response;
+fr_dict_attr_t const *attr_tls_ocsp_request;
+fr_dict_attr_t const *attr_tls_ocsp_responder_uri;
 fr_dict_attr_t const *attr_tls_psk_identity;
 
 fr_dict_attr_t const *attr_tls_session_cert_file;
@@ -146,6 +148,8 @@ fr_dict_attr_autoload_t tls_dict_attr[] = {
 	{ .out = &attr_tls_ocsp_cert_valid, .name = "TLS-OCSP-Cert-Valid", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
 	{ .out = &attr_tls_ocsp_next_update, .name = "TLS-OCSP-Next-Update", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
 	{ .out = &attr_tls_ocsp_response, .name = "TLS-OCSP-Response", .type = FR_TYPE_OCTETS, .dict = &dict_freeradius },
+	{ .out = &attr_tls_ocsp_request, .name = "TLS-OCSP-Request", .type = FR_TYPE_OCTETS, .dict = &dict_freeradius },
+	{ .out = &attr_tls_ocsp_responder_uri, .name = "TLS-OCSP-Responder-URI", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
 	{ .out = &attr_tls_psk_identity, .name = "TLS-PSK-Identity", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
 
 	{ .out = &attr_tls_session_cert_file, .name = "TLS-Session-Certificate-File", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
@@ -43,6 +43,8 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #include "base.h"
 #include "log.h"
+#include "ocsp_cache.h"
+#include "store.h"
 
 static int tls_conf_parse_cache_mode(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, conf_parser_t const *rule);
 
@@ -152,6 +154,9 @@ static conf_parser_t tls_verify_config[] = {
 	{ FR_CONF_OFFSET("check_crl", fr_tls_verify_conf_t, check_crl), .dflt = "no" },
 	{ FR_CONF_OFFSET("allow_expired_crl", fr_tls_verify_conf_t, allow_expired_crl) },
 	{ FR_CONF_OFFSET("allow_not_yet_valid_crl", fr_tls_verify_conf_t, allow_not_yet_valid_crl) },
+	{ FR_CONF_OFFSET("check_ocsp", fr_tls_verify_conf_t, check_ocsp), .dflt = "no" },
+	{ FR_CONF_OFFSET("ocsp_cache_size", fr_tls_verify_conf_t, ocsp_cache_size), .dflt = "1024" },
+	{ FR_CONF_OFFSET("ocsp_cache_lifetime", fr_tls_verify_conf_t, ocsp_cache_lifetime), .dflt = "3600" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -440,6 +445,48 @@ static X509_STORE *conf_ocsp_revocation_store(fr_tls_conf_t *conf)
 }
 #endif
 
+/** Load the CAs and CRLs into a store shared by all the SSL_CTXs using this config
+ *
+ * Also registers radmin commands to inspect and reload the store.
+ */
+static int conf_verify_store_init(fr_tls_conf_t *conf, CONF_SECTION *cs)
+{
+	char const *name;
+
+	conf->store = fr_tls_store_alloc(conf, conf);
+	if (!conf->store) {
+		cf_log_perr(cs, "Failed loading verification store");
+		return -1;
+	}
+
+	/*
+	 *	Anonymous "tls { ... }" sections are named after
+	 *	the section they're in, e.g. the module instance,
+	 *	so they don't all end up being called "tls".
+	 */
+	name = cf_section_name2(cs);
+	if (!name) {
+		CONF_SECTION *parent = cf_item_to_section(cf_parent(cs));
+
+		if (parent) name = cf_section_name2(parent);
+		if (!name && parent) name = cf_section_name1(parent);
+		if (!name) name = cf_section_name1(cs);
+	}
+
+	if (fr_tls_store_register(conf->store, name) < 0) {
+		cf_log_perr(cs, "Failed registering TLS configuration, give the section a unique name, "
+			    "e.g. \"%s <name> { ... }\"", cf_section_name1(cs));
+		return -1;
+	}
+
+	if (conf->verify.check_ocsp) {
+		conf->ocsp_cache = fr_tls_ocsp_cache_alloc(conf, conf->verify.ocsp_cache_size,
+							   conf->verify.ocsp_cache_lifetime);
+	}
+
+	return 0;
+}
+
 /*
  *	Free TLS client/server config
  *	Should not be called outside this code, as a callback is
@@ -505,6 +552,11 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 	if (conf_cert_admin_password(conf) < 0) goto error;
 #endif
 
+	if (conf_verify_store_init(conf, cs) < 0) {
+		talloc_free(conf);
+		return NULL;
+	}
+
 	/*
 	 *	Cache conf in cs in case we're asked to parse this again.
 	 */
@@ -548,6 +600,11 @@ fr_tls_conf_t *fr_tls_conf_parse_client(CONF_SECTION *cs)
 	if (conf_cert_admin_password(conf) < 0) goto error;
 #endif
 
+	if (conf_verify_store_init(conf, cs) < 0) {
+		talloc_free(conf);
+		return NULL;
+	}
+
 	cf_data_add(cs, conf, NULL, false);
 
 	return conf;
@@ -41,6 +41,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include "base.h"
 #include "utils.h"
 #include "log.h"
+#include "store.h"
 #include "cert.h"
 
 #include <openssl/rand.h>
@@ -748,56 +749,71 @@ SSL_CTX *fr_tls_ctx_alloc(fr_tls_conf_t const *conf, bool client)
 	}
 
 	/*
-	 *	Initialise a separate store for verifying user
-	 *      certificates.
-	 *
-	 *      This makes the configuration cleaner as there's
-	 *	no mixing of chain certs and user certs.
+	 *	Use the CAs and CRLs shared by all the SSL_CTXs
+	 *	created from this configuration.  These are loaded
+	 *	once, and can be reloaded without restarting.
 	 */
-	MEM(verify_store = X509_STORE_new());
-
-	/* Sets OpenSSL's (CERT *)->verify_store, overring (SSL_CTX *)->cert_store */
-	SSL_CTX_set0_verify_cert_store(ctx, verify_store);
+	if (conf->store) {
+		if (fr_tls_store_ctx_sync(ctx) < 0) goto error;
 
-	/* This isn't accessible to use later, i.e. there's no SSL_CTX_get0_verify_cert_store */
-	SSL_CTX_set_ex_data(ctx, FR_TLS_EX_CTX_INDEX_VERIFY_STORE, verify_store);
-
-	/*
-	 *	Load the CAs we trust
-	 */
-	if (conf->ca_file || conf->ca_path) {
 		/*
-		 *	This adds all the certificates to the store for conf->ca_file
-		 *      and adds a dynamic lookup for conf->ca_path.
-		 *
-		 *      It's also possible to add extra virtual server lookups
+		 *	Sets the list of CAs we send to the peer if we're
+		 *	requesting a certificate.
 		 */
-		if (!X509_STORE_load_locations(verify_store, conf->ca_file, conf->ca_path)) {
-			fr_tls_log(NULL, "Failed reading Trusted root CA list \"%s\"",
-				      conf->ca_file);
-			goto error;
-		}
-
+		if (conf->ca_file) SSL_CTX_set_client_CA_list(ctx, SSL_load_client_CA_file(conf->ca_file));
+	} else {
 		/*
-		 *	These set the default parameters of the store when the
-		 *      store is involved in building chains.
+		 *	Initialise a separate store for verifying user
+		 *      certificates.
 		 *
-		 *	- X509_PURPOSE_SSL_CLIENT ensure the purpose of the
-		 *	  client certificate is for peer authentication as
-		 *	  a client.
+		 *      This makes the configuration cleaner as there's
+		 *	no mixing of chain certs and user certs.
 		 */
-		X509_STORE_set_purpose(verify_store, X509_PURPOSE_SSL_CLIENT);
+		MEM(verify_store = X509_STORE_new());
+
+		/* Sets OpenSSL's (CERT *)->verify_store, overring (SSL_CTX *)->cert_store */
+		SSL_CTX_set0_verify_cert_store(ctx, verify_store);
+
+		/* This isn't accessible to use later, i.e. there's no SSL_CTX_get0_verify_cert_store */
+		SSL_CTX_set_ex_data(ctx, FR_TLS_EX_CTX_INDEX_VERIFY_STORE, verify_store);
 
 		/*
-		 *	Sets the list of CAs we send to the peer if we're
-		 *	requesting a certificate.
-		 *
-		 *	This does not change the trusted certificate authorities,
-		 *	those are set above with SSL_CTX_load_verify_locations.
+		 *	Load the CAs we trust
 		 */
-		if (conf->ca_file) SSL_CTX_set_client_CA_list(ctx, SSL_load_client_CA_file(conf->ca_file));
-	} else {
-		X509_STORE_set_default_paths(verify_store);
+		if (conf->ca_file || conf->ca_path) {
+			/*
+			 *	This adds all the certificates to the store for conf->ca_file
+			 *      and adds a dynamic lookup for conf->ca_path.
+			 *
+			 *      It's also possible to add extra virtual server lookups
+			 */
+			if (!X509_STORE_load_locations(verify_store, conf->ca_file, conf->ca_path)) {
+				fr_tls_log(NULL, "Failed reading Trusted root CA list \"%s\"",
+					      conf->ca_file);
+				goto error;
+			}
+
+			/*
+			 *	These set the default parameters of the store when the
+			 *      store is involved in building chains.
+			 *
+			 *	- X509_PURPOSE_SSL_CLIENT ensure the purpose of the
+			 *	  client certificate is for peer authentication as
+			 *	  a client.
+			 */
+			X509_STORE_set_purpose(verify_store, X509_PURPOSE_SSL_CLIENT);
+
+			/*
+			 *	Sets the list of CAs we send to the peer if we're
+			 *	requesting a certificate.
+			 *
+			 *	This does not change the trusted certificate authorities,
+			 *	those are set above with SSL_CTX_load_verify_locations.
+			 */
+			if (conf->ca_file) SSL_CTX_set_client_CA_list(ctx, SSL_load_client_CA_file(conf->ca_file));
+		} else {
+			X509_STORE_set_default_paths(verify_store);
+		}
 	}
 
 	/*
@@ -38,6 +38,7 @@ extern "C" {
 #define FR_TLS_EX_INDEX_TALLOC			(17)
 
 #define FR_TLS_EX_CTX_INDEX_VERIFY_STORE	(20)
+#define FR_TLS_EX_CTX_INDEX_STORE_GENERATION	(21)
 #ifdef __cplusplus
 }
 #endif
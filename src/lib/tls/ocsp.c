@@ -0,0 +1,303 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/ocsp.c
+ * @brief Build OCSP requests for client certificates, and check the responses
+ *
+ * OCSP checks are split around `verify certificate { ... }` so that the
+ * responder can be queried by a module, without blocking the worker.
+ *
+ * Before the section is run, the in-process cache is searched for a response
+ * for the client certificate.  If there isn't one, an OCSP request is built
+ * for the section to send.  After the section is run, the response it
+ * received is verified against the verification store and cached.
+ *
+ * Requests don't include a nonce, so responders can pre-generate their
+ * responses, and so the same response can be used for every session until
+ * its nextUpdate.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#ifdef WITH_TLS
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/strerror.h>
+
+#include <openssl/err.h>
+#include <openssl/ocsp.h>
+#include <openssl/x509v3.h>
+
+#include "ocsp.h"
+
+/** Maximum leeway in validity period of OCSP responses
+ *
+ * Default 5 minutes.
+ */
+#define OCSP_MAX_VALIDITY_PERIOD (5 * 60)
+
+/** Return the last OpenSSL error, and clear the error queue
+ *
+ */
+static char const *ocsp_ssl_error(void)
+{
+	char const *reason;
+
+	reason = ERR_reason_error_string(ERR_peek_last_error());
+	ERR_clear_error();
+
+	return reason ? reason : "unknown error";
+}
+
+/** Create the certid for a certificate, and encode it as a cache key
+ *
+ * @param[out] key	DER encoded certid, allocated in ctx.
+ * @param[out] key_len	Length of the key.
+ * @param[in] ctx	to allocate the key in.
+ * @param[in] cert	to create the certid for.
+ * @param[in] issuer	of cert.
+ * @return
+ *	- The certid.  Must be freed with OCSP_CERTID_free().
+ *	- NULL on error.
+ */
+static OCSP_CERTID *ocsp_certid_alloc(uint8_t **key, size_t *key_len, TALLOC_CTX *ctx, X509 *cert, X509 *issuer)
+{
+	OCSP_CERTID	*certid;
+	uint8_t		*p;
+	int		len;
+
+	certid = OCSP_cert_to_id(NULL, cert, issuer);
+	if (!certid) {
+		fr_strerror_printf("Failed creating OCSP certid: %s", ocsp_ssl_error());
+		return NULL;
+	}
+
+	len = i2d_OCSP_CERTID(certid, NULL);
+	if (len <= 0) {
+	error:
+		fr_strerror_printf("Failed encoding OCSP certid: %s", ocsp_ssl_error());
+		OCSP_CERTID_free(certid);
+		return NULL;
+	}
+
+	MEM(*key = p = talloc_array(ctx, uint8_t, len));
+	if (i2d_OCSP_CERTID(certid, &p) != len) {
+		TALLOC_FREE(*key);
+		goto error;
+	}
+	*key_len = (size_t)len;
+
+	return certid;
+}
+
+/** Find a cached response for a certificate
+ *
+ * @param[out] status	V_OCSP_CERTSTATUS_* value from the cached response.
+ * @param[out] expires	When the cached response expires.
+ * @param[in] cache	to search.
+ * @param[in] cert	to find the response for.
+ * @param[in] issuer	of cert.
+ * @param[in] now	Current time (seconds since the epoch).
+ * @return
+ *	- 1 if a response was found.
+ *	- 0 if there's no response for the certificate.
+ *	- -1 on error.
+ */
+int fr_tls_ocsp_cache_lookup(int *status, time_t *expires, fr_tls_ocsp_cache_t *cache,
+			     X509 *cert, X509 *issuer, time_t now)
+{
+	OCSP_CERTID	*certid;
+	uint8_t		*key;
+	size_t		key_len;
+	bool		found;
+
+	certid = ocsp_certid_alloc(&key, &key_len, NULL, cert, issuer);
+	if (!certid) return -1;
+	OCSP_CERTID_free(certid);
+
+	found = fr_tls_ocsp_cache_find(status, expires, NULL, NULL, NULL, cache, key, key_len, now);
+	talloc_free(key);
+
+	return found ? 1 : 0;
+}
+
+DIAG_OFF(DIAG_UNKNOWN_PRAGMAS)
+DIAG_OFF(used-but-marked-unused)	/* fix spurious warnings for sk macros */
+/** Build a DER encoded OCSP request for a certificate
+ *
+ * @param[in] ctx	to allocate the request and URI in.
+ * @param[out] req	DER encoded OCSP request.
+ * @param[out] req_len	Length of the request.
+ * @param[out] uri	First OCSP responder URI from the certificate's
+ *			Authority Information Access extension, or NULL
+ *			if it doesn't have one.
+ * @param[in] cert	to build the request for.
+ * @param[in] issuer	of cert.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_tls_ocsp_request_alloc(TALLOC_CTX *ctx, uint8_t **req, size_t *req_len, char **uri,
+			      X509 *cert, X509 *issuer)
+{
+	OCSP_CERTID		*certid;
+	OCSP_REQUEST		*ocsp_req;
+	STACK_OF(OPENSSL_STRING) *uris;
+	uint8_t			*key, *p;
+	size_t			key_len;
+	int			len;
+
+	certid = ocsp_certid_alloc(&key, &key_len, NULL, cert, issuer);
+	if (!certid) return -1;
+	talloc_free(key);
+
+	ocsp_req = OCSP_REQUEST_new();
+	if (!ocsp_req || !OCSP_request_add0_id(ocsp_req, certid)) {
+		fr_strerror_printf("Failed creating OCSP request: %s", ocsp_ssl_error());
+		OCSP_CERTID_free(certid);
+		OCSP_REQUEST_free(ocsp_req);
+		return -1;
+	}
+
+	len = i2d_OCSP_REQUEST(ocsp_req, NULL);
+	if (len <= 0) {
+	error:
+		fr_strerror_printf("Failed encoding OCSP request: %s", ocsp_ssl_error());
+		OCSP_REQUEST_free(ocsp_req);
+		return -1;
+	}
+
+	MEM(*req = p = talloc_array(ctx, uint8_t, len));
+	if (i2d_OCSP_REQUEST(ocsp_req, &p) != len) {
+		TALLOC_FREE(*req);
+		goto error;
+	}
+	*req_len = (size_t)len;
+	OCSP_REQUEST_free(ocsp_req);
+
+	*uri = NULL;
+	uris = X509_get1_ocsp(cert);
+	if (uris) {
+		if (sk_OPENSSL_STRING_num(uris) > 0) MEM(*uri = talloc_strdup(ctx, sk_OPENSSL_STRING_value(uris, 0)));
+		X509_email_free(uris);
+	}
+
+	return 0;
+}
+DIAG_ON(used-but-marked-unused)
+DIAG_ON(DIAG_UNKNOWN_PRAGMAS)
+
+/** Verify an OCSP response for a certificate, and cache it
+ *
+ * The response must be signed by the certificate's issuer, or by a responder
+ * the issuer has delegated to, and must be current.  Responses which pass
+ * are added to the cache, whatever status they give the certificate.
+ *
+ * @param[out] status		V_OCSP_CERTSTATUS_* value for the certificate.
+ * @param[out] next_update	nextUpdate from the response, or 0 if it didn't have one.
+ * @param[in] cache		to add the response to.  May be NULL.
+ * @param[in] store		containing the trusted CAs.
+ * @param[in] chain		Certificates the peer sent, used to find the responder's
+ *				certificate.  May be NULL.
+ * @param[in] cert		the response should be for.
+ * @param[in] issuer		of cert.
+ * @param[in] resp		DER encoded OCSP response.
+ * @param[in] resp_len		Length of the response.
+ * @param[in] now		Current time (seconds since the epoch).
+ * @return
+ *	- 0 if the response was verified.
+ *	- -1 if the response couldn't be verified.
+ */
+int fr_tls_ocsp_response_verify(int *status, time_t *next_update, fr_tls_ocsp_cache_t *cache,
+				X509_STORE *store, STACK_OF(X509) *chain, X509 *cert, X509 *issuer,
+				uint8_t const *resp, size_t resp_len, time_t now)
+{
+	OCSP_RESPONSE		*ocsp_resp;
+	OCSP_BASICRESP		*bresp = NULL;
+	OCSP_CERTID		*certid = NULL;
+	ASN1_GENERALIZEDTIME	*rev, *this_update, *next;
+	uint8_t const		*p = resp;
+	uint8_t			*key = NULL;
+	size_t			key_len;
+	int			reason, resp_status;
+	int			ret = -1;
+
+	*next_update = 0;
+
+	ocsp_resp = d2i_OCSP_RESPONSE(NULL, &p, resp_len);
+	if (!ocsp_resp) {
+		fr_strerror_printf("Failed parsing OCSP response: %s", ocsp_ssl_error());
+		return -1;
+	}
+
+	resp_status = OCSP_response_status(ocsp_resp);
+	if (resp_status != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+		fr_strerror_printf("OCSP responder returned \"%s\"", OCSP_response_status_str(resp_status));
+		goto finish;
+	}
+
+	bresp = OCSP_response_get1_basic(ocsp_resp);
+	if (!bresp) {
+		fr_strerror_printf("Failed decoding OCSP basic response: %s", ocsp_ssl_error());
+		goto finish;
+	}
+
+	if (OCSP_basic_verify(bresp, chain, store, 0) != 1) {
+		fr_strerror_printf("Failed verifying OCSP response signature: %s", ocsp_ssl_error());
+		goto finish;
+	}
+
+	certid = ocsp_certid_alloc(&key, &key_len, NULL, cert, issuer);
+	if (!certid) goto finish;
+
+	if (!OCSP_resp_find_status(bresp, certid, status, &reason, &rev, &this_update, &next)) {
+		fr_strerror_const("OCSP response doesn't contain a status for the certificate");
+		goto finish;
+	}
+
+	if (!OCSP_check_validity(this_update, next, OCSP_MAX_VALIDITY_PERIOD, -1)) {
+		fr_strerror_printf("OCSP response is outside its validity period, or our clock is more than "
+				   "%u seconds out: %s", OCSP_MAX_VALIDITY_PERIOD, ocsp_ssl_error());
+		goto finish;
+	}
+
+	if (next) {
+		struct tm tm;
+
+		if (!ASN1_TIME_to_tm(next, &tm)) {
+			fr_strerror_printf("Failed parsing OCSP nextUpdate: %s", ocsp_ssl_error());
+			goto finish;
+		}
+		*next_update = timegm(&tm);
+	}
+
+	if (cache) fr_tls_ocsp_cache_insert(cache, key, key_len, *status, resp, resp_len, *next_update, now);
+
+	ret = 0;
+
+finish:
+	talloc_free(key);
+	OCSP_CERTID_free(certid);
+	OCSP_BASICRESP_free(bresp);
+	OCSP_RESPONSE_free(ocsp_resp);
+
+	return ret;
+}
+#endif /* WITH_TLS */
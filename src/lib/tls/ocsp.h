@@ -0,0 +1,53 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifdef WITH_TLS
+/**
+ * $Id$
+ *
+ * @file lib/tls/ocsp.h
+ * @brief Build OCSP requests for client certificates, and check the responses
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(tls_ocsp_h, "$Id$")
+
+#include "openssl_user_macros.h"
+
+#include <openssl/x509.h>
+
+#include <freeradius-devel/util/talloc.h>
+
+#include "ocsp_cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int	fr_tls_ocsp_cache_lookup(int *status, time_t *expires, fr_tls_ocsp_cache_t *cache,
+				 X509 *cert, X509 *issuer, time_t now);
+
+int	fr_tls_ocsp_request_alloc(TALLOC_CTX *ctx, uint8_t **req, size_t *req_len, char **uri,
+				  X509 *cert, X509 *issuer);
+
+int	fr_tls_ocsp_response_verify(int *status, time_t *next_update, fr_tls_ocsp_cache_t *cache,
+				    X509_STORE *store, STACK_OF(X509) *chain, X509 *cert, X509 *issuer,
+				    uint8_t const *resp, size_t resp_len, time_t now);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* WITH_TLS */
@@ -0,0 +1,229 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/ocsp_cache.c
+ * @brief In-process cache of verified OCSP responses, shared by all threads
+ *
+ * Entries are keyed by the DER encoded OCSP_CERTID, which covers the issuer
+ * name hash, the issuer key hash and the serial number.  An entry lives
+ * until the response's nextUpdate, but never longer than the configured
+ * maximum lifetime.  When the cache is full, the least recently used entry
+ * is evicted.
+ *
+ * The cache only deals in opaque keys and DER encoded responses, it's up
+ * to the caller to verify responses before inserting them.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#ifdef WITH_TLS
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/rb.h>
+
+#include <pthread.h>
+
+#include "ocsp_cache.h"
+
+/** An OCSP response held in the cache
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;		//!< Entry in the tree of cached responses.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+
+	uint8_t			*key;		//!< DER encoded OCSP_CERTID, i.e. hashes of
+						///< the issuer name and key, and the serial.
+	size_t			key_len;	//!< Length of the key.
+
+	int			status;		//!< V_OCSP_CERTSTATUS_* value from the response.
+	time_t			expires;	//!< nextUpdate, or the maximum lifetime if that's sooner.
+
+	uint8_t			*resp;		//!< DER encoded OCSP response, used for stapling.
+	size_t			resp_len;	//!< Length of the response.
+} ocsp_cache_entry_t;
+
+struct fr_tls_ocsp_cache_s {
+	pthread_mutex_t		mutex;		//!< Protects the tree and LRU list.
+	fr_rb_tree_t		*tree;		//!< Cached responses, by OCSP_CERTID.
+	fr_dlist_head_t		lru;		//!< Most recently used at the head.
+	uint32_t		max_entries;	//!< Maximum number of responses to cache.
+	uint32_t		max_lifetime;	//!< Maximum time to cache a response for.
+};
+
+static int8_t ocsp_cache_cmp(void const *one, void const *two)
+{
+	ocsp_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->key_len, b->key_len);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->key, b->key, a->key_len);
+	return CMP(ret, 0);
+}
+
+static int _ocsp_cache_free(fr_tls_ocsp_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+	return 0;
+}
+
+/** Allocate an in-process OCSP response cache
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of responses to cache.
+ * @param[in] max_lifetime	Maximum time (seconds) to cache a response for.  Also
+ *				used for responses without a nextUpdate field.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+fr_tls_ocsp_cache_t *fr_tls_ocsp_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_lifetime)
+{
+	fr_tls_ocsp_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, fr_tls_ocsp_cache_t));
+	MEM(cache->tree = fr_rb_inline_talloc_alloc(cache, ocsp_cache_entry_t, node, ocsp_cache_cmp, NULL));
+	fr_dlist_talloc_init(&cache->lru, ocsp_cache_entry_t, entry);
+	cache->max_entries = max_entries;
+	cache->max_lifetime = max_lifetime;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _ocsp_cache_free);
+
+	return cache;
+}
+
+/** Remove an entry from the cache
+ *
+ * @note Must be called with the cache mutex held.
+ */
+static void ocsp_cache_entry_remove(fr_tls_ocsp_cache_t *cache, ocsp_cache_entry_t *entry)
+{
+	fr_rb_remove(cache->tree, entry);
+	fr_dlist_remove(&cache->lru, entry);
+	talloc_free(entry);
+}
+
+/** Find an unexpired response for a certificate
+ *
+ * @param[out] status	V_OCSP_CERTSTATUS_* value from the cached response.
+ * @param[out] expires	When the cached response expires.
+ * @param[out] resp	A copy of the DER encoded response, allocated in ctx.
+ *			May be NULL if the response isn't needed.
+ * @param[out] resp_len	Length of the response.
+ * @param[in] ctx	to allocate the response copy in.
+ * @param[in] cache	to search.
+ * @param[in] key	DER encoded OCSP_CERTID identifying the certificate.
+ * @param[in] key_len	Length of the key.
+ * @param[in] now	Current time (seconds since the epoch).
+ * @return
+ *	- true if an unexpired response was found.
+ *	- false otherwise.
+ */
+bool fr_tls_ocsp_cache_find(int *status, time_t *expires, uint8_t **resp, size_t *resp_len,
+			    TALLOC_CTX *ctx, fr_tls_ocsp_cache_t *cache,
+			    uint8_t const *key, size_t key_len, time_t now)
+{
+	ocsp_cache_entry_t	find, *found;
+
+	memcpy(&find.key, &key, sizeof(find.key));
+	find.key_len = key_len;
+
+	pthread_mutex_lock(&cache->mutex);
+	found = fr_rb_find(cache->tree, &find);
+	if (!found) {
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+
+	if (found->expires <= now) {
+		ocsp_cache_entry_remove(cache, found);
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+
+	fr_dlist_remove(&cache->lru, found);
+	fr_dlist_insert_head(&cache->lru, found);
+
+	*status = found->status;
+	*expires = found->expires;
+	if (resp) {
+		*resp = found->resp_len ? talloc_memdup(ctx, found->resp, found->resp_len) : NULL;
+		*resp_len = found->resp_len;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return true;
+}
+
+/** Add a verified response to the cache
+ *
+ * Replaces any existing response for the same certificate.
+ *
+ * @param[in] cache		to add the response to.
+ * @param[in] key		DER encoded OCSP_CERTID identifying the certificate.
+ * @param[in] key_len		Length of the key.
+ * @param[in] status		V_OCSP_CERTSTATUS_* value from the response.
+ * @param[in] resp		The full DER encoded response, stored for stapling.
+ * @param[in] resp_len		Length of the response.
+ * @param[in] next_update	nextUpdate from the response, or 0 if there wasn't one.
+ * @param[in] now		Current time (seconds since the epoch).
+ */
+void fr_tls_ocsp_cache_insert(fr_tls_ocsp_cache_t *cache, uint8_t const *key, size_t key_len,
+			      int status, uint8_t const *resp, size_t resp_len,
+			      time_t next_update, time_t now)
+{
+	ocsp_cache_entry_t	*entry, *old;
+	time_t			expires = now + cache->max_lifetime;
+
+	if (!cache->max_entries) return;
+
+	if (next_update && (next_update < expires)) expires = next_update;
+	if (expires <= now) return;
+
+	MEM(entry = talloc_zero(NULL, ocsp_cache_entry_t));
+	MEM(entry->key = talloc_memdup(entry, key, key_len));
+	entry->key_len = key_len;
+	entry->status = status;
+	entry->expires = expires;
+	if (resp_len) {
+		MEM(entry->resp = talloc_memdup(entry, resp, resp_len));
+		entry->resp_len = resp_len;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	talloc_steal(cache, entry);
+
+	old = fr_rb_find(cache->tree, entry);
+	if (old) ocsp_cache_entry_remove(cache, old);
+
+	while (fr_rb_num_elements(cache->tree) >= cache->max_entries) {
+		old = fr_dlist_tail(&cache->lru);
+		if (!old) break;
+		ocsp_cache_entry_remove(cache, old);
+	}
+
+	fr_rb_insert(cache->tree, entry);
+	fr_dlist_insert_head(&cache->lru, entry);
+	pthread_mutex_unlock(&cache->mutex);
+}
+#endif /* WITH_TLS */
@@ -0,0 +1,49 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifdef WITH_TLS
+/**
+ * $Id$
+ *
+ * @file lib/tls/ocsp_cache.h
+ * @brief In-process cache of verified OCSP responses
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(ocsp_cache_h, "$Id$")
+
+#include <freeradius-devel/util/talloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_tls_ocsp_cache_s fr_tls_ocsp_cache_t;
+
+fr_tls_ocsp_cache_t	*fr_tls_ocsp_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_lifetime);
+
+bool			fr_tls_ocsp_cache_find(int *status, time_t *expires, uint8_t **resp, size_t *resp_len,
+					       TALLOC_CTX *ctx, fr_tls_ocsp_cache_t *cache,
+					       uint8_t const *key, size_t key_len, time_t now);
+
+void			fr_tls_ocsp_cache_insert(fr_tls_ocsp_cache_t *cache, uint8_t const *key, size_t key_len,
+						 int status, uint8_t const *resp, size_t resp_len,
+						 time_t next_update, time_t now);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* WITH_TLS */
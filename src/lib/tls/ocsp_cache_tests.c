@@ -0,0 +1,178 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the in-process OCSP response cache
+ *
+ * @file src/lib/tls/ocsp_cache_tests.c
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include "ocsp_cache.c"
+
+#define NOW		1700000000
+
+static uint8_t const	key_a[] = { 0x30, 0x01, 0xaa };
+static uint8_t const	key_b[] = { 0x30, 0x01, 0xbb };
+static uint8_t const	key_c[] = { 0x30, 0x01, 0xcc };
+static uint8_t const	key_long[] = { 0x30, 0x01, 0xaa, 0x00 };
+static uint8_t const	resp[] = { 0x30, 0x03, 0x0a, 0x01, 0x00 };
+
+static bool cache_has(fr_tls_ocsp_cache_t *cache, uint8_t const *key, size_t key_len, time_t now)
+{
+	int	status;
+	time_t	expires;
+
+	return fr_tls_ocsp_cache_find(&status, &expires, NULL, NULL, NULL, cache, key, key_len, now);
+}
+
+static void test_ocsp_cache_hit_miss(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ocsp_cache_tests");
+	fr_tls_ocsp_cache_t	*cache = fr_tls_ocsp_cache_alloc(ctx, 16, 3600);
+	int			status = -1;
+	time_t			expires = 0;
+	uint8_t			*out = NULL;
+	size_t			out_len = 0;
+
+	TEST_CHECK(!cache_has(cache, key_a, sizeof(key_a), NOW));
+
+	fr_tls_ocsp_cache_insert(cache, key_a, sizeof(key_a), 1, resp, sizeof(resp), 0, NOW);
+
+	TEST_CHECK(fr_tls_ocsp_cache_find(&status, &expires, &out, &out_len, ctx, cache,
+					  key_a, sizeof(key_a), NOW + 1));
+	TEST_CHECK(status == 1);
+	TEST_CHECK(expires == NOW + 3600);
+	TEST_ASSERT(out != NULL);
+	TEST_CHECK(out_len == sizeof(resp));
+	TEST_CHECK(memcmp(out, resp, sizeof(resp)) == 0);
+
+	/*
+	 *	The copy belongs to the caller.
+	 */
+	TEST_CHECK(talloc_parent(out) == ctx);
+
+	/*
+	 *	Keys must match exactly, including the length.
+	 */
+	TEST_CHECK(!cache_has(cache, key_b, sizeof(key_b), NOW));
+	TEST_CHECK(!cache_has(cache, key_long, sizeof(key_long), NOW));
+	TEST_CHECK(!cache_has(cache, key_a, sizeof(key_a) - 1, NOW));
+
+	talloc_free(ctx);
+}
+
+static void test_ocsp_cache_expiry(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ocsp_cache_tests");
+	fr_tls_ocsp_cache_t	*cache = fr_tls_ocsp_cache_alloc(ctx, 16, 3600);
+	int			status;
+	time_t			expires;
+
+	/*
+	 *	nextUpdate sooner than the maximum lifetime wins.
+	 */
+	fr_tls_ocsp_cache_insert(cache, key_a, sizeof(key_a), 0, NULL, 0, NOW + 60, NOW);
+	TEST_CHECK(fr_tls_ocsp_cache_find(&status, &expires, NULL, NULL, NULL, cache, key_a, sizeof(key_a), NOW));
+	TEST_CHECK(expires == NOW + 60);
+	TEST_CHECK(cache_has(cache, key_a, sizeof(key_a), NOW + 59));
+	TEST_CHECK(!cache_has(cache, key_a, sizeof(key_a), NOW + 60));
+
+	/*
+	 *	Expired entries are removed when they're found.
+	 */
+	TEST_CHECK(fr_rb_num_elements(cache->tree) == 0);
+	TEST_CHECK(fr_dlist_num_elements(&cache->lru) == 0);
+
+	/*
+	 *	...and the maximum lifetime caps a later nextUpdate.
+	 */
+	fr_tls_ocsp_cache_insert(cache, key_b, sizeof(key_b), 0, NULL, 0, NOW + 86400, NOW);
+	TEST_CHECK(fr_tls_ocsp_cache_find(&status, &expires, NULL, NULL, NULL, cache, key_b, sizeof(key_b), NOW));
+	TEST_CHECK(expires == NOW + 3600);
+
+	/*
+	 *	Responses which have already expired aren't cached.
+	 */
+	fr_tls_ocsp_cache_insert(cache, key_c, sizeof(key_c), 0, NULL, 0, NOW - 1, NOW);
+	TEST_CHECK(!cache_has(cache, key_c, sizeof(key_c), NOW));
+
+	talloc_free(ctx);
+}
+
+static void test_ocsp_cache_replace(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ocsp_cache_tests");
+	fr_tls_ocsp_cache_t	*cache = fr_tls_ocsp_cache_alloc(ctx, 16, 3600);
+	int			status;
+	time_t			expires;
+
+	fr_tls_ocsp_cache_insert(cache, key_a, sizeof(key_a), 0, NULL, 0, 0, NOW);
+	fr_tls_ocsp_cache_insert(cache, key_a, sizeof(key_a), 1, NULL, 0, 0, NOW + 10);
+
+	TEST_CHECK(fr_rb_num_elements(cache->tree) == 1);
+	TEST_CHECK(fr_dlist_num_elements(&cache->lru) == 1);
+	TEST_CHECK(fr_tls_ocsp_cache_find(&status, &expires, NULL, NULL, NULL, cache, key_a, sizeof(key_a), NOW + 10));
+	TEST_CHECK(status == 1);
+	TEST_CHECK(expires == NOW + 10 + 3600);
+
+	talloc_free(ctx);
+}
+
+static void test_ocsp_cache_lru(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ocsp_cache_tests");
+	fr_tls_ocsp_cache_t	*cache = fr_tls_ocsp_cache_alloc(ctx, 2, 3600);
+
+	fr_tls_ocsp_cache_insert(cache, key_a, sizeof(key_a), 0, NULL, 0, 0, NOW);
+	fr_tls_ocsp_cache_insert(cache, key_b, sizeof(key_b), 0, NULL, 0, 0, NOW);
+
+	/*
+	 *	Using a makes b the least recently used.
+	 */
+	TEST_CHECK(cache_has(cache, key_a, sizeof(key_a), NOW));
+
+	fr_tls_ocsp_cache_insert(cache, key_c, sizeof(key_c), 0, NULL, 0, 0, NOW);
+	TEST_CHECK(fr_rb_num_elements(cache->tree) == 2);
+	TEST_CHECK(cache_has(cache, key_a, sizeof(key_a), NOW));
+	TEST_CHECK(!cache_has(cache, key_b, sizeof(key_b), NOW));
+	TEST_CHECK(cache_has(cache, key_c, sizeof(key_c), NOW));
+
+	talloc_free(ctx);
+}
+
+static void test_ocsp_cache_disabled(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ocsp_cache_tests");
+	fr_tls_ocsp_cache_t	*cache = fr_tls_ocsp_cache_alloc(ctx, 0, 3600);
+
+	fr_tls_ocsp_cache_insert(cache, key_a, sizeof(key_a), 0, NULL, 0, 0, NOW);
+	TEST_CHECK(!cache_has(cache, key_a, sizeof(key_a), NOW));
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "hit_miss",		test_ocsp_cache_hit_miss },
+	{ "expiry",		test_ocsp_cache_expiry },
+	{ "replace",		test_ocsp_cache_replace },
+	{ "lru",		test_ocsp_cache_lru },
+	{ "disabled",		test_ocsp_cache_disabled },
+
+	{ NULL }
+};
@@ -0,0 +1,13 @@
+ifneq ($(OPENSSL_LIBS),)
+TARGET		:= ocsp_cache_tests$(E)
+else
+TARGET		:=
+endif
+
+SOURCES		:= ocsp_cache_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util$(L)
+
+TGT_INSTALLDIR	:=
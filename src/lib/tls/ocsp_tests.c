@@ -0,0 +1,350 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for building OCSP requests, and verifying and caching OCSP responses
+ *
+ * A CA, a client certificate it issued, and an unrelated CA are generated
+ * in memory, and the responses are signed here, so no responder is needed.
+ *
+ * @file src/lib/tls/ocsp_tests.c
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+/*
+ *	The certificates are only generated once, rather than
+ *	before every test with TEST_INIT.
+ */
+static void test_init(void) __attribute__((constructor));
+static void test_free(void) __attribute__((destructor));
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <openssl/ec.h>
+
+#include "ocsp_cache.c"
+
+/*
+ *	Both files define rcsid.
+ */
+#undef RCSID
+#define RCSID(_id)
+#include "ocsp.c"
+
+#define RESPONDER_URI	"http://ocsp.example.com/"
+
+typedef struct {
+	EVP_PKEY	*key;
+	X509		*cert;
+} test_cert_t;
+
+static test_cert_t	ca, client, other_client, rogue_ca;
+static X509_STORE	*store;
+
+static EVP_PKEY *test_key_alloc(void)
+{
+	return EVP_EC_gen("P-256");
+}
+
+static void test_ext_add(X509 *cert, X509 *issuer, int nid, char const *value)
+{
+	X509V3_CTX	v3;
+	X509_EXTENSION	*ext;
+
+	X509V3_set_ctx(&v3, issuer, cert, NULL, NULL, 0);
+	ext = X509V3_EXT_conf_nid(NULL, &v3, nid, value);
+	X509_add_ext(cert, ext, -1);
+	X509_EXTENSION_free(ext);
+}
+
+/** Create a certificate, self-signed if issuer is NULL
+ *
+ */
+static void test_cert_alloc(test_cert_t *out, char const *cn, long serial, test_cert_t *issuer)
+{
+	X509_NAME	*name;
+
+	out->key = test_key_alloc();
+	out->cert = X509_new();
+
+	X509_set_version(out->cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(out->cert), serial);
+	X509_gmtime_adj(X509_getm_notBefore(out->cert), -3600);
+	X509_gmtime_adj(X509_getm_notAfter(out->cert), 86400);
+	X509_set_pubkey(out->cert, out->key);
+
+	name = X509_get_subject_name(out->cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char const *)cn, -1, -1, 0);
+	X509_set_issuer_name(out->cert, issuer ? X509_get_subject_name(issuer->cert) : name);
+
+	if (!issuer) {
+		test_ext_add(out->cert, out->cert, NID_basic_constraints, "critical,CA:TRUE");
+		test_ext_add(out->cert, out->cert, NID_key_usage, "critical,keyCertSign,cRLSign");
+		test_ext_add(out->cert, out->cert, NID_subject_key_identifier, "hash");
+	} else {
+		test_ext_add(out->cert, issuer->cert, NID_info_access, "OCSP;URI:" RESPONDER_URI);
+	}
+
+	X509_sign(out->cert, issuer ? issuer->key : out->key, EVP_sha256());
+}
+
+static void test_init(void)
+{
+	test_cert_alloc(&ca, "Test CA", 1, NULL);
+	test_cert_alloc(&client, "client", 2, &ca);
+	test_cert_alloc(&other_client, "other", 3, &ca);
+	test_cert_alloc(&rogue_ca, "Test CA", 1, NULL);	/* Same name, different key */
+
+	store = X509_STORE_new();
+	X509_STORE_add_cert(store, ca.cert);
+}
+
+static void test_free(void)
+{
+	test_cert_t *certs[] = { &ca, &client, &other_client, &rogue_ca };
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(certs); i++) {
+		X509_free(certs[i]->cert);
+		EVP_PKEY_free(certs[i]->key);
+	}
+	X509_STORE_free(store);
+}
+
+/** Sign an OCSP response for a certificate issued by ca
+ *
+ * @param[in] ctx		to allocate the response in.
+ * @param[out] len		of the response.
+ * @param[in] signer		Key and certificate to sign the response with.
+ * @param[in] cert		to give the status of.
+ * @param[in] status		V_OCSP_CERTSTATUS_* value.
+ * @param[in] next_update	Seconds from now.
+ */
+static uint8_t *test_response_alloc(TALLOC_CTX *ctx, size_t *len, test_cert_t *signer,
+				    X509 *cert, int status, long next_update)
+{
+	OCSP_BASICRESP	*bresp;
+	OCSP_RESPONSE	*resp;
+	OCSP_CERTID	*certid;
+	ASN1_TIME	*this_upd, *next_upd, *rev = NULL;
+	uint8_t		*out, *p;
+	int		out_len;
+
+	certid = OCSP_cert_to_id(NULL, cert, ca.cert);
+	this_upd = X509_gmtime_adj(NULL, -7200);
+	next_upd = X509_gmtime_adj(NULL, next_update);
+	if (status == V_OCSP_CERTSTATUS_REVOKED) rev = X509_gmtime_adj(NULL, -120);
+
+	bresp = OCSP_BASICRESP_new();
+	OCSP_basic_add1_status(bresp, certid, status, OCSP_REVOKED_STATUS_KEYCOMPROMISE, rev, this_upd, next_upd);
+	OCSP_basic_sign(bresp, signer->cert, signer->key, EVP_sha256(), NULL, 0);
+	resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bresp);
+
+	out_len = i2d_OCSP_RESPONSE(resp, NULL);
+	out = p = talloc_array(ctx, uint8_t, out_len);
+	i2d_OCSP_RESPONSE(resp, &p);
+	*len = out_len;
+
+	OCSP_RESPONSE_free(resp);
+	OCSP_BASICRESP_free(bresp);
+	OCSP_CERTID_free(certid);
+	ASN1_TIME_free(this_upd);
+	ASN1_TIME_free(next_upd);
+	ASN1_TIME_free(rev);
+
+	return out;
+}
+
+static int cache_lookup(fr_tls_ocsp_cache_t *cache, X509 *cert, int *status)
+{
+	time_t expires;
+
+	return fr_tls_ocsp_cache_lookup(status, &expires, cache, cert, ca.cert, time(NULL));
+}
+
+static void test_ocsp_request(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ocsp_tests");
+	OCSP_REQUEST		*req;
+	OCSP_CERTID		*certid, *expected;
+	uint8_t const		*p;
+	uint8_t			*req_der;
+	size_t			req_len;
+	char			*uri;
+
+	TEST_ASSERT(fr_tls_ocsp_request_alloc(ctx, &req_der, &req_len, &uri, client.cert, ca.cert) == 0);
+	TEST_CHECK(uri && (strcmp(uri, RESPONDER_URI) == 0));
+	TEST_MSG("Expected %s, got %s", RESPONDER_URI, uri);
+
+	p = req_der;
+	req = d2i_OCSP_REQUEST(NULL, &p, req_len);
+	TEST_ASSERT(req != NULL);
+	TEST_CHECK(p == req_der + req_len);
+
+	/*
+	 *	One certid, for the client certificate, and no
+	 *	nonce, so responders can pre-generate responses.
+	 */
+	TEST_CHECK(OCSP_request_onereq_count(req) == 1);
+	certid = OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, 0));
+	expected = OCSP_cert_to_id(NULL, client.cert, ca.cert);
+	TEST_CHECK(OCSP_id_cmp(certid, expected) == 0);
+	TEST_CHECK(OCSP_REQUEST_get_ext_by_NID(req, NID_id_pkix_OCSP_Nonce, -1) < 0);
+
+	OCSP_CERTID_free(expected);
+	OCSP_REQUEST_free(req);
+
+	/*
+	 *	Certificates without an AIA extension don't name a responder.
+	 */
+	TEST_ASSERT(fr_tls_ocsp_request_alloc(ctx, &req_der, &req_len, &uri, ca.cert, ca.cert) == 0);
+	TEST_CHECK(uri == NULL);
+
+	talloc_free(ctx);
+}
+
+static void test_ocsp_miss_hit(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ocsp_tests");
+	fr_tls_ocsp_cache_t	*cache = fr_tls_ocsp_cache_alloc(ctx, 16, 3600);
+	uint8_t			*resp;
+	size_t			resp_len;
+	int			status = -1;
+	time_t			next_update, now = time(NULL);
+
+	TEST_CHECK(cache_lookup(cache, client.cert, &status) == 0);
+
+	resp = test_response_alloc(ctx, &resp_len, &ca, client.cert, V_OCSP_CERTSTATUS_GOOD, 600);
+	TEST_CHECK(fr_tls_ocsp_response_verify(&status, &next_update, cache, store, NULL, client.cert, ca.cert,
+					       resp, resp_len, now) == 0);
+	TEST_MSG("%s", fr_strerror());
+	TEST_CHECK(status == V_OCSP_CERTSTATUS_GOOD);
+	TEST_CHECK((next_update >= now + 590) && (next_update <= now + 610));
+	TEST_MSG("nextUpdate is %li seconds from now", (long)(next_update - now));
+
+	/*
+	 *	The second verification hits the cache...
+	 */
+	status = -1;
+	TEST_CHECK(cache_lookup(cache, client.cert, &status) == 1);
+	TEST_CHECK(status == V_OCSP_CERTSTATUS_GOOD);
+
+	/*
+	 *	...but only for the certificate the response was for.
+	 */
+	TEST_CHECK(cache_lookup(cache, other_client.cert, &status) == 0);
+
+	talloc_free(ctx);
+}
+
+static void test_ocsp_revoked(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ocsp_tests");
+	fr_tls_ocsp_cache_t	*cache = fr_tls_ocsp_cache_alloc(ctx, 16, 3600);
+	uint8_t			*resp;
+	size_t			resp_len;
+	int			status = -1;
+	time_t			next_update;
+
+	/*
+	 *	A valid response which revokes the certificate
+	 *	is still a valid response, and is cached.
+	 */
+	resp = test_response_alloc(ctx, &resp_len, &ca, client.cert, V_OCSP_CERTSTATUS_REVOKED, 600);
+	TEST_CHECK(fr_tls_ocsp_response_verify(&status, &next_update, cache, store, NULL, client.cert, ca.cert,
+					       resp, resp_len, time(NULL)) == 0);
+	TEST_CHECK(status == V_OCSP_CERTSTATUS_REVOKED);
+
+	status = -1;
+	TEST_CHECK(cache_lookup(cache, client.cert, &status) == 1);
+	TEST_CHECK(status == V_OCSP_CERTSTATUS_REVOKED);
+
+	talloc_free(ctx);
+}
+
+static void test_ocsp_invalid(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("ocsp_tests");
+	fr_tls_ocsp_cache_t	*cache = fr_tls_ocsp_cache_alloc(ctx, 16, 3600);
+	OCSP_RESPONSE		*try_later;
+	uint8_t			*resp, *p;
+	size_t			resp_len;
+	int			status;
+	time_t			next_update, now = time(NULL);
+
+	/*
+	 *	Signed by a CA we don't trust.
+	 */
+	resp = test_response_alloc(ctx, &resp_len, &rogue_ca, client.cert, V_OCSP_CERTSTATUS_GOOD, 600);
+	TEST_CHECK(fr_tls_ocsp_response_verify(&status, &next_update, cache, store, NULL, client.cert, ca.cert,
+					       resp, resp_len, now) < 0);
+
+	/*
+	 *	Signed by a certificate the CA issued, but didn't
+	 *	delegate OCSP signing to.
+	 */
+	resp = test_response_alloc(ctx, &resp_len, &other_client, client.cert, V_OCSP_CERTSTATUS_GOOD, 600);
+	TEST_CHECK(fr_tls_ocsp_response_verify(&status, &next_update, cache, store, NULL, client.cert, ca.cert,
+					       resp, resp_len, now) < 0);
+
+	/*
+	 *	For a different certificate.
+	 */
+	resp = test_response_alloc(ctx, &resp_len, &ca, other_client.cert, V_OCSP_CERTSTATUS_GOOD, 600);
+	TEST_CHECK(fr_tls_ocsp_response_verify(&status, &next_update, cache, store, NULL, client.cert, ca.cert,
+					       resp, resp_len, now) < 0);
+
+	/*
+	 *	Stale.
+	 */
+	resp = test_response_alloc(ctx, &resp_len, &ca, client.cert, V_OCSP_CERTSTATUS_GOOD, -3600);
+	TEST_CHECK(fr_tls_ocsp_response_verify(&status, &next_update, cache, store, NULL, client.cert, ca.cert,
+					       resp, resp_len, now) < 0);
+
+	/*
+	 *	Responder error.
+	 */
+	try_later = OCSP_response_create(OCSP_RESPONSE_STATUS_TRYLATER, NULL);
+	resp_len = i2d_OCSP_RESPONSE(try_later, NULL);
+	resp = p = talloc_array(ctx, uint8_t, resp_len);
+	i2d_OCSP_RESPONSE(try_later, &p);
+	OCSP_RESPONSE_free(try_later);
+	TEST_CHECK(fr_tls_ocsp_response_verify(&status, &next_update, cache, store, NULL, client.cert, ca.cert,
+					       resp, resp_len, now) < 0);
+
+	/*
+	 *	Garbage.
+	 */
+	TEST_CHECK(fr_tls_ocsp_response_verify(&status, &next_update, cache, store, NULL, client.cert, ca.cert,
+					       (uint8_t const *)"\x30\x03\x0a\x01", 4, now) < 0);
+
+	/*
+	 *	None of them were cached.
+	 */
+	TEST_CHECK(fr_rb_num_elements(cache->tree) == 0);
+	TEST_CHECK(cache_lookup(cache, client.cert, &status) == 0);
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "request",		test_ocsp_request },
+	{ "miss_hit",		test_ocsp_miss_hit },
+	{ "revoked",		test_ocsp_revoked },
+	{ "invalid",		test_ocsp_invalid },
+
+	{ NULL }
+};
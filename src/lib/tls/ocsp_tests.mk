@@ -0,0 +1,13 @@
+ifneq ($(OPENSSL_LIBS),)
+TARGET		:= ocsp_tests$(E)
+else
+TARGET		:=
+endif
+
+SOURCES		:= ocsp_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(OPENSSL_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(OPENSSL_FLAGS)
+TGT_PREREQS	:= libfreeradius-util$(L)
+
+TGT_INSTALLDIR	:=
@@ -46,6 +46,7 @@
 #include "attrs.h"
 #include "base.h"
 #include "log.h"
+#include "store.h"
 
 #include <openssl/x509v3.h>
 #include <openssl/ssl.h>
@@ -1635,6 +1636,14 @@ fr_tls_session_t *fr_tls_session_alloc_client(TALLOC_CTX *ctx, SSL_CTX *ssl_ctx)
 	talloc_set_destructor(tls_session, _fr_tls_session_free);
 	fr_pair_list_init(&tls_session->extra_pairs);
 
+	/*
+	 *	Pick up any reloaded CAs and CRLs
+	 */
+	if (fr_tls_store_ctx_sync(ssl_ctx) < 0) {
+		talloc_free(tls_session);
+		return NULL;
+	}
+
 	tls_session->ssl = SSL_new(ssl_ctx);
 	if (!tls_session->ssl) {
 		talloc_free(tls_session);
@@ -1698,6 +1707,15 @@ fr_tls_session_t *fr_tls_session_alloc_server(TALLOC_CTX *ctx, SSL_CTX *ssl_ctx,
 
 	RDEBUG2("Initiating new TLS session");
 
+	/*
+	 *	Pick up any reloaded CAs and CRLs before
+	 *	the session takes its reference to them.
+	 */
+	if (fr_tls_store_ctx_sync(ssl_ctx) < 0) {
+		fr_tls_log(request, "Error updating verification store");
+		return NULL;
+	}
+
 	MEM(tls_session = talloc_zero(ctx, fr_tls_session_t));
 
 	ssl = SSL_new(ssl_ctx);
@@ -0,0 +1,458 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/store.c
+ * @brief Shared, reloadable certificate verification stores.
+ *
+ * Every thread has its own SSL_CTX, but loading the CAs and CRLs into
+ * each of them separately is slow when the CRLs are large, and changing
+ * them used to need a restart.
+ *
+ * Instead, one X509_STORE is built per TLS configuration, and shared by
+ * all the SSL_CTXs created from that configuration.  When the store is
+ * reloaded a complete replacement is built and checked, before being
+ * swapped in and its generation number incremented.
+ *
+ * Worker threads compare the generation number before creating a new
+ * SSL session, and if it's changed, they update the verification store
+ * of their SSL_CTX.  OpenSSL reference counts X509_STOREs, so sessions
+ * that are already in progress continue to use the store they started
+ * with, and the old store is freed when the last of them completes.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls"
+
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/rb.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include <pthread.h>
+
+#include "base.h"
+#include "log.h"
+#include "store.h"
+#include "strerror.h"
+
+#include <openssl/x509v3.h>
+
+struct fr_tls_store_s {
+	fr_tls_conf_t const	*conf;			//!< Configuration the store is built from.
+
+	pthread_mutex_t		mutex;			//!< Serialises reloads, and protects the
+							///< store pointer while it's being swapped.
+	X509_STORE		*store;			//!< Current verification store.
+	atomic_uint_fast32_t	generation;		//!< Incremented each time the store is replaced.
+
+	fr_time_t		loaded;			//!< When the current store was built.
+	fr_time_delta_t		load_time;		//!< How long it took to build the current store.
+	size_t			num_certs;		//!< Certificates in the current store.
+	size_t			num_crls;		//!< CRLs in the current store.
+
+	uint64_t		reloads;		//!< Successful reloads.
+	uint64_t		failures;		//!< Failed reloads.
+	char			*last_error;		//!< Why the last reload failed.
+
+	char const		*name;			//!< Name the store's radmin commands are registered under.
+	fr_rb_node_t		name_node;		//!< Entry in tls_store_names.
+};
+
+/** Stores registered with fr_tls_store_register(), by name
+ *
+ * Only modified while the configuration is being parsed.
+ */
+static fr_rb_tree_t *tls_store_names;
+
+static int8_t _tls_store_name_cmp(void const *one, void const *two)
+{
+	fr_tls_store_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->name, b->name);
+	return CMP(ret, 0);
+}
+
+DIAG_OFF(DIAG_UNKNOWN_PRAGMAS)
+DIAG_OFF(used-but-marked-unused)	/* fix spurious warnings for sk macros */
+/** Build a new verification store from the configuration
+ *
+ * This is the slow part, so it's done without holding the mutex.
+ *
+ * @param[out] num_certs	How many certificates were loaded.
+ * @param[out] num_crls		How many CRLs were loaded.
+ * @param[in] conf		to read ca_file, ca_path and the CRL settings from.
+ * @return
+ *	- A new X509_STORE.
+ *	- NULL on error.
+ */
+static X509_STORE *tls_store_build(size_t *num_certs, size_t *num_crls, fr_tls_conf_t const *conf)
+{
+	X509_STORE		*store;
+	STACK_OF(X509_OBJECT)	*objs;
+	int			i;
+
+	*num_certs = 0;
+	*num_crls = 0;
+
+	store = X509_STORE_new();
+	if (!store) {
+		fr_tls_strerror_printf("Failed allocating verification store");
+		return NULL;
+	}
+
+	if (conf->ca_file || conf->ca_path) {
+		/*
+		 *	This adds all the certificates and CRLs in
+		 *	conf->ca_file to the store, and adds a dynamic
+		 *	lookup for conf->ca_path.
+		 */
+		if (!X509_STORE_load_locations(store, conf->ca_file, conf->ca_path)) {
+			fr_tls_strerror_printf("Failed reading Trusted root CA list \"%s\"",
+					       conf->ca_file ? conf->ca_file : conf->ca_path);
+		error:
+			X509_STORE_free(store);
+			return NULL;
+		}
+
+		/*
+		 *	- X509_PURPOSE_SSL_CLIENT ensure the purpose of the
+		 *	  client certificate is for peer authentication as
+		 *	  a client.
+		 */
+		X509_STORE_set_purpose(store, X509_PURPOSE_SSL_CLIENT);
+	} else {
+		X509_STORE_set_default_paths(store);
+	}
+
+#ifdef X509_V_FLAG_CRL_CHECK_ALL
+	if (conf->verify.check_crl) {
+		X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+#ifdef X509_V_FLAG_USE_DELTAS
+		X509_STORE_set_flags(store, X509_V_FLAG_USE_DELTAS);
+#endif
+	}
+#endif
+
+	/*
+	 *	Sanity check what we loaded, so that a truncated
+	 *	file doesn't replace a working store with one that
+	 *	rejects everyone.
+	 */
+	objs = X509_STORE_get0_objects(store);
+	for (i = 0; i < sk_X509_OBJECT_num(objs); i++) {
+		switch (X509_OBJECT_get_type(sk_X509_OBJECT_value(objs, i))) {
+		case X509_LU_X509:
+			(*num_certs)++;
+			break;
+
+		case X509_LU_CRL:
+			(*num_crls)++;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (conf->ca_file && !conf->ca_path && (*num_certs == 0)) {
+		fr_strerror_printf("No certificates found in \"%s\"", conf->ca_file);
+		goto error;
+	}
+
+	if (conf->verify.check_crl && conf->ca_file && !conf->ca_path && (*num_crls == 0)) {
+		fr_strerror_printf("check_crl is enabled, but no CRLs found in \"%s\"", conf->ca_file);
+		goto error;
+	}
+
+	return store;
+}
+DIAG_ON(used-but-marked-unused)
+DIAG_ON(DIAG_UNKNOWN_PRAGMAS)
+
+static int _tls_store_free(fr_tls_store_t *store)
+{
+	if (store->name) {
+		fr_rb_delete(tls_store_names, store);
+		if (fr_rb_num_elements(tls_store_names) == 0) TALLOC_FREE(tls_store_names);
+	}
+
+	if (store->store) X509_STORE_free(store->store);
+	pthread_mutex_destroy(&store->mutex);
+	return 0;
+}
+
+/** Allocate a shared verification store, and perform the initial load
+ *
+ * @param[in] ctx	to allocate the store in.  Usually the #fr_tls_conf_t.
+ * @param[in] conf	to build the store from.
+ * @return
+ *	- A new store.
+ *	- NULL on error.
+ */
+fr_tls_store_t *fr_tls_store_alloc(TALLOC_CTX *ctx, fr_tls_conf_t const *conf)
+{
+	fr_tls_store_t	*store;
+
+	MEM(store = talloc_zero(ctx, fr_tls_store_t));
+	store->conf = conf;
+	pthread_mutex_init(&store->mutex, NULL);
+	talloc_set_destructor(store, _tls_store_free);
+
+	if (fr_tls_store_reload(store) < 0) {
+		talloc_free(store);
+		return NULL;
+	}
+
+	return store;
+}
+
+/** Build a new verification store, and swap it in if it's valid
+ *
+ * May be called from any thread.  Worker threads are not blocked while
+ * the new store is being built, and pick it up the next time they
+ * create a TLS session.
+ *
+ * @param[in] store	to reload.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The previous store remains in use.
+ */
+int fr_tls_store_reload(fr_tls_store_t *store)
+{
+	X509_STORE	*new, *old;
+	size_t		num_certs, num_crls;
+	fr_time_t	start;
+
+	/*
+	 *	The new store is built without holding the mutex
+	 *	so worker threads creating sessions aren't held up.
+	 */
+	start = fr_time();
+	new = tls_store_build(&num_certs, &num_crls, store->conf);
+
+	pthread_mutex_lock(&store->mutex);
+	if (!new) {
+		store->failures++;
+		TALLOC_FREE(store->last_error);
+		store->last_error = talloc_strdup(store, fr_strerror());
+		pthread_mutex_unlock(&store->mutex);
+		return -1;
+	}
+
+	old = store->store;
+	store->store = new;
+	store->loaded = fr_time();
+	store->load_time = fr_time_sub(store->loaded, start);
+	store->num_certs = num_certs;
+	store->num_crls = num_crls;
+	if (old) store->reloads++;
+	TALLOC_FREE(store->last_error);
+	atomic_fetch_add_explicit(&store->generation, 1, memory_order_release);
+	pthread_mutex_unlock(&store->mutex);
+
+	/*
+	 *	SSL_CTXs and sessions hold their own references
+	 *	so this only frees the store when nothing is
+	 *	using it.
+	 */
+	if (old) X509_STORE_free(old);
+
+	DEBUG2("Loaded verification store with %zu certificate(s) and %zu CRL(s) in %"PRIu64" ms",
+	       num_certs, num_crls, fr_time_delta_to_msec(store->load_time));
+
+	return 0;
+}
+
+/** Ensure an SSL_CTX is using the latest verification store
+ *
+ * Must be called by the thread that owns the SSL_CTX, before creating
+ * a new session.  If the store hasn't changed, this is a single atomic
+ * load.
+ *
+ * @param[in] ssl_ctx	to update.
+ * @return
+ *	- 0 on success, or if there's no shared store.
+ *	- -1 on failure.
+ */
+int fr_tls_store_ctx_sync(SSL_CTX *ssl_ctx)
+{
+	fr_tls_conf_t	*conf = fr_tls_ctx_conf(ssl_ctx);
+	fr_tls_store_t	*store = conf->store;
+	X509_STORE	*x509_store;
+	uint32_t	generation, ctx_generation;
+
+	if (!store) return 0;
+
+	ctx_generation = (uint32_t)(uintptr_t)SSL_CTX_get_ex_data(ssl_ctx, FR_TLS_EX_CTX_INDEX_STORE_GENERATION);
+	generation = atomic_load_explicit(&store->generation, memory_order_acquire);
+	if (likely(generation == ctx_generation)) return 0;
+
+	pthread_mutex_lock(&store->mutex);
+	x509_store = store->store;
+	X509_STORE_up_ref(x509_store);
+	generation = atomic_load_explicit(&store->generation, memory_order_relaxed);
+	pthread_mutex_unlock(&store->mutex);
+
+	/* Takes its own reference, and releases the one for the previous store */
+	if (!SSL_CTX_set1_verify_cert_store(ssl_ctx, x509_store)) {
+		X509_STORE_free(x509_store);
+		fr_tls_log(NULL, "Failed updating verification store");
+		return -1;
+	}
+	X509_STORE_free(x509_store);
+
+	SSL_CTX_set_ex_data(ssl_ctx, FR_TLS_EX_CTX_INDEX_VERIFY_STORE, x509_store);
+	SSL_CTX_set_ex_data(ssl_ctx, FR_TLS_EX_CTX_INDEX_STORE_GENERATION, (void *)(uintptr_t)generation);
+
+	return 0;
+}
+
+/** Copy the current statistics for a verification store
+ *
+ * @param[in] ctx	to allocate stats->last_error in.
+ * @param[out] stats	Where to write the statistics.
+ * @param[in] store	to get statistics for.
+ */
+void fr_tls_store_stats(TALLOC_CTX *ctx, fr_tls_store_stats_t *stats, fr_tls_store_t *store)
+{
+	pthread_mutex_lock(&store->mutex);
+	*stats = (fr_tls_store_stats_t) {
+		.generation = atomic_load_explicit(&store->generation, memory_order_relaxed),
+		.loaded = store->loaded,
+		.load_time = store->load_time,
+		.num_certs = store->num_certs,
+		.num_crls = store->num_crls,
+		.reloads = store->reloads,
+		.failures = store->failures,
+		.last_error = store->last_error ? talloc_strdup(ctx, store->last_error) : NULL
+	};
+	pthread_mutex_unlock(&store->mutex);
+}
+
+static int cmd_show_tls_store(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_tls_store_t		*store = talloc_get_type_abort(ctx, fr_tls_store_t);
+	fr_tls_store_stats_t	stats;
+
+	/*
+	 *	Writing to the radmin socket can block, so
+	 *	don't hold the mutex while doing it.
+	 */
+	fr_tls_store_stats(NULL, &stats, store);
+
+	fprintf(fp, "generation\t%u\n", (unsigned int)stats.generation);
+	fprintf(fp, "age\t%"PRIu64"\n", fr_time_delta_to_sec(fr_time_sub(fr_time(), stats.loaded)));
+	fprintf(fp, "load_time\t%"PRIu64" ms\n", fr_time_delta_to_msec(stats.load_time));
+	fprintf(fp, "certificates\t%zu\n", stats.num_certs);
+	fprintf(fp, "crls\t%zu\n", stats.num_crls);
+	fprintf(fp, "reloads\t%"PRIu64"\n", stats.reloads);
+	fprintf(fp, "failures\t%"PRIu64"\n", stats.failures);
+	if (stats.last_error) fprintf(fp, "last_error\t%s\n", stats.last_error);
+
+	talloc_free(stats.last_error);
+
+	return 0;
+}
+
+static int cmd_set_tls_reload(FILE *fp, FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_tls_store_t *store = talloc_get_type_abort(ctx, fr_tls_store_t);
+
+	if (fr_tls_store_reload(store) < 0) {
+		fprintf(fp_err, "Failed reloading verification store: %s\n", fr_strerror());
+		return -1;
+	}
+
+	fprintf(fp, "ok\n");
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_tls_store_table[] = {
+	{
+		.parent = "show tls",
+		.add_name = true,
+		.name = "store",
+		.func = cmd_show_tls_store,
+		.help = "Show the status of the CA and CRL verification store.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "set tls",
+		.add_name = true,
+		.name = "reload",
+		.func = cmd_set_tls_reload,
+		.help = "Reload the CA and CRL verification store.",
+		.read_only = false,
+	},
+
+	CMD_TABLE_END
+};
+
+/** Register radmin commands for a verification store
+ *
+ * Names must be unique, as they're used in the command path.
+ *
+ * @param[in] store	to register commands for.
+ * @param[in] name	of the TLS configuration, used in the command path.
+ * @return
+ *	- 0 on success.
+ *	- -1 if another store is already registered with the same name.
+ */
+int fr_tls_store_register(fr_tls_store_t *store, char const *name)
+{
+	fr_tls_store_t *found;
+
+	if (!tls_store_names) {
+		MEM(tls_store_names = fr_rb_inline_alloc(NULL, fr_tls_store_t, name_node,
+							 _tls_store_name_cmp, NULL));
+	}
+
+	found = fr_rb_find(tls_store_names, &(fr_tls_store_t){ .name = name });
+	if (found) {
+		if (found == store) return 0;
+
+		fr_strerror_printf("Another TLS configuration is already called \"%s\"", name);
+		return -1;
+	}
+
+	fr_assert(!store->name);
+	store->name = talloc_strdup(store, name);
+	fr_rb_insert(tls_store_names, store);
+
+	if (fr_command_register_hook(NULL, name, store, cmd_tls_store_table) < 0) {
+		PWARN("Failed registering radmin commands for TLS configuration \"%s\"", name);
+	}
+
+	return 0;
+}
+#endif /* WITH_TLS */
@@ -0,0 +1,79 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifdef WITH_TLS
+/**
+ * $Id$
+ *
+ * @file lib/tls/store.h
+ * @brief Shared, reloadable certificate verification stores.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(store_h, "$Id$")
+
+#include "openssl_user_macros.h"
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <freeradius-devel/util/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_tls_store_s fr_tls_store_t;
+
+/** Statistics for a verification store, copied by fr_tls_store_stats()
+ *
+ */
+typedef struct {
+	uint32_t		generation;		//!< Incremented each time the store is replaced.
+	fr_time_t		loaded;			//!< When the current store was built.
+	fr_time_delta_t		load_time;		//!< How long it took to build the current store.
+	size_t			num_certs;		//!< Certificates in the current store.
+	size_t			num_crls;		//!< CRLs in the current store.
+	uint64_t		reloads;		//!< Successful reloads.
+	uint64_t		failures;		//!< Failed reloads.
+	char			*last_error;		//!< Why the last reload failed.  Must be freed
+							///< by the caller.
+} fr_tls_store_stats_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "conf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+fr_tls_store_t	*fr_tls_store_alloc(TALLOC_CTX *ctx, fr_tls_conf_t const *conf);
+
+int		fr_tls_store_reload(fr_tls_store_t *store);
+
+int		fr_tls_store_ctx_sync(SSL_CTX *ssl_ctx);
+
+void		fr_tls_store_stats(TALLOC_CTX *ctx, fr_tls_store_stats_t *stats, fr_tls_store_t *store);
+
+int		fr_tls_store_register(fr_tls_store_t *store, char const *name);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* WITH_TLS */
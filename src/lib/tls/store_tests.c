@@ -0,0 +1,227 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for reloading shared verification stores, and registering them by name
+ *
+ * @file src/lib/tls/store_tests.c
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+/*
+ *	The CAs are only generated once, rather than
+ *	before every test with TEST_INIT.
+ */
+static void test_init(void) __attribute__((constructor));
+static void test_free(void) __attribute__((destructor));
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+
+#include "base.h"
+#include "store.h"
+
+typedef struct {
+	EVP_PKEY	*key;
+	X509		*cert;
+} test_cert_t;
+
+static test_cert_t	ca, other_ca;
+
+static void test_cert_alloc(test_cert_t *out, char const *cn)
+{
+	X509_NAME	*name;
+
+	out->key = EVP_EC_gen("P-256");
+	out->cert = X509_new();
+
+	X509_set_version(out->cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(out->cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(out->cert), -3600);
+	X509_gmtime_adj(X509_getm_notAfter(out->cert), 86400);
+	X509_set_pubkey(out->cert, out->key);
+
+	name = X509_get_subject_name(out->cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char const *)cn, -1, -1, 0);
+	X509_set_issuer_name(out->cert, name);
+
+	X509_sign(out->cert, out->key, EVP_sha256());
+}
+
+static void test_init(void)
+{
+	test_cert_alloc(&ca, "Test CA");
+	test_cert_alloc(&other_ca, "Other CA");
+}
+
+static void test_free(void)
+{
+	test_cert_t *certs[] = { &ca, &other_ca };
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(certs); i++) {
+		X509_free(certs[i]->cert);
+		EVP_PKEY_free(certs[i]->key);
+	}
+}
+
+/** Replace the contents of the CA file
+ *
+ * @param[in] path	of the CA file.
+ * @param[in] certs	to write, NULL terminated.  If the first entry is NULL
+ *			the file is truncated.
+ */
+static void test_ca_file_write(char const *path, X509 **certs)
+{
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	TEST_ASSERT(fp != NULL);
+
+	while (*certs) PEM_write_X509(fp, *certs++);
+	fclose(fp);
+}
+
+/** Allocate a TLS configuration with a CA file containing ca
+ *
+ */
+static fr_tls_conf_t *test_conf_alloc(TALLOC_CTX *ctx)
+{
+	fr_tls_conf_t	*conf;
+	char		path[] = "/tmp/store_tests_XXXXXX";
+	int		fd;
+
+	fd = mkstemp(path);
+	TEST_ASSERT(fd >= 0);
+	close(fd);
+
+	test_ca_file_write(path, (X509 *[]){ ca.cert, NULL });
+
+	conf = talloc_zero(ctx, fr_tls_conf_t);
+	conf->ca_file = talloc_strdup(conf, path);
+
+	return conf;
+}
+
+static void test_conf_free(fr_tls_conf_t *conf)
+{
+	unlink(conf->ca_file);
+	talloc_free(conf);
+}
+
+static void test_store_stats(void)
+{
+	fr_tls_conf_t		*conf = test_conf_alloc(NULL);
+	fr_tls_store_t		*store;
+	fr_tls_store_stats_t	stats;
+
+	store = fr_tls_store_alloc(conf, conf);
+	TEST_ASSERT(store != NULL);
+
+	fr_tls_store_stats(NULL, &stats, store);
+	TEST_CHECK(stats.generation == 1);
+	TEST_MSG("Expected generation 1, got %u", (unsigned int)stats.generation);
+	TEST_CHECK(stats.num_certs == 1);
+	TEST_MSG("Expected 1 certificate, got %zu", stats.num_certs);
+	TEST_CHECK(stats.num_crls == 0);
+	TEST_CHECK(stats.reloads == 0);
+	TEST_CHECK(stats.failures == 0);
+	TEST_CHECK(stats.last_error == NULL);
+
+	test_conf_free(conf);
+}
+
+static void test_store_reload(void)
+{
+	fr_tls_conf_t		*conf = test_conf_alloc(NULL);
+	fr_tls_store_t		*store;
+	fr_tls_store_stats_t	stats;
+
+	store = fr_tls_store_alloc(conf, conf);
+	TEST_ASSERT(store != NULL);
+
+	/*
+	 *	A truncated file must not replace the
+	 *	store that's in use.
+	 */
+	test_ca_file_write(conf->ca_file, (X509 *[]){ NULL });
+	TEST_CHECK(fr_tls_store_reload(store) < 0);
+
+	fr_tls_store_stats(NULL, &stats, store);
+	TEST_CHECK(stats.generation == 1);
+	TEST_MSG("Expected generation 1, got %u", (unsigned int)stats.generation);
+	TEST_CHECK(stats.num_certs == 1);
+	TEST_CHECK(stats.reloads == 0);
+	TEST_CHECK(stats.failures == 1);
+	TEST_CHECK(stats.last_error != NULL);
+	TEST_MSG("Expected last_error to be set");
+	talloc_free(stats.last_error);
+
+	/*
+	 *	A good file replaces it, and clears the error.
+	 */
+	test_ca_file_write(conf->ca_file, (X509 *[]){ ca.cert, other_ca.cert, NULL });
+	TEST_CHECK(fr_tls_store_reload(store) == 0);
+
+	fr_tls_store_stats(NULL, &stats, store);
+	TEST_CHECK(stats.generation == 2);
+	TEST_MSG("Expected generation 2, got %u", (unsigned int)stats.generation);
+	TEST_CHECK(stats.num_certs == 2);
+	TEST_MSG("Expected 2 certificates, got %zu", stats.num_certs);
+	TEST_CHECK(stats.reloads == 1);
+	TEST_CHECK(stats.failures == 1);
+	TEST_CHECK(stats.last_error == NULL);
+
+	test_conf_free(conf);
+}
+
+static void test_store_register(void)
+{
+	fr_tls_conf_t		*conf = test_conf_alloc(NULL);
+	fr_tls_store_t		*a, *b, *c;
+
+	a = fr_tls_store_alloc(conf, conf);
+	b = fr_tls_store_alloc(conf, conf);
+	c = fr_tls_store_alloc(conf, conf);
+	TEST_ASSERT(a && b && c);
+
+	TEST_CHECK(fr_tls_store_register(a, "tls-common") == 0);
+	TEST_CHECK(fr_tls_store_register(a, "tls-common") == 0);
+	TEST_MSG("Registering the same store twice should succeed");
+
+	TEST_CHECK(fr_tls_store_register(b, "tls-common") < 0);
+	TEST_MSG("Expected a name collision");
+	TEST_CHECK(fr_tls_store_register(b, "tls-other") == 0);
+
+	/*
+	 *	Names are released when the store is freed.
+	 */
+	talloc_free(a);
+	TEST_CHECK(fr_tls_store_register(c, "tls-common") == 0);
+	TEST_MSG("Expected the name to be released by the freed store");
+
+	test_conf_free(conf);
+}
+
+TEST_LIST = {
+	{ "stats",		test_store_stats },
+	{ "reload",		test_store_reload },
+	{ "register",		test_store_register },
+
+	{ NULL }
+};
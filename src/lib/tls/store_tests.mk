@@ -0,0 +1,13 @@
+ifneq ($(OPENSSL_LIBS),)
+TARGET		:= store_tests$(E)
+else
+TARGET		:=
+endif
+
+SOURCES		:= store_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(OPENSSL_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(OPENSSL_FLAGS)
+TGT_PREREQS	:= libfreeradius-util$(L) libfreeradius-server$(L) libfreeradius-tls$(L)
+
+TGT_INSTALLDIR	:=
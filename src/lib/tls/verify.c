@@ -38,8 +38,11 @@
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/syserror.h>
 
+#include <openssl/ocsp.h>
+
 #include "attrs.h"
 #include "base.h"
+#include "ocsp.h"
 
 /** Check to see if a verification operation should apply to a certificate
  *
@@ -408,6 +411,144 @@ int fr_tls_verify_cert_chain(request_t *request, SSL *ssl)
 	return ret;
 }
 
+/** Get the client certificate and its issuer from the verified chain
+ *
+ * @return
+ *	- true if the chain contains both certificates.
+ *	- false if the chain wasn't verified during this handshake (i.e. the
+ *	  session was resumed), or the client certificate is self-signed.
+ */
+static bool tls_verify_ocsp_certs(X509 **cert, X509 **issuer, SSL *ssl)
+{
+	STACK_OF(X509) *chain;
+
+	chain = SSL_get0_verified_chain(ssl);			/* Does not increase ref count */
+	if (!chain || (sk_X509_num(chain) < 2)) return false;
+
+	*cert = sk_X509_value(chain, 0);
+	*issuer = sk_X509_value(chain, 1);
+
+	return true;
+}
+
+/** Add the status of the client certificate from an OCSP response
+ *
+ */
+static void tls_verify_ocsp_status_add(request_t *request, int status, time_t next_update, time_t now)
+{
+	fr_pair_t *vp;
+
+	MEM(pair_update_request(&vp, attr_tls_ocsp_cert_valid) >= 0);
+	switch (status) {
+	case V_OCSP_CERTSTATUS_GOOD:
+		vp->vp_uint32 = 1;	/* yes */
+		break;
+
+	case V_OCSP_CERTSTATUS_REVOKED:
+		vp->vp_uint32 = 0;	/* no */
+		break;
+
+	default:
+		vp->vp_uint32 = 3;	/* unknown */
+		break;
+	}
+	RDEBUG2("&%pP", vp);
+
+	if (next_update > now) {
+		MEM(pair_update_request(&vp, attr_tls_ocsp_next_update) >= 0);
+		vp->vp_uint32 = next_update - now;
+		RDEBUG2("&%pP", vp);
+	}
+}
+
+/** Add the cached OCSP status of the client certificate, or an OCSP request for it
+ *
+ * Either &request.TLS-OCSP-Cert-Valid is added from a cached response, or
+ * &request.TLS-OCSP-Request and &request.TLS-OCSP-Responder-URI are added
+ * for a module in `verify certificate { ... }` to send.  The module must write
+ * the responder's answer to &reply.TLS-OCSP-Response, which is checked by
+ * tls_verify_ocsp_response_check().
+ */
+static void tls_verify_ocsp_pairs_add(request_t *request, fr_tls_conf_t *conf, fr_tls_session_t *tls_session)
+{
+	X509		*cert, *issuer;
+	fr_pair_t	*vp;
+	uint8_t		*req;
+	size_t		req_len;
+	char		*uri;
+	int		status;
+	time_t		expires, now = time(NULL);
+
+	if (!tls_verify_ocsp_certs(&cert, &issuer, tls_session->ssl)) {
+		RDEBUG2("No verified issuer for client certificate, skipping OCSP");
+		return;
+	}
+
+	switch (fr_tls_ocsp_cache_lookup(&status, &expires, conf->ocsp_cache, cert, issuer, now)) {
+	case 1:
+		RDEBUG2("Using cached OCSP response for client certificate");
+		tls_verify_ocsp_status_add(request, status, expires, now);
+		return;
+
+	case 0:
+		break;
+
+	default:
+		RPWDEBUG("Failed searching OCSP response cache");
+		break;
+	}
+
+	if (fr_tls_ocsp_request_alloc(request, &req, &req_len, &uri, cert, issuer) < 0) {
+		RPWDEBUG("Failed building OCSP request");
+		return;
+	}
+
+	MEM(pair_append_request(&vp, attr_tls_ocsp_request) >= 0);
+	fr_pair_value_memdup_buffer_shallow(vp, req, false);
+
+	if (uri) {
+		MEM(pair_append_request(&vp, attr_tls_ocsp_responder_uri) >= 0);
+		fr_pair_value_bstrdup_buffer_shallow(vp, uri, false);
+	}
+}
+
+/** Check the OCSP response `verify certificate { ... }` received, and cache it
+ *
+ * @return
+ *	- 0 if there was no response, or the response was valid and
+ *	  the client certificate hasn't been revoked.
+ *	- -1 if the response was invalid, or the client certificate has
+ *	  been revoked.
+ */
+static int tls_verify_ocsp_response_check(request_t *request, fr_tls_conf_t *conf, fr_tls_session_t *tls_session)
+{
+	X509		*cert, *issuer;
+	X509_STORE	*store;
+	fr_pair_t	*vp;
+	int		status;
+	time_t		next_update, now = time(NULL);
+
+	vp = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_tls_ocsp_response);
+	if (!vp || !tls_verify_ocsp_certs(&cert, &issuer, tls_session->ssl)) return 0;
+
+	store = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(tls_session->ssl), FR_TLS_EX_CTX_INDEX_VERIFY_STORE);
+
+	if (fr_tls_ocsp_response_verify(&status, &next_update, conf->ocsp_cache,
+					store, SSL_get_peer_cert_chain(tls_session->ssl), cert, issuer,
+					vp->vp_octets, vp->vp_length, now) < 0) {
+		RPEDEBUG("Invalid OCSP response");
+		return -1;
+	}
+
+	tls_verify_ocsp_status_add(request, status, next_update, now);
+	if (status == V_OCSP_CERTSTATUS_REVOKED) {
+		REDEBUG("OCSP responder says client certificate has been revoked");
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Process the result of `verify certificate { ... }`
  *
  */
@@ -415,6 +556,7 @@ static unlang_action_t tls_verify_client_cert_result(UNUSED rlm_rcode_t *p_resul
 						     request_t *request, void *uctx)
 {
 	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
+	fr_tls_conf_t		*conf = fr_tls_session_conf(tls_session->ssl);
 	fr_pair_t		*vp;
 
 	fr_assert(tls_session->validate.state == FR_TLS_VALIDATION_REQUESTED);
@@ -426,6 +568,11 @@ static unlang_action_t tls_verify_client_cert_result(UNUSED rlm_rcode_t *p_resul
 		return UNLANG_ACTION_CALCULATE_RESULT;
 	}
 
+	if (conf->verify.check_ocsp && (tls_verify_ocsp_response_check(request, conf, tls_session) < 0)) {
+		tls_session->validate.state = FR_TLS_VALIDATION_FAILED;
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
 	tls_session->validate.state = FR_TLS_VALIDATION_SUCCESS;
 
 	RDEBUG2("Certificates (re-)validated");
@@ -467,6 +614,8 @@ static unlang_action_t tls_verify_client_cert_push(request_t *request, fr_tls_se
 	MEM(pair_append_request(&vp, attr_tls_session_resumed) >= 0);
 	vp->vp_bool = tls_session->validate.resumed;
 
+	if (conf->verify.check_ocsp) tls_verify_ocsp_pairs_add(child, conf, tls_session);
+
 	/*
 	 *	Allocate a child, and set it up to call
 	 *      the TLS virtual server.
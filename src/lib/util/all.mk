@@ -8,12 +8,14 @@ SUBMAKEFILES := \
 	heap_tests.mk \
 	hmac_tests.mk \
 	libfreeradius-util.mk \
+	line_index_tests.mk \
 	lst_tests.mk \
 	minmax_heap_tests.mk \
 	pair_legacy_tests.mk \
 	pair_list_perf_test.mk \
 	pair_nested_tests.mk \
 	pair_tests.mk \
+	pcap_tests.mk \
 	rb_tests.mk \
 	sbuff_tests.mk \
 	size_tests.mk \
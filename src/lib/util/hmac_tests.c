@@ -25,6 +25,7 @@
 #include <freeradius-devel/util/acutest_helpers.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/sha1.h>
+#include <freeradius-devel/util/time.h>
 
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
@@ -205,12 +206,196 @@ static void test_hmac_sha1(void)
 			      sizeof(digest)), 0);
 }
 
+/*
+ *	Check the multi-buffer MD5 against the serial one, over
+ *	batches of messages of different lengths.  The lengths
+ *	straddle the block and padding boundaries.
+ */
+static void test_md5_multi(void)
+{
+	uint8_t		data[300];
+	uint8_t		digest[20][MD5_DIGEST_LENGTH];
+	uint8_t		expected[MD5_DIGEST_LENGTH];
+	fr_md5_multi_t	jobs[20];
+	size_t		i, num;
+
+	for (i = 0; i < sizeof(data); i++) data[i] = (uint8_t)(i * 7);
+
+	for (num = 1; num <= NUM_ELEMENTS(jobs); num++) {
+		for (i = 0; i < num; i++) {
+			size_t len = (i * 29 + num * 13) % 200;
+
+			jobs[i] = (fr_md5_multi_t){
+				.in = { data, data + 200 },
+				.inlen = { len, i % 3 ? (i * 11) % 100 : 0 },
+				.out = digest[i]
+			};
+		}
+
+		fr_md5_calc_multi(jobs, num);
+
+		for (i = 0; i < num; i++) {
+			fr_md5_ctx_t *ctx;
+
+			ctx = fr_md5_ctx_alloc_from_list();
+			fr_md5_update(ctx, jobs[i].in[0], jobs[i].inlen[0]);
+			fr_md5_update(ctx, jobs[i].in[1], jobs[i].inlen[1]);
+			fr_md5_final(expected, ctx);
+			fr_md5_ctx_free_from_list(&ctx);
+
+			TEST_CASE("multi-buffer digest matches");
+			TEST_CHECK(memcmp(digest[i], expected, sizeof(expected)) == 0);
+			TEST_MSG("batch %zu, message %zu, length %zu + %zu", num, i, jobs[i].inlen[0], jobs[i].inlen[1]);
+		}
+	}
+}
+
+static void test_hmac_md5_multi(void)
+{
+	uint8_t			key[100];
+	uint8_t			data[300];
+	uint8_t			digest[20][MD5_DIGEST_LENGTH];
+	uint8_t			expected[MD5_DIGEST_LENGTH];
+	fr_hmac_md5_multi_t	jobs[20];
+	size_t			i;
+
+	for (i = 0; i < sizeof(key); i++) key[i] = (uint8_t)(i + 1);
+	for (i = 0; i < sizeof(data); i++) data[i] = (uint8_t)(i * 3);
+
+	/*
+	 *	RFC 2104 vector, which must come out the same
+	 *	from any lane.
+	 */
+	for (i = 0; i < NUM_ELEMENTS(jobs); i++) {
+		jobs[i] = (fr_hmac_md5_multi_t){
+			.in = (uint8_t const *)"what do ya want for nothing?",
+			.inlen = 28,
+			.key = (uint8_t const *)"Jefe",
+			.key_len = 4,
+			.digest = digest[i]
+		};
+	}
+	fr_hmac_md5_multi(jobs, NUM_ELEMENTS(jobs));
+
+	for (i = 0; i < NUM_ELEMENTS(jobs); i++) {
+		TEST_CHECK_RET(memcmp(digest[i],
+				      (uint8_t[]){
+						0x75, 0x0c, 0x78, 0x3e, 0x6a, 0xb0, 0xb5, 0x03,
+						0xea, 0xa8, 0x6e, 0x31, 0x0a, 0x5d, 0xb7, 0x38
+				      },
+				      MD5_DIGEST_LENGTH), 0);
+	}
+
+	/*
+	 *	Mixed key and message lengths, including keys
+	 *	longer than a block.
+	 */
+	for (i = 0; i < NUM_ELEMENTS(jobs); i++) {
+		jobs[i] = (fr_hmac_md5_multi_t){
+			.in = data,
+			.inlen = (i * 37) % sizeof(data),
+			.key = key,
+			.key_len = ((i * 17) % (sizeof(key) - 1)) + 1,	/* OpenSSL won't do empty keys */
+			.digest = digest[i]
+		};
+	}
+	fr_hmac_md5_multi(jobs, NUM_ELEMENTS(jobs));
+
+	for (i = 0; i < NUM_ELEMENTS(jobs); i++) {
+		TEST_CASE("multi-buffer HMAC matches");
+		TEST_CHECK(fr_hmac_md5(expected, jobs[i].in, jobs[i].inlen, jobs[i].key, jobs[i].key_len) == 0);
+		TEST_CHECK(memcmp(digest[i], expected, sizeof(expected)) == 0);
+		TEST_MSG("message %zu, key length %zu, data length %zu", i, jobs[i].key_len, jobs[i].inlen);
+	}
+}
+
+#define SIGN_ROUNDS	(100000)
+#define SIGN_BATCH	(16)
+
+/*
+ *	Approximate the work needed to sign an Access-Accept.  That's
+ *	an HMAC-MD5 for the Message-Authenticator, followed by an MD5
+ *	over the packet and the shared secret for the Response
+ *	Authenticator.
+ *
+ *	Each round feeds the digests back into the packets, so both
+ *	sides must produce the same packets after the same number of
+ *	rounds.
+ */
+static void test_sign_benchmark(void)
+{
+	uint8_t			packet[SIGN_BATCH][120];
+	uint8_t			serial[SIGN_BATCH][120];
+	uint8_t const		*secret = (uint8_t const *)"testing123";
+	fr_hmac_md5_multi_t	hmac[SIGN_BATCH];
+	fr_md5_multi_t		md5[SIGN_BATCH];
+	fr_time_t		start, stop;
+	uint64_t		serial_rate, multi_rate;
+	size_t			i, j;
+
+	for (j = 0; j < SIGN_BATCH; j++) memset(packet[j], (int)j, sizeof(packet[j]));
+	memcpy(serial, packet, sizeof(serial));
+
+	start = fr_time();
+	for (i = 0; i < (SIGN_ROUNDS / SIGN_BATCH); i++) {
+		for (j = 0; j < SIGN_BATCH; j++) {
+			fr_md5_ctx_t *ctx;
+
+			fr_hmac_md5(serial[j] + 100, serial[j], sizeof(serial[j]), secret, 10);
+
+			ctx = fr_md5_ctx_alloc_from_list();
+			fr_md5_update(ctx, serial[j], sizeof(serial[j]));
+			fr_md5_update(ctx, secret, 10);
+			fr_md5_final(serial[j] + 4, ctx);
+			fr_md5_ctx_free_from_list(&ctx);
+		}
+	}
+	stop = fr_time();
+
+	serial_rate = (uint64_t)((float)NSEC / ((float)fr_time_delta_unwrap(fr_time_sub(stop, start)) / SIGN_ROUNDS));
+	printf("serial signing rate %" PRIu64 " packets/s\n", serial_rate);
+
+	for (j = 0; j < SIGN_BATCH; j++) {
+		hmac[j] = (fr_hmac_md5_multi_t){
+			.in = packet[j],
+			.inlen = sizeof(packet[j]),
+			.key = secret,
+			.key_len = 10,
+			.digest = packet[j] + 100
+		};
+		md5[j] = (fr_md5_multi_t){
+			.in = { packet[j], secret },
+			.inlen = { sizeof(packet[j]), 10 },
+			.out = packet[j] + 4
+		};
+	}
+
+	start = fr_time();
+	for (i = 0; i < (SIGN_ROUNDS / SIGN_BATCH); i++) {
+		fr_hmac_md5_multi(hmac, SIGN_BATCH);
+		fr_md5_calc_multi(md5, SIGN_BATCH);
+	}
+	stop = fr_time();
+
+	multi_rate = (uint64_t)((float)NSEC / ((float)fr_time_delta_unwrap(fr_time_sub(stop, start)) / SIGN_ROUNDS));
+	printf("multi-buffer signing rate %" PRIu64 " packets/s\n", multi_rate);
+
+	for (j = 0; j < SIGN_BATCH; j++) {
+		TEST_CASE("multi-buffer signing matches serial signing");
+		TEST_CHECK(memcmp(packet[j], serial[j], sizeof(packet[j])) == 0);
+		TEST_MSG("packet %zu", j);
+	}
+}
+
 TEST_LIST = {
 	/*
 	 *	Allocation and management
 	 */
 	{ "hmac-md5",			test_hmac_md5	},
 	{ "hmac-sha1",			test_hmac_sha1	},
+	{ "md5-multi",			test_md5_multi	},
+	{ "hmac-md5-multi",		test_hmac_md5_multi	},
+	{ "sign-benchmark",		test_sign_benchmark	},
 
 	{ NULL }
 };
@@ -49,6 +49,7 @@ SOURCES		:= \
 		   inet.c \
 		   iovec.c \
 		   isaac.c \
+		   line_index.c \
 		   log.c \
 		   lst.c \
 		   machine.c \
@@ -0,0 +1,665 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Precompiled, memory mapped indexes of delimited text files
+ *
+ * Loading a large CSV or passwd style file means parsing every line,
+ * and allocating memory for every field, before the first lookup can be
+ * done.  Instead, the file can be compiled into an index once, with
+ * radindex, and the index mapped read-only by the modules.  Lookups
+ * are done in place, so startup doesn't depend on the size of the file,
+ * and the pages are shared by every process mapping the same index.
+ *
+ * The index file contains:
+ *
+ * - A header, with the options the index was built with.
+ * - Each indexed line, '\0' terminated.
+ * - A table of 12 byte entries, one per key, sorted by the hash of the
+ *   key, then by position in the source file.  An entry holds only the
+ *   hash, and the position and length of the line.
+ *
+ * The keys aren't stored separately.  Lookups are a binary search of
+ * the table, and the key is found again in each line with the same
+ * hash, and compared.  Lines with the same key are returned in the
+ * order they appear in the source file.  The index is therefore the
+ * size of the source file, plus 12 bytes per key.
+ *
+ * Integers are stored in host byte order, so an index must be built on
+ * a machine with the same byte order as the one using it.
+ *
+ * @file src/lib/util/line_index.c
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/line_index.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LINE_INDEX_MAGIC	"FRLINDEX"
+#define LINE_INDEX_VERSION	2
+
+#define LINE_INDEX_FLAG_HEADER		0x01
+#define LINE_INDEX_FLAG_QUOTED		0x02
+#define LINE_INDEX_FLAG_KEY_LIST	0x04
+#define LINE_INDEX_FLAG_IGNORE_NISLIKE	0x08
+
+#define LINE_INDEX_MAX_LINE	8192
+
+typedef struct {
+	char		magic[8];
+	uint32_t	version;
+	uint8_t		delimiter;
+	uint8_t		flags;
+	uint16_t	key_field;
+	uint64_t	num_entries;
+	uint64_t	num_duplicates;		//!< Entries with the same key as an earlier entry.
+	uint64_t	entries_offset;		//!< From the start of the file.
+	uint64_t	file_len;
+} line_index_header_t;
+
+/** An entry in the index
+ *
+ * The line offset is 48 bits, split so the entry needs only 4 byte
+ * alignment.
+ */
+typedef struct {
+	uint32_t	hash;			//!< Of the key.
+	uint32_t	line_offset_lo;		//!< From the start of the file.
+	uint16_t	line_offset_hi;
+	uint16_t	line_len;
+} line_index_entry_t;
+
+static_assert(sizeof(line_index_entry_t) == 12, "line_index_entry_t must be packed");
+static_assert(LINE_INDEX_MAX_LINE <= UINT16_MAX, "Lines must fit in line_index_entry_t");
+
+#define LINE_INDEX_MAX_OFFSET	(((uint64_t)1 << 48) - 1)
+
+/** An entry while the index is being built
+ *
+ * The keys are kept in memory so duplicates can be counted.
+ */
+typedef struct {
+	uint32_t	hash;
+	uint32_t	key_len;
+	uint64_t	key_offset;		//!< In the buffer of keys.
+	uint64_t	line_offset;		//!< From the start of the index file.
+	uint32_t	line_len;
+} line_index_build_entry_t;
+
+struct fr_line_index_s {
+	uint8_t const			*map;		//!< The whole index file.
+	size_t				map_len;
+
+	fr_line_index_conf_t		conf;		//!< To find the keys in the lines.
+
+	line_index_entry_t const	*entries;
+	uint64_t			num_entries;
+	uint64_t			num_duplicates;
+};
+
+static uint8_t line_index_flags(fr_line_index_conf_t const *conf)
+{
+	return (conf->header ? LINE_INDEX_FLAG_HEADER : 0) |
+	       (conf->quoted ? LINE_INDEX_FLAG_QUOTED : 0) |
+	       (conf->key_list ? LINE_INDEX_FLAG_KEY_LIST : 0) |
+	       (conf->ignore_nislike ? LINE_INDEX_FLAG_IGNORE_NISLIKE : 0);
+}
+
+/** Find the key field in a line, and copy it out, unquoting it if necessary
+ *
+ * @return
+ *	- 1 if the key was found.
+ *	- 0 if the line has no key field.
+ *	- -1 if the key is too long.
+ */
+static int line_index_key(char *out, size_t outlen, size_t *out_len,
+			  char const *line, size_t len, fr_line_index_conf_t const *conf)
+{
+	char const	*p = line, *end = line + len;
+	char		*q = out, *q_end = out + outlen;
+	unsigned int	field;
+
+	for (field = 0; field < conf->key_field; field++) {
+		/*
+		 *	Delimiters inside quotes don't end the field.
+		 */
+		if (conf->quoted && (p < end) && (*p == '"')) {
+			for (p++; p < end; p++) {
+				if (*p != '"') continue;
+				if (((p + 1) < end) && (p[1] == '"')) {
+					p++;
+					continue;
+				}
+				p++;
+				break;
+			}
+		}
+
+		p = memchr(p, conf->delimiter, end - p);
+		if (!p) return 0;
+		p++;
+	}
+
+	if (conf->quoted && (p < end) && (*p == '"')) {
+		for (p++; p < end; p++) {
+			if (*p == '"') {
+				if (((p + 1) >= end) || (p[1] != '"')) break;
+				p++;
+			}
+			if (q == q_end) return -1;
+			*q++ = *p;
+		}
+	} else {
+		while ((p < end) && (*p != conf->delimiter)) {
+			if (q == q_end) return -1;
+			*q++ = *p++;
+		}
+	}
+
+	*out_len = q - out;
+
+	return 1;
+}
+
+static int line_index_entry_cmp(void const *one, void const *two)
+{
+	line_index_build_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->hash, b->hash);
+	if (ret != 0) return ret;
+
+	return CMP(a->key_offset, b->key_offset);
+}
+
+/** Compile a delimited text file into an index
+ *
+ * The index is written to a temporary file, which is renamed to out
+ * once it's complete, so a module reopening the index never sees a
+ * partial file.
+ *
+ * Lines with no key field, or an empty key, aren't indexed.
+ *
+ * All the keys are held in memory while the index is built, so that
+ * keys which appear more than once can be counted.
+ *
+ * @param[in] out	Where to write the index.
+ * @param[in] in	File to index.
+ * @param[in] conf	How to find the key in each line.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with the error in fr_strerror().
+ */
+int fr_line_index_build(char const *out, char const *in, fr_line_index_conf_t const *conf)
+{
+	FILE			*fp_in, *fp_out = NULL;
+	char			*tmp = NULL;
+	line_index_build_entry_t *entries = NULL;
+	line_index_entry_t	out_entry;
+	char			*keys = NULL;
+	uint64_t		num_entries = 0, num_duplicates = 0, keys_len = 0, offset, i, j;
+	line_index_header_t	header;
+	char			buffer[LINE_INDEX_MAX_LINE + 2];
+	char			key[LINE_INDEX_MAX_LINE];
+	int			lineno = 0;
+	int			ret = -1;
+
+	fp_in = fopen(in, "r");
+	if (!fp_in) {
+		fr_strerror_printf("Failed opening %s: %s", in, fr_syserror(errno));
+		return -1;
+	}
+
+	MEM(tmp = talloc_asprintf(NULL, "%s.tmp", out));
+	fp_out = fopen(tmp, "w");
+	if (!fp_out) {
+		fr_strerror_printf("Failed opening %s: %s", tmp, fr_syserror(errno));
+		goto finish;
+	}
+
+	/*
+	 *	Written for real once we know where everything is.
+	 */
+	memset(&header, 0, sizeof(header));
+	if (fwrite(&header, sizeof(header), 1, fp_out) != 1) goto write_error;
+	offset = sizeof(header);
+
+	while (fgets(buffer, sizeof(buffer), fp_in)) {
+		size_t	len = strlen(buffer);
+		size_t	key_len;
+		uint64_t line_offset;
+		char	*p, *next;
+
+		lineno++;
+
+		if (len && (buffer[len - 1] == '\n')) {
+			len--;
+		} else if (!feof(fp_in)) {
+			fr_strerror_printf("%s[%d]: Line is too long, the maximum is %u characters",
+					   in, lineno, LINE_INDEX_MAX_LINE);
+			goto finish;
+		}
+		if (len && (buffer[len - 1] == '\r')) len--;
+		buffer[len] = '\0';
+
+		if ((lineno == 1) && conf->header) continue;
+		if (!len) continue;
+		if (conf->ignore_nislike && ((buffer[0] == '+') || (buffer[0] == '-'))) continue;
+
+		switch (line_index_key(key, sizeof(key) - 1, &key_len, buffer, len, conf)) {
+		case 1:
+			break;
+
+		case 0:
+			continue;
+
+		default:
+			fr_strerror_printf("%s[%d]: Key is too long", in, lineno);
+			goto finish;
+		}
+		if (!key_len) continue;
+		key[key_len] = '\0';
+
+		line_offset = offset;
+		if (line_offset > LINE_INDEX_MAX_OFFSET) {
+			fr_strerror_printf("%s[%d]: File is too large to index", in, lineno);
+			goto finish;
+		}
+		if (fwrite(buffer, len + 1, 1, fp_out) != 1) goto write_error;
+		offset += len + 1;
+
+		/*
+		 *	One entry per key.  Empty keys in
+		 *	lists are silently ignored.
+		 */
+		for (p = key; p; p = next) {
+			size_t this_len;
+
+			if (conf->key_list) {
+				next = strchr(p, ',');
+				if (next) *next++ = '\0';
+			} else {
+				next = NULL;
+			}
+
+			this_len = conf->key_list ? strlen(p) : key_len;
+			if (!this_len) continue;
+
+			if (num_entries == talloc_array_length(entries)) {
+				MEM(entries = talloc_realloc(NULL, entries, line_index_build_entry_t,
+							     num_entries ? (num_entries * 2) : 1024));
+			}
+			if ((keys_len + this_len) > talloc_array_length(keys)) {
+				MEM(keys = talloc_realloc(NULL, keys, char,
+							  (keys_len + this_len) * 2));
+			}
+			memcpy(keys + keys_len, p, this_len);
+
+			entries[num_entries++] = (line_index_build_entry_t) {
+				.hash = fr_hash(p, this_len),
+				.key_len = this_len,
+				.key_offset = keys_len,
+				.line_offset = line_offset,
+				.line_len = len
+			};
+			keys_len += this_len;
+		}
+	}
+	if (ferror(fp_in)) {
+		fr_strerror_printf("Failed reading %s: %s", in, fr_syserror(errno));
+		goto finish;
+	}
+
+	/*
+	 *	Align the table of entries.
+	 */
+	while (offset % sizeof(uint32_t)) {
+		if (fputc('\0', fp_out) == EOF) goto write_error;
+		offset++;
+	}
+
+	/*
+	 *	The key offsets increase with the position
+	 *	in the file, so lines with the same key stay
+	 *	in file order.
+	 */
+	if (num_entries) qsort(entries, num_entries, sizeof(entries[0]), line_index_entry_cmp);
+
+	for (i = 0; i < num_entries; i++) {
+		/*
+		 *	Search backwards through the entries with
+		 *	the same hash.  Repeated keys are usually
+		 *	next to each other, so this is quick.
+		 */
+		for (j = i; j > 0; j--) {
+			line_index_build_entry_t const *prev = &entries[j - 1];
+
+			if (prev->hash != entries[i].hash) break;
+
+			if ((prev->key_len == entries[i].key_len) &&
+			    (memcmp(keys + prev->key_offset, keys + entries[i].key_offset, prev->key_len) == 0)) {
+				num_duplicates++;
+				break;
+			}
+		}
+
+		out_entry = (line_index_entry_t) {
+			.hash = entries[i].hash,
+			.line_offset_lo = (uint32_t)entries[i].line_offset,
+			.line_offset_hi = (uint16_t)(entries[i].line_offset >> 32),
+			.line_len = entries[i].line_len
+		};
+		if (fwrite(&out_entry, sizeof(out_entry), 1, fp_out) != 1) goto write_error;
+	}
+
+	memcpy(header.magic, LINE_INDEX_MAGIC, sizeof(header.magic));
+	header.version = LINE_INDEX_VERSION;
+	header.delimiter = (uint8_t)conf->delimiter;
+	header.flags = line_index_flags(conf);
+	header.key_field = conf->key_field;
+	header.num_entries = num_entries;
+	header.num_duplicates = num_duplicates;
+	header.entries_offset = offset;
+	header.file_len = offset + (num_entries * sizeof(line_index_entry_t));
+
+	if ((fseek(fp_out, 0, SEEK_SET) < 0) ||
+	    (fwrite(&header, sizeof(header), 1, fp_out) != 1) ||
+	    (fflush(fp_out) != 0) ||
+	    (fsync(fileno(fp_out)) < 0)) {
+	write_error:
+		fr_strerror_printf("Failed writing %s: %s", tmp, fr_syserror(errno));
+		goto finish;
+	}
+
+	if (fclose(fp_out) != 0) {
+		fp_out = NULL;
+		goto write_error;
+	}
+	fp_out = NULL;
+
+	if (rename(tmp, out) < 0) {
+		fr_strerror_printf("Failed renaming %s to %s: %s", tmp, out, fr_syserror(errno));
+		goto finish;
+	}
+
+	ret = 0;
+
+finish:
+	if (fp_out) fclose(fp_out);
+	if (ret < 0) unlink(tmp);
+	fclose(fp_in);
+	talloc_free(entries);
+	talloc_free(keys);
+	talloc_free(tmp);
+
+	return ret;
+}
+
+static int _line_index_free(fr_line_index_t *index)
+{
+	munmap(UNCONST(uint8_t *, index->map), index->map_len);
+
+	return 0;
+}
+
+/** Map an index built by fr_line_index_build()
+ *
+ * Only the header is checked, so opening an index takes the same time
+ * regardless of its size.
+ *
+ * @param[in] ctx	to allocate the index handle in.  Freeing the handle
+ *			unmaps the index.
+ * @param[in] filename	of the index.
+ * @param[in] conf	the options the index must have been built with.
+ * @return
+ *	- The index on success.
+ *	- NULL on failure, with the error in fr_strerror().
+ */
+fr_line_index_t *fr_line_index_open(TALLOC_CTX *ctx, char const *filename, fr_line_index_conf_t const *conf)
+{
+	fr_line_index_t			*index;
+	line_index_header_t const	*header;
+	struct stat			buf;
+	uint8_t				*map;
+	int				fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &buf) < 0) {
+		fr_strerror_printf("Failed getting size of %s: %s", filename, fr_syserror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if ((size_t)buf.st_size < sizeof(*header)) {
+		fr_strerror_printf("%s is too short to be an index", filename);
+		close(fd);
+		return NULL;
+	}
+
+	/*
+	 *	MAP_SHARED so every process using the
+	 *	index shares the same pages.
+	 */
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping %s: %s", filename, fr_syserror(errno));
+		return NULL;
+	}
+
+	MEM(index = talloc_zero(ctx, fr_line_index_t));
+	index->map = map;
+	index->map_len = buf.st_size;
+	talloc_set_destructor(index, _line_index_free);
+
+	header = (line_index_header_t const *)map;
+	if (memcmp(header->magic, LINE_INDEX_MAGIC, sizeof(header->magic)) != 0) {
+		fr_strerror_printf("%s is not an index", filename);
+	error:
+		talloc_free(index);
+		return NULL;
+	}
+
+	if (header->version != LINE_INDEX_VERSION) {
+		fr_strerror_printf("%s has unsupported version %u, expected %u", filename,
+				   header->version, LINE_INDEX_VERSION);
+		goto error;
+	}
+
+	if ((header->file_len != index->map_len) ||
+	    (header->entries_offset % sizeof(uint32_t)) ||
+	    (header->entries_offset > header->file_len) ||
+	    (header->num_entries > ((header->file_len - header->entries_offset) / sizeof(line_index_entry_t)))) {
+		fr_strerror_printf("%s is truncated or corrupt", filename);
+		goto error;
+	}
+
+	if ((header->delimiter != (uint8_t)conf->delimiter) ||
+	    (header->key_field != conf->key_field) ||
+	    (header->flags != line_index_flags(conf))) {
+		fr_strerror_printf("%s was built with different options.  Expected delimiter '%c', key field %u",
+				   filename, conf->delimiter, conf->key_field + 1);
+		goto error;
+	}
+
+	index->conf = *conf;
+	index->entries = (line_index_entry_t const *)(map + header->entries_offset);
+	index->num_entries = header->num_entries;
+	index->num_duplicates = header->num_duplicates;
+
+	/*
+	 *	Lookups touch a few pages, scattered through the file.
+	 */
+	(void) madvise(map, index->map_len, MADV_RANDOM);
+
+	return index;
+}
+
+/** Return the line for an entry, if the line has the cursor's key
+ *
+ */
+static char const *line_index_match(fr_line_index_cursor_t *cursor, line_index_entry_t const *entry, size_t *len)
+{
+	fr_line_index_t const	*index = cursor->index;
+	uint64_t		line_offset = ((uint64_t)entry->line_offset_hi << 32) | entry->line_offset_lo;
+	char const		*line;
+	char			key[LINE_INDEX_MAX_LINE];
+	size_t			key_len;
+	char			*p, *end, *next;
+
+	if ((line_offset + entry->line_len) >= index->map_len) return NULL;
+	line = (char const *)(index->map + line_offset);
+
+	if (line_index_key(key, sizeof(key), &key_len, line, entry->line_len, &index->conf) != 1) return NULL;
+
+	/*
+	 *	The line matches if any key in the list does.
+	 */
+	for (p = key, end = key + key_len; p < end; p = next) {
+		if (index->conf.key_list) {
+			next = memchr(p, ',', end - p);
+			if (!next) next = end;
+		} else {
+			next = end;
+		}
+
+		if (((size_t)(next - p) == cursor->key_len) && (memcmp(p, cursor->key, cursor->key_len) == 0)) {
+			if (len) *len = entry->line_len;
+			return line;
+		}
+
+		if (next < end) next++;
+	}
+
+	return NULL;
+}
+
+/** Return the next line matching the cursor's key
+ *
+ * @param[in] cursor	initialised by fr_line_index_find().
+ * @param[out] len	Length of the line.
+ * @return
+ *	- The next line, '\0' terminated.
+ *	- NULL if there are no more lines with the key.
+ */
+char const *fr_line_index_next(fr_line_index_cursor_t *cursor, size_t *len)
+{
+	fr_line_index_t const *index = cursor->index;
+
+	while (cursor->pos < index->num_entries) {
+		line_index_entry_t const	*entry = &index->entries[cursor->pos++];
+		char const			*line;
+
+		if (entry->hash != cursor->hash) break;
+
+		/*
+		 *	A line with a list of keys has an entry
+		 *	for each one.  If two of them have the same
+		 *	hash, the entries are next to each other,
+		 *	and the line is only returned once.
+		 */
+		line = line_index_match(cursor, entry, len);
+		if (line && (line != cursor->line)) {
+			cursor->line = line;
+			return line;
+		}
+	}
+
+	cursor->pos = index->num_entries;
+
+	return NULL;
+}
+
+/** Find the first line with a key
+ *
+ * @param[out] cursor	to pass to fr_line_index_next() to get the
+ *			remaining lines with the same key.
+ * @param[in] index	to search.
+ * @param[in] key	to find.  Must remain valid while the cursor is used.
+ * @param[in] key_len	Length of the key.
+ * @param[out] len	Length of the line.
+ * @return
+ *	- The first line, '\0' terminated.
+ *	- NULL if no lines have the key.
+ */
+char const *fr_line_index_find(fr_line_index_cursor_t *cursor, fr_line_index_t const *index,
+			       char const *key, size_t key_len, size_t *len)
+{
+	uint64_t	lo = 0, hi = index->num_entries;
+	uint32_t	hash = fr_hash(key, key_len);
+
+	/*
+	 *	Find the first entry with this hash.
+	 */
+	while (lo < hi) {
+		uint64_t mid = lo + ((hi - lo) / 2);
+
+		if (index->entries[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	*cursor = (fr_line_index_cursor_t) {
+		.index = index,
+		.key = key,
+		.key_len = key_len,
+		.hash = hash,
+		.pos = lo
+	};
+
+	return fr_line_index_next(cursor, len);
+}
+
+/** The number of keys in an index
+ *
+ */
+uint64_t fr_line_index_num_entries(fr_line_index_t const *index)
+{
+	return index->num_entries;
+}
+
+/** The number of keys in an index which are the same as an earlier key
+ *
+ * i.e. the number of lines which would be skipped if only the first
+ * line with each key was used.
+ */
+uint64_t fr_line_index_num_duplicates(fr_line_index_t const *index)
+{
+	return index->num_duplicates;
+}
+
+/** The size of an index's mapping
+ *
+ */
+size_t fr_line_index_size(fr_line_index_t const *index)
+{
+	return index->map_len;
+}
@@ -0,0 +1,80 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Precompiled, memory mapped indexes of delimited text files
+ *
+ * @file src/lib/util/line_index.h
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(line_index_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct fr_line_index_s fr_line_index_t;
+
+/** How the lines of the source file are split into fields
+ *
+ * An index can only be opened with the same options it was built with.
+ */
+typedef struct {
+	char		delimiter;		//!< Between fields.
+	unsigned int	key_field;		//!< Field containing the key, counted from 0.
+	bool		header;			//!< The first line is a header, and isn't indexed.
+	bool		quoted;			//!< Fields may be quoted, as in RFC 4180.
+	bool		key_list;		//!< The key field is a comma separated list of keys.
+	bool		ignore_nislike;		//!< Skip lines beginning with '+' or '-'.
+} fr_line_index_conf_t;
+
+/** State for iterating over the lines matching a key
+ *
+ */
+typedef struct {
+	fr_line_index_t const	*index;
+	char const		*key;
+	size_t			key_len;
+	uint32_t		hash;
+	uint64_t		pos;		//!< Next entry to check.
+	char const		*line;		//!< Last line returned.
+} fr_line_index_cursor_t;
+
+int			fr_line_index_build(char const *out, char const *in, fr_line_index_conf_t const *conf);
+
+fr_line_index_t		*fr_line_index_open(TALLOC_CTX *ctx, char const *filename, fr_line_index_conf_t const *conf);
+
+char const		*fr_line_index_find(fr_line_index_cursor_t *cursor, fr_line_index_t const *index,
+					    char const *key, size_t key_len, size_t *len);
+
+char const		*fr_line_index_next(fr_line_index_cursor_t *cursor, size_t *len);
+
+uint64_t		fr_line_index_num_entries(fr_line_index_t const *index);
+
+uint64_t		fr_line_index_num_duplicates(fr_line_index_t const *index);
+
+size_t			fr_line_index_size(fr_line_index_t const *index);
+
+#ifdef __cplusplus
+}
+#endif
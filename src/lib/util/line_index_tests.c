@@ -0,0 +1,193 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for precompiled line indexes
+ *
+ * @file src/lib/util/line_index_tests.c
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+#include <freeradius-devel/util/line_index.h>
+
+#include <stdio.h>
+#include <unistd.h>
+
+static char const csv_data[] =
+	"user,password,groups\n"
+	"bob,hello,\"staff,admin\"\n"
+	"\"alice\",\"say \"\"hi\"\"\",staff\n"
+	"bob,again,users\n"
+	",empty,none\n";
+
+static char const passwd_data[] =
+	"root:x:0:0\n"
+	"+nis:x:1:1\n"
+	"daemon:x:2:2\n";
+
+static char in_file[] = "/tmp/line_index_tests_in_XXXXXX";
+static char out_file[sizeof(in_file) + 4];
+
+/** Write the test data, and build an index of it
+ *
+ */
+static fr_line_index_t *index_alloc(char const *data, fr_line_index_conf_t const *conf)
+{
+	int		fd;
+	ssize_t		len = strlen(data);
+
+	strcpy(in_file, "/tmp/line_index_tests_in_XXXXXX");
+	fd = mkstemp(in_file);
+	TEST_ASSERT(fd >= 0);
+	TEST_ASSERT(write(fd, data, len) == len);
+	close(fd);
+
+	snprintf(out_file, sizeof(out_file), "%s.idx", in_file);
+
+	TEST_CHECK(fr_line_index_build(out_file, in_file, conf) == 0);
+	unlink(in_file);
+
+	return fr_line_index_open(NULL, out_file, conf);
+}
+
+static void index_free(fr_line_index_t *index)
+{
+	talloc_free(index);
+	unlink(out_file);
+}
+
+static void test_line_index_csv(void)
+{
+	fr_line_index_conf_t	conf = { .delimiter = ',', .key_field = 0, .header = true, .quoted = true };
+	fr_line_index_t		*index;
+	fr_line_index_cursor_t	cursor;
+	char const		*line;
+	size_t			len;
+
+	index = index_alloc(csv_data, &conf);
+	TEST_ASSERT(index != NULL);
+
+	TEST_MSG("Header and lines with empty keys are not indexed");
+	TEST_CHECK(fr_line_index_num_entries(index) == 3);
+
+	TEST_MSG("The second line for bob is a duplicate");
+	TEST_CHECK(fr_line_index_num_duplicates(index) == 1);
+
+	TEST_MSG("Duplicate keys are returned in file order");
+	line = fr_line_index_find(&cursor, index, "bob", 3, &len);
+	TEST_ASSERT(line != NULL);
+	TEST_CHECK(strncmp(line, "bob,hello,", 10) == 0);
+
+	line = fr_line_index_next(&cursor, &len);
+	TEST_ASSERT(line != NULL);
+	TEST_CHECK(strncmp(line, "bob,again,users", len) == 0);
+	TEST_CHECK(fr_line_index_next(&cursor, &len) == NULL);
+
+	TEST_MSG("Quoted keys are unquoted");
+	line = fr_line_index_find(&cursor, index, "alice", 5, &len);
+	TEST_ASSERT(line != NULL);
+	TEST_CHECK(line[0] == '"');
+
+	TEST_CHECK(fr_line_index_find(&cursor, index, "user", 4, &len) == NULL);
+	TEST_CHECK(fr_line_index_find(&cursor, index, "bo", 2, &len) == NULL);
+
+	index_free(index);
+}
+
+static void test_line_index_key_list(void)
+{
+	fr_line_index_conf_t	conf = { .delimiter = ',', .key_field = 2, .header = true,
+					 .quoted = true, .key_list = true };
+	fr_line_index_t		*index;
+	fr_line_index_cursor_t	cursor;
+	char const		*line;
+	size_t			len;
+
+	index = index_alloc(csv_data, &conf);
+	TEST_ASSERT(index != NULL);
+
+	TEST_CHECK(fr_line_index_num_entries(index) == 5);
+	TEST_CHECK(fr_line_index_num_duplicates(index) == 1);
+
+	line = fr_line_index_find(&cursor, index, "admin", 5, &len);
+	TEST_ASSERT(line != NULL);
+	TEST_CHECK(strncmp(line, "bob,hello,", 10) == 0);
+
+	TEST_MSG("Each line containing the key is returned");
+	TEST_CHECK(fr_line_index_find(&cursor, index, "staff", 5, &len) != NULL);
+	TEST_CHECK(fr_line_index_next(&cursor, &len) != NULL);
+	TEST_CHECK(fr_line_index_next(&cursor, &len) == NULL);
+
+	index_free(index);
+
+	TEST_MSG("A line listing the same key twice is returned once");
+	conf.header = false;
+	index = index_alloc("a,b,\"x,y,x\"\nc,d,x\n", &conf);
+	TEST_ASSERT(index != NULL);
+
+	line = fr_line_index_find(&cursor, index, "x", 1, &len);
+	TEST_ASSERT(line != NULL);
+	TEST_CHECK(line[0] == 'a');
+	line = fr_line_index_next(&cursor, &len);
+	TEST_ASSERT(line != NULL);
+	TEST_CHECK(line[0] == 'c');
+	TEST_CHECK(fr_line_index_next(&cursor, &len) == NULL);
+
+	line = fr_line_index_find(&cursor, index, "y", 1, &len);
+	TEST_ASSERT(line != NULL);
+	TEST_CHECK(line[0] == 'a');
+
+	index_free(index);
+}
+
+static void test_line_index_passwd(void)
+{
+	fr_line_index_conf_t	conf = { .delimiter = ':', .key_field = 0, .ignore_nislike = true };
+	fr_line_index_conf_t	other = conf;
+	fr_line_index_t		*index;
+	fr_line_index_cursor_t	cursor;
+	char const		*line;
+	size_t			len;
+
+	index = index_alloc(passwd_data, &conf);
+	TEST_ASSERT(index != NULL);
+
+	TEST_CHECK(fr_line_index_num_entries(index) == 2);
+	TEST_CHECK(fr_line_index_num_duplicates(index) == 0);
+	TEST_CHECK(fr_line_index_find(&cursor, index, "+nis", 4, &len) == NULL);
+
+	line = fr_line_index_find(&cursor, index, "daemon", 6, &len);
+	TEST_ASSERT(line != NULL);
+	TEST_CHECK(len == strlen("daemon:x:2:2"));
+	TEST_CHECK(strncmp(line, "daemon:x:2:2", len) == 0);
+
+	talloc_free(index);
+
+	TEST_MSG("Indexes can't be opened with different options");
+	other.key_field = 1;
+	TEST_CHECK(fr_line_index_open(NULL, out_file, &other) == NULL);
+
+	unlink(out_file);
+}
+
+TEST_LIST = {
+	{ "csv",		test_line_index_csv },
+	{ "key_list",		test_line_index_key_list },
+	{ "passwd",		test_line_index_passwd },
+
+	{ NULL }
+};
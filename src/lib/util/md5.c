@@ -174,6 +174,83 @@ static const uint8_t PADDING[MD5_BLOCK_LENGTH] = {
 /* This is the central step in the MD5 algorithm. */
 #define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
 
+/** All 64 steps of the MD5 algorithm
+ *
+ * Used for both the single and multi-buffer transforms, so the
+ * round constants only live in one place.  Works for any type
+ * that supports the usual integer operators, including GCC
+ * vector types.
+ */
+#define MD5_ROUNDS(_a, _b, _c, _d, _in) do { \
+	MD5STEP(MD5_F1, _a, _b, _c, _d, _in[ 0] + 0xd76aa478,  7); \
+	MD5STEP(MD5_F1, _d, _a, _b, _c, _in[ 1] + 0xe8c7b756, 12); \
+	MD5STEP(MD5_F1, _c, _d, _a, _b, _in[ 2] + 0x242070db, 17); \
+	MD5STEP(MD5_F1, _b, _c, _d, _a, _in[ 3] + 0xc1bdceee, 22); \
+	MD5STEP(MD5_F1, _a, _b, _c, _d, _in[ 4] + 0xf57c0faf,  7); \
+	MD5STEP(MD5_F1, _d, _a, _b, _c, _in[ 5] + 0x4787c62a, 12); \
+	MD5STEP(MD5_F1, _c, _d, _a, _b, _in[ 6] + 0xa8304613, 17); \
+	MD5STEP(MD5_F1, _b, _c, _d, _a, _in[ 7] + 0xfd469501, 22); \
+	MD5STEP(MD5_F1, _a, _b, _c, _d, _in[ 8] + 0x698098d8,  7); \
+	MD5STEP(MD5_F1, _d, _a, _b, _c, _in[ 9] + 0x8b44f7af, 12); \
+	MD5STEP(MD5_F1, _c, _d, _a, _b, _in[10] + 0xffff5bb1, 17); \
+	MD5STEP(MD5_F1, _b, _c, _d, _a, _in[11] + 0x895cd7be, 22); \
+	MD5STEP(MD5_F1, _a, _b, _c, _d, _in[12] + 0x6b901122,  7); \
+	MD5STEP(MD5_F1, _d, _a, _b, _c, _in[13] + 0xfd987193, 12); \
+	MD5STEP(MD5_F1, _c, _d, _a, _b, _in[14] + 0xa679438e, 17); \
+	MD5STEP(MD5_F1, _b, _c, _d, _a, _in[15] + 0x49b40821, 22); \
+\
+	MD5STEP(MD5_F2, _a, _b, _c, _d, _in[ 1] + 0xf61e2562,  5); \
+	MD5STEP(MD5_F2, _d, _a, _b, _c, _in[ 6] + 0xc040b340,  9); \
+	MD5STEP(MD5_F2, _c, _d, _a, _b, _in[11] + 0x265e5a51, 14); \
+	MD5STEP(MD5_F2, _b, _c, _d, _a, _in[ 0] + 0xe9b6c7aa, 20); \
+	MD5STEP(MD5_F2, _a, _b, _c, _d, _in[ 5] + 0xd62f105d,  5); \
+	MD5STEP(MD5_F2, _d, _a, _b, _c, _in[10] + 0x02441453,  9); \
+	MD5STEP(MD5_F2, _c, _d, _a, _b, _in[15] + 0xd8a1e681, 14); \
+	MD5STEP(MD5_F2, _b, _c, _d, _a, _in[ 4] + 0xe7d3fbc8, 20); \
+	MD5STEP(MD5_F2, _a, _b, _c, _d, _in[ 9] + 0x21e1cde6,  5); \
+	MD5STEP(MD5_F2, _d, _a, _b, _c, _in[14] + 0xc33707d6,  9); \
+	MD5STEP(MD5_F2, _c, _d, _a, _b, _in[ 3] + 0xf4d50d87, 14); \
+	MD5STEP(MD5_F2, _b, _c, _d, _a, _in[ 8] + 0x455a14ed, 20); \
+	MD5STEP(MD5_F2, _a, _b, _c, _d, _in[13] + 0xa9e3e905,  5); \
+	MD5STEP(MD5_F2, _d, _a, _b, _c, _in[ 2] + 0xfcefa3f8,  9); \
+	MD5STEP(MD5_F2, _c, _d, _a, _b, _in[ 7] + 0x676f02d9, 14); \
+	MD5STEP(MD5_F2, _b, _c, _d, _a, _in[12] + 0x8d2a4c8a, 20); \
+\
+	MD5STEP(MD5_F3, _a, _b, _c, _d, _in[ 5] + 0xfffa3942,  4); \
+	MD5STEP(MD5_F3, _d, _a, _b, _c, _in[ 8] + 0x8771f681, 11); \
+	MD5STEP(MD5_F3, _c, _d, _a, _b, _in[11] + 0x6d9d6122, 16); \
+	MD5STEP(MD5_F3, _b, _c, _d, _a, _in[14] + 0xfde5380c, 23); \
+	MD5STEP(MD5_F3, _a, _b, _c, _d, _in[ 1] + 0xa4beea44,  4); \
+	MD5STEP(MD5_F3, _d, _a, _b, _c, _in[ 4] + 0x4bdecfa9, 11); \
+	MD5STEP(MD5_F3, _c, _d, _a, _b, _in[ 7] + 0xf6bb4b60, 16); \
+	MD5STEP(MD5_F3, _b, _c, _d, _a, _in[10] + 0xbebfbc70, 23); \
+	MD5STEP(MD5_F3, _a, _b, _c, _d, _in[13] + 0x289b7ec6,  4); \
+	MD5STEP(MD5_F3, _d, _a, _b, _c, _in[ 0] + 0xeaa127fa, 11); \
+	MD5STEP(MD5_F3, _c, _d, _a, _b, _in[ 3] + 0xd4ef3085, 16); \
+	MD5STEP(MD5_F3, _b, _c, _d, _a, _in[ 6] + 0x04881d05, 23); \
+	MD5STEP(MD5_F3, _a, _b, _c, _d, _in[ 9] + 0xd9d4d039,  4); \
+	MD5STEP(MD5_F3, _d, _a, _b, _c, _in[12] + 0xe6db99e5, 11); \
+	MD5STEP(MD5_F3, _c, _d, _a, _b, _in[15] + 0x1fa27cf8, 16); \
+	MD5STEP(MD5_F3, _b, _c, _d, _a, _in[2 ] + 0xc4ac5665, 23); \
+\
+	MD5STEP(MD5_F4, _a, _b, _c, _d, _in[ 0] + 0xf4292244,  6); \
+	MD5STEP(MD5_F4, _d, _a, _b, _c, _in[7 ] + 0x432aff97, 10); \
+	MD5STEP(MD5_F4, _c, _d, _a, _b, _in[14] + 0xab9423a7, 15); \
+	MD5STEP(MD5_F4, _b, _c, _d, _a, _in[5 ] + 0xfc93a039, 21); \
+	MD5STEP(MD5_F4, _a, _b, _c, _d, _in[12] + 0x655b59c3,  6); \
+	MD5STEP(MD5_F4, _d, _a, _b, _c, _in[3 ] + 0x8f0ccc92, 10); \
+	MD5STEP(MD5_F4, _c, _d, _a, _b, _in[10] + 0xffeff47d, 15); \
+	MD5STEP(MD5_F4, _b, _c, _d, _a, _in[1 ] + 0x85845dd1, 21); \
+	MD5STEP(MD5_F4, _a, _b, _c, _d, _in[8 ] + 0x6fa87e4f,  6); \
+	MD5STEP(MD5_F4, _d, _a, _b, _c, _in[15] + 0xfe2ce6e0, 10); \
+	MD5STEP(MD5_F4, _c, _d, _a, _b, _in[6 ] + 0xa3014314, 15); \
+	MD5STEP(MD5_F4, _b, _c, _d, _a, _in[13] + 0x4e0811a1, 21); \
+	MD5STEP(MD5_F4, _a, _b, _c, _d, _in[4 ] + 0xf7537e82,  6); \
+	MD5STEP(MD5_F4, _d, _a, _b, _c, _in[11] + 0xbd3af235, 10); \
+	MD5STEP(MD5_F4, _c, _d, _a, _b, _in[2 ] + 0x2ad7d2bb, 15); \
+	MD5STEP(MD5_F4, _b, _c, _d, _a, _in[9 ] + 0xeb86d391, 21); \
+} while (0)
+
 /** The core of the MD5 algorithm
  *
  * This alters an existing MD5 hash to reflect the addition of 16
@@ -202,73 +279,7 @@ static void fr_md5_local_transform(uint32_t state[static 4], uint8_t const block
 	c = state[2];
 	d = state[3];
 
-	MD5STEP(MD5_F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);
-	MD5STEP(MD5_F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);
-	MD5STEP(MD5_F1, c, d, a, b, in[ 2] + 0x242070db, 17);
-	MD5STEP(MD5_F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);
-	MD5STEP(MD5_F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);
-	MD5STEP(MD5_F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);
-	MD5STEP(MD5_F1, c, d, a, b, in[ 6] + 0xa8304613, 17);
-	MD5STEP(MD5_F1, b, c, d, a, in[ 7] + 0xfd469501, 22);
-	MD5STEP(MD5_F1, a, b, c, d, in[ 8] + 0x698098d8,  7);
-	MD5STEP(MD5_F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);
-	MD5STEP(MD5_F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-	MD5STEP(MD5_F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-	MD5STEP(MD5_F1, a, b, c, d, in[12] + 0x6b901122,  7);
-	MD5STEP(MD5_F1, d, a, b, c, in[13] + 0xfd987193, 12);
-	MD5STEP(MD5_F1, c, d, a, b, in[14] + 0xa679438e, 17);
-	MD5STEP(MD5_F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-	MD5STEP(MD5_F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);
-	MD5STEP(MD5_F2, d, a, b, c, in[ 6] + 0xc040b340,  9);
-	MD5STEP(MD5_F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(MD5_F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);
-	MD5STEP(MD5_F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);
-	MD5STEP(MD5_F2, d, a, b, c, in[10] + 0x02441453,  9);
-	MD5STEP(MD5_F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(MD5_F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);
-	MD5STEP(MD5_F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);
-	MD5STEP(MD5_F2, d, a, b, c, in[14] + 0xc33707d6,  9);
-	MD5STEP(MD5_F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);
-	MD5STEP(MD5_F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);
-	MD5STEP(MD5_F2, a, b, c, d, in[13] + 0xa9e3e905,  5);
-	MD5STEP(MD5_F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);
-	MD5STEP(MD5_F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);
-	MD5STEP(MD5_F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-	MD5STEP(MD5_F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);
-	MD5STEP(MD5_F3, d, a, b, c, in[ 8] + 0x8771f681, 11);
-	MD5STEP(MD5_F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-	MD5STEP(MD5_F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-	MD5STEP(MD5_F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);
-	MD5STEP(MD5_F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);
-	MD5STEP(MD5_F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);
-	MD5STEP(MD5_F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-	MD5STEP(MD5_F3, a, b, c, d, in[13] + 0x289b7ec6,  4);
-	MD5STEP(MD5_F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);
-	MD5STEP(MD5_F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);
-	MD5STEP(MD5_F3, b, c, d, a, in[ 6] + 0x04881d05, 23);
-	MD5STEP(MD5_F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);
-	MD5STEP(MD5_F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-	MD5STEP(MD5_F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-	MD5STEP(MD5_F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23);
-
-	MD5STEP(MD5_F4, a, b, c, d, in[ 0] + 0xf4292244,  6);
-	MD5STEP(MD5_F4, d, a, b, c, in[7 ] + 0x432aff97, 10);
-	MD5STEP(MD5_F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-	MD5STEP(MD5_F4, b, c, d, a, in[5 ] + 0xfc93a039, 21);
-	MD5STEP(MD5_F4, a, b, c, d, in[12] + 0x655b59c3,  6);
-	MD5STEP(MD5_F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10);
-	MD5STEP(MD5_F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-	MD5STEP(MD5_F4, b, c, d, a, in[1 ] + 0x85845dd1, 21);
-	MD5STEP(MD5_F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6);
-	MD5STEP(MD5_F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-	MD5STEP(MD5_F4, c, d, a, b, in[6 ] + 0xa3014314, 15);
-	MD5STEP(MD5_F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-	MD5STEP(MD5_F4, a, b, c, d, in[4 ] + 0xf7537e82,  6);
-	MD5STEP(MD5_F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-	MD5STEP(MD5_F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15);
-	MD5STEP(MD5_F4, b, c, d, a, in[9 ] + 0xeb86d391, 21);
+	MD5_ROUNDS(a, b, c, d, in);
 
 	state[0] += a;
 	state[1] += b;
@@ -466,6 +477,182 @@ void fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_
 	fr_md5_ctx_free_from_list(&ctx);
 }
 
+/** Digest a batch of messages one after another
+ *
+ */
+static void md5_multi_serial(fr_md5_multi_t const *jobs, size_t num)
+{
+	fr_md5_ctx_t	*ctx;
+	size_t		i;
+
+	ctx = fr_md5_ctx_alloc_from_list();
+	for (i = 0; i < num; i++) {
+		fr_md5_update(ctx, jobs[i].in[0], jobs[i].inlen[0]);
+		fr_md5_update(ctx, jobs[i].in[1], jobs[i].inlen[1]);
+		fr_md5_final(jobs[i].out, ctx);
+		fr_md5_ctx_reset(ctx);
+	}
+	fr_md5_ctx_free_from_list(&ctx);
+}
+
+#ifdef __GNUC__
+/*
+ *	Each MD5 block depends on the output of the previous one, so
+ *	a single digest can't be made any faster with SIMD.  What we
+ *	can do is run several independent digests side by side, one
+ *	per vector lane.
+ *
+ *	We use the GCC vector extensions, and let the compiler pick
+ *	the instructions.  With AVX2 a vector of 8 lanes fits in one
+ *	register, with AVX-512 we use 16.  On other targets the
+ *	compiler splits the vector up into whatever it has.
+ */
+#  ifdef __AVX512F__
+#    define MD5_MULTI_LANES	16
+#  else
+#    define MD5_MULTI_LANES	8
+#  endif
+typedef uint32_t md5_vec_t __attribute__((vector_size(MD5_MULTI_LANES * sizeof(uint32_t))));
+
+/** Produce one block of the padded message for a job
+ *
+ * The message is the concatenation of in[0] and in[1], followed by
+ * the usual MD5 padding, and the length of the message in bits.
+ *
+ * @param[out] block	to write.
+ * @param[in] job	to produce the block for.
+ * @param[in] total	length of the message.
+ * @param[in] padded	length of the message including padding.
+ * @param[in] offset	of the block in the padded message.
+ */
+static void md5_multi_block(uint8_t block[static MD5_BLOCK_LENGTH], fr_md5_multi_t const *job,
+			    size_t total, size_t padded, size_t offset)
+{
+	size_t		start = 0, copied = 0, i;
+
+	for (i = 0; i < NUM_ELEMENTS(job->in); i++) {
+		size_t len = job->inlen[i];
+
+		if ((copied < MD5_BLOCK_LENGTH) && ((offset + copied) < (start + len))) {
+			size_t skip = (offset + copied) - start;
+			size_t n = len - skip;
+
+			if (n > (MD5_BLOCK_LENGTH - copied)) n = MD5_BLOCK_LENGTH - copied;
+
+			memcpy(block + copied, job->in[i] + skip, n);
+			copied += n;
+		}
+		start += len;
+	}
+	if (copied < MD5_BLOCK_LENGTH) memset(block + copied, 0, MD5_BLOCK_LENGTH - copied);
+
+	if ((total >= offset) && (total < (offset + MD5_BLOCK_LENGTH))) block[total - offset] = 0x80;
+
+	if ((offset + MD5_BLOCK_LENGTH) == padded) {
+		uint32_t bits[2] = { (uint32_t)(total << 3), (uint32_t)((uint64_t)total >> 29) };
+
+		PUT_64BIT_LE(block + MD5_BLOCK_LENGTH - 8, bits);
+	}
+}
+
+/** Digest up to MD5_MULTI_LANES messages in parallel
+ *
+ * Lanes which run out of data before the others keep feeding
+ * blocks through the transform, but the result is masked out, so
+ * their state doesn't change.
+ */
+static void md5_multi_lanes(fr_md5_multi_t const *jobs, size_t num)
+{
+	md5_vec_t	state[4], a, b, c, d, active, in[MD5_BLOCK_LENGTH / 4];
+	uint8_t		block[MD5_MULTI_LANES][MD5_BLOCK_LENGTH];
+	size_t		total[MD5_MULTI_LANES], padded[MD5_MULTI_LANES];
+	size_t		offset, max = 0, i, j;
+
+	for (i = 0; i < MD5_MULTI_LANES; i++) {
+		if (i < num) {
+			total[i] = jobs[i].inlen[0] + jobs[i].inlen[1];
+			padded[i] = (((total[i] + 8) / MD5_BLOCK_LENGTH) + 1) * MD5_BLOCK_LENGTH;
+		} else {
+			total[i] = padded[i] = 0;
+		}
+		if (padded[i] > max) max = padded[i];
+
+		state[0][i] = 0x67452301;
+		state[1][i] = 0xefcdab89;
+		state[2][i] = 0x98badcfe;
+		state[3][i] = 0x10325476;
+	}
+
+	for (offset = 0; offset < max; offset += MD5_BLOCK_LENGTH) {
+		for (i = 0; i < MD5_MULTI_LANES; i++) {
+			if (offset < padded[i]) {
+				md5_multi_block(block[i], &jobs[i], total[i], padded[i], offset);
+				active[i] = UINT32_MAX;
+			} else {
+				memset(block[i], 0, MD5_BLOCK_LENGTH);
+				active[i] = 0;
+			}
+		}
+
+		for (j = 0; j < (MD5_BLOCK_LENGTH / 4); j++) {
+			for (i = 0; i < MD5_MULTI_LANES; i++) {
+				uint8_t const *p = block[i] + (j * 4);
+
+				in[j][i] = (uint32_t)p[0] |
+					   (uint32_t)p[1] << 8 |
+					   (uint32_t)p[2] << 16 |
+					   (uint32_t)p[3] << 24;
+			}
+		}
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+
+		MD5_ROUNDS(a, b, c, d, in);
+
+		state[0] += a & active;
+		state[1] += b & active;
+		state[2] += c & active;
+		state[3] += d & active;
+	}
+
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < 4; j++) PUT_32BIT_LE(jobs[i].out + (j * 4), state[j][i]);
+	}
+}
+#endif
+
+/** Calculate the MD5 hashes of a batch of independent messages
+ *
+ * Where the compiler supports it, the messages are hashed in parallel,
+ * one message per vector lane.  This is much faster than hashing them
+ * one after another when there are several messages ready at once, e.g.
+ * when signing a batch of replies.
+ *
+ * @param[in] jobs	Messages to hash, and where to write the digests.
+ * @param[in] num	Number of jobs.
+ */
+void fr_md5_calc_multi(fr_md5_multi_t const *jobs, size_t num)
+{
+#ifdef MD5_MULTI_LANES
+	/*
+	 *	A single message is faster through the normal
+	 *	code, which may well be using OpenSSL's assembly.
+	 */
+	while (num > 1) {
+		size_t n = (num > MD5_MULTI_LANES) ? MD5_MULTI_LANES : num;
+
+		md5_multi_lanes(jobs, n);
+		jobs += n;
+		num -= n;
+	}
+#endif
+
+	if (num > 0) md5_multi_serial(jobs, num);
+}
+
 static int _md5_ctx_free_on_exit(void *arg)
 {
 	int i;
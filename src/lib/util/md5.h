@@ -83,6 +83,22 @@ extern		fr_md5_final_t		fr_md5_final;
  */
 void		fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen);
 
+/** One message in a batch passed to fr_md5_calc_multi()
+ *
+ * The message digested is in[1] appended to in[0].  Either may be
+ * NULL, as long as the corresponding length is zero.
+ */
+typedef struct {
+	uint8_t const	*in[2];			//!< Data to digest.
+	size_t		inlen[2];		//!< Length of each piece of data.
+	uint8_t		*out;			//!< Where to write the MD5_DIGEST_LENGTH byte digest.
+} fr_md5_multi_t;
+
+/** Perform digest operations on a batch of independent messages
+ *
+ */
+void		fr_md5_calc_multi(fr_md5_multi_t const *jobs, size_t num);
+
 /** Allocate an MD5 context from a free list
  *
  */
@@ -96,6 +112,19 @@ void		fr_md5_ctx_free_from_list(fr_md5_ctx_t **ctx);
 /* hmac.c */
 int		fr_hmac_md5(uint8_t digest[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
 			    uint8_t const *key, size_t key_len);
+
+/** One message in a batch passed to fr_hmac_md5_multi()
+ *
+ */
+typedef struct {
+	uint8_t const	*in;			//!< Data to authenticate.
+	size_t		inlen;			//!< Length of the data.
+	uint8_t const	*key;			//!< Authentication key.
+	size_t		key_len;		//!< Length of the key.
+	uint8_t		*digest;		//!< Where to write the MD5_DIGEST_LENGTH byte HMAC.
+} fr_hmac_md5_multi_t;
+
+void		fr_hmac_md5_multi(fr_hmac_md5_multi_t const *jobs, size_t num);
 #ifdef __cplusplus
 }
 #endif
@@ -96,6 +96,19 @@ struct fr_pcap {
 	int			fd;				//!< Selectable file descriptor we feed to select.
 	struct pcap_stat	pstats;				//!< The last set of pcap stats for this handle.
 
+	uint8_t const		*map;				//!< Capture file mapped into memory.
+								//!< Only valid for classic pcap files.
+	size_t			map_len;			//!< Length of the mapping.
+	size_t			map_offset;			//!< Offset of the next record.
+	bool			map_swapped;			//!< Capture file was written with the
+								//!< opposite byte order.
+	bool			map_nsec;			//!< Timestamps are in nanoseconds.
+	struct pcap_pkthdr	map_header;			//!< Header of the last record returned.
+#ifdef HAVE_PCAP_OFFLINE_FILTER
+	struct bpf_program	map_filter;			//!< Filter to apply to mapped records.
+	bool			map_filter_set;			//!< Whether map_filter has been compiled.
+#endif
+
 	fr_pcap_t		*next;				//!< Next handle in collection.
 };
 
@@ -103,6 +116,7 @@ int		fr_pcap_if_link_layer(pcap_if_t *dev);
 fr_pcap_t	*fr_pcap_init(TALLOC_CTX *ctx, char const *name, fr_pcap_type_t type);
 int		fr_pcap_open(fr_pcap_t *handle);
 int		fr_pcap_apply_filter(fr_pcap_t *handle, char const *expression);
+int		fr_pcap_next(fr_pcap_t *handle, struct pcap_pkthdr **header, uint8_t const **data);
 char		*fr_pcap_device_names(TALLOC_CTX *ctx, fr_pcap_t *handle, char c);
 int		fr_pcap_mac_addr(uint8_t *macaddr, char *ifname);
 bool		fr_pcap_link_layer_supported(int link_layer);
@@ -0,0 +1,279 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for reading capture files through a memory mapping
+ *
+ * Every file is read with both fr_pcap_next() and pcap_next_ex(), and
+ * the records have to match exactly.
+ *
+ * @file src/lib/util/pcap_tests.c
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+#include <freeradius-devel/util/pcap.h>
+
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#define TEST_PACKETS	64
+
+static void pcap_put_uint32(FILE *fp, uint32_t num, bool swapped)
+{
+	if (swapped) {
+		num = ((num & 0xff000000) >> 24) | ((num & 0x00ff0000) >> 8) |
+		      ((num & 0x0000ff00) << 8) | ((num & 0x000000ff) << 24);
+	}
+	TEST_ASSERT(fwrite(&num, sizeof(num), 1, fp) == 1);
+}
+
+static void pcap_put_uint16(FILE *fp, uint16_t num, bool swapped)
+{
+	if (swapped) num = (num >> 8) | (num << 8);
+	TEST_ASSERT(fwrite(&num, sizeof(num), 1, fp) == 1);
+}
+
+/** Build an Ethernet/IPv4/UDP frame
+ *
+ * Alternates between RADIUS and DNS ports so filters have something to do.
+ */
+static size_t pcap_test_frame(uint8_t *out, size_t outlen, unsigned int i)
+{
+	size_t		payload = (i * 37) % 300;
+	size_t		len = 14 + 20 + 8 + payload;
+	uint16_t	port = (i % 2) ? 53 : 1812;
+	uint8_t		*p = out;
+	size_t		j;
+
+	TEST_ASSERT(len <= outlen);
+	memset(out, 0, len);
+
+	/* Ethernet */
+	memset(p, 0x02, 12);
+	p[12] = 0x08;
+	p[13] = 0x00;
+	p += 14;
+
+	/* IPv4 */
+	p[0] = 0x45;
+	p[2] = ((20 + 8 + payload) >> 8) & 0xff;
+	p[3] = (20 + 8 + payload) & 0xff;
+	p[8] = 64;
+	p[9] = IPPROTO_UDP;
+	p[12] = 192; p[13] = 0; p[14] = 2; p[15] = 1;
+	p[16] = 192; p[17] = 0; p[18] = 2; p[19] = 2 + (i % 5);
+	p += 20;
+
+	/* UDP */
+	p[0] = 0x40; p[1] = i & 0xff;
+	p[2] = port >> 8; p[3] = port & 0xff;
+	p[4] = ((8 + payload) >> 8) & 0xff;
+	p[5] = (8 + payload) & 0xff;
+	p += 8;
+
+	for (j = 0; j < payload; j++) p[j] = (i + j) & 0xff;
+
+	return len;
+}
+
+/** Write a classic pcap file
+ *
+ * @param[in] swapped	Write the file in the opposite byte order.
+ * @param[in] nsec	Use the nanosecond timestamp format.
+ * @return the name of the file.
+ */
+static char *pcap_test_file(bool swapped, bool nsec)
+{
+	static char	path[64];
+	int		fd;
+	FILE		*fp;
+	unsigned int	i;
+	uint8_t		frame[512];
+
+	strlcpy(path, "/tmp/pcap_tests_XXXXXX", sizeof(path));
+	fd = mkstemp(path);
+	TEST_ASSERT(fd >= 0);
+
+	fp = fdopen(fd, "w");
+	TEST_ASSERT(fp != NULL);
+
+	pcap_put_uint32(fp, nsec ? 0xa1b23c4d : 0xa1b2c3d4, swapped);
+	pcap_put_uint16(fp, 2, swapped);
+	pcap_put_uint16(fp, 4, swapped);
+	pcap_put_uint32(fp, 0, swapped);		/* thiszone */
+	pcap_put_uint32(fp, 0, swapped);		/* sigfigs */
+	pcap_put_uint32(fp, 65535, swapped);		/* snaplen */
+	pcap_put_uint32(fp, DLT_EN10MB, swapped);
+
+	for (i = 0; i < TEST_PACKETS; i++) {
+		size_t		len = pcap_test_frame(frame, sizeof(frame), i);
+		size_t		caplen = len;
+		uint32_t	frac = nsec ? (i * 15625111) % 1000000000 : (i * 15625) % 1000000;
+
+		/*
+		 *	Some records were cut short by the snaplen.
+		 */
+		if ((i % 7) == 3) caplen = len - 5;
+
+		pcap_put_uint32(fp, 1700000000 + (i / 4), swapped);
+		pcap_put_uint32(fp, frac, swapped);
+		pcap_put_uint32(fp, caplen, swapped);
+		pcap_put_uint32(fp, len, swapped);
+		TEST_ASSERT(fwrite(frame, caplen, 1, fp) == 1);
+	}
+
+	TEST_ASSERT(fclose(fp) == 0);
+
+	return path;
+}
+
+/** Read the file with both readers and compare every record
+ *
+ */
+static void pcap_test_compare(char const *path, char const *filter, bool mapped)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("pcap_tests");
+	fr_pcap_t		*pcap;
+	pcap_t			*ref;
+	char			errbuf[PCAP_ERRBUF_SIZE];
+	unsigned int		count = 0;
+
+	pcap = fr_pcap_init(ctx, path, PCAP_FILE_IN);
+	TEST_ASSERT(pcap != NULL);
+	TEST_ASSERT(fr_pcap_open(pcap) == 0);
+	if (mapped) TEST_CHECK(pcap->map != NULL);
+
+	ref = pcap_open_offline(path, errbuf);
+	TEST_ASSERT(ref != NULL);
+
+	if (filter) {
+		struct bpf_program fp;
+
+		TEST_CHECK(fr_pcap_apply_filter(pcap, filter) == 0);
+		TEST_ASSERT(pcap_compile(ref, &fp, filter, 0, 0) == 0);
+		TEST_ASSERT(pcap_setfilter(ref, &fp) == 0);
+		pcap_freecode(&fp);
+	}
+
+	for (;;) {
+		struct pcap_pkthdr	*header, *ref_header;
+		uint8_t const		*data, *ref_data;
+		int			ret, ref_ret;
+
+		ret = fr_pcap_next(pcap, &header, &data);
+		ref_ret = pcap_next_ex(ref, &ref_header, &ref_data);
+
+		TEST_CHECK(ret == ref_ret);
+		TEST_MSG("record %u, got %i expected %i", count, ret, ref_ret);
+		if ((ret != ref_ret) || (ret != 1)) break;
+
+		TEST_CHECK(header->ts.tv_sec == ref_header->ts.tv_sec);
+		TEST_CHECK(header->ts.tv_usec == ref_header->ts.tv_usec);
+		TEST_MSG("usec %ld expected %ld", (long) header->ts.tv_usec, (long) ref_header->ts.tv_usec);
+		TEST_CHECK(header->caplen == ref_header->caplen);
+		TEST_CHECK(header->len == ref_header->len);
+		TEST_ASSERT(header->caplen == ref_header->caplen);
+		TEST_CHECK(memcmp(data, ref_data, header->caplen) == 0);
+
+		count++;
+	}
+
+	TEST_CHECK(count == (filter ? TEST_PACKETS / 2 : TEST_PACKETS));
+	TEST_MSG("read %u records", count);
+
+	pcap_close(ref);
+	talloc_free(ctx);
+}
+
+static void pcap_test_variant(bool swapped, bool nsec)
+{
+	static char const	*ports[] = { "1812", "53" };
+	char			*path = pcap_test_file(swapped, nsec);
+	size_t			i;
+
+	pcap_test_compare(path, NULL, true);
+
+	/*
+	 *	Each filter matches half the records.
+	 */
+	for (i = 0; i < NUM_ELEMENTS(ports); i++) {
+		char filter[32];
+
+		snprintf(filter, sizeof(filter), "udp dst port %s", ports[i]);
+		pcap_test_compare(path, filter, false);
+	}
+
+	unlink(path);
+}
+
+static void test_pcap_native(void)
+{
+	pcap_test_variant(false, false);
+}
+
+static void test_pcap_swapped(void)
+{
+	pcap_test_variant(true, false);
+}
+
+static void test_pcap_native_nsec(void)
+{
+	pcap_test_variant(false, true);
+}
+
+static void test_pcap_swapped_nsec(void)
+{
+	pcap_test_variant(true, true);
+}
+
+/** A record running past the end of the file is an error, not the end of the capture
+ *
+ */
+static void test_pcap_truncated(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("pcap_tests");
+	char			*path = pcap_test_file(false, false);
+	fr_pcap_t		*pcap;
+	struct pcap_pkthdr	*header;
+	uint8_t const		*data;
+	struct stat		buf;
+	int			ret;
+
+	TEST_ASSERT(stat(path, &buf) == 0);
+	TEST_ASSERT(truncate(path, buf.st_size - 3) == 0);
+
+	pcap = fr_pcap_init(ctx, path, PCAP_FILE_IN);
+	TEST_ASSERT(pcap != NULL);
+	TEST_ASSERT(fr_pcap_open(pcap) == 0);
+	TEST_CHECK(pcap->map != NULL);
+
+	while ((ret = fr_pcap_next(pcap, &header, &data)) == 1);
+	TEST_CHECK(ret == -1);
+
+	unlink(path);
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "native",		test_pcap_native },
+	{ "swapped",		test_pcap_swapped },
+	{ "native_nsec",	test_pcap_native_nsec },
+	{ "swapped_nsec",	test_pcap_swapped_nsec },
+	{ "truncated",		test_pcap_truncated },
+
+	{ NULL }
+};
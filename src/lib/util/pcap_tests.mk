@@ -0,0 +1,13 @@
+ifneq ($(PCAP_LIBS),)
+TARGET		:= pcap_tests$(E)
+else
+TARGET		:=
+endif
+
+SOURCES		:= pcap_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(PCAP_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(PCAP_LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util$(L)
+
+TGT_INSTALLDIR	:=
@@ -89,6 +89,7 @@ static const conf_parser_t load_listen_config[] = {
 	{ FR_CONF_OFFSET("step", proto_load_step_t, load.step) },
 	{ FR_CONF_OFFSET("max_backlog", proto_load_step_t, load.milliseconds) },
 	{ FR_CONF_OFFSET("parallel", proto_load_step_t, load.parallel) },
+	{ FR_CONF_OFFSET("timeout", proto_load_step_t, load.timeout) },
 	{ FR_CONF_OFFSET("repeat", proto_load_step_t, repeat) },
 
 	CONF_PARSER_TERMINATOR
@@ -174,6 +175,11 @@ static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t req
 	 */
 	state = fr_load_generator_have_reply(thread->l, request_time);
 	if (state == FR_LOAD_DONE) {
+		char buffer[512];
+
+		(void) fr_load_generator_summary_sprint(thread->l, buffer, sizeof(buffer));
+		INFO("%s - %s", thread->name, buffer);
+
 		if (!thread->inst->repeat) {
 			thread->done = true;
 		} else {
@@ -379,6 +385,11 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_backlog", inst->load.milliseconds, >=, 1);
 	FR_INTEGER_BOUND_CHECK("max_backlog", inst->load.milliseconds, <, 100000);
 
+	if (fr_time_delta_ispos(inst->load.timeout)) {
+		FR_TIME_DELTA_BOUND_CHECK("timeout", inst->load.timeout, >=, fr_time_delta_from_usec(100));
+		FR_TIME_DELTA_BOUND_CHECK("timeout", inst->load.timeout, <=, fr_time_delta_from_sec(120));
+	}
+
 	return 0;
 }
 
@@ -80,6 +80,13 @@ static conf_parser_t const proto_radius_config[] = {
 	 */
 	{ FR_CONF_OFFSET("tunnel_password_zeros", proto_radius_t, tunnel_password_zeros) } ,
 
+	/*
+	 *	Re-use the layout of previous replies when encoding
+	 *	new ones.  Global, so enabling it in one listener
+	 *	enables it everywhere.
+	 */
+	{ FR_CONF_OFFSET("cache_reply_shapes", proto_radius_t, cache_reply_shapes) } ,
+
 	{ FR_CONF_POINTER("limit", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	{ FR_CONF_POINTER("priority", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) priority_config },
 
@@ -502,6 +509,8 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 1024);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
 
+	if (inst->cache_reply_shapes) fr_radius_encode_shape_enable(true);
+
 	/*
 	 *	Instantiate the master io submodule
 	 */
@@ -19,14 +19,23 @@
  * @file rlm_csv.c
  * @brief Read and map CSV files
  *
+ * The file can be reloaded with the radmin command 'set module <name> reload'.
+ * The replacement index is built by the thread running the command, and
+ * swapped in under a short lock.  Each worker holds a reference to the
+ * index it's using, and picks up the new one the next time it does a
+ * lookup, so lookups never wait for a reload.  The old index is freed
+ * when the last worker has moved on.
+ *
  * @copyright 2019 The FreeRADIUS server project
  * @copyright 2019 Alan DeKok (aland@freeradius.org)
  */
 RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module_reload.h>
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/util/htrie.h>
+#include <freeradius-devel/util/line_index.h>
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/server/map_proc.h>
@@ -46,6 +55,7 @@ typedef struct {
 	char const	*delimiter;
 	char const	*fields;
 	char const	*index_field_name;
+	char const	*index_file;
 
 	bool		header;
 	bool		allow_multiple_keys;
@@ -58,15 +68,31 @@ typedef struct {
 	char const     	**field_names;
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
 	fr_type_t	*field_types;
-	fr_rb_tree_t	*tree;
-	fr_htrie_t	*trie;
+	fr_htrie_type_t	htype;
 
 	tmpl_t		*key;
 	fr_type_t	key_data_type;
 
 	map_list_t	map;		//!< if there is an "update" section in the configuration.
+
+	CONF_SECTION	*conf;			//!< Module configuration, for reporting errors on reload.
+
+	module_reload_t	*reload;		//!< The current index.
 } rlm_csv_t;
 
+/** The index built from one read of the file
+ *
+ */
+typedef struct rlm_csv_data_s {
+	fr_htrie_t	*trie;
+	fr_line_index_t	*index;			//!< Precompiled index, used instead of the trie.
+	uint64_t	entries;
+} rlm_csv_data_t;
+
+typedef struct {
+	module_reload_thread_t	reload;		//!< Index this thread is using.
+} rlm_csv_thread_t;
+
 typedef struct rlm_csv_entry_s rlm_csv_entry_t;
 struct rlm_csv_entry_s {
 	fr_rb_node_t node;
@@ -83,6 +109,7 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("delimiter", CONF_FLAG_NOT_EMPTY, rlm_csv_t, delimiter), .dflt = "," },
 	{ FR_CONF_OFFSET("fields", rlm_csv_t, fields) },
 	{ FR_CONF_OFFSET("header", rlm_csv_t, header) },
+	{ FR_CONF_OFFSET_FLAGS("index_file", CONF_FLAG_FILE_INPUT, rlm_csv_t, index_file) },
 	{ FR_CONF_OFFSET("allow_multiple_keys", rlm_csv_t, allow_multiple_keys) },
 	{ FR_CONF_OFFSET_FLAGS("index_field", CONF_FLAG_REQUIRED | CONF_FLAG_NOT_EMPTY, rlm_csv_t, index_field_name) },
 	{ FR_CONF_OFFSET("key", rlm_csv_t, key) },
@@ -92,7 +119,7 @@ static const conf_parser_t module_config[] = {
 /*
  *	Allow for quotation marks.
  */
-static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
+static bool buf2entry(rlm_csv_t const *inst, char *buf, char **out)
 {
 	char *p, *q;
 
@@ -185,13 +212,15 @@ static int csv_to_key(uint8_t **out, size_t *outlen, void const *data)
 }
 
 
-static bool insert_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t *e, int lineno)
+static bool insert_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_data_t *data, rlm_csv_entry_t *e, int lineno)
 {
 	rlm_csv_entry_t *old;
 
 	fr_assert(e != NULL);
 
-	old = fr_htrie_find(inst->trie, e);
+	data->entries++;
+
+	old = fr_htrie_find(data->trie, e);
 	if (old) {
 		if (!inst->allow_multiple_keys && !inst->multiple_index_fields) {
 			cf_log_err(conf, "%s[%d]: Multiple entries are disallowed", inst->filename, lineno);
@@ -207,7 +236,7 @@ static bool insert_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t *e
 		return true;
 	}
 
-	if (!fr_htrie_insert(inst->trie, e)) {
+	if (!fr_htrie_insert(data->trie, e)) {
 		cf_log_err(conf, "Failed inserting entry for file %s line %d: %s",
 			   inst->filename, lineno, fr_strerror());
 fail:
@@ -219,13 +248,14 @@ fail:
 }
 
 
-static bool duplicate_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t *old, char *p, int lineno)
+static bool duplicate_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_data_t *data,
+			    rlm_csv_entry_t *old, char *p, int lineno)
 {
 	int i;
 	fr_type_t type = inst->key_data_type;
 	rlm_csv_entry_t *e;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst, uint8_t,
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(data, uint8_t,
 						     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
 	talloc_set_type(e, rlm_csv_entry_t);
 
@@ -247,85 +277,45 @@ static bool duplicate_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t
 		if (old->data[i]) e->data[i] = old->data[i]; /* no need to dup it, it's never freed... */
 	}
 
-	return insert_entry(conf, inst, e, lineno);
+	return insert_entry(conf, inst, data, e, lineno);
 }
 
 /*
- *	Convert a buffer to a CSV entry
+ *	Convert a buffer to a CSV entry, without its key
+ *
+ *	The key field is returned in 'key', unquoted.
  */
-static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static rlm_csv_entry_t *csv_entry_parse(TALLOC_CTX *ctx, CONF_SECTION *conf, rlm_csv_t const *inst,
+					int lineno, char *buffer, char **key)
 {
 	rlm_csv_entry_t *e;
 	int i;
 	char *p, *q;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst, uint8_t,
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(ctx, uint8_t,
 						     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
 	talloc_set_type(e, rlm_csv_entry_t);
 
+	*key = NULL;
+
 	for (p = buffer, i = 0; p != NULL; p = q, i++) {
 		if (!buf2entry(inst, p, &q)) {
 			cf_log_err(conf, "Malformed entry in file %s line %d", inst->filename, lineno);
-			return false;
+			goto fail;
 		}
 
 		if (q) *(q++) = '\0';
 
 		if (i >= inst->num_fields) {
 			cf_log_err(conf, "Too many fields at file %s line %d", inst->filename, lineno);
-			return false;
+			goto fail;
 		}
 
 		/*
 		 *	This is the key field.
 		 */
 		if (i == inst->index_field) {
-			fr_type_t type = inst->key_data_type;
-
-			/*
-			 *	Check for /etc/group style keys.
-			 */
-			if (inst->multiple_index_fields) {
-				char *l;
-
-				/*
-				 *	Silently omit empty entries.
-				 */
-				if (!*p) {
-					talloc_free(e);
-					return true;
-				}
-
-				/*
-				 *	Check & smash ','.  duplicate
-				 *	'e', and insert it into the
-				 *	hash table / trie.
-				 */
-				l = strchr(p, ',');
-				while (l) {
-					*l = '\0';
-
-					if (!duplicate_entry(conf, inst, e, p, lineno)) goto fail;
-
-					p = l + 1;
-					l = strchr(p, ',');
-				}
-			}
-
-			/*
-			 *	Set the last entry to use 'e'
-			 */
-			e->key = fr_value_box_alloc_null(e);
-			if (!e->key) goto fail;
-
-			if (fr_value_box_from_str(e->key, e->key, type, NULL,
-						  p, strlen(p), NULL, false) < 0) {
-				cf_log_err(conf, "Failed parsing key field in file %s line %d - %s", inst->filename, lineno,
-					   fr_strerror());
-			fail:
-				talloc_free(e);
-				return false;
-			}
+			*key = p;
 			continue;
 		}
 
@@ -356,10 +346,72 @@ static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buff
 
 	if (i < inst->num_fields) {
 		cf_log_err(conf, "Too few fields in file %s at line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
-		goto fail;
+	fail:
+		talloc_free(e);
+		return NULL;
 	}
 
-	return insert_entry(conf, inst, e, lineno);
+	return e;
+}
+
+/*
+ *	Convert a buffer to a CSV entry, and insert it into the index
+ */
+static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_data_t *data, int lineno, char *buffer)
+{
+	rlm_csv_entry_t *e;
+	fr_type_t type = inst->key_data_type;
+	char *p;
+
+	e = csv_entry_parse(data, conf, inst, lineno, buffer, &p);
+	if (!e) return false;
+
+	/*
+	 *	Check for /etc/group style keys.
+	 */
+	if (inst->multiple_index_fields) {
+		char *l;
+
+		/*
+		 *	Silently omit empty entries.
+		 */
+		if (!*p) {
+			talloc_free(e);
+			return true;
+		}
+
+		/*
+		 *	Check & smash ','.  duplicate
+		 *	'e', and insert it into the
+		 *	hash table / trie.
+		 */
+		l = strchr(p, ',');
+		while (l) {
+			*l = '\0';
+
+			if (!duplicate_entry(conf, inst, data, e, p, lineno)) goto fail;
+
+			p = l + 1;
+			l = strchr(p, ',');
+		}
+	}
+
+	/*
+	 *	Set the last entry to use 'e'
+	 */
+	e->key = fr_value_box_alloc_null(e);
+	if (!e->key) goto fail;
+
+	if (fr_value_box_from_str(e->key, e->key, type, NULL,
+				  p, strlen(p), NULL, false) < 0) {
+		cf_log_err(conf, "Failed parsing key field in file %s line %d - %s", inst->filename, lineno,
+			   fr_strerror());
+	fail:
+		talloc_free(e);
+		return false;
+	}
+
+	return insert_entry(conf, inst, data, e, lineno);
 }
 
 
@@ -520,7 +572,6 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	char const	*p;
 	char		*q;
 	char		*fields;
-	fr_htrie_type_t	htype;
 
 	if (inst->delimiter[1]) {
 		cf_log_err(conf, "'delimiter' must be one character long");
@@ -550,20 +601,20 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	/*
 	 *	IP addresses go into tries.  Everything else into binary tries.
 	 */
-	htype = fr_htrie_hint(inst->key_data_type);
-	if (htype == FR_HTRIE_INVALID) {
+	inst->htype = fr_htrie_hint(inst->key_data_type);
+	if (inst->htype == FR_HTRIE_INVALID) {
 		cf_log_err(conf, "Invalid data type '%s' used for CSV file.",
 			   fr_type_to_str(inst->key_data_type));
 		return -1;
 	}
 
-	inst->trie = fr_htrie_alloc(inst, htype,
-				    (fr_hash_t) csv_hash,
-				    (fr_cmp_t) csv_cmp,
-				    (fr_trie_key_t) csv_to_key,
-				    NULL);
-	if (!inst->trie) {
-		cf_log_err(conf, "Failed creating internal trie: %s", fr_strerror());
+	/*
+	 *	Keys in a precompiled index are the text of the
+	 *	key field, so they can only be looked up as strings.
+	 */
+	if (inst->index_file && (inst->key_data_type != FR_TYPE_STRING)) {
+		cf_log_err(conf, "'index_file' can only be used with keys of type 'string', not '%s'",
+			   fr_type_to_str(inst->key_data_type));
 		return -1;
 	}
 
@@ -743,6 +794,108 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 }
 
 
+/** Read the CSV file into a new index
+ *
+ */
+static void *csv_data_read(void *uctx, UNUSED bool at_runtime)
+{
+	rlm_csv_t	*inst = talloc_get_type_abort(uctx, rlm_csv_t);
+	CONF_SECTION	*conf = inst->conf;
+	rlm_csv_data_t	*data;
+	int		lineno;
+	FILE		*fp;
+	char		buffer[8192];
+
+	MEM(data = talloc_zero(NULL, rlm_csv_data_t));
+
+	/*
+	 *	The index is mapped rather than read, so there's
+	 *	nothing to parse until a key is looked up.
+	 */
+	if (inst->index_file) {
+		fr_line_index_conf_t	li_conf = {
+						.delimiter = *inst->delimiter,
+						.key_field = inst->index_field,
+						.header = inst->header,
+						.quoted = true,
+						.key_list = inst->multiple_index_fields
+					};
+
+		data->index = fr_line_index_open(data, inst->index_file, &li_conf);
+		if (!data->index) {
+			cf_log_perr(conf, "Failed opening index for %s", inst->filename);
+			goto error;
+		}
+		data->entries = fr_line_index_num_entries(data->index);
+
+		/*
+		 *	Same as insert_entry(), but the index
+		 *	only knows how many duplicates there are.
+		 */
+		if (!inst->allow_multiple_keys && !inst->multiple_index_fields &&
+		    (fr_line_index_num_duplicates(data->index) > 0)) {
+			cf_log_err(conf, "%s: Multiple entries are disallowed, but %"PRIu64" lines have the same "
+				   "key as an earlier line", inst->index_file, fr_line_index_num_duplicates(data->index));
+			goto error;
+		}
+
+		return data;
+	}
+
+	data->trie = fr_htrie_alloc(data, inst->htype,
+				    (fr_hash_t) csv_hash,
+				    (fr_cmp_t) csv_cmp,
+				    (fr_trie_key_t) csv_to_key,
+				    NULL);
+	if (!data->trie) {
+		cf_log_err(conf, "Failed creating internal trie: %s", fr_strerror());
+	error:
+		talloc_free(data);
+		return NULL;
+	}
+
+	fp = fopen(inst->filename, "r");
+	if (!fp) {
+		cf_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+		goto error;
+	}
+	lineno = 1;
+
+	/*
+	 *	If there is a header in the file, then read that first.
+	 *	This time we just ignore it.
+	 */
+	if (inst->header) {
+		char *p = fgets(buffer, sizeof(buffer), fp);
+		if (!p) {
+			cf_log_err(conf, "Error reading filename %s: Unexpected EOF", inst->filename);
+			fclose(fp);
+			goto error;
+		}
+		lineno++;
+	}
+
+	/*
+	 *	Read the rest of the file.
+	 */
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		if (!file2csv(conf, inst, data, lineno, buffer)) {
+			fclose(fp);
+			goto error;
+		}
+
+		lineno++;
+	}
+	fclose(fp);
+
+	return data;
+}
+
+static void csv_data_print(FILE *fp, void const *data, UNUSED void *uctx)
+{
+	fprintf(fp, "entries\t%"PRIu64"\n", ((rlm_csv_data_t const *)data)->entries);
+}
+
 /** Instantiate the module
  *
  * Creates a new instance of the module reading parameters from a configuration section.
@@ -757,14 +910,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	rlm_csv_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_csv_t);
 	CONF_SECTION	*conf = mctx->inst->conf;
 	CONF_SECTION	*cs;
-	int		lineno;
-	FILE		*fp;
 	tmpl_rules_t	parse_rules = {
 		.attr = {
 			.allow_foreign = true	/* Because we don't know where we'll be called */
 		}
 	};
-	char buffer[8192];
 
 	map_list_init(&inst->map);
 	/*
@@ -794,42 +944,38 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		cf_log_warn(conf, "Ignoring 'key', as no 'update' section has been defined.");
 	}
 
-	/*
-	 *	Re-open the file and read it all.
-	 */
-	fp = fopen(inst->filename, "r");
-	if (!fp) {
-		cf_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
-		return -1;
-	}
-	lineno = 1;
+	inst->conf = conf;
+	inst->reload = module_reload_alloc(inst, mctx->inst->name, csv_data_read, csv_data_print, inst, false);
+	if (module_reload(inst->reload) < 0) return -1;
 
-	/*
-	 *	If there is a header in the file, then read that first.
-	 *	This time we just ignore it.
-	 */
-	if (inst->header) {
-		char *p = fgets(buffer, sizeof(buffer), fp);
-		if (!p) {
-			cf_log_err(conf, "Error reading filename %s: Unexpected EOF", inst->filename);
-			fclose(fp);
-			return -1;
-		}
-		lineno++;
-	}
+	return module_reload_register(inst->reload);
+}
 
-	/*
-	 *	Read the rest of the file.
-	 */
-	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-		if (!file2csv(conf, inst, lineno, buffer)) {
-			fclose(fp);
-			return -1;
-		}
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_csv_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_csv_t);
+	rlm_csv_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_csv_thread_t);
 
-		lineno++;
-	}
-	fclose(fp);
+	(void) module_reload_thread_data(inst->reload, &t->reload);
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_csv_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_csv_t);
+	rlm_csv_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_csv_thread_t);
+
+	module_reload_thread_detach(inst->reload, &t->reload);
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_csv_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_csv_t);
+
+	TALLOC_FREE(inst->reload);
 
 	return 0;
 }
@@ -885,9 +1031,54 @@ static int csv_map_getvalue(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *req
 }
 
 
+/** Find the entries for a key in a precompiled index
+ *
+ * Matching lines are parsed into temporary entries, which are
+ * chained together in the same way as entries in the trie.
+ *
+ * @param[out] tmp_ctx	holding the entries, which the caller must free.
+ * @param[in] inst	of rlm_csv.
+ * @param[in] data	containing the index.
+ * @param[in] request	The current request.
+ * @param[in] key	to look for.
+ * @return
+ *	- The first matching entry.
+ *	- NULL if there are no matches, or they couldn't be parsed.
+ */
+static rlm_csv_entry_t *csv_index_find(TALLOC_CTX **tmp_ctx, rlm_csv_t const *inst, rlm_csv_data_t const *data,
+				       request_t *request, fr_value_box_t const *key)
+{
+	fr_line_index_cursor_t	cursor;
+	rlm_csv_entry_t		*head = NULL, **last = &head;
+	char const		*line;
+	size_t			len;
+
+	for (line = fr_line_index_find(&cursor, data->index, key->vb_strvalue, key->vb_length, &len);
+	     line;
+	     line = fr_line_index_next(&cursor, &len)) {
+		rlm_csv_entry_t	*e;
+		char		*buffer, *p;
+
+		if (!*tmp_ctx) MEM(*tmp_ctx = talloc_new(request));
+
+		MEM(buffer = talloc_bstrndup(*tmp_ctx, line, len));
+		e = csv_entry_parse(*tmp_ctx, inst->conf, inst, 0, buffer, &p);
+		if (!e) {
+			REDEBUG("Failed parsing entry for key \"%pV\" from index %s", key, inst->index_file);
+			return NULL;
+		}
+
+		*last = e;
+		last = &e->next;
+	}
+
+	return head;
+}
+
 /** Perform a search and map the result of the search to server attributes
  *
  * @param[in] inst	#rlm_csv_t.
+ * @param[in] data	index to search.
  * @param[in,out]	request The current request.
  * @param[in] key	key to look for
  * @param[in] maps	Head of the map list.
@@ -896,14 +1087,19 @@ static int csv_map_getvalue(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *req
  *	- #RLM_MODULE_UPDATED if one or more #fr_pair_t were added to the #request_t.
  *	- #RLM_MODULE_FAIL if an error occurred.
  */
-static rlm_rcode_t mod_map_apply(rlm_csv_t const *inst, request_t *request,
+static rlm_rcode_t mod_map_apply(rlm_csv_t const *inst, rlm_csv_data_t const *data, request_t *request,
 				fr_value_box_t const *key, map_list_t const *maps)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
 	rlm_csv_entry_t		*e;
 	map_t const		*map = NULL;
+	TALLOC_CTX		*tmp_ctx = NULL;
 
-	e = fr_htrie_find(inst->trie, &(rlm_csv_entry_t) { .key = UNCONST(fr_value_box_t *, key) } );
+	if (data->index) {
+		e = csv_index_find(&tmp_ctx, inst, data, request, key);
+	} else {
+		e = fr_htrie_find(data->trie, &(rlm_csv_entry_t) { .key = UNCONST(fr_value_box_t *, key) } );
+	}
 	if (!e) {
 		rcode = RLM_MODULE_NOOP;
 		goto finish;
@@ -959,6 +1155,7 @@ redo:
 	}
 
 finish:
+	talloc_free(tmp_ctx);
 	return rcode;
 }
 
@@ -980,6 +1177,7 @@ static unlang_action_t mod_map_proc(rlm_rcode_t *p_result, void *mod_inst, UNUSE
 				    fr_value_box_list_t *key, map_list_t const *maps)
 {
 	rlm_csv_t		*inst = talloc_get_type_abort(mod_inst, rlm_csv_t);
+	rlm_csv_thread_t	*t = talloc_get_type_abort(module_rlm_thread_by_data(inst)->data, rlm_csv_thread_t);
 	fr_value_box_t		*key_head = fr_value_box_list_head(key);
 
 	if (!key_head) {
@@ -997,13 +1195,14 @@ static unlang_action_t mod_map_proc(rlm_rcode_t *p_result, void *mod_inst, UNUSE
 		}
 	}
 
-	RETURN_MODULE_RCODE(mod_map_apply(inst, request, key_head, maps));
+	RETURN_MODULE_RCODE(mod_map_apply(inst, module_reload_thread_data(inst->reload, &t->reload), request, key_head, maps));
 }
 
 
 static unlang_action_t CC_HINT(nonnull) mod_process(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_csv_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_csv_t);
+	rlm_csv_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_csv_t);
+	rlm_csv_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_csv_thread_t);
 	rlm_rcode_t rcode;
 	ssize_t slen;
 	fr_value_box_t *key;
@@ -1041,7 +1240,7 @@ static unlang_action_t CC_HINT(nonnull) mod_process(rlm_rcode_t *p_result, modul
 
 	RDEBUG2("Processing CVS map with key %pV", key);
 	RINDENT();
-	rcode = mod_map_apply(inst, request, key, &inst->map);
+	rcode = mod_map_apply(inst, module_reload_thread_data(inst->reload, &t->reload), request, key, &inst->map);
 	REXDENT();
 
 	talloc_free(key);
@@ -1058,6 +1257,12 @@ module_rlm_t rlm_csv = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_csv_thread_t),
+		.thread_inst_type	= "rlm_csv_thread_t",
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
 	},
 	.method_names = (module_method_name_t[]){
 		{ .name1 = CF_IDENT_ANY,	.name2 = CF_IDENT_ANY,	.method = mod_process },
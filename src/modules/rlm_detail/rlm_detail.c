@@ -25,11 +25,15 @@ RCSID("$Id$")
 
 #define LOG_PREFIX mctx->inst->name
 
+#include <freeradius-devel/io/file_writer.h>
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/cf_util.h>
+#include <freeradius-devel/server/command.h>
 #include <freeradius-devel/server/exfile.h>
 #include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/unlang/module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/iovec.h>
 #include <freeradius-devel/util/perm.h>
 
 #include <ctype.h>
@@ -67,9 +71,17 @@ typedef struct {
 
 	exfile_t    	*ef;		//!< Log file handler
 
+	fr_file_writer_conf_t	async;	//!< Write from a dedicated thread.
+	bool		durable;	//!< Wait for entries to be synced to disk.
+	fr_file_writer_t	*writer; //!< Writer thread, if async writes are enabled.
+
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
 } rlm_detail_t;
 
+typedef struct {
+	fr_file_writer_thread_t	*writer; //!< Queue to the writer thread.
+} rlm_detail_thread_t;
+
 int detail_group_parse(UNUSED TALLOC_CTX *ctx, void *out, void *parent,
 		       CONF_ITEM *ci, conf_parser_t const *rule);
 
@@ -81,6 +93,8 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("locking", rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET_SUBSECTION("async", 0, rlm_detail_t, async, fr_file_writer_config) },
+	{ FR_CONF_OFFSET("durable", rlm_detail_t, durable), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -180,6 +194,38 @@ static int8_t detail_cmp(void const *a, void const *b)
 	return CMP(a, b);
 }
 
+static int cmd_show_module_writer(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	rlm_detail_t		*inst = talloc_get_type_abort(ctx, rlm_detail_t);
+	fr_file_writer_stats_t	stats;
+
+	fr_file_writer_stats(&stats, inst->writer);
+
+	fprintf(fp, "queued\t%" PRIu64 "\n", stats.queued);
+	fprintf(fp, "pending\t%" PRIu64 "\n", stats.pending);
+	fprintf(fp, "written\t%" PRIu64 "\n", stats.written);
+	fprintf(fp, "failed\t%" PRIu64 "\n", stats.failed);
+	fprintf(fp, "bytes\t%" PRIu64 "\n", stats.bytes);
+	fprintf(fp, "batches\t%" PRIu64 "\n", stats.batches);
+	fprintf(fp, "fsyncs\t%" PRIu64 "\n", stats.fsyncs);
+	fprintf(fp, "dropped\t%" PRIu64 "\n", stats.dropped);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_detail_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "writer",
+		.func = cmd_show_module_writer,
+		.help = "Show statistics for the asynchronous file writer.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
 /*
  *	(Re-)read radiusd.conf into memory.
  */
@@ -204,6 +250,34 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	if (inst->durable && !inst->async.enable) {
+		cf_log_err(conf, "'durable' requires 'async.enable = yes'");
+		return -1;
+	}
+
+	if (inst->async.enable) {
+		if (inst->async.queue_size == 0) {
+			cf_log_err(conf, "'async.queue_size' must be greater than 0");
+			return -1;
+		}
+		if (inst->async.batch_size == 0) {
+			cf_log_err(conf, "'async.batch_size' must be greater than 0");
+			return -1;
+		}
+
+		inst->writer = fr_file_writer_alloc(inst, &inst->async, mctx->inst->name, inst->perm,
+						    inst->group_is_set ? inst->group : (gid_t) -1, inst->locking);
+		if (!inst->writer) {
+			cf_log_perr(conf, "Failed starting file writer");
+			return -1;
+		}
+
+		if (fr_command_register_hook(NULL, mctx->inst->name, inst, cmd_detail_table) < 0) {
+			PERROR("Failed registering radmin commands for module %s", mctx->inst->name);
+			return -1;
+		}
+	}
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -260,23 +334,63 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_detail_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_detail_t);
+	rlm_detail_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_detail_thread_t);
+
+	if (!inst->writer) return 0;
+
+	t->writer = fr_file_writer_thread_alloc(t, inst->writer, mctx->el);
+	if (!t->writer) {
+		PERROR("Failed registering with file writer");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_detail_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_detail_t);
+
+	TALLOC_FREE(inst->writer);
+
+	return 0;
+}
+
+/*
+ *	Print one attribute, in the same format as fr_pair_fprint().
+ */
+static int detail_pair_print(fr_sbuff_t *out, fr_pair_t const *vp)
+{
+	if ((fr_sbuff_in_char(out, '\t') <= 0) ||
+	    (fr_pair_print(out, NULL, vp) < 0) ||
+	    (fr_sbuff_in_char(out, '\n') <= 0)) return -1;
+
+	return 0;
+}
+
 /*
  *	Wrapper for VPs allocated on the stack.
  */
-static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, fr_pair_t const *stacked)
+static int detail_pair_print_stacked(TALLOC_CTX *ctx, fr_sbuff_t *out, fr_pair_t const *stacked)
 {
-	fr_pair_t *vp;
+	fr_pair_t	*vp;
+	int		ret;
 
 	vp = fr_pair_copy(ctx, stacked);
-	if (unlikely(vp == NULL)) return;
+	if (unlikely(vp == NULL)) return -1;
 
 	vp->op = T_OP_EQ;
-	fr_pair_fprint(out, vp);
+	ret = detail_pair_print(out, vp);
 	talloc_free(vp);
+
+	return ret;
 }
 
 
-/** Write a single detail entry to file pointer
+/** Write a single detail entry to a buffer
  *
  * @param[in] out Where to write entry.
  * @param[in] inst Instance of rlm_detail.
@@ -285,7 +399,7 @@ static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, fr_pair_t const *s
  * @param[in] list of pairs to write.
  * @param[in] compat Write out entry in compatibility mode.
  */
-static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
+static int detail_write(fr_sbuff_t *out, rlm_detail_t const *inst, request_t *request,
 			fr_radius_packet_t *packet, fr_pair_list_t *list, bool compat)
 {
 	char timestamp[256];
@@ -301,10 +415,7 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 	}
 
 #define WRITE(fmt, ...) do {\
-	if (fprintf(out, fmt, ## __VA_ARGS__) < 0) {\
-		RERROR("Failed writing to detail file: %s", fr_syserror(errno));\
-		return -1;\
-	}\
+	if (fr_sbuff_in_sprintf(out, fmt, ## __VA_ARGS__) < 0) goto error;\
 } while(0)
 
 	WRITE("%s\n", timestamp);
@@ -342,14 +453,14 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 		/*
 		 *	These pairs will exist, but Coverity doesn't know that
 		 */
-		if (src_vp) detail_fr_pair_fprint(request, out, src_vp);
-		if (dst_vp) detail_fr_pair_fprint(request, out, dst_vp);
+		if (src_vp && (detail_pair_print_stacked(request, out, src_vp) < 0)) goto error;
+		if (dst_vp && (detail_pair_print_stacked(request, out, dst_vp) < 0)) goto error;
 
 		src_vp = fr_pair_find_by_da_nested(&request->control_pairs, NULL, attr_net_src_port);
 		dst_vp = fr_pair_find_by_da_nested(&request->control_pairs, NULL, attr_net_dst_port);
 
-		if (src_vp) detail_fr_pair_fprint(request, out, src_vp);
-		if (dst_vp) detail_fr_pair_fprint(request, out, dst_vp);
+		if (src_vp && (detail_pair_print_stacked(request, out, src_vp) < 0)) goto error;
+		if (dst_vp && (detail_pair_print_stacked(request, out, dst_vp) < 0)) goto error;
 	}
 
 	/* Write each attribute/value to the log file */
@@ -374,7 +485,7 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 		 */
 		if (compat && (vp->da == attr_user_password)) continue;
 
-		fr_pair_fprint(out, vp);
+		if (detail_pair_print(out, vp) < 0) goto error;
 	}
 
 	/*
@@ -388,6 +499,58 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 	WRITE("\n");
 
 	return 0;
+
+error:
+	RERROR("Failed writing detail entry: Out of memory");
+	return -1;
+}
+
+static unlang_action_t detail_durable_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	fr_file_writer_entry_t	*entry = mctx->rctx;
+	int			error;
+
+	error = fr_file_writer_entry_error(entry);
+	fr_file_writer_entry_free(entry);
+
+	if (error) {
+		RERROR("Failed writing detail entry: %s", fr_syserror(error));
+		RETURN_MODULE_FAIL;
+	}
+
+	RETURN_MODULE_OK;
+}
+
+static void detail_durable_cancel(module_ctx_t const *mctx, UNUSED request_t *request, UNUSED fr_signal_t action)
+{
+	fr_file_writer_entry_cancel(mctx->rctx);
+}
+
+/*
+ *	Queue the entry for the writer thread.
+ */
+static unlang_action_t CC_HINT(nonnull) detail_do_async(rlm_rcode_t *p_result, rlm_detail_t const *inst,
+							rlm_detail_thread_t *t, request_t *request, char const *path,
+							fr_sbuff_t *entry_buff)
+{
+	fr_file_writer_entry_t	*entry = NULL;
+	ssize_t			slen;
+
+	if (fr_sbuff_used(entry_buff) == 0) RETURN_MODULE_OK;
+
+	slen = fr_file_writer_write(t->writer, inst->durable ? &entry : NULL, request, path, NULL, 0,
+				    &(struct iovec){ .iov_base = fr_sbuff_start(entry_buff),
+						     .iov_len = fr_sbuff_used(entry_buff) }, 1);
+	if (slen < 0) {
+		RPERROR("Failed queueing detail entry for %s", path);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (!entry) RETURN_MODULE_OK;
+
+	RDEBUG2("Waiting for detail entry to be written");
+
+	return unlang_module_yield(request, detail_durable_resume, detail_durable_cancel, ~FR_SIGNAL_CANCEL, entry);
 }
 
 /*
@@ -397,12 +560,14 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 						  fr_radius_packet_t *packet, fr_pair_list_t *list,
 						  bool compat)
 {
-	int		outfd, dupfd;
-	char		buffer[DIRLEN];
-
-	FILE		*outfp = NULL;
+	int			outfd;
+	char			buffer[DIRLEN];
+	fr_sbuff_t		entry_buff;
+	fr_sbuff_uctx_talloc_t	entry_tctx;
+	unlang_action_t		ua;
 
 	rlm_detail_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_detail_t);
+	rlm_detail_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_detail_thread_t);
 
 	/*
 	 *	Generate the path for the detail file.  Use the same
@@ -415,43 +580,51 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 
 	RDEBUG2("%s expands to %s", inst->filename, buffer);
 
+	/*
+	 *	Format the entry first, so it can be written
+	 *	with one call, or copied to the writer thread.
+	 */
+	if (!fr_sbuff_init_talloc(request, &entry_buff, &entry_tctx, 1024, SIZE_MAX)) {
+		RERROR("Failed allocating detail buffer");
+		RETURN_MODULE_FAIL;
+	}
+
+	if (detail_write(&entry_buff, inst, request, packet, list, compat) < 0) {
+	fail:
+		talloc_free(fr_sbuff_buff(&entry_buff));
+		RETURN_MODULE_FAIL;
+	}
+
+	if (t->writer) {
+		ua = detail_do_async(p_result, inst, t, request, buffer, &entry_buff);
+		talloc_free(fr_sbuff_buff(&entry_buff));
+		return ua;
+	}
+
 	outfd = exfile_open(inst->ef, buffer, inst->perm, NULL);
 	if (outfd < 0) {
 		RPERROR("Couldn't open file %s", buffer);
-		RETURN_MODULE_FAIL;
+		goto fail;
 	}
 
 	if (inst->group_is_set) {
 		if (chown(buffer, -1, inst->group) == -1) {
 			RERROR("Unable to set detail file group to '%s': %s", buffer, fr_syserror(errno));
+		close_fail:
+			exfile_close(inst->ef, outfd);
 			goto fail;
 		}
 	}
 
-	dupfd = dup(outfd);
-	if (dupfd < 0) {
-		RERROR("Failed to dup() file descriptor for detail file");
-		goto fail;
-	}
-
-	/*
-	 *	Open the output fp for buffering.
-	 */
-	if ((outfp = fdopen(dupfd, "a")) == NULL) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_syserror(errno));
-	fail:
-		if (outfp) fclose(outfp);
-		exfile_close(inst->ef, outfd);
-		RETURN_MODULE_FAIL;
+	if ((fr_sbuff_used(&entry_buff) > 0) &&
+	    (fr_writev(outfd, &(struct iovec){ .iov_base = fr_sbuff_start(&entry_buff),
+					       .iov_len = fr_sbuff_used(&entry_buff) }, 1, fr_time_delta_wrap(0)) < 0)) {
+		RERROR("Failed writing to detail file %s: %s", buffer, fr_syserror(errno));
+		goto close_fail;
 	}
 
-	if (detail_write(outfp, inst, request, packet, list, compat) < 0) goto fail;
-
-	/*
-	 *	Flush everything
-	 */
-	fclose(outfp);
 	exfile_close(inst->ef, outfd);
+	talloc_free(fr_sbuff_buff(&entry_buff));
 
 	/*
 	 *	And everything is fine.
@@ -492,7 +665,12 @@ module_rlm_t rlm_detail = {
 		.name		= "detail",
 		.inst_size	= sizeof(rlm_detail_t),
 		.config		= module_config,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_detail_thread_t),
+		.thread_inst_type	= "rlm_detail_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	},
 	.method_names = (module_method_name_t[]){
 		{ .name1 = "recv",		.name2 = "accounting-request",	.method = mod_accounting },
@@ -19,12 +19,24 @@
  * @file rlm_files.c
  * @brief Process simple 'users' policy files.
  *
+ * The files can be reloaded with the radmin command
+ * 'set module <name> reload'.  The replacement trees are built by the
+ * thread running the command, and swapped in under a short lock.  Each
+ * worker holds a reference to the trees it's using, and picks up the
+ * new ones the next time it's called, so lookups never wait for a
+ * reload.  The old trees are freed when the last worker has moved on.
+ * Expansions in reloaded files are ephemeral, and any functions they
+ * call are instantiated against the main event list, so the functions'
+ * thread instance data is shared by all the workers.
+ *
  * @copyright 2000,2006 The FreeRADIUS server project
  * @copyright 2000 Jeff Carneal (jeff@apex.net)
  */
 RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/main_loop.h>
+#include <freeradius-devel/server/module_reload.h>
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/server/pairmove.h>
 #include <freeradius-devel/server/users_file.h>
@@ -35,31 +47,45 @@ RCSID("$Id$")
 #include <ctype.h>
 #include <fcntl.h>
 
+/** The trees built from one read of the files
+ *
+ */
 typedef struct {
-	tmpl_t *key;
-	fr_type_t	key_data_type;
-
-	char const *common_filename;
 	fr_htrie_t *common_htrie;
 	PAIR_LIST_LIST *common_def;
 
-	char const *recv_filename;
 	fr_htrie_t *recv_htrie;
 	PAIR_LIST_LIST *recv_pl;
 
-	char const *auth_filename;
 	fr_htrie_t *auth_htrie;
 	PAIR_LIST_LIST *auth_pl;
 
-	char const *recv_acct_filename;
 	fr_htrie_t *recv_acct_users;
 	PAIR_LIST_LIST *recv_acct_pl;
 
-	char const *send_filename;
 	fr_htrie_t *send_htrie;
 	PAIR_LIST_LIST *send_pl;
+} rlm_files_data_t;
+
+typedef struct {
+	tmpl_t *key;
+	fr_type_t	key_data_type;
+
+	char const *common_filename;
+	char const *recv_filename;
+	char const *auth_filename;
+	char const *recv_acct_filename;
+	char const *send_filename;
+
+	module_reload_t		*reload;		//!< The current trees.  The trees read at startup
+							///< are kept until the module is detached, as their
+							///< xlats are in the global instance tree.
 } rlm_files_t;
 
+typedef struct {
+	module_reload_thread_t	reload;			//!< Trees this thread is using.
+} rlm_files_thread_t;
+
 typedef struct {
 	fr_value_box_t	key;
 } rlm_files_env_t;
@@ -115,7 +141,8 @@ static int pairlist_to_key(uint8_t **out, size_t *outlen, void const *a)
 	return fr_value_box_to_key(out, outlen, ((PAIR_LIST_LIST const *)a)->box);
 }
 
-static int getrecv_filename(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptree, PAIR_LIST_LIST **pdefault, fr_type_t data_type)
+static int getrecv_filename(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptree, PAIR_LIST_LIST **pdefault,
+			    fr_type_t data_type, fr_event_list_t *runtime_el)
 {
 	int rcode;
 	PAIR_LIST_LIST users;
@@ -133,7 +160,7 @@ static int getrecv_filename(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **
 	}
 
 	pairlist_list_init(&users);
-	rcode = pairlist_read(ctx, dict_radius, filename, &users);
+	rcode = pairlist_read(ctx, dict_radius, filename, &users, runtime_el);
 	if (rcode < 0) {
 		return -1;
 	}
@@ -407,8 +434,33 @@ static int getrecv_filename(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **
 
 
 
+/** Read the "users" files into a new set of trees
+ *
+ * Files read after startup are shared by all the workers, and may be
+ * freed by any of them, so expansions in them are parsed as ephemeral.
+ */
+static void *files_data_read(void *uctx, bool at_runtime)
+{
+	rlm_files_t const	*inst = talloc_get_type_abort_const(uctx, rlm_files_t);
+	rlm_files_data_t	*data;
+	fr_event_list_t		*runtime_el = at_runtime ? main_loop_event_list() : NULL;
+
+	MEM(data = talloc_zero(NULL, rlm_files_data_t));
+
+#undef READFILE
+#define READFILE(_x, _y, _d) if (getrecv_filename(data, inst->_x, &data->_y, &data->_d, inst->key_data_type, runtime_el) != 0) do { ERROR("Failed reading %s", inst->_x); talloc_free(data); return NULL;} while (0)
+
+	READFILE(common_filename, common_htrie, common_def);
+	READFILE(recv_filename, recv_htrie, recv_pl);
+	READFILE(recv_acct_filename, recv_acct_users, recv_acct_pl);
+	READFILE(auth_filename, auth_htrie, auth_pl);
+	READFILE(send_filename, send_htrie, send_pl);
+
+	return data;
+}
+
 /*
- *	(Re-)read the "users" file into memory.
+ *	Read the "users" file into memory.
  */
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
@@ -421,14 +473,37 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-#undef READFILE
-#define READFILE(_x, _y, _d) if (getrecv_filename(inst, inst->_x, &inst->_y, &inst->_d, inst->key_data_type) != 0) do { ERROR("Failed reading %s", inst->_x); return -1;} while (0)
+	inst->reload = module_reload_alloc(inst, mctx->inst->name, files_data_read, NULL, inst, true);
+	if (module_reload(inst->reload) < 0) return -1;
 
-	READFILE(common_filename, common_htrie, common_def);
-	READFILE(recv_filename, recv_htrie, recv_pl);
-	READFILE(recv_acct_filename, recv_acct_users, recv_acct_pl);
-	READFILE(auth_filename, auth_htrie, auth_pl);
-	READFILE(send_filename, send_htrie, send_pl);
+	return module_reload_register(inst->reload);
+}
+
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_files_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
+	rlm_files_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+
+	(void) module_reload_thread_data(inst->reload, &t->reload);
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_files_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
+	rlm_files_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+
+	module_reload_thread_detach(inst->reload, &t->reload);
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_files_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
+
+	TALLOC_FREE(inst->reload);
 
 	return 0;
 }
@@ -638,12 +713,14 @@ redo:
  */
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
+	rlm_files_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
 	rlm_files_env_t *env_data = talloc_get_type_abort(mctx->env_data, rlm_files_env_t);
+	rlm_files_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+	rlm_files_data_t const *data = module_reload_thread_data(inst->reload, &t->reload);
 
 	return file_common(p_result, inst, env_data, request,
-			   inst->recv_htrie ? inst->recv_htrie : inst->common_htrie,
-			   inst->recv_htrie ? inst->recv_pl : inst->common_def);
+			   data->recv_htrie ? data->recv_htrie : data->common_htrie,
+			   data->recv_htrie ? data->recv_pl : data->common_def);
 }
 
 
@@ -654,32 +731,38 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
  */
 static unlang_action_t CC_HINT(nonnull) mod_preacct(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
+	rlm_files_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
 	rlm_files_env_t *env_data = talloc_get_type_abort(mctx->env_data, rlm_files_env_t);
+	rlm_files_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+	rlm_files_data_t const *data = module_reload_thread_data(inst->reload, &t->reload);
 
 	return file_common(p_result, inst, env_data, request,
-			   inst->recv_acct_users ? inst->recv_acct_users : inst->common_htrie,
-			   inst->recv_acct_users ? inst->recv_acct_pl : inst->common_def);
+			   data->recv_acct_users ? data->recv_acct_users : data->common_htrie,
+			   data->recv_acct_users ? data->recv_acct_pl : data->common_def);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
+	rlm_files_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
 	rlm_files_env_t *env_data = talloc_get_type_abort(mctx->env_data, rlm_files_env_t);
+	rlm_files_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+	rlm_files_data_t const *data = module_reload_thread_data(inst->reload, &t->reload);
 
 	return file_common(p_result, inst, env_data, request,
-			   inst->auth_htrie ? inst->auth_htrie : inst->common_htrie,
-			   inst->auth_htrie ? inst->auth_pl : inst->common_def);
+			   data->auth_htrie ? data->auth_htrie : data->common_htrie,
+			   data->auth_htrie ? data->auth_pl : data->common_def);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_files_t);
+	rlm_files_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_files_t);
 	rlm_files_env_t *env_data = talloc_get_type_abort(mctx->env_data, rlm_files_env_t);
+	rlm_files_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+	rlm_files_data_t const *data = module_reload_thread_data(inst->reload, &t->reload);
 
 	return file_common(p_result, inst, env_data, request,
-			   inst->send_htrie ? inst->send_htrie : inst->common_htrie,
-			   inst->send_htrie ? inst->send_pl : inst->common_def);
+			   data->send_htrie ? data->send_htrie : data->common_htrie,
+			   data->send_htrie ? data->send_pl : data->common_def);
 }
 
 /*
@@ -706,7 +789,13 @@ module_rlm_t rlm_files = {
 		.name		= "files",
 		.inst_size	= sizeof(rlm_files_t),
 		.config		= module_config,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_files_thread_t),
+		.thread_inst_type	= "rlm_files_thread_t",
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
 	},
 	.method_names = (module_method_name_t[]){
 		{ .name1 = "recv",		.name2 = "accounting-request",	.method = mod_preacct,
@@ -19,18 +19,399 @@
  * @file rlm_kafka.c
  * @brief Kafka producer module
  *
+ * Each worker thread has its own producer.  librdkafka batches messages
+ * in its own threads, and signals the worker's event loop via a pipe
+ * when delivery reports are ready to be served.
+ *
  * @copyright 2022 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
  */
 RCSID("$Id$")
 USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/unlang/call_env.h>
 #include <freeradius-devel/kafka/base.h>
 
+#include <librdkafka/rdkafka_mock.h>
+
+/** Mock cluster configuration
+ *
+ * Used by the module tests, so produce and delivery can be tested
+ * without a real Kafka cluster.
+ */
+typedef struct {
+	uint32_t		brokers;		//!< Number of brokers in the in-process mock cluster.
+							///< 0 produces to the configured servers.
+	char const		**denied_topic;		//!< Topics the mock cluster refuses messages for.
+} rlm_kafka_mock_t;
+
+/** rlm_kafka module instance
+ *
+ */
 typedef struct {
-	char const *foo;
+	bool			wait;			//!< Yield until the message has been delivered
+							///< (or delivery has failed).
+
+	fr_time_delta_t		flush_timeout;		//!< How long we wait for outstanding messages
+							///< to be delivered when a thread exits.
+
+	rlm_kafka_mock_t	mock;			//!< Mock cluster, for testing.
 } rlm_kafka_t;
 
+/** rlm_kafka thread instance
+ *
+ */
+typedef struct {
+	rd_kafka_t		*rk;			//!< This thread's producer.
+	rd_kafka_queue_t	*queue;			//!< Main queue, delivery reports are served from here.
+
+	fr_event_list_t		*el;			//!< Event list the pipe is registered with.
+	int			fd[2];			//!< librdkafka writes to fd[1] when the queue
+							///< becomes non-empty.
+
+	rd_kafka_topic_t	**topics;		//!< Handles for configured topics.  Keeps the topic
+							///< configuration alive for the producer.
+} rlm_kafka_thread_t;
+
+/** Tracks a message we're waiting on a delivery report for
+ *
+ * Allocated in the thread ctx, as the delivery report may arrive after
+ * the request has been cancelled.
+ */
+typedef struct {
+	request_t		*request;		//!< Request to resume.  NULL if the request was cancelled.
+	rd_kafka_resp_err_t	err;			//!< Result of the delivery.
+} rlm_kafka_msg_ctx_t;
+
+/** Call environment for producing messages
+ *
+ */
+typedef struct {
+	fr_value_box_t		topic;			//!< Topic to produce the message to.
+	fr_value_box_t		key;			//!< Message key, used for partitioning.
+	fr_value_box_t		value;			//!< Message payload.
+} rlm_kafka_env_t;
+
+static conf_parser_t const mock_config[] = {
+	{ FR_CONF_OFFSET("brokers", rlm_kafka_mock_t, brokers), .dflt = "0" },
+	{ FR_CONF_OFFSET_FLAGS("denied_topic", CONF_FLAG_MULTI, rlm_kafka_mock_t, denied_topic) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static conf_parser_t const module_config[] = {
+	{ FR_CONF_SUBSECTION_GLOBAL("producer", CONF_FLAG_REQUIRED, kafka_base_producer_config) },
+
+	{ FR_CONF_OFFSET("wait", rlm_kafka_t, wait), .dflt = "no" },
+	{ FR_CONF_OFFSET("flush_timeout", rlm_kafka_t, flush_timeout), .dflt = "5" },
+
+	{ FR_CONF_OFFSET_SUBSECTION("mock", 0, rlm_kafka_t, mock, mock_config) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static const call_env_method_t rlm_kafka_method_env = {
+	FR_CALL_ENV_METHOD_OUT(rlm_kafka_env_t),
+	.env = (call_env_parser_t[]) {
+		{ FR_CALL_ENV_OFFSET("topic", FR_TYPE_STRING, CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_CONCAT, rlm_kafka_env_t, topic) },
+		{ FR_CALL_ENV_OFFSET("key", FR_TYPE_STRING, CALL_ENV_FLAG_NULLABLE | CALL_ENV_FLAG_CONCAT, rlm_kafka_env_t, key),
+				     .pair.dflt = "", .pair.dflt_quote = T_SINGLE_QUOTED_STRING },
+		{ FR_CALL_ENV_OFFSET("value", FR_TYPE_STRING, CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_CONCAT, rlm_kafka_env_t, value) },
+		CALL_ENV_TERMINATOR
+	}
+};
+
+/** Called by librdkafka (from rd_kafka_poll) for every message it has finished with
+ *
+ */
+static void kafka_delivery_report(UNUSED rd_kafka_t *rk, rd_kafka_message_t const *msg, UNUSED void *uctx)
+{
+	rlm_kafka_msg_ctx_t	*msg_ctx = msg->_private;
+
+	if (!msg_ctx) {
+		if (msg->err) ERROR("Failed delivering message to \"%s\" - %s",
+				    rd_kafka_topic_name(msg->rkt), rd_kafka_err2str(msg->err));
+		return;
+	}
+
+	/*
+	 *	Request was cancelled while we were waiting
+	 */
+	if (!msg_ctx->request) {
+		talloc_free(msg_ctx);
+		return;
+	}
+
+	msg_ctx->err = msg->err;
+	unlang_interpret_mark_runnable(msg_ctx->request);
+}
+
+/** Serve delivery reports when librdkafka signals there are events on the main queue
+ *
+ */
+static void kafka_queue_readable(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_kafka_thread_t	*t = talloc_get_type_abort(uctx, rlm_kafka_thread_t);
+	uint8_t			buff[64];
+
+	while (read(fd, buff, sizeof(buff)) > 0);
+
+	rd_kafka_poll(t->rk, 0);
+}
+
+static unlang_action_t mod_produce_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_kafka_msg_ctx_t	*msg = talloc_get_type_abort(mctx->rctx, rlm_kafka_msg_ctx_t);
+	rd_kafka_resp_err_t	err = msg->err;
+
+	talloc_free(msg);
+
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		REDEBUG("Message delivery failed - %s", rd_kafka_err2str(err));
+		RETURN_MODULE_FAIL;
+	}
+
+	RDEBUG2("Message delivered");
+	RETURN_MODULE_OK;
+}
+
+static void mod_produce_signal(module_ctx_t const *mctx, request_t *request, UNUSED fr_signal_t action)
+{
+	rlm_kafka_msg_ctx_t	*msg = talloc_get_type_abort(mctx->rctx, rlm_kafka_msg_ctx_t);
+
+	RDEBUG2("Request cancelled, delivery report will be ignored");
+
+	/*
+	 *	librdkafka still holds a pointer to the msg ctx,
+	 *	it's freed when the delivery report arrives.
+	 */
+	msg->request = NULL;
+}
+
+/** Produce a message
+ *
+ * If the module isn't configured to wait, this returns as soon as the message
+ * has been added to the producer's queue.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_produce(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_kafka_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_kafka_t);
+	rlm_kafka_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_kafka_thread_t);
+	rlm_kafka_env_t		*env = talloc_get_type_abort(mctx->env_data, rlm_kafka_env_t);
+	rlm_kafka_msg_ctx_t	*msg = NULL;
+	rd_kafka_resp_err_t	err;
+	int			tries = 0;
+
+	if (inst->wait) {
+		MEM(msg = talloc_zero(t, rlm_kafka_msg_ctx_t));
+		msg->request = request;
+	}
+
+again:
+	err = rd_kafka_producev(t->rk,
+				RD_KAFKA_V_TOPIC(env->topic.vb_strvalue),
+				RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
+				RD_KAFKA_V_KEY(env->key.vb_length ? env->key.vb_strvalue : NULL, env->key.vb_length),
+				RD_KAFKA_V_VALUE(UNCONST(char *, env->value.vb_strvalue), env->value.vb_length),
+				RD_KAFKA_V_OPAQUE(msg),
+				RD_KAFKA_V_END);
+	switch (err) {
+	case RD_KAFKA_RESP_ERR_NO_ERROR:
+		break;
+
+	/*
+	 *	Serve any outstanding delivery reports, which
+	 *	may free up space in the queue, and try once more.
+	 */
+	case RD_KAFKA_RESP_ERR__QUEUE_FULL:
+		if (tries++ == 0) {
+			rd_kafka_poll(t->rk, 0);
+			goto again;
+		}
+		FALL_THROUGH;
+
+	default:
+		REDEBUG("Failed producing message to \"%pV\" - %s", &env->topic, rd_kafka_err2str(err));
+		talloc_free(msg);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (!msg) {
+		RDEBUG2("Message queued for \"%pV\"", &env->topic);
+		RETURN_MODULE_OK;
+	}
+
+	RDEBUG2("Message queued for \"%pV\", waiting for delivery", &env->topic);
+
+	return unlang_module_yield(request, mod_produce_resume, mod_produce_signal, ~FR_SIGNAL_CANCEL, msg);
+}
+
+/** Create the topics the mock cluster refuses messages for
+ *
+ * The mock cluster reports the topics as not authorized, which is a
+ * permanent error, so the producer fails the messages with a delivery
+ * report instead of retrying them.
+ */
+static int kafka_mock_init(rlm_kafka_mock_t const *mock, rd_kafka_t *rk)
+{
+	rd_kafka_mock_cluster_t	*mcluster;
+	size_t			i;
+
+	mcluster = rd_kafka_handle_mock_cluster(rk);
+	if (!mcluster) {
+		ERROR("Failed creating mock cluster");
+		return -1;
+	}
+
+	for (i = 0; i < talloc_array_length(mock->denied_topic); i++) {
+		rd_kafka_resp_err_t err;
+
+		err = rd_kafka_mock_topic_create(mcluster, mock->denied_topic[i], 1, 1);
+		if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			ERROR("Failed creating mock topic \"%s\" - %s", mock->denied_topic[i], rd_kafka_err2str(err));
+			return -1;
+		}
+		rd_kafka_mock_topic_set_error(mcluster, mock->denied_topic[i],
+					      RD_KAFKA_RESP_ERR_TOPIC_AUTHORIZATION_FAILED);
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_kafka_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_kafka_t);
+	rlm_kafka_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_kafka_thread_t);
+	CONF_SECTION		*producer = cf_section_find(mctx->inst->conf, "producer", NULL);
+	CONF_SECTION		*topics, *topic_cs = NULL;
+	rd_kafka_conf_t		*conf;
+	char			errstr[512];
+	size_t			i = 0;
+
+	fr_assert(producer);
+
+	t->fd[0] = t->fd[1] = -1;
+	t->el = mctx->el;
+
+	conf = fr_kafka_conf_dup(producer);
+	if (!conf) {
+		PERROR("Failed creating producer");
+		return -1;
+	}
+	rd_kafka_conf_set_dr_msg_cb(conf, kafka_delivery_report);
+	rd_kafka_conf_set_opaque(conf, t);
+
+	/*
+	 *	librdkafka creates the mock cluster when the
+	 *	producer is created, and ignores the configured
+	 *	servers.
+	 */
+	if (inst->mock.brokers) {
+		char buff[16];
+
+		snprintf(buff, sizeof(buff), "%u", inst->mock.brokers);
+		if (rd_kafka_conf_set(conf, "test.mock.num.brokers", buff, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+			rd_kafka_conf_destroy(conf);
+			ERROR("Failed enabling mock cluster - %s", errstr);
+			return -1;
+		}
+	}
+
+	/*
+	 *	rd_kafka_new takes ownership of conf, but only on success.
+	 */
+	t->rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+	if (!t->rk) {
+		rd_kafka_conf_destroy(conf);
+		ERROR("Failed creating producer - %s", errstr);
+		return -1;
+	}
+
+	if (inst->mock.brokers && (kafka_mock_init(&inst->mock, t->rk) < 0)) return -1;
+
+	/*
+	 *	Create handles for configured topics so their
+	 *	configuration is used when messages are produced
+	 *	by topic name.
+	 */
+	topics = cf_section_find(producer, "topic", NULL);
+	if (topics) {
+		while ((topic_cs = cf_section_next(topics, topic_cs))) i++;
+
+		MEM(t->topics = talloc_zero_array(t, rd_kafka_topic_t *, i + 1));
+		i = 0;
+		while ((topic_cs = cf_section_next(topics, topic_cs))) {
+			rd_kafka_topic_conf_t *tconf = fr_kafka_topic_conf_dup(topic_cs);
+
+			t->topics[i] = rd_kafka_topic_new(t->rk, cf_section_name1(topic_cs), tconf);
+			if (!t->topics[i]) {
+				rd_kafka_topic_conf_destroy(tconf);
+				ERROR("Failed creating topic \"%s\" - %s", cf_section_name1(topic_cs),
+				      rd_kafka_err2str(rd_kafka_last_error()));
+				return -1;
+			}
+			i++;
+		}
+	}
+
+	/*
+	 *	Have librdkafka wake up the event loop when
+	 *	there are delivery reports to serve, instead
+	 *	of polling on a timer.
+	 */
+	if (pipe(t->fd) < 0) {
+		ERROR("Failed creating pipe - %s", fr_syserror(errno));
+		return -1;
+	}
+	if ((fr_nonblock(t->fd[0]) < 0) || (fr_nonblock(t->fd[1]) < 0)) {
+		PERROR("Failed setting pipe to non-blocking");
+		return -1;
+	}
+
+	t->queue = rd_kafka_queue_get_main(t->rk);
+	rd_kafka_queue_io_event_enable(t->queue, t->fd[1], "1", 1);
+
+	if (fr_event_fd_insert(t, mctx->el, t->fd[0], kafka_queue_readable, NULL, NULL, t) < 0) {
+		PERROR("Failed registering pipe with event loop");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Flush outstanding messages and destroy the producer
+ *
+ */
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_kafka_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_kafka_t);
+	rlm_kafka_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_kafka_thread_t);
+
+	if (t->fd[0] >= 0) fr_event_fd_delete(t->el, t->fd[0], FR_EVENT_FILTER_IO);
+
+	if (t->rk) {
+		size_t i;
+
+		if (t->queue) {
+			rd_kafka_queue_io_event_enable(t->queue, -1, NULL, 0);
+			rd_kafka_queue_destroy(t->queue);
+		}
+
+		if (rd_kafka_flush(t->rk, fr_time_delta_to_msec(inst->flush_timeout)) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			WARN("%d message(s) were not delivered before flush_timeout", rd_kafka_outq_len(t->rk));
+		}
+
+		for (i = 0; t->topics && t->topics[i]; i++) rd_kafka_topic_destroy(t->topics[i]);
+		rd_kafka_destroy(t->rk);
+	}
+
+	if (t->fd[0] >= 0) close(t->fd[0]);
+	if (t->fd[1] >= 0) close(t->fd[1]);
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -43,9 +424,18 @@ typedef struct {
 extern module_rlm_t rlm_kafka;
 module_rlm_t rlm_kafka = {
 	.common = {
-		.magic		= MODULE_MAGIC_INIT,
-		.name		= "kafka",
-		.inst_size	= sizeof(rlm_kafka_t),
-		.config		= kafka_base_producer_config,
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "kafka",
+		.flags			= MODULE_TYPE_THREAD_SAFE,
+		.inst_size		= sizeof(rlm_kafka_t),
+		.config			= module_config,
+
+		.thread_inst_size	= sizeof(rlm_kafka_thread_t),
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
+	},
+	.method_names = (module_method_name_t[]){
+		{ .name1 = CF_IDENT_ANY, .name2 = CF_IDENT_ANY, .method = mod_produce, .method_env = &rlm_kafka_method_env },
+		MODULE_NAME_TERMINATOR
 	}
 };
@@ -30,12 +30,267 @@ USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/util/debug.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #define LOG_PREFIX "rlm_ldap groups"
 
 #include "rlm_ldap.h"
 
-static char const *null_attrs[] = { NULL };
+/** What a group cache entry maps from and to
+ *
+ */
+typedef enum {
+	LDAP_GROUP_CACHE_DN2NAME = 0,				//!< Group DN to group name.
+	LDAP_GROUP_CACHE_NAME2DN,				//!< Group name to group DN.
+	LDAP_GROUP_CACHE_GROUPOBJ				//!< Group object search to the resulting memberships.
+} ldap_group_cache_type_t;
+
+/** An entry in the group cache
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;				//!< Entry in the tree of cached mappings.
+	fr_dlist_t		entry;				//!< Entry in the LRU list.
+
+	ldap_group_cache_type_t	type;				//!< What the key and values are.
+	char const		*key;				//!< Group DN, group name, or for group object
+								///< searches, the base DN and filter.
+	size_t			base_len;			//!< For group object searches, the length of
+								///< the base DN at the start of the key.
+	char const		**values;			//!< What the key maps to.
+
+	fr_time_t		expires;			//!< When this entry should no longer be used.
+	size_t			size;				//!< Memory used by this entry.
+} ldap_group_cache_entry_t;
+
+/** Group membership and group name/DN cache, shared by all threads
+ *
+ */
+struct rlm_ldap_group_cache_s {
+	pthread_mutex_t		mutex;				//!< Protects the tree and the LRU list.
+	fr_rb_tree_t		*tree;				//!< Cached mappings.
+	fr_dlist_head_t		lru;				//!< Most recently used at the head.
+
+	size_t			size;				//!< Memory used by all entries.
+	size_t			max_size;			//!< Evict entries once we reach this size.
+	fr_time_delta_t		lifetime;			//!< How long entries are used for.
+};
+
+static int8_t ldap_group_cache_cmp(void const *one, void const *two)
+{
+	ldap_group_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->type, b->type);
+	if (ret != 0) return ret;
+
+	ret = strcmp(a->key, b->key);
+	return CMP(ret, 0);
+}
+
+static int _ldap_group_cache_free(rlm_ldap_group_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+	return 0;
+}
+
+/** Allocate a group cache
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_size		Approximate maximum memory to use for cache entries.
+ * @param[in] lifetime		How long entries are used for.
+ * @return A new group cache.
+ */
+rlm_ldap_group_cache_t *rlm_ldap_group_cache_alloc(TALLOC_CTX *ctx, size_t max_size, fr_time_delta_t lifetime)
+{
+	rlm_ldap_group_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, rlm_ldap_group_cache_t));
+	MEM(cache->tree = fr_rb_inline_talloc_alloc(cache, ldap_group_cache_entry_t, node,
+						    ldap_group_cache_cmp, NULL));
+	fr_dlist_talloc_init(&cache->lru, ldap_group_cache_entry_t, entry);
+	cache->max_size = max_size;
+	cache->lifetime = lifetime;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _ldap_group_cache_free);
+
+	return cache;
+}
+
+/** Remove an entry from the group cache
+ *
+ * @note Must be called with the cache mutex held.
+ */
+static void ldap_group_cache_entry_remove(rlm_ldap_group_cache_t *cache, ldap_group_cache_entry_t *entry)
+{
+	fr_rb_remove(cache->tree, entry);
+	fr_dlist_remove(&cache->lru, entry);
+	cache->size -= entry->size;
+	talloc_free(entry);
+}
+
+/** Find an unexpired group cache entry
+ *
+ * @param[in] ctx	to allocate the copy of the values in.
+ * @param[out] out	A talloced array of values.  Empty if the key is
+ *			cached as mapping to nothing.
+ * @param[in] cache	to search.
+ * @param[in] type	of mapping.
+ * @param[in] key	to search for.
+ * @return
+ *	- true if an entry was found.
+ *	- false if no entry was found.
+ */
+static bool ldap_group_cache_find(TALLOC_CTX *ctx, char const ***out, rlm_ldap_group_cache_t *cache,
+				  ldap_group_cache_type_t type, char const *key)
+{
+	ldap_group_cache_entry_t	*found;
+	char const			**values;
+	size_t				i, num;
+
+	if (!cache) return false;
+
+	pthread_mutex_lock(&cache->mutex);
+	found = fr_rb_find(cache->tree, &(ldap_group_cache_entry_t){ .type = type, .key = key });
+	if (!found) {
+	miss:
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+
+	if (fr_time_lteq(found->expires, fr_time())) {
+		ldap_group_cache_entry_remove(cache, found);
+		goto miss;
+	}
+
+	fr_dlist_remove(&cache->lru, found);
+	fr_dlist_insert_head(&cache->lru, found);
+
+	num = talloc_array_length(found->values);
+	MEM(values = talloc_array(ctx, char const *, num));
+	for (i = 0; i < num; i++) MEM(values[i] = talloc_strdup(values, found->values[i]));
+	pthread_mutex_unlock(&cache->mutex);
+
+	*out = values;
+
+	return true;
+}
+
+/** Add or replace a group cache entry
+ *
+ * @param[in] cache	to insert into.
+ * @param[in] type	of mapping.
+ * @param[in] key	to insert.
+ * @param[in] base_len	For group object searches, the length of the base DN
+ *			at the start of the key.  0 otherwise.
+ * @param[in] values	the key maps to.
+ * @param[in] num	Number of values.
+ */
+static void ldap_group_cache_insert(rlm_ldap_group_cache_t *cache, ldap_group_cache_type_t type, char const *key,
+				    size_t base_len, char const * const *values, size_t num)
+{
+	ldap_group_cache_entry_t	*entry, *old;
+	size_t				i;
+
+	if (!cache) return;
+
+	/*
+	 *	Build the entry before taking the lock
+	 */
+	MEM(entry = talloc_zero(NULL, ldap_group_cache_entry_t));
+	entry->type = type;
+	MEM(entry->key = talloc_strdup(entry, key));
+	entry->base_len = base_len;
+	MEM(entry->values = talloc_array(entry, char const *, num));
+	for (i = 0; i < num; i++) MEM(entry->values[i] = talloc_strdup(entry->values, values[i]));
+	entry->expires = fr_time_add(fr_time(), cache->lifetime);
+	entry->size = talloc_total_size(entry);
+
+	if (entry->size > cache->max_size) {
+		talloc_free(entry);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	talloc_steal(cache, entry);
+
+	old = fr_rb_find(cache->tree, entry);
+	if (old) ldap_group_cache_entry_remove(cache, old);
+
+	while ((cache->size + entry->size) > cache->max_size) {
+		old = fr_dlist_tail(&cache->lru);
+		if (!old) break;
+		ldap_group_cache_entry_remove(cache, old);
+	}
+
+	fr_rb_insert(cache->tree, entry);
+	fr_dlist_insert_head(&cache->lru, entry);
+	cache->size += entry->size;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Check whether a DN is, or is below, a search base
+ *
+ */
+static bool ldap_group_cache_dn_in_base(char const *dn, char const *base, size_t base_len)
+{
+	size_t dn_len = strlen(dn);
+
+	if (base_len == 0) return true;			/* Root DSE */
+	if (dn_len < base_len) return false;
+	if (strncasecmp(dn + (dn_len - base_len), base, base_len) != 0) return false;
+
+	return (dn_len == base_len) || (dn[dn_len - base_len - 1] == ',');
+}
+
+/** Remove group cache entries which reference a DN
+ *
+ * Used when a directory change notification is received.  Any entry
+ * whose key or values contain the DN is removed, which covers renamed
+ * and deleted groups, and users whose memberships changed.
+ *
+ * Group object search results are also removed if the DN is within
+ * the base DN of the search.  A change to any group object there may
+ * add or remove members, and the results don't record the groups a
+ * user isn't a member of.
+ *
+ * @param[in] cache	to remove entries from.
+ * @param[in] dn	to remove entries for.  If NULL, all entries are removed.
+ * @return The number of entries removed.
+ */
+uint32_t rlm_ldap_group_cache_expire(rlm_ldap_group_cache_t *cache, char const *dn)
+{
+	ldap_group_cache_entry_t	*entry, *next;
+	uint32_t			removed = 0;
+	size_t				i, num;
+
+	if (!cache) return 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	for (entry = fr_dlist_head(&cache->lru); entry; entry = next) {
+		next = fr_dlist_next(&cache->lru, entry);
+
+		if (!dn) goto remove;
+
+		if (strcasestr(entry->key, dn)) goto remove;
+
+		if ((entry->type == LDAP_GROUP_CACHE_GROUPOBJ) &&
+		    ldap_group_cache_dn_in_base(dn, entry->key, entry->base_len)) goto remove;
+
+		num = talloc_array_length(entry->values);
+		for (i = 0; i < num; i++) if (strcasecmp(entry->values[i], dn) == 0) goto remove;
+
+		continue;
+
+	remove:
+		ldap_group_cache_entry_remove(cache, entry);
+		removed++;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return removed;
+}
 
 /** Context to use when resolving group membership from the user object.
  *
@@ -65,6 +320,8 @@ typedef struct {
 	char const		*attrs[2];				//!< For retrieving the group name.
 	fr_ldap_query_t		*query;					//!< Current query performing group lookup.
 	void			*uctx;					//!< Optional context for use in results parsing.
+	char const		*cache_key;				//!< Key for the shared group cache.
+	char const		**cache_values;				//!< Memberships to add to the shared group cache.
 } ldap_group_groupobj_ctx_t;
 
 /** Context to use when evaluating group membership from the user object in an xlat
@@ -146,9 +403,13 @@ static unlang_action_t ldap_group_name2dn_start(rlm_rcode_t *p_result, UNUSED in
 					       inst->groupobj_filter ? ")" : "",
 					       group_ctx->group_name[0] && group_ctx->group_name[1] ? ")" : "");
 
+	/*
+	 *	Retrieve the group names too, so the mappings
+	 *	can be added to the shared group cache.
+	 */
 	return fr_ldap_trunk_search(group_ctx, &group_ctx->query, request, group_ctx->ttrunk,
 				    group_ctx->base_dn->vb_strvalue, inst->groupobj_scope, filter,
-				    null_attrs, NULL, NULL);
+				    group_ctx->attrs, NULL, NULL);
 }
 
 /** Process the results of looking up group DNs from names
@@ -223,6 +484,22 @@ static unlang_action_t ldap_group_name2dn_resume(rlm_rcode_t *p_result, UNUSED i
 		MEM(vp = fr_pair_afrom_da(group_ctx->list_ctx, inst->cache_da));
 		fr_pair_value_bstrndup(vp, dn, strlen(dn), true);
 		fr_pair_append(&group_ctx->groups, vp);
+
+		if (inst->group_cache) {
+			struct berval	**values;
+
+			values = ldap_get_values_len(query->ldap_conn->handle, entry, inst->groupobj_name_attr);
+			if (values) {
+				char *name = fr_ldap_berval_to_string(group_ctx, values[0]);
+
+				ldap_group_cache_insert(inst->group_cache, LDAP_GROUP_CACHE_NAME2DN,
+							name, 0, (char const *[]){ vp->vp_strvalue }, 1);
+				ldap_group_cache_insert(inst->group_cache, LDAP_GROUP_CACHE_DN2NAME,
+							vp->vp_strvalue, 0, (char const *[]){ name }, 1);
+				talloc_free(name);
+				ldap_value_free_len(values);
+			}
+		}
 		ldap_memfree(dn);
 	} while((entry = ldap_next_entry(query->ldap_conn->handle, entry)));
 
@@ -323,6 +600,9 @@ static unlang_action_t ldap_group_dn2name_resume(rlm_rcode_t *p_result, UNUSED i
 	fr_pair_append(&group_ctx->groups, vp);
 	RDEBUG2("Group DN \"%s\" resolves to name \"%pV\"", *group_ctx->dn, &vp->data);
 
+	ldap_group_cache_insert(inst->group_cache, LDAP_GROUP_CACHE_DN2NAME,
+				*group_ctx->dn, 0, (char const *[]){ vp->vp_strvalue }, 1);
+
 finish:
 	/*
 	 *	Walk the pointer to the DN being resolved forward
@@ -428,6 +708,38 @@ static unlang_action_t ldap_cacheable_userobj_resolve(rlm_rcode_t *p_result, UNU
 	return ldap_cacheable_userobj_store(p_result, request, group_ctx);
 }
 
+/** Add group memberships from the shared group cache
+ *
+ * @param[in] request		Current request.
+ * @param[in] group_ctx		Context to add the memberships to.
+ * @param[in] type		Whether key is a group DN or a group name.
+ * @param[in] key		Group DN or group name to resolve.
+ * @return
+ *	- true if the key was resolved from the cache.
+ *	- false if the key needs resolving with an LDAP search.
+ */
+static bool ldap_group_cache_pair_add(request_t *request, ldap_group_userobj_ctx_t *group_ctx,
+				      ldap_group_cache_type_t type, char const *key)
+{
+	char const	**values;
+	fr_pair_t	*vp;
+	size_t		i, num;
+
+	if (!ldap_group_cache_find(group_ctx, &values, group_ctx->inst->group_cache, type, key)) return false;
+
+	num = talloc_array_length(values);
+	for (i = 0; i < num; i++) {
+		MEM(vp = fr_pair_afrom_da(group_ctx->list_ctx, group_ctx->inst->cache_da));
+		fr_pair_value_strdup(vp, values[i], true);
+		fr_pair_append(&group_ctx->groups, vp);
+		RDEBUG2("Group %s \"%s\" resolves to \"%s\" (cached)",
+			type == LDAP_GROUP_CACHE_DN2NAME ? "DN" : "name", key, values[i]);
+	}
+	talloc_free(values);
+
+	return true;
+}
+
 /** Convert group membership information into attributes
  *
  * This may just be able to parse attribute values in the user object
@@ -506,14 +818,20 @@ unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, request_t *req
 			 *	this to a DN. Store all the group names in an array so we can do one query.
 			 */
 			} else {
-				if (++name2dn > LDAP_MAX_CACHEABLE) {
-					REDEBUG("Too many groups require name to DN resolution");
-				invalid:
-					ldap_value_free_len(values);
-					talloc_free(group_ctx);
-					RETURN_MODULE_INVALID;
+				char *name = fr_ldap_berval_to_string(group_ctx, values[i]);
+
+				if (ldap_group_cache_pair_add(request, group_ctx, LDAP_GROUP_CACHE_NAME2DN, name)) {
+					talloc_free(name);
+				} else {
+					if (++name2dn > LDAP_MAX_CACHEABLE) {
+						REDEBUG("Too many groups require name to DN resolution");
+					invalid:
+						ldap_value_free_len(values);
+						talloc_free(group_ctx);
+						RETURN_MODULE_INVALID;
+					}
+					*name_p++ = name;
 				}
-				*name_p++ = fr_ldap_berval_to_string(group_ctx, values[i]);
 			}
 		}
 
@@ -530,11 +848,17 @@ unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, request_t *req
 			 *	this to a name.  Store group DNs which need resolving to names.
 			 */
 			} else {
-				if (++dn2name > LDAP_MAX_CACHEABLE) {
-					REDEBUG("Too many groups require DN to name resolution");
-					goto invalid;
+				char *dn = fr_ldap_berval_to_string(group_ctx, values[i]);
+
+				if (ldap_group_cache_pair_add(request, group_ctx, LDAP_GROUP_CACHE_DN2NAME, dn)) {
+					talloc_free(dn);
+				} else {
+					if (++dn2name > LDAP_MAX_CACHEABLE) {
+						REDEBUG("Too many groups require DN to name resolution");
+						goto invalid;
+					}
+					*dn_p++ = dn;
 				}
-				*dn_p++ = fr_ldap_berval_to_string(group_ctx, values[i]);
 			}
 		}
 	}
@@ -598,6 +922,17 @@ static void ldap_group_groupobj_cancel(UNUSED request_t *request, UNUSED fr_sign
 	fr_trunk_request_signal_cancel(group_ctx->query->treq);
 }
 
+/** Record a membership to add to the shared group cache
+ *
+ */
+static inline void ldap_group_cache_value_add(ldap_group_groupobj_ctx_t *group_ctx, char const *value)
+{
+	size_t num = talloc_array_length(group_ctx->cache_values);
+
+	MEM(group_ctx->cache_values = talloc_realloc(group_ctx, group_ctx->cache_values, char const *, num + 1));
+	MEM(group_ctx->cache_values[num] = talloc_strdup(group_ctx->cache_values, value));
+}
+
 /** Process the results of a group object lookup.
  *
  * @param[out] p_result		Result of processing group lookup.
@@ -617,6 +952,7 @@ static unlang_action_t ldap_cacheable_groupobj_resume(rlm_rcode_t *p_result, UNU
 	int				ldap_errno;
 	char				*dn;
 	fr_pair_t			*vp;
+	bool				complete = false;
 
 	switch (query->ret) {
 	case LDAP_SUCCESS:
@@ -626,6 +962,7 @@ static unlang_action_t ldap_cacheable_groupobj_resume(rlm_rcode_t *p_result, UNU
 	case LDAP_RESULT_BAD_DN:
 		RDEBUG2("No cacheable group memberships found in group objects");
 		rcode = RLM_MODULE_NOTFOUND;
+		complete = true;
 		goto finish;
 
 	default:
@@ -660,6 +997,8 @@ static unlang_action_t ldap_cacheable_groupobj_resume(rlm_rcode_t *p_result, UNU
 			RDEBUG2("&control.%pP", vp);
 			REXDENT();
 			ldap_memfree(dn);
+
+			if (group_ctx->cache_key) ldap_group_cache_value_add(group_ctx, vp->vp_strvalue);
 		}
 
 		if (inst->cacheable_group_name) {
@@ -676,10 +1015,21 @@ static unlang_action_t ldap_cacheable_groupobj_resume(rlm_rcode_t *p_result, UNU
 			REXDENT();
 
 			ldap_value_free_len(values);
+
+			if (group_ctx->cache_key) ldap_group_cache_value_add(group_ctx, vp->vp_strvalue);
 		}
 	} while ((entry = ldap_next_entry(query->ldap_conn->handle, entry)));
+	complete = true;
 
 finish:
+	/*
+	 *	Only cache complete results, including finding no groups.
+	 */
+	if (complete && group_ctx->cache_key) {
+		ldap_group_cache_insert(inst->group_cache, LDAP_GROUP_CACHE_GROUPOBJ, group_ctx->cache_key,
+					group_ctx->base_dn->vb_length,
+					group_ctx->cache_values, talloc_array_length(group_ctx->cache_values));
+	}
 	talloc_free(group_ctx);
 
 	RETURN_MODULE_RCODE(rcode);
@@ -719,6 +1069,37 @@ unlang_action_t rlm_ldap_cacheable_groupobj(rlm_rcode_t *p_result, request_t *re
 		RETURN_MODULE_INVALID;
 	}
 
+	/*
+	 *	The filter usually contains the user's DN, so the
+	 *	base DN and filter identify the user's memberships.
+	 */
+	if (inst->group_cache) {
+		char const	**values;
+		fr_pair_t	*vp;
+		size_t		i, num;
+
+		MEM(group_ctx->cache_key = talloc_typed_asprintf(group_ctx, "%s?%s",
+								 group_ctx->base_dn->vb_strvalue, group_ctx->filter));
+
+		if (ldap_group_cache_find(group_ctx, &values, inst->group_cache,
+					  LDAP_GROUP_CACHE_GROUPOBJ, group_ctx->cache_key)) {
+			num = talloc_array_length(values);
+
+			RDEBUG2("Adding cached group object memberships");
+			RINDENT();
+			for (i = 0; i < num; i++) {
+				MEM(pair_append_control(&vp, inst->cache_da) == 0);
+				fr_pair_value_strdup(vp, values[i], true);
+				RDEBUG2("&control.%pP", vp);
+			}
+			REXDENT();
+
+			talloc_free(group_ctx);
+			if (num == 0) RETURN_MODULE_NOTFOUND;
+			RETURN_MODULE_OK;
+		}
+	}
+
 	if (unlang_function_push(request, ldap_cacheable_groupobj_start, ldap_cacheable_groupobj_resume,
 				 ldap_group_groupobj_cancel, ~FR_SIGNAL_CANCEL, UNLANG_SUB_FRAME, group_ctx) < 0) {
 		talloc_free(group_ctx);
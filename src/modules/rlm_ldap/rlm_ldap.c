@@ -120,6 +120,8 @@ static conf_parser_t group_config[] = {
 	{ FR_CONF_OFFSET("cache_attribute", rlm_ldap_t, cache_attribute) },
 	{ FR_CONF_OFFSET("group_attribute", rlm_ldap_t, group_attribute) },
 	{ FR_CONF_OFFSET("allow_dangling_group_ref", rlm_ldap_t, allow_dangling_group_refs), .dflt = "no" },
+	{ FR_CONF_OFFSET("cache_lifetime", rlm_ldap_t, group_cache_lifetime), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_max_size", rlm_ldap_t, group_cache_max_size), .dflt = "16M" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -958,6 +960,89 @@ static int ldap_xlat_profile_ctx_free(ldap_xlat_profile_ctx_t *to_free)
 	return 0;
 }
 
+static xlat_arg_parser_t const ldap_group_cache_expire_xlat_arg[] = {
+	{ .required = false, .concat = true, .type = FR_TYPE_STRING },
+	XLAT_ARG_PARSER_TERMINATOR
+};
+
+/** Remove entries from the group cache
+ *
+ * Intended to be called from an `ldap_sync` virtual server, when a
+ * user or group object changes.  With no arguments, all entries
+ * are removed.
+ *
+ * Example:
+@verbatim
+%ldap.group_cache_expire(%{LDAP-Sync.Entry-DN})
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t ldap_group_cache_expire_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
+						  xlat_ctx_t const *xctx,
+						  request_t *request, fr_value_box_list_t *in)
+{
+	rlm_ldap_t const	*inst = talloc_get_type_abort_const(xctx->mctx->inst->data, rlm_ldap_t);
+	fr_value_box_t		*dn_vb, *vb;
+	uint32_t		removed;
+
+	XLAT_ARGS(in, &dn_vb);
+
+	removed = rlm_ldap_group_cache_expire(inst->group_cache, dn_vb ? dn_vb->vb_strvalue : NULL);
+	RDEBUG2("Removed %u group cache entries", removed);
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT32, NULL));
+	vb->vb_uint32 = removed;
+	fr_dcursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+
+static xlat_arg_parser_t const ldap_search_stats_xlat_arg[] = {
+	{ .required = true, .single = true, .type = FR_TYPE_STRING },
+	XLAT_ARG_PARSER_TERMINATOR
+};
+
+/** Return how many searches this thread has sent, or how many waited on an identical search
+ *
+ * Identical concurrent searches are coalesced, with only one of them being
+ * sent to the directory.  The totals are for the current worker thread.
+ *
+ * Example:
+@verbatim
+%ldap.search_stats(issued)
+%ldap.search_stats(coalesced)
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t ldap_search_stats_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
+					    xlat_ctx_t const *xctx,
+					    request_t *request, fr_value_box_list_t *in)
+{
+	fr_ldap_thread_t	*t = talloc_get_type_abort(xctx->mctx->thread, fr_ldap_thread_t);
+	fr_value_box_t		*which, *vb;
+	uint64_t		issued, coalesced;
+
+	XLAT_ARGS(in, &which);
+
+	fr_thread_ldap_search_stats(&issued, &coalesced, t);
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT64, NULL));
+	if (strcmp(which->vb_strvalue, "issued") == 0) {
+		vb->vb_uint64 = issued;
+	} else if (strcmp(which->vb_strvalue, "coalesced") == 0) {
+		vb->vb_uint64 = coalesced;
+	} else {
+		REDEBUG("Unknown search statistic \"%s\", expected \"issued\" or \"coalesced\"", which->vb_strvalue);
+		talloc_free(vb);
+		return XLAT_ACTION_FAIL;
+	}
+	fr_dcursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+
 /** Expand an LDAP URL into a query, applying the results using the user update map.
  *
  * For fetching profiles by DN.
@@ -2274,6 +2359,14 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	xlat_func_args_set(xlat, ldap_xlat_arg);
 	xlat_func_call_env_set(xlat, &xlat_profile_method_env);
 
+	if (unlikely(!(xlat = xlat_func_register_module(NULL, mctx, "group_cache_expire", ldap_group_cache_expire_xlat,
+							FR_TYPE_UINT32)))) return -1;
+	xlat_func_args_set(xlat, ldap_group_cache_expire_xlat_arg);
+
+	if (unlikely(!(xlat = xlat_func_register_module(NULL, mctx, "search_stats", ldap_search_stats_xlat,
+							FR_TYPE_UINT64)))) return -1;
+	xlat_func_args_set(xlat, ldap_search_stats_xlat_arg);
+
 	map_proc_register(inst, mctx->inst->name, mod_map_proc, ldap_map_verify, 0);
 
 	return 0;
@@ -2400,6 +2493,15 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		}
 	}
 
+	/*
+	 *	Memberships and group name/DN mappings shared
+	 *	between requests and threads.
+	 */
+	if (fr_time_delta_ispos(inst->group_cache_lifetime) && (inst->cacheable_group_name || inst->cacheable_group_dn)) {
+		inst->group_cache = rlm_ldap_group_cache_alloc(inst, inst->group_cache_max_size,
+							       inst->group_cache_lifetime);
+	}
+
 	/*
 	 *	If we have a *pair* as opposed to a *section*
 	 *	then the module is referencing another ldap module's
@@ -23,6 +23,8 @@ typedef struct {
 	char const	*reference;			//!< Configuration reference string.
 } ldap_acct_section_t;
 
+typedef struct rlm_ldap_group_cache_s rlm_ldap_group_cache_t;
+
 typedef struct {
 	/*
 	 *	Options
@@ -91,6 +93,11 @@ typedef struct {
 	bool		allow_dangling_group_refs;	//!< Don't error if we fail to resolve a group DN referenced
 							///< from a user object.
 
+	fr_time_delta_t	group_cache_lifetime;		//!< How long group memberships and group name/DN
+							///< mappings are cached for.  Zero disables the cache.
+	size_t		group_cache_max_size;		//!< Maximum memory used by the group cache.
+	rlm_ldap_group_cache_t *group_cache;		//!< Group cache, shared by all threads.
+
 	/*
 	 *	Profiles
 	 */
@@ -255,6 +262,10 @@ void rlm_ldap_check_reply(request_t *request, char const *inst_name, bool expect
 /*
  *	groups.c - Group membership functions.
  */
+rlm_ldap_group_cache_t *rlm_ldap_group_cache_alloc(TALLOC_CTX *ctx, size_t max_size, fr_time_delta_t lifetime);
+
+uint32_t rlm_ldap_group_cache_expire(rlm_ldap_group_cache_t *cache, char const *dn);
+
 unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, request_t *request, ldap_autz_ctx_t *autz_ctx,
 					   char const *attr);
 
@@ -23,7 +23,9 @@
 
 RCSID("$Id$")
 
+#include <freeradius-devel/io/file_writer.h>
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/command.h>
 #include <freeradius-devel/server/exfile.h>
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/server/tmpl_dcursor.h>
@@ -121,6 +123,8 @@ typedef struct {
 		exfile_t		*ef;			//!< Exclusive file access handle.
 		bool			escape;			//!< Do filename escaping, yes / no.
 		xlat_escape_legacy_t	escape_func;		//!< Escape function.
+		fr_file_writer_conf_t	async;			//!< Write from a dedicated thread.
+		fr_file_writer_t	*writer;		//!< Writer thread, if async writes are enabled.
 	} file;
 
 	struct {
@@ -134,6 +138,12 @@ typedef struct {
 	CONF_SECTION		*cs;			//!< #CONF_SECTION to use as the root for #log_ref lookups.
 } rlm_linelog_t;
 
+/** linelog thread instance
+ */
+typedef struct {
+	fr_file_writer_thread_t	*writer;		//!< Queue to the writer thread.
+} rlm_linelog_thread_t;
+
 typedef struct {
 	int			sockfd;			//!< File descriptor associated with socket
 } linelog_conn_t;
@@ -144,6 +154,7 @@ static const conf_parser_t file_config[] = {
 	{ FR_CONF_OFFSET("permissions", rlm_linelog_t, file.permissions), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", rlm_linelog_t, file.group_str) },
 	{ FR_CONF_OFFSET("escape_filenames", rlm_linelog_t, file.escape), .dflt = "no" },
+	{ FR_CONF_OFFSET_SUBSECTION("async", 0, rlm_linelog_t, file.async, fr_file_writer_config) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -344,7 +355,7 @@ static void linelog_hexdump(request_t *request, struct iovec *vector_p, size_t v
 	RHEXDUMP3(fr_dbuff_start(agg), fr_dbuff_used(agg), "%s", msg);
 }
 
-static int linelog_write(rlm_linelog_t const *inst, linelog_call_env_t const *call_env, request_t *request, struct iovec *vector_p, size_t vector_len, bool with_delim)
+static int linelog_write(rlm_linelog_t const *inst, rlm_linelog_thread_t *t, linelog_call_env_t const *call_env, request_t *request, struct iovec *vector_p, size_t vector_len, bool with_delim)
 {
 	int 			ret = 0;
 	linelog_conn_t		*conn;
@@ -366,6 +377,36 @@ static int linelog_write(rlm_linelog_t const *inst, linelog_call_env_t const *ca
 			goto finish;
 		}
 
+		/*
+		 *	Hand the data to the writer thread, which
+		 *	creates the directories, and writes the
+		 *	header if the file is new.
+		 */
+		if (t->writer) {
+			struct iovec	head_vector_s[2];
+			size_t		head_vector_len = 0;
+
+			if (call_env->log_head) {
+				memcpy(&head_vector_s[0].iov_base, &call_env->log_head->vb_strvalue, sizeof(head_vector_s[0].iov_base));
+				head_vector_s[0].iov_len = call_env->log_head->vb_length;
+				head_vector_len = 1;
+
+				if (with_delim) {
+					memcpy(&head_vector_s[1].iov_base, &(inst->delimiter),
+					       sizeof(head_vector_s[1].iov_base));
+					head_vector_s[1].iov_len = inst->delimiter_len;
+					head_vector_len = 2;
+				}
+			}
+
+			if (RDEBUG_ENABLED3) linelog_hexdump(request, vector_p, vector_len, "linelog data");
+
+			ret = fr_file_writer_write(t->writer, NULL, request, path,
+						   head_vector_s, head_vector_len, vector_p, vector_len);
+			if (ret < 0) RPERROR("Failed queueing data for \"%s\"", path);
+			goto finish;
+		}
+
 		/* check path and eventually create subdirs */
 		p = strrchr(path, '/');
 		if (p) {
@@ -562,6 +603,7 @@ static xlat_action_t linelog_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 				  fr_value_box_list_t *args)
 {
 	rlm_linelog_t const		*inst = talloc_get_type_abort_const(xctx->mctx->inst->data, rlm_linelog_t);
+	rlm_linelog_thread_t		*t = talloc_get_type_abort(xctx->mctx->thread, rlm_linelog_thread_t);
 	linelog_call_env_t const	*call_env = talloc_get_type_abort(xctx->env_data, linelog_call_env_t);
 
 	struct iovec			vector[2];
@@ -582,7 +624,7 @@ static xlat_action_t linelog_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 		vector[i].iov_len = inst->delimiter_len;
 		i++;
 	}
-	slen = linelog_write(inst, call_env, request, vector, i, with_delim);
+	slen = linelog_write(inst, t, call_env, request, vector, i, with_delim);
 	if (slen < 0) return XLAT_ACTION_FAIL;
 
 	MEM(wrote = fr_value_box_alloc(ctx, FR_TYPE_SIZE, NULL));
@@ -601,6 +643,7 @@ typedef struct {
 static unlang_action_t CC_HINT(nonnull) mod_do_linelog_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_linelog_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_linelog_t);
+	rlm_linelog_thread_t		*t = talloc_get_type_abort(mctx->thread, rlm_linelog_thread_t);
 	linelog_call_env_t const	*call_env = talloc_get_type_abort(mctx->env_data, linelog_call_env_t);
 	rlm_linelog_rctx_t		*rctx = talloc_get_type_abort(mctx->rctx, rlm_linelog_rctx_t);
 	struct iovec			*vector;
@@ -651,7 +694,7 @@ static unlang_action_t CC_HINT(nonnull) mod_do_linelog_resume(rlm_rcode_t *p_res
 		}
 	}
 
-	RETURN_MODULE_RCODE(linelog_write(inst, call_env, request, vector, vector_len, rctx->with_delim) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK);
+	RETURN_MODULE_RCODE(linelog_write(inst, t, call_env, request, vector, vector_len, rctx->with_delim) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK);
 }
 
 /** Write a linelog message
@@ -668,6 +711,7 @@ static unlang_action_t CC_HINT(nonnull) mod_do_linelog_resume(rlm_rcode_t *p_res
 static unlang_action_t CC_HINT(nonnull) mod_do_linelog(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_linelog_t const		*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_linelog_t);
+	rlm_linelog_thread_t		*t = talloc_get_type_abort(mctx->thread, rlm_linelog_thread_t);
 	linelog_call_env_t const	*call_env = talloc_get_type_abort(mctx->env_data, linelog_call_env_t);
 	CONF_SECTION			*conf = mctx->inst->conf;
 
@@ -837,7 +881,7 @@ build_vector:
 			RDEBUG2("No data to write");
 			rcode = RLM_MODULE_NOOP;
 		} else {
-			rcode = linelog_write(inst, call_env, request, vector_p, vector_len, with_delim) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK;
+			rcode = linelog_write(inst, t, call_env, request, vector_p, vector_len, with_delim) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK;
 		}
 
 		talloc_free(vpt);
@@ -862,12 +906,60 @@ build_vector:
 	}
 }
 
+static int cmd_show_module_writer(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	rlm_linelog_t		*inst = talloc_get_type_abort(ctx, rlm_linelog_t);
+	fr_file_writer_stats_t	stats;
+
+	fr_file_writer_stats(&stats, inst->file.writer);
+
+	fprintf(fp, "queued\t%" PRIu64 "\n", stats.queued);
+	fprintf(fp, "pending\t%" PRIu64 "\n", stats.pending);
+	fprintf(fp, "written\t%" PRIu64 "\n", stats.written);
+	fprintf(fp, "failed\t%" PRIu64 "\n", stats.failed);
+	fprintf(fp, "bytes\t%" PRIu64 "\n", stats.bytes);
+	fprintf(fp, "batches\t%" PRIu64 "\n", stats.batches);
+	fprintf(fp, "fsyncs\t%" PRIu64 "\n", stats.fsyncs);
+	fprintf(fp, "dropped\t%" PRIu64 "\n", stats.dropped);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_linelog_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "writer",
+		.func = cmd_show_module_writer,
+		.help = "Show statistics for the asynchronous file writer.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_linelog_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_linelog_t);
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_linelog_thread_t);
+
+	if (!inst->file.writer) return 0;
+
+	t->writer = fr_file_writer_thread_alloc(t, inst->file.writer, mctx->el);
+	if (!t->writer) {
+		PERROR("Failed registering with file writer");
+		return -1;
+	}
+
+	return 0;
+}
 
 static int mod_detach(module_detach_ctx_t const *mctx)
 {
 	rlm_linelog_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_linelog_t);
 
 	fr_pool_free(inst->pool);
+	TALLOC_FREE(inst->file.writer);
 
 	return 0;
 }
@@ -927,6 +1019,31 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 				}
 			}
 		}
+
+		if (inst->file.async.enable) {
+			if (inst->file.async.queue_size == 0) {
+				cf_log_err(conf, "'file.async.queue_size' must be greater than 0");
+				return -1;
+			}
+			if (inst->file.async.batch_size == 0) {
+				cf_log_err(conf, "'file.async.batch_size' must be greater than 0");
+				return -1;
+			}
+
+			inst->file.writer = fr_file_writer_alloc(inst, &inst->file.async, mctx->inst->name,
+								 inst->file.permissions,
+								 inst->file.group_str ? inst->file.group : (gid_t) -1,
+								 true);
+			if (!inst->file.writer) {
+				cf_log_perr(conf, "Failed starting file writer");
+				return -1;
+			}
+
+			if (fr_command_register_hook(NULL, mctx->inst->name, inst, cmd_linelog_table) < 0) {
+				PERROR("Failed registering radmin commands for module %s", mctx->inst->name);
+				return -1;
+			}
+		}
 	}
 		break;
 
@@ -1025,7 +1142,11 @@ module_rlm_t rlm_linelog = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
-		.detach		= mod_detach
+		.detach		= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_linelog_thread_t),
+		.thread_inst_type	= "rlm_linelog_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	},
 	.method_names = (module_method_name_t[]){
 		{ .name1 = CF_IDENT_ANY, .name2 = CF_IDENT_ANY, .method = mod_do_linelog, .method_env = &linelog_method_env },
@@ -920,14 +920,14 @@ int fr_lua_init(lua_State **out, module_inst_ctx_t const *mctx)
 	fr_lua_util_fr_register(L);
 
 	/*
-	 *	Setup "fr.log.{}"
+	 *	Setup "fr.log.{}" and "fr.pair.{}"
 	 */
 	if (inst->jit) {
 		DEBUG4("Initialised new LuaJIT interpreter %p", L);
-		if (fr_lua_util_jit_log_register(L) < 0) goto error;
+		if (fr_lua_util_jit_register(L) < 0) goto error;
 	} else {
 		DEBUG4("Initialised new Lua interpreter %p", L);
-		if (fr_lua_util_log_register(L) < 0) goto error;
+		if ((fr_lua_util_log_register(L) < 0) || (fr_lua_util_pair_register(L) < 0)) goto error;
 	}
 
 	/*
@@ -63,6 +63,16 @@ typedef struct {
 	lua_State	*interpreter;		//!< Thread specific interpreter.
 } rlm_lua_thread_t;
 
+/** A value returned to Lua by fr_lua_util_jit_pair_get()
+ *
+ * Must match the cdef in fr_lua_util_jit_register().
+ */
+typedef struct {
+	char const	*str;			//!< String representation, or NULL if the value is a number.
+	size_t		len;			//!< Length of str.
+	double		num;			//!< Numeric value.
+} fr_lua_jit_value_t;
+
 /* lua.c */
 int		fr_lua_init(lua_State **out, module_inst_ctx_t const *mctx);
 unlang_action_t fr_lua_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request, char const *funcname);
@@ -75,8 +85,15 @@ void		fr_lua_util_jit_log_info(char const *msg);
 void		fr_lua_util_jit_log_warn(char const *msg);
 void		fr_lua_util_jit_log_error(char const *msg);
 
-int		fr_lua_util_jit_log_register(lua_State *L);
+int		fr_lua_util_jit_pair_get(char const *name, unsigned int index, fr_lua_jit_value_t *out);
+int		fr_lua_util_jit_pair_set_str(char const *name, unsigned int index, char const *value, size_t len);
+int		fr_lua_util_jit_pair_set_num(char const *name, unsigned int index, double value);
+int		fr_lua_util_jit_pair_delete(char const *name, unsigned int index);
+int		fr_lua_util_jit_pair_count(char const *name);
+
+int		fr_lua_util_jit_register(lua_State *L);
 int		fr_lua_util_log_register(lua_State *L);
+int		fr_lua_util_pair_register(lua_State *L);
 void		fr_lua_util_set_mctx(module_ctx_t const *mctx);
 module_ctx_t const *fr_lua_util_get_mctx(void);
 void		fr_lua_util_set_request(request_t *request);
@@ -33,9 +33,11 @@ RCSID("$Id$")
 
 #include <lauxlib.h>
 #include <lualib.h>
+#include <math.h>
 
 static _Thread_local request_t *fr_lua_request;
 static _Thread_local module_ctx_t const *fr_lua_mctx;
+static _Thread_local char fr_lua_jit_buff[256];		//!< For printing values which aren't strings or numbers.
 
 void fr_lua_util_fr_register(lua_State *L)
 {
@@ -191,15 +193,307 @@ void fr_lua_util_jit_log_error(char const *msg)
 	ROPTIONAL(RERROR, ERROR, "%s", msg);
 }
 
+/** Find the list and attribute a name refers to
+ *
+ * Names may be qualified with a list, as in unlang, e.g. `reply.Reply-Message`
+ * or `control.Auth-Type`.  Unqualified names refer to the request list.
+ *
+ * @param[out] list	the attribute is in.
+ * @param[out] ctx	to allocate new pairs in the list in.  May be NULL.
+ * @param[in] request	the current request.
+ * @param[in] name	of the attribute.
+ * @return
+ *	- The attribute.
+ *	- NULL if the list or attribute is unknown.
+ */
+static fr_dict_attr_t const *fr_lua_util_pair_attr(fr_pair_list_t **list, TALLOC_CTX **ctx,
+						   request_t *request, char const *name)
+{
+	fr_dict_attr_t const	*list_da = request_attr_request;
+	fr_dict_attr_t const	*da;
+	fr_sbuff_t		sbuff = FR_SBUFF_IN(name, strlen(name));
+
+	/*
+	 *	The list name must be followed by a '.',
+	 *	so `Reply-Message` isn't taken as `reply`.
+	 */
+	if ((tmpl_attr_list_from_substr(&list_da, &sbuff) > 0) && fr_sbuff_next_if_char(&sbuff, '.')) {
+		name = fr_sbuff_current(&sbuff);
+	} else {
+		list_da = request_attr_request;
+	}
+
+	*list = tmpl_list_head(request, list_da);
+	if (!*list) {
+		REDEBUG("List \"%s\" is not available", list_da->name);
+		return NULL;
+	}
+	if (ctx) *ctx = tmpl_list_ctx(request, list_da);
+
+	/*
+	 *	Control attributes like Auth-Type are
+	 *	in the internal dictionary.
+	 */
+	da = fr_dict_attr_by_name(NULL, fr_dict_root(request->dict), name);
+	if (!da) da = fr_dict_attr_by_name(NULL, fr_dict_root(fr_dict_internal()), name);
+	if (!da) REDEBUG("Unknown or invalid attribute name \"%s\"", name);
+
+	return da;
+}
+
+/** Get the value of an instance of an attribute in a list
+ *
+ * Values are converted in the same way as fr.request, numeric types
+ * are written to out->num, everything else to out->str.
+ *
+ * @param[in] name	of the attribute, optionally qualified with a list.
+ * @param[in] index	of the instance of the attribute.
+ * @param[out] out	Where to write the value.
+ * @return
+ *	- 1 if the attribute was found.
+ *	- 0 if there's no such instance.
+ *	- -1 on error.
+ */
+int fr_lua_util_jit_pair_get(char const *name, unsigned int index, fr_lua_jit_value_t *out)
+{
+	request_t		*request = fr_lua_request;
+	fr_pair_list_t		*list;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp;
+
+	if (!request) return -1;
+
+	da = fr_lua_util_pair_attr(&list, NULL, request, name);
+	if (!da) return -1;
+
+	vp = fr_pair_find_by_da_idx(list, da, index);
+	if (!vp) return 0;
+
+	out->str = NULL;
+	out->len = 0;
+	out->num = 0;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		out->str = vp->vp_strvalue;
+		out->len = vp->vp_length;
+		break;
+
+	case FR_TYPE_OCTETS:
+		out->str = (char const *)vp->vp_octets;
+		out->len = vp->vp_length;
+		break;
+
+	case FR_TYPE_BOOL:
+		out->num = vp->vp_bool ? 1 : 0;
+		break;
+
+	case FR_TYPE_DATE:
+		out->num = fr_unix_time_to_sec(vp->vp_date);
+		break;
+
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+	case FR_TYPE_UINT64:
+	case FR_TYPE_INT8:
+	case FR_TYPE_INT16:
+	case FR_TYPE_INT32:
+	case FR_TYPE_INT64:
+	case FR_TYPE_SIZE:
+	case FR_TYPE_FLOAT32:
+	case FR_TYPE_FLOAT64:
+	{
+		fr_value_box_t vb;
+
+		if (fr_value_box_cast(NULL, &vb, FR_TYPE_FLOAT64, NULL, &vp->data) < 0) {
+			RPEDEBUG("Failed converting %s to Lua number", vp->da->name);
+			return -1;
+		}
+		out->num = vb.vb_float64;
+	}
+		break;
+
+	case FR_TYPE_NON_LEAF:
+		REDEBUG("Cannot convert %s to Lua type", fr_type_to_str(vp->vp_type));
+		return -1;
+
+	default:
+	{
+		ssize_t slen;
+
+		slen = fr_pair_print_value_quoted(&FR_SBUFF_OUT(fr_lua_jit_buff, sizeof(fr_lua_jit_buff)),
+						  vp, T_BARE_WORD);
+		if (slen < 0) {
+			REDEBUG("Cannot convert %s to Lua type, insufficient buffer space",
+				fr_type_to_str(vp->vp_type));
+			return -1;
+		}
+		out->str = fr_lua_jit_buff;
+		out->len = (size_t)slen;
+	}
+		break;
+	}
+
+	return 1;
+}
+
+/** Replace or add an instance of an attribute in a list
+ *
+ * If index is past the last instance, a new instance is added.
+ */
+static int fr_lua_util_pair_set(request_t *request, char const *name, unsigned int index, fr_value_box_t const *vb)
+{
+	fr_pair_list_t		*list;
+	TALLOC_CTX		*ctx;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp, *old;
+
+	da = fr_lua_util_pair_attr(&list, &ctx, request, name);
+	if (!da) return -1;
+
+	MEM(vp = fr_pair_afrom_da(ctx, da));
+	if (fr_value_box_cast(vp, &vp->data, vp->vp_type, vp->da, vb) < 0) {
+		RPEDEBUG("Failed setting \"%s\"", vp->da->name);
+		talloc_free(vp);
+		return -1;
+	}
+
+	old = fr_pair_find_by_da_idx(list, da, index);
+	if (old) {
+		fr_pair_replace(list, old, vp);
+	} else {
+		fr_pair_append(list, vp);
+	}
+
+	return 0;
+}
+
+/** Set an instance of an attribute in a list from a string
+ *
+ * @param[in] name	of the attribute, optionally qualified with a list.
+ * @param[in] index	of the instance of the attribute.
+ * @param[in] value	to parse.
+ * @param[in] len	of value.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_set_str(char const *name, unsigned int index, char const *value, size_t len)
+{
+	request_t	*request = fr_lua_request;
+	fr_value_box_t	vb;
+
+	if (!request) return -1;
+
+	fr_value_box_bstrndup_shallow(&vb, NULL, value, len, true);
+
+	return fr_lua_util_pair_set(request, name, index, &vb);
+}
+
+/** Set an instance of an attribute in a list from a number
+ *
+ * @param[in] name	of the attribute, optionally qualified with a list.
+ * @param[in] index	of the instance of the attribute.
+ * @param[in] value	to convert.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_set_num(char const *name, unsigned int index, double value)
+{
+	request_t	*request = fr_lua_request;
+	fr_value_box_t	vb;
+
+	if (!request) return -1;
+
+	/*
+	 *	Preserve decimal precision, but cast
+	 *	integral values from an integer type.
+	 *
+	 *	Casting NaN, infinities, or values outside the
+	 *	range of an int64_t is undefined, so they're
+	 *	kept as doubles.  -(double)INT64_MIN is 2^63,
+	 *	which is exact, unlike (double)INT64_MAX.
+	 */
+	if (!isfinite(value) || (value < (double)INT64_MIN) || (value >= -(double)INT64_MIN) ||
+	    (value != (double)(int64_t)value)) {
+		fr_value_box_init(&vb, FR_TYPE_FLOAT64, NULL, true);
+		vb.vb_float64 = value;
+	} else {
+		fr_value_box_init(&vb, FR_TYPE_INT64, NULL, true);
+		vb.vb_int64 = (int64_t)value;
+	}
+
+	return fr_lua_util_pair_set(request, name, index, &vb);
+}
+
+/** Remove an instance of an attribute from the request list
+ *
+ * @param[in] name	of the attribute, optionally qualified with a list.
+ * @param[in] index	of the instance of the attribute.
+ * @return
+ *	- 1 if the instance was removed.
+ *	- 0 if there's no such instance.
+ *	- -1 on error.
+ */
+int fr_lua_util_jit_pair_delete(char const *name, unsigned int index)
+{
+	request_t		*request = fr_lua_request;
+	fr_pair_list_t		*list;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp;
+
+	if (!request) return -1;
+
+	da = fr_lua_util_pair_attr(&list, NULL, request, name);
+	if (!da) return -1;
+
+	vp = fr_pair_find_by_da_idx(list, da, index);
+	if (!vp) return 0;
+
+	fr_pair_delete(list, vp);
+
+	return 1;
+}
+
+/** Count the instances of an attribute in a list
+ *
+ * @param[in] name	of the attribute, optionally qualified with a list.
+ * @return
+ *	- The number of instances.
+ *	- -1 on error.
+ */
+int fr_lua_util_jit_pair_count(char const *name)
+{
+	request_t		*request = fr_lua_request;
+	fr_pair_list_t		*list;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp = NULL;
+	int			count = 0;
+
+	if (!request) return -1;
+
+	da = fr_lua_util_pair_attr(&list, NULL, request, name);
+	if (!da) return -1;
+
+	while ((vp = fr_pair_find_by_da(list, vp, da))) count++;
+
+	return count;
+}
+
 /** Insert cdefs into the lua environment
  *
  * For LuaJIT using the FFI is significantly faster than the Lua interface.
  * Help people wishing to use the FFI by inserting cdefs for standard functions.
  *
+ * fr.log and fr.pair are implemented with calls through the FFI, which
+ * can be compiled into traces, unlike calls to Lua C functions.
+ *
  * @param L Lua interpreter.
  * @return 0 (no arguments).
  */
-int fr_lua_util_jit_log_register(lua_State *L)
+int fr_lua_util_jit_register(lua_State *L)
 {
 	char const *search_path;
 	char *lua_str, *ctx = NULL;
@@ -233,6 +527,16 @@ int fr_lua_util_jit_log_register(lua_State *L)
 			void fr_lua_util_jit_log_info(char const *msg);\
 			void fr_lua_util_jit_log_warn(char const *msg);\
 			void fr_lua_util_jit_log_error(char const *msg);\
+			typedef struct {\
+				char const *str;\
+				size_t len;\
+				double num;\
+			} fr_lua_jit_value_t;\
+			int fr_lua_util_jit_pair_get(char const *name, unsigned int index, fr_lua_jit_value_t *out);\
+			int fr_lua_util_jit_pair_set_str(char const *name, unsigned int index, char const *value, size_t len);\
+			int fr_lua_util_jit_pair_set_num(char const *name, unsigned int index, double value);\
+			int fr_lua_util_jit_pair_delete(char const *name, unsigned int index);\
+			int fr_lua_util_jit_pair_count(char const *name);\
 		]]\
 		fr_lua = ffi.load(\"%s%clibfreeradius-lua%s\")\
 		_fr_log = {}\
@@ -258,6 +562,32 @@ int fr_lua_util_jit_log_register(lua_State *L)
 			}); \
 		end\
 		fr.log = _ro_log(_fr_log)\
+		local _fr_value = ffi.new(\"fr_lua_jit_value_t\")\
+		fr.pair = {}\
+		fr.pair.get = function(name, index)\
+			local ret = fr_lua.fr_lua_util_jit_pair_get(name, index or 0, _fr_value)\
+			if ret < 0 then error(\"Failed getting \" .. name) end\
+			if ret == 0 then return nil end\
+			if _fr_value.str ~= nil then return ffi.string(_fr_value.str, _fr_value.len) end\
+			return _fr_value.num\
+		end\
+		fr.pair.set = function(name, value, index)\
+			local ret\
+			if value == nil then\
+				ret = fr_lua.fr_lua_util_jit_pair_delete(name, index or 0)\
+			elseif type(value) == \"number\" then\
+				ret = fr_lua.fr_lua_util_jit_pair_set_num(name, index or 0, value)\
+			else\
+				value = tostring(value)\
+				ret = fr_lua.fr_lua_util_jit_pair_set_str(name, index or 0, value, #value)\
+			end\
+			if ret < 0 then error(\"Failed setting \" .. name) end\
+		end\
+		fr.pair.count = function(name)\
+			local ret = fr_lua.fr_lua_util_jit_pair_count(name)\
+			if ret < 0 then error(\"Failed counting \" .. name) end\
+			return ret\
+		end\
 		", search_path, FR_DIR_SEP, DL_EXTENSION);
 	ret = luaL_dostring(L, lua_str);
 	talloc_free(lua_str);
@@ -272,6 +602,118 @@ int fr_lua_util_jit_log_register(lua_State *L)
 	return 0;
 }
 
+/** Lua function to get the value of an attribute in a list
+ *
+ * Lua arguments are the attribute name and an optional index.
+ *
+ * @param L Lua interpreter.
+ * @return 1 (the value, or nil).
+ */
+static int _util_pair_get(lua_State *L)
+{
+	fr_lua_jit_value_t	value;
+	int			ret;
+
+	ret = fr_lua_util_jit_pair_get(luaL_checkstring(L, 1), (unsigned int)luaL_optinteger(L, 2, 0), &value);
+	if (ret < 0) return luaL_error(L, "Failed getting %s", lua_tostring(L, 1));
+
+	if (ret == 0) {
+		lua_pushnil(L);
+	} else if (value.str) {
+		lua_pushlstring(L, value.str, value.len);
+	} else {
+		lua_pushnumber(L, value.num);
+	}
+
+	return 1;
+}
+
+/** Lua function to set, or with a nil value, remove an attribute in a list
+ *
+ * Lua arguments are the attribute name, the value and an optional index.
+ *
+ * @param L Lua interpreter.
+ * @return 0 (no results).
+ */
+static int _util_pair_set(lua_State *L)
+{
+	char const	*name = luaL_checkstring(L, 1);
+	unsigned int	index = (unsigned int)luaL_optinteger(L, 3, 0);
+	int		ret;
+
+	switch (lua_type(L, 2)) {
+	case LUA_TNIL:
+	case LUA_TNONE:
+		ret = fr_lua_util_jit_pair_delete(name, index);
+		break;
+
+	case LUA_TNUMBER:
+		ret = fr_lua_util_jit_pair_set_num(name, index, lua_tonumber(L, 2));
+		break;
+
+	default:
+	{
+		char const	*value;
+		size_t		len;
+
+		value = luaL_checklstring(L, 2, &len);
+		ret = fr_lua_util_jit_pair_set_str(name, index, value, len);
+	}
+		break;
+	}
+	if (ret < 0) return luaL_error(L, "Failed setting %s", name);
+
+	return 0;
+}
+
+/** Lua function to count the instances of an attribute in a list
+ *
+ * @param L Lua interpreter.
+ * @return 1 (the number of instances).
+ */
+static int _util_pair_count(lua_State *L)
+{
+	int ret;
+
+	ret = fr_lua_util_jit_pair_count(luaL_checkstring(L, 1));
+	if (ret < 0) return luaL_error(L, "Failed counting %s", lua_tostring(L, 1));
+
+	lua_pushinteger(L, ret);
+
+	return 1;
+}
+
+/** Register fr.pair in the lua environment
+ *
+ * The same functions LuaJIT calls through the FFI, wrapped as Lua
+ * C functions.
+ *
+ * @param L Lua interpreter.
+ * @return 0 (no arguments).
+ */
+int fr_lua_util_pair_register(lua_State *L)
+{
+	/* fr.{} */
+	lua_getglobal(L, "fr");
+	luaL_checktype(L, -1, LUA_TTABLE);
+
+	/* fr.pair.{} */
+	lua_newtable(L);
+	{
+		lua_pushcfunction(L, _util_pair_get);
+		lua_setfield(L, -2, "get");
+
+		lua_pushcfunction(L, _util_pair_set);
+		lua_setfield(L, -2, "set");
+
+		lua_pushcfunction(L, _util_pair_count);
+		lua_setfield(L, -2, "count");
+	}
+	lua_setfield(L, -2, "pair");
+
+	return 0;
+}
+
 /** Register utililiary functions in the lua environment
  *
  * @param L Lua interpreter.
@@ -0,0 +1,335 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file auth_ntlm_helper.c
+ * @brief NTLM authentication via persistent ntlm_auth helper processes
+ *
+ * Instead of running ntlm_auth once per authentication, a pool of
+ * ntlm_auth processes is started with --helper-protocol=ntlm-server-1,
+ * and each authentication is a request/response exchange over the
+ * helper's stdin and stdout.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/exec_legacy.h>
+#include <freeradius-devel/util/base16.h>
+#include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/debug.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "rlm_mschap.h"
+#include "mschap.h"
+#include "auth_ntlm_helper.h"
+
+/** A running ntlm_auth helper
+ *
+ */
+typedef struct {
+	pid_t		pid;			//!< of the helper.
+	int		to_child;		//!< Helper's stdin.
+	int		from_child;		//!< Helper's stdout.
+} mschap_ntlm_helper_t;
+
+/** Stop a helper process
+ *
+ * Closing stdin is enough to make ntlm_auth exit, the signal is
+ * for helpers which are stuck.
+ */
+static int _mschap_ntlm_helper_free(mschap_ntlm_helper_t *helper)
+{
+	if (helper->to_child >= 0) close(helper->to_child);
+	if (helper->from_child >= 0) close(helper->from_child);
+
+	if (helper->pid > 0) {
+		kill(helper->pid, SIGTERM);
+		(void) waitpid(helper->pid, NULL, 0);
+	}
+
+	return 0;
+}
+
+/** Start an ntlm_auth helper process
+ *
+ * Called by the connection pool whenever it needs a new helper,
+ * including when one is replaced after failing.
+ */
+void *mschap_ntlm_helper_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta_t timeout)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(instance, rlm_mschap_t);
+	mschap_ntlm_helper_t	*helper;
+
+	MEM(helper = talloc_zero(ctx, mschap_ntlm_helper_t));
+	helper->to_child = -1;
+	helper->from_child = -1;
+
+	helper->pid = radius_start_program_legacy(&helper->to_child, &helper->from_child, NULL,
+						  inst->ntlm_helper, NULL, true, NULL, false);
+	if (helper->pid < 0) {
+		ERROR("Failed starting ntlm_auth helper \"%s\"", inst->ntlm_helper);
+		talloc_free(helper);
+		return NULL;
+	}
+	talloc_set_destructor(helper, _mschap_ntlm_helper_free);
+
+	DEBUG2("Started ntlm_auth helper (pid %u)", (unsigned int)helper->pid);
+
+	return helper;
+}
+
+/** Write all of a buffer to the helper
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the helper can't be written to.
+ */
+static int ntlm_helper_write(mschap_ntlm_helper_t *helper, char const *buf, size_t len)
+{
+	size_t	done = 0;
+
+	while (done < len) {
+		ssize_t	slen;
+
+		slen = write(helper->to_child, buf + done, len - done);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += slen;
+	}
+
+	return 0;
+}
+
+/** Read one complete reply from the helper
+ *
+ * ntlm-server-1 replies are a series of "Key: Value" lines,
+ * terminated by a line containing only ".".
+ *
+ * @return
+ *	- >0 the length of the reply, which is '\0' terminated.
+ *	- -1 on error, timeout, or if the helper exited.
+ */
+static ssize_t ntlm_helper_read(request_t *request, mschap_ntlm_helper_t *helper,
+				char *buf, size_t buflen, fr_time_delta_t timeout)
+{
+	fr_time_t	end = fr_time_add(fr_time(), timeout);
+	size_t		used = 0;
+
+	while (true) {
+		struct pollfd	pfd = { .fd = helper->from_child, .events = POLLIN };
+		fr_time_delta_t	left = fr_time_sub(end, fr_time());
+		ssize_t		slen;
+		int		ret;
+
+		if (!fr_time_delta_ispos(left)) {
+			REDEBUG("Timeout waiting for reply from ntlm_auth helper");
+			return -1;
+		}
+
+		ret = poll(&pfd, 1, fr_time_delta_to_msec(left));
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			REDEBUG("Failed waiting for ntlm_auth helper: %s", fr_syserror(errno));
+			return -1;
+		}
+		if (ret == 0) continue;
+
+		if (used >= (buflen - 1)) {
+			REDEBUG("Reply from ntlm_auth helper is too long");
+			return -1;
+		}
+
+		slen = read(helper->from_child, buf + used, buflen - 1 - used);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			REDEBUG("Failed reading from ntlm_auth helper: %s", fr_syserror(errno));
+			return -1;
+		}
+		if (slen == 0) {
+			REDEBUG("ntlm_auth helper exited unexpectedly");
+			return -1;
+		}
+		used += slen;
+		buf[used] = '\0';
+
+		if ((strcmp(buf, ".\n") == 0) ||
+		    ((used >= 3) && (strcmp(buf + used - 3, "\n.\n") == 0))) return used;
+	}
+}
+
+/** Add a "Key:: base64" line to a helper request
+ *
+ * Base64 is used so that usernames can't inject extra lines.
+ */
+static ssize_t ntlm_helper_b64_line(fr_sbuff_t *out, char const *key, char const *value)
+{
+	fr_sbuff_t	our_out = FR_SBUFF(out);
+
+	FR_SBUFF_RETURN(fr_sbuff_in_sprintf, &our_out, "%s:: ", key);
+	FR_SBUFF_RETURN(fr_base64_encode, &our_out, &FR_DBUFF_TMP((uint8_t const *)value, strlen(value)), true);
+	FR_SBUFF_RETURN(fr_sbuff_in_char, &our_out, '\n');
+
+	FR_SBUFF_SET_RETURN(out, &our_out);
+}
+
+/** Authenticate using one of the ntlm_auth helpers
+ *
+ * @param[in] inst		of rlm_mschap.
+ * @param[in] request		being authenticated.
+ * @param[in] challenge		8 byte challenge.
+ * @param[in] response		24 byte NT-Response.
+ * @param[out] nthashhash	the user session key, on success.
+ * @param[out] err		where to write the helper's error message
+ *				on authentication failure.
+ * @param[in] errlen		length of err.
+ * @return
+ *	- 0 on success.
+ *	- 1 if the helper rejected the user, with the reason in err.
+ *	- -1 if the helper couldn't be used.
+ */
+int do_auth_ntlm_helper(rlm_mschap_t const *inst, request_t *request,
+			uint8_t const *challenge, uint8_t const *response,
+			uint8_t nthashhash[NT_DIGEST_LENGTH], char *err, size_t errlen)
+{
+	mschap_ntlm_helper_t	*helper;
+	char			*username = NULL, *domain = NULL;
+	char			out[1024], in[1024];
+	fr_sbuff_t		sbuff = FR_SBUFF_OUT(out, sizeof(out));
+	char			*p, *next;
+	bool			authenticated = false, have_key = false;
+	int			ret = -1;
+	int			tries;
+
+	*err = '\0';
+
+	/*
+	 *	Build the request first, so we don't hold
+	 *	a helper while expanding things.
+	 */
+	if (tmpl_aexpand(request, &username, request, inst->ntlm_helper_username, NULL, NULL) < 0) {
+		REDEBUG("Unable to expand ntlm_auth_helper username");
+		return -1;
+	}
+
+	if (inst->ntlm_helper_domain &&
+	    (tmpl_aexpand(request, &domain, request, inst->ntlm_helper_domain, NULL, NULL) < 0)) {
+		REDEBUG("Unable to expand ntlm_auth_helper domain");
+		goto finish;
+	}
+
+	if ((fr_sbuff_in_strcpy_literal(&sbuff, "LANMAN-Challenge: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(challenge, 8)) < 0) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "\nNT-Response: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(response, 24)) < 0) ||
+	    (fr_sbuff_in_char(&sbuff, '\n') < 0) ||
+	    (ntlm_helper_b64_line(&sbuff, "Username", username) < 0) ||
+	    (domain && (ntlm_helper_b64_line(&sbuff, "NT-Domain", domain) < 0)) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "Request-User-Session-Key: Yes\n.\n") < 0)) {
+		REDEBUG("Request to ntlm_auth helper is too long");
+		goto finish;
+	}
+
+	RDEBUG2("Sending authentication request user \"%s\" domain \"%s\" to ntlm_auth helper",
+		username, domain ? domain : "");
+
+	helper = fr_pool_connection_get(inst->ntlm_helper_pool, request);
+	if (!helper) {
+		REDEBUG("No ntlm_auth helpers available");
+		goto finish;
+	}
+
+	/*
+	 *	A helper which exited since it was last used only
+	 *	shows up when we write to it.  Replace it and try
+	 *	once more.
+	 */
+	for (tries = 0; tries < 2; tries++) {
+		if (ntlm_helper_write(helper, out, fr_sbuff_used(&sbuff)) == 0) break;
+
+		RWDEBUG("Failed writing to ntlm_auth helper (pid %u): %s, restarting it",
+			(unsigned int)helper->pid, fr_syserror(errno));
+
+		helper = fr_pool_connection_reconnect(inst->ntlm_helper_pool, request, helper);
+		if (!helper) {
+			REDEBUG("Failed restarting ntlm_auth helper");
+			goto finish;
+		}
+	}
+	if (tries == 2) {
+		fr_pool_connection_close(inst->ntlm_helper_pool, request, helper);
+		goto finish;
+	}
+
+	/*
+	 *	If the reply is late or garbled, the helper
+	 *	is out of step with us.  Close it so the pool
+	 *	starts a new one.
+	 */
+	if (ntlm_helper_read(request, helper, in, sizeof(in), inst->ntlm_auth_timeout) < 0) {
+		fr_pool_connection_close(inst->ntlm_helper_pool, request, helper);
+		goto finish;
+	}
+	fr_pool_connection_release(inst->ntlm_helper_pool, request, helper);
+
+	for (p = in; p && *p; p = next) {
+		next = strchr(p, '\n');
+		if (next) *next++ = '\0';
+
+		if (strcmp(p, "Authenticated: Yes") == 0) {
+			authenticated = true;
+
+		} else if (strncmp(p, "User-Session-Key: ", 18) == 0) {
+			if (fr_base16_decode(NULL, &FR_DBUFF_TMP(nthashhash, NT_DIGEST_LENGTH),
+					     &FR_SBUFF_IN(p + 18, strlen(p + 18)), false) != NT_DIGEST_LENGTH) {
+				REDEBUG("Invalid User-Session-Key from ntlm_auth helper");
+				goto finish;
+			}
+			have_key = true;
+
+		} else if ((strncmp(p, "Authentication-Error: ", 22) == 0) ||
+			   (strncmp(p, "Error: ", 7) == 0)) {
+			strlcpy(err, strchr(p, ':') + 2, errlen);
+		}
+	}
+
+	if (!authenticated) {
+		if (!*err) strlcpy(err, "Authentication failed", errlen);
+		ret = 1;
+		goto finish;
+	}
+
+	if (!have_key) {
+		REDEBUG("ntlm_auth helper did not return a User-Session-Key");
+		goto finish;
+	}
+
+	ret = 0;
+
+finish:
+	talloc_free(username);
+	talloc_free(domain);
+
+	return ret;
+}
@@ -0,0 +1,9 @@
+#pragma once
+/* @copyright 2024 The FreeRADIUS server project */
+RCSIDH(auth_ntlm_helper_h, "$Id$")
+
+void *mschap_ntlm_helper_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
+
+int do_auth_ntlm_helper(rlm_mschap_t const *inst, request_t *request,
+			uint8_t const *challenge, uint8_t const *response,
+			uint8_t nthashhash[NT_DIGEST_LENGTH], char *err, size_t errlen);
@@ -51,6 +51,7 @@ RCSID("$Id$")
 #include "rlm_mschap.h"
 #include "mschap.h"
 #include "smbdes.h"
+#include "auth_ntlm_helper.h"
 
 #ifdef WITH_AUTH_WINBIND
 #include "auth_wbclient.h"
@@ -89,6 +90,13 @@ static const conf_parser_t passchange_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const conf_parser_t ntlm_auth_helper_config[] = {
+	{ FR_CONF_OFFSET("program", rlm_mschap_t, ntlm_helper) },
+	{ FR_CONF_OFFSET("username", rlm_mschap_t, ntlm_helper_username) },
+	{ FR_CONF_OFFSET("domain", rlm_mschap_t, ntlm_helper_domain) },
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t winbind_config[] = {
 	{ FR_CONF_OFFSET("username", rlm_mschap_t, wb_username) },
 	{ FR_CONF_OFFSET("domain", rlm_mschap_t, wb_domain) },
@@ -110,6 +118,7 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("with_ntdomain_hack", rlm_mschap_t, with_ntdomain_hack), .dflt = "yes" },
 	{ FR_CONF_OFFSET_FLAGS("ntlm_auth", CONF_FLAG_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", rlm_mschap_t, ntlm_auth_timeout) },
+	{ FR_CONF_POINTER("ntlm_auth_helper", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) ntlm_auth_helper_config },
 
 	{ FR_CONF_POINTER("passchange", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", rlm_mschap_t, allow_retry), .dflt = "yes" },
@@ -1251,10 +1260,22 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		size_t	len;
 
 		/*
-		 *	Run the program, and expect that we get 16
+		 *	Ask one of the running helpers.  Rejections
+		 *	come back as text, so they go through the same
+		 *	checks as the output of the program below.
 		 */
-		result = radius_exec_program_legacy(buffer, sizeof(buffer), request, inst->ntlm_auth, NULL,
-					     true, true, inst->ntlm_auth_timeout);
+		if (inst->ntlm_helper_pool) {
+			result = do_auth_ntlm_helper(inst, request, challenge, response, nthashhash,
+						     buffer, sizeof(buffer));
+			if (result < 0) return -2;
+			if (result == 0) break;
+		} else {
+			/*
+			 *	Run the program, and expect that we get 16
+			 */
+			result = radius_exec_program_legacy(buffer, sizeof(buffer), request, inst->ntlm_auth, NULL,
+							    true, true, inst->ntlm_auth_timeout);
+		}
 		if (result != 0) {
 			char *p;
 
@@ -2319,6 +2340,30 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		inst->method = AUTH_NTLMAUTH_EXEC;
 	}
 
+	/*
+	 *	Persistent ntlm_auth helpers are used in preference
+	 *	to running ntlm_auth for every authentication.
+	 */
+	if (inst->ntlm_helper) {
+		CONF_SECTION	*helper_cs = cf_section_find(conf, "ntlm_auth_helper", NULL);
+		char		log_prefix[128];
+
+		if (!inst->ntlm_helper_username) {
+			cf_log_err(helper_cs, "'username' must be set to use ntlm_auth helpers");
+			return -1;
+		}
+
+		inst->method = AUTH_NTLMAUTH_EXEC;
+
+		snprintf(log_prefix, sizeof(log_prefix), "rlm_mschap (%s) ntlm_auth", mctx->inst->name);
+		inst->ntlm_helper_pool = module_rlm_connection_pool_init(helper_cs, inst, mschap_ntlm_helper_create,
+									 NULL, log_prefix, NULL, NULL);
+		if (!inst->ntlm_helper_pool) {
+			cf_log_err(helper_cs, "Unable to start ntlm_auth helpers");
+			return -1;
+		}
+	}
+
 	switch (inst->method) {
 	case AUTH_INTERNAL:
 		DEBUG("Using internal authentication");
@@ -2327,7 +2372,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		DEBUG("Using auto password or ntlm_auth");
 		break;
 	case AUTH_NTLMAUTH_EXEC:
-		DEBUG("Authenticating by calling 'ntlm_auth'");
+		if (inst->ntlm_helper_pool) {
+			DEBUG("Authenticating via 'ntlm_auth' helpers");
+		} else {
+			DEBUG("Authenticating by calling 'ntlm_auth'");
+		}
 		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
@@ -2398,15 +2447,12 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 /*
  *	Tidy up instance
  */
-static int mod_detach(
-#ifndef WITH_AUTH_WINBIND
-		      UNUSED
-#endif
-		      module_detach_ctx_t const *mctx)
+static int mod_detach(module_detach_ctx_t const *mctx)
 {
-#ifdef WITH_AUTH_WINBIND
 	rlm_mschap_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_mschap_t);
 
+	fr_pool_free(inst->ntlm_helper_pool);
+#ifdef WITH_AUTH_WINBIND
 	fr_pool_free(inst->wb_pool);
 #endif
 
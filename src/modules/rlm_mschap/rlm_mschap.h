@@ -5,12 +5,11 @@ RCSIDH(rlm_mschap_h, "$Id$")
 #include "config.h"
 
 #include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/server/pool.h>
 #include <freeradius-devel/server/tmpl.h>
 
 #ifdef WITH_AUTH_WINBIND
 #  include <wbclient.h>
-
-#include <freeradius-devel/server/pool.h>
 #endif
 
 /* Method of authentication we are going to use */
@@ -50,6 +49,10 @@ typedef struct {
 
 	char const		*ntlm_auth;
 	fr_time_delta_t		ntlm_auth_timeout;
+	char const		*ntlm_helper;
+	tmpl_t			*ntlm_helper_username;
+	tmpl_t			*ntlm_helper_domain;
+	fr_pool_t		*ntlm_helper_pool;
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
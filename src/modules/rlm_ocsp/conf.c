@@ -11,6 +11,9 @@ static conf_parser_t ocsp_config[] = {
 	{ FR_CONF_OFFSET("softfail", fr_tls_ocsp_conf_t, softfail), .dflt = "no" },
 	{ FR_CONF_OFFSET("verifycert", fr_tls_ocsp_conf_t, verifycert), .dflt = "yes" },
 
+	{ FR_CONF_OFFSET("cache_size", fr_tls_ocsp_conf_t, cache_size), .dflt = "1024" },
+	{ FR_CONF_OFFSET("cache_lifetime", fr_tls_ocsp_conf_t, cache_lifetime), .dflt = "3600" },
+
 	CONF_PARSER_TERMINATOR
 };
 #endif
@@ -61,11 +64,17 @@ static conf_parser_t ocsp_config[] = {
 	if (conf->ocsp.enable) {
 		conf->ocsp.store = conf_ocsp_revocation_store(conf);
 		if (conf->ocsp.store == NULL) goto error;
+
+		if (conf->ocsp.cache_size) conf->ocsp.mem_cache = fr_tls_ocsp_cache_alloc(conf, conf->ocsp.cache_size,
+											     conf->ocsp.cache_lifetime);
 	}
 
 	if (conf->staple.enable) {
 		conf->staple.store = conf_ocsp_revocation_store(conf);
 		if (conf->staple.store == NULL) goto error;
+
+		if (conf->staple.cache_size) conf->staple.mem_cache = fr_tls_ocsp_cache_alloc(conf, conf->staple.cache_size,
+												 conf->staple.cache_lifetime);
 	}
 #endif /*HAVE_OPENSSL_OCSP_H*/
 
@@ -59,6 +59,36 @@ typedef enum {
  */
 #define OCSP_MAX_VALIDITY_PERIOD (5 * 60)
 
+/** Longest DER encoded OCSP_CERTID we'll use as a cache key
+ *
+ * Hash algorithm, two hashes and a serial number.  Even with SHA512 hashes
+ * this is well under the limit.
+ */
+#define OCSP_CACHE_KEY_MAX	256
+
+/** Encode a certid as a key for the in-process response cache
+ *
+ * @param[out] key	Where to write the DER encoded certid.  Must be
+ *			OCSP_CACHE_KEY_MAX bytes long.
+ * @param[in] certid	identifying the certificate.
+ * @return
+ *	- The length of the key.
+ *	- -1 if the certid couldn't be encoded.
+ */
+static ssize_t ocsp_cache_key(uint8_t *key, OCSP_CERTID *certid)
+{
+	uint8_t	*p = key;
+	int	len;
+
+	len = i2d_OCSP_CERTID(certid, NULL);
+	if ((len <= 0) || (len > OCSP_CACHE_KEY_MAX)) return -1;
+
+	len = i2d_OCSP_CERTID(certid, &p);
+	if (len <= 0) return -1;
+
+	return len;
+}
+
 DIAG_OFF(DIAG_UNKNOWN_PRAGMAS)
 DIAG_OFF(used-but-marked-unused)	/* fix spurious warnings for sk macros */
 /** Extract components of OCSP responder URL from a certificate
@@ -343,6 +373,8 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 		   fr_tls_ocsp_conf_t *conf, bool staple_response)
 {
 	OCSP_CERTID	*certid;
+	uint8_t		key[OCSP_CACHE_KEY_MAX];
+	ssize_t		key_len = -1;
 	OCSP_REQUEST	*req = NULL;
 	OCSP_RESPONSE	*resp = NULL;
 	OCSP_BASICRESP	*bresp = NULL;
@@ -446,6 +478,68 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 	 *	Create OCSP Request
 	 */
 	certid = OCSP_cert_to_id(NULL, client_cert, issuer_cert);
+
+	/*
+	 *	Use a response we've already verified if it's
+	 *	still current.
+	 */
+	if (conf->mem_cache && ((key_len = ocsp_cache_key(key, certid)) > 0)) {
+		int		cached_status;
+		time_t		expires;
+		uint8_t		*cached_resp = NULL;
+		size_t		cached_resp_len = 0;
+
+		if (fr_tls_ocsp_cache_find(&cached_status, &expires,
+					   staple_response ? &cached_resp : NULL, &cached_resp_len,
+					   request, conf->mem_cache, key, (size_t)key_len, fr_time_to_sec(fr_time()))) {
+			OCSP_CERTID_free(certid);
+			BIO_free(ssl_log);
+
+			RDEBUG2("Found cached OCSP response, cert status: %s", OCSP_cert_status_str(cached_status));
+
+			MEM(pair_update_request(&vp, attr_tls_ocsp_next_update) >= 0);
+			vp->vp_uint32 = expires - fr_time_to_sec(fr_time());
+
+			if (cached_status != V_OCSP_CERTSTATUS_GOOD) {
+				MEM(pair_update_request(&vp, attr_tls_ocsp_cert_valid) >= 0);
+				vp->vp_uint32 = 0;	/* no */
+				REDEBUG("Failed to validate certificate");
+				return OCSP_STATUS_FAILED;
+			}
+
+			/*
+			 *	Same as a live response, add it to the
+			 *	request, and set it for the SSL session.
+			 */
+			if (staple_response) {
+				if (!cached_resp) {
+					RWDEBUG("Cached OCSP response has no response data to staple");
+					return OCSP_STATUS_FAILED;
+				}
+
+				MEM(pair_update_request(&vp, attr_tls_ocsp_response) >= 0);
+				MEM(fr_pair_value_memdup(vp, cached_resp, cached_resp_len, true) == 0);
+				talloc_free(cached_resp);
+
+				RDEBUG2("Using cached OCSP response");
+				RINDENT();
+				RDEBUG2("&%pP", vp);
+				REXDENT();
+
+				if (ocsp_staple_from_pair(request, ssl, vp) < 0) {
+					RWDEBUG("Failed setting OCSP staple response from cache");
+					return OCSP_STATUS_FAILED;
+				}
+			}
+
+			MEM(pair_update_request(&vp, attr_tls_ocsp_cert_valid) >= 0);
+			vp->vp_uint32 = 1;	/* yes */
+			RDEBUG2("Certificate is valid");
+
+			return OCSP_STATUS_OK;
+		}
+	}
+
 	req = OCSP_REQUEST_new();
 	OCSP_request_add0_id(req, certid);
 	if (conf->use_nonce) OCSP_request_add1_nonce(req, NULL, 8);
@@ -534,7 +628,7 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 	do {
 		rc = OCSP_sendreq_nbio(&resp, ctx);
 		if (conf->timeout) {
-			if (conf->timeout > (fr_time() - start)) break;
+			if (fr_time_delta_to_sec(fr_time_sub(fr_time(), start)) >= conf->timeout) break;
 		}
 	} while ((rc == -1) && BIO_should_retry(conn));
 
@@ -653,6 +747,27 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 		RDEBUG2("Update time not provided.  Not adding &TLS-OCSP-Next-Update");
 	}
 
+	/*
+	 *	The response has been verified, so other threads
+	 *	(and stapling) can use it until nextUpdate.
+	 */
+	if (conf->mem_cache && (key_len > 0)) {
+		time_t	next = 0;
+		uint8_t	*der = NULL, *p;
+		int	der_len;
+
+		if (next_update && (fr_tls_utils_asn1time_to_epoch(&next, next_update) < 0)) next = 0;
+
+		der_len = i2d_OCSP_RESPONSE(resp, NULL);
+		if (der_len > 0) {
+			MEM(der = p = talloc_array(NULL, uint8_t, der_len));
+			if (i2d_OCSP_RESPONSE(resp, &p) != der_len) der_len = 0;
+		}
+		fr_tls_ocsp_cache_insert(conf->mem_cache, key, (size_t)key_len, status,
+					 der, der_len > 0 ? (size_t)der_len : 0, next, fr_time_to_sec(fr_time()));
+		talloc_free(der);
+	}
+
 	switch (status) {
 	case V_OCSP_CERTSTATUS_GOOD:
 		RDEBUG2("Cert status: good");
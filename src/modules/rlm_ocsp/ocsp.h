@@ -1,3 +1,5 @@
+#include <freeradius-devel/tls/ocsp_cache.h>
+
 /** OCSP Configuration
  *
  */
@@ -16,6 +18,11 @@ typedef struct {
 
 	fr_tls_cache_t	cache;				//!< Cached cache section pointers.  Means we don't have
 							///< to look them up at runtime.
+
+	uint32_t	cache_size;			//!< Maximum number of responses to cache in-process.
+							///< 0 disables the in-process cache.
+	uint32_t	cache_lifetime;			//!< Maximum time a response is cached for.
+	fr_tls_ocsp_cache_t *mem_cache;			//!< In-process response cache, shared by all threads.
 } fr_tls_ocsp_conf_t;
 
 #ifdef HAVE_OPENSSL_OCSP_H
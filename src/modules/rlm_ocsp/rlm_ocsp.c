@@ -0,0 +1,334 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_ocsp.c
+ * @brief Send OCSP requests for client certificates to a responder.
+ *
+ * The TLS code adds &request.TLS-OCSP-Request to `verify certificate { ... }`
+ * when it has no cached response for the client certificate.  This module
+ * POSTs it to the responder without blocking the worker, and writes the
+ * answer to &reply.TLS-OCSP-Response, which the TLS code then verifies and
+ * caches.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/curl/base.h>
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/global_lib.h>
+#include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/util/slab.h>
+
+/** Largest response we'll accept from a responder
+ *
+ * Responses for a single certificate are usually well under 4k, even
+ * when the responder includes its own certificate.
+ */
+#define OCSP_MAX_RESPONSE_SIZE	65536
+
+static fr_dict_t const *dict_freeradius;
+
+extern fr_dict_autoload_t rlm_ocsp_dict[];
+fr_dict_autoload_t rlm_ocsp_dict[] = {
+	{ .out = &dict_freeradius, .proto = "freeradius" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_tls_ocsp_request;
+static fr_dict_attr_t const *attr_tls_ocsp_responder_uri;
+static fr_dict_attr_t const *attr_tls_ocsp_response;
+
+extern fr_dict_attr_autoload_t rlm_ocsp_dict_attr[];
+fr_dict_attr_autoload_t rlm_ocsp_dict_attr[] = {
+	{ .out = &attr_tls_ocsp_request, .name = "TLS-OCSP-Request", .type = FR_TYPE_OCTETS, .dict = &dict_freeradius },
+	{ .out = &attr_tls_ocsp_responder_uri, .name = "TLS-OCSP-Responder-URI", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
+	{ .out = &attr_tls_ocsp_response, .name = "TLS-OCSP-Response", .type = FR_TYPE_OCTETS, .dict = &dict_freeradius },
+	{ NULL },
+};
+
+extern global_lib_autoinst_t const * const rlm_ocsp_lib[];
+global_lib_autoinst_t const * const rlm_ocsp_lib[] = {
+	&fr_curl_autoinst,
+	GLOBAL_LIB_TERMINATOR
+};
+
+typedef struct {
+	char const			*uri;		//!< Responder to use if the certificate doesn't name one.
+	bool				override_uri;	//!< Always use uri, even if the certificate names a responder.
+	fr_time_delta_t 		timeout;	//!< Timeout for connection and responder response.
+	fr_curl_tls_t			tls;
+	fr_curl_conn_config_t		conn_config;	//!< Reusable CURL handle config
+} rlm_ocsp_t;
+
+/** Per-handle state, allocated once with the handle
+ *
+ */
+typedef struct {
+	struct curl_slist		*headers;	//!< Content-Type and Accept headers.
+	uint8_t				*body;		//!< Response received so far.
+	size_t				used;		//!< How much of body has been written.
+} rlm_ocsp_ctx_t;
+
+FR_SLAB_TYPES(ocsp, fr_curl_io_request_t)
+FR_SLAB_FUNCS(ocsp, fr_curl_io_request_t)
+
+typedef struct {
+	ocsp_slab_list_t		*slab;		//!< Slab list for connection handles.
+	fr_curl_handle_t    		*mhandle;	//!< Thread specific multi handle.
+} rlm_ocsp_thread_t;
+
+static const conf_parser_t module_config[] = {
+	{ FR_CONF_OFFSET("uri", rlm_ocsp_t, uri) },
+	{ FR_CONF_OFFSET("override_uri", rlm_ocsp_t, override_uri), .dflt = "no" },
+	{ FR_CONF_OFFSET("timeout", rlm_ocsp_t, timeout), .dflt = "5.0" },
+	{ FR_CONF_OFFSET_SUBSECTION("tls", 0, rlm_ocsp_t, tls, fr_curl_tls_config ) },
+	{ FR_CONF_OFFSET_SUBSECTION("connection", 0, rlm_ocsp_t, conn_config, fr_curl_conn_config ) },
+	CONF_PARSER_TERMINATOR
+};
+
+static void ocsp_io_module_signal(module_ctx_t const *mctx, request_t *request, UNUSED fr_signal_t action)
+{
+	fr_curl_io_request_t	*randle = talloc_get_type_abort(mctx->rctx, fr_curl_io_request_t);
+	rlm_ocsp_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ocsp_thread_t);
+
+	RDEBUG2("Forcefully cancelling pending OCSP request");
+
+	fr_curl_io_request_cancel(t->mhandle, randle);
+	ocsp_slab_release(randle);
+}
+
+/** Called when the responder has answered, or the transfer has failed
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) mod_ocsp_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+							request_t *request)
+{
+	fr_curl_io_request_t     	*randle = talloc_get_type_abort(mctx->rctx, fr_curl_io_request_t);
+	rlm_ocsp_ctx_t			*ctx = talloc_get_type_abort(randle->uctx, rlm_ocsp_ctx_t);
+	fr_pair_t			*vp;
+	long				code = 0;
+
+	if (randle->result != CURLE_OK) {
+		REDEBUG("OCSP request failed: %s", curl_easy_strerror(randle->result));
+	error:
+		ocsp_slab_release(randle);
+		RETURN_MODULE_FAIL;
+	}
+
+	curl_easy_getinfo(randle->candle, CURLINFO_RESPONSE_CODE, &code);
+	if (code != 200) {
+		REDEBUG("OCSP responder returned HTTP status %li", code);
+		goto error;
+	}
+
+	if (!ctx->used) {
+		REDEBUG("OCSP responder returned an empty response");
+		goto error;
+	}
+
+	MEM(pair_update_reply(&vp, attr_tls_ocsp_response) >= 0);
+	fr_pair_value_memdup(vp, ctx->body, ctx->used, true);
+	RDEBUG2("Received %zu byte OCSP response", ctx->used);
+
+	ocsp_slab_release(randle);
+	RETURN_MODULE_UPDATED;
+}
+
+/** Send &request.TLS-OCSP-Request to the responder
+ *
+ * If there's no request, the TLS code found a cached response for the
+ * client certificate, and there's nothing to do.
+ */
+static unlang_action_t CC_HINT(nonnull(1,2)) mod_ocsp(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_ocsp_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_ocsp_t);
+	rlm_ocsp_thread_t       *t = talloc_get_type_abort(mctx->thread, rlm_ocsp_thread_t);
+	fr_pair_t const 	*req, *uri_vp;
+	char const		*uri = inst->uri;
+	fr_curl_io_request_t    *randle;
+
+	req = fr_pair_find_by_da(&request->request_pairs, NULL, attr_tls_ocsp_request);
+	if (!req) {
+		RDEBUG2("No &request.%s, nothing to send", attr_tls_ocsp_request->name);
+		RETURN_MODULE_NOOP;
+	}
+
+	if (!inst->override_uri) {
+		uri_vp = fr_pair_find_by_da(&request->request_pairs, NULL, attr_tls_ocsp_responder_uri);
+		if (uri_vp) uri = uri_vp->vp_strvalue;
+	}
+
+	if (!uri) {
+		REDEBUG("Client certificate doesn't name an OCSP responder, and no \"uri\" is configured");
+		RETURN_MODULE_FAIL;
+	}
+
+	randle = ocsp_slab_reserve(t->slab);
+	if (!randle) RETURN_MODULE_FAIL;
+
+	RDEBUG2("Sending OCSP request to %s", uri);
+
+	/*
+	 *	req stays in the request until we're resumed,
+	 *	so curl doesn't need its own copy.
+	 */
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_URL, uri);
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_POSTFIELDS, req->vp_octets);
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_POSTFIELDSIZE, (long)req->vp_length);
+
+	if (fr_curl_io_request_enqueue(t->mhandle, request, randle)) {
+	error:
+		ocsp_slab_release(randle);
+		RETURN_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_ocsp_resume, ocsp_io_module_signal, ~FR_SIGNAL_CANCEL, randle);
+}
+
+/** Append data from the responder to the response buffer
+ *
+ */
+static size_t ocsp_response_write(void *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	rlm_ocsp_ctx_t	*ctx = talloc_get_type_abort(userdata, rlm_ocsp_ctx_t);
+	size_t		len = size * nmemb;
+
+	if ((ctx->used + len) > OCSP_MAX_RESPONSE_SIZE) return 0;	/* Aborts the transfer */
+
+	MEM(ctx->body = talloc_realloc(ctx, ctx->body, uint8_t, ctx->used + len));
+	memcpy(ctx->body + ctx->used, ptr, len);
+	ctx->used += len;
+
+	return len;
+}
+
+/** Clean up CURL handle on freeing
+ *
+ */
+static int _mod_conn_free(fr_curl_io_request_t *randle)
+{
+	rlm_ocsp_ctx_t *ctx = talloc_get_type_abort(randle->uctx, rlm_ocsp_ctx_t);
+
+	curl_slist_free_all(ctx->headers);
+	curl_easy_cleanup(randle->candle);
+
+	return 0;
+}
+
+/** Callback to configure a CURL handle when it is allocated
+ *
+ */
+static int ocsp_conn_alloc(fr_curl_io_request_t *randle, void *uctx)
+{
+	rlm_ocsp_t const	*inst = talloc_get_type_abort(uctx, rlm_ocsp_t);
+	rlm_ocsp_ctx_t		*ctx;
+
+	randle->candle = curl_easy_init();
+	if (unlikely(!randle->candle)) {
+	error:
+		fr_strerror_printf("Unable to initialise CURL handle");
+		return -1;
+	}
+
+	MEM(ctx = talloc_zero(randle, rlm_ocsp_ctx_t));
+	randle->uctx = ctx;
+
+	talloc_set_destructor(randle, _mod_conn_free);
+
+	ctx->headers = curl_slist_append(ctx->headers, "Content-Type: application/ocsp-request");
+	ctx->headers = curl_slist_append(ctx->headers, "Accept: application/ocsp-response");
+	if (!ctx->headers) goto error;
+
+#if CURL_AT_LEAST_VERSION(7,85,0)
+	FR_CURL_SET_OPTION(CURLOPT_PROTOCOLS_STR, "http,https");
+#else
+	FR_CURL_SET_OPTION(CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
+#endif
+	FR_CURL_SET_OPTION(CURLOPT_HTTPHEADER, ctx->headers);
+	FR_CURL_SET_OPTION(CURLOPT_WRITEFUNCTION, ocsp_response_write);
+	FR_CURL_SET_OPTION(CURLOPT_WRITEDATA, ctx);
+	FR_CURL_SET_OPTION(CURLOPT_CONNECTTIMEOUT_MS, fr_time_delta_to_msec(inst->timeout));
+	FR_CURL_SET_OPTION(CURLOPT_TIMEOUT_MS, fr_time_delta_to_msec(inst->timeout));
+
+	if (DEBUG_ENABLED3) FR_CURL_SET_OPTION(CURLOPT_VERBOSE, 1L);
+
+	if (fr_curl_easy_tls_init(randle, &inst->tls) != 0) goto error;
+
+	return 0;
+}
+
+/** Discard any response left from the last time the handle was used
+ *
+ */
+static int ocsp_conn_reserve(fr_curl_io_request_t *randle, UNUSED void *uctx)
+{
+	rlm_ocsp_ctx_t *ctx = talloc_get_type_abort(randle->uctx, rlm_ocsp_ctx_t);
+
+	TALLOC_FREE(ctx->body);
+	ctx->used = 0;
+
+	return 0;
+}
+
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_ocsp_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_ocsp_t);
+	rlm_ocsp_thread_t    	*t = talloc_get_type_abort(mctx->thread, rlm_ocsp_thread_t);
+	fr_curl_handle_t    	*mhandle;
+
+	if (!(t->slab = ocsp_slab_list_alloc(t, mctx->el, &inst->conn_config.reuse,
+					     ocsp_conn_alloc, ocsp_conn_reserve, inst,
+					     false, false))) {
+		ERROR("Connection handle pool instantiation failed");
+		return -1;
+	}
+
+	mhandle = fr_curl_io_init(t, mctx->el, &inst->conn_config, false);
+	if (!mhandle) return -1;
+
+	t->mhandle = mhandle;
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_ocsp_thread_t    		*t = talloc_get_type_abort(mctx->thread, rlm_ocsp_thread_t);
+
+	talloc_free(t->mhandle);
+	talloc_free(t->slab);
+    	return 0;
+}
+
+extern module_rlm_t rlm_ocsp;
+module_rlm_t rlm_ocsp = {
+	.common = {
+		.magic		        = MODULE_MAGIC_INIT,
+		.name		        = "ocsp",
+		.flags		        = MODULE_TYPE_THREAD_SAFE,
+		.inst_size	        = sizeof(rlm_ocsp_t),
+		.thread_inst_size   	= sizeof(rlm_ocsp_thread_t),
+		.config		        = module_config,
+		.thread_instantiate 	= mod_thread_instantiate,
+		.thread_detach      	= mod_thread_detach,
+	},
+	.method_names = (module_method_name_t[]){
+		{ .name1 = CF_IDENT_ANY,	.name2 = CF_IDENT_ANY,	.method = mod_ocsp },
+		MODULE_NAME_TERMINATOR
+	}
+};
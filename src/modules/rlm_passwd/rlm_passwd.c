@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/line_index.h>
 
 struct mypasswd {
 	struct mypasswd *next;
@@ -356,8 +357,10 @@ int main(void){
 #else  /* TEST */
 typedef struct {
 	struct hashtable	*ht;
+	fr_line_index_t		*index;		//!< Used instead of ht, if index_file is set.
 	struct mypasswd		*pwd_fmt;
 	char const		*filename;
+	char const		*index_file;
 	char const		*format;
 	char const		*delimiter;
 	bool			allow_multiple;
@@ -372,6 +375,7 @@ typedef struct {
 
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("filename", CONF_FLAG_FILE_INPUT | CONF_FLAG_REQUIRED, rlm_passwd_t, filename) },
+	{ FR_CONF_OFFSET_FLAGS("index_file", CONF_FLAG_FILE_INPUT, rlm_passwd_t, index_file) },
 	{ FR_CONF_OFFSET_FLAGS("format", CONF_FLAG_REQUIRED, rlm_passwd_t, format) },
 	{ FR_CONF_OFFSET("delimiter", rlm_passwd_t, delimiter), .dflt = ":" },
 
@@ -441,11 +445,32 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-	inst->ht = build_hash_table(inst->filename, num_fields, key_field, listable,
-				    inst->hash_size, inst->ignore_nislike, *inst->delimiter);
-	if (!inst->ht){
-		ERROR("Can't build hashtable from passwd file");
-		return -1;
+	/*
+	 *	Lines are found in the precompiled index, and
+	 *	parsed when they're used.
+	 */
+	if (inst->index_file) {
+		fr_line_index_conf_t index_conf = {
+			.delimiter = *inst->delimiter,
+			.key_field = key_field,
+			.key_list = listable,
+			.ignore_nislike = inst->ignore_nislike
+		};
+
+		inst->index = fr_line_index_open(inst, inst->index_file, &index_conf);
+		if (!inst->index) {
+			cf_log_perr(conf, "Can't open index");
+			return -1;
+		}
+
+		DEBUG2("Mapped index %s with %"PRIu64" keys", inst->index_file, fr_line_index_num_entries(inst->index));
+	} else {
+		inst->ht = build_hash_table(inst->filename, num_fields, key_field, listable,
+					    inst->hash_size, inst->ignore_nislike, *inst->delimiter);
+		if (!inst->ht){
+			ERROR("Can't build hashtable from passwd file");
+			return -1;
+		}
 	}
 
 	inst->pwd_fmt = mypasswd_alloc(inst->format, num_fields, &len);
@@ -560,6 +585,42 @@ static void result_add(TALLOC_CTX *ctx, rlm_passwd_t const *inst, request_t *req
 	}
 }
 
+/** Add the attributes from every line in the index with a key
+ *
+ * @return the number of lines found.
+ */
+static int passwd_index_map(rlm_passwd_t const *inst, request_t *request, char const *name)
+{
+	fr_line_index_cursor_t	cursor;
+	char const		*line;
+	size_t			len;
+	int			found = 0;
+
+	if (!*name) return 0;
+
+	for (line = fr_line_index_find(&cursor, inst->index, name, strlen(name), &len);
+	     line;
+	     line = fr_line_index_next(&cursor, &len)) {
+		struct mypasswd	*pw;
+		size_t		pw_len;
+
+		pw = mypasswd_alloc(line, inst->num_fields, &pw_len);
+		if (!string_to_entry(line, inst->num_fields, *inst->delimiter, pw, pw_len)) {
+			talloc_free(pw);
+			continue;
+		}
+
+		result_add(request->control_ctx, inst, request, &request->control_pairs, pw, 0, "config");
+		result_add(request->reply_ctx, inst, request, &request->reply_pairs, pw, 1, "reply_items");
+		result_add(request->request_ctx, inst, request, &request->request_pairs, pw, 2, "request_items");
+		talloc_free(pw);
+
+		found++;
+	}
+
+	return found;
+}
+
 static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_passwd_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_passwd_t);
@@ -587,14 +648,18 @@ static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, mo
 		buffer[0] = '\0';
 #endif
 		fr_pair_print_value_quoted(&FR_SBUFF_OUT(buffer, sizeof(buffer)), i, T_BARE_WORD);
-		pw = get_pw_nam(buffer, inst->ht, &last_found);
-		if (!pw) continue;
-
-		do {
-			result_add(request->control_ctx, inst, request, &request->control_pairs, pw, 0, "config");
-			result_add(request->reply_ctx, inst, request, &request->reply_pairs, pw, 1, "reply_items");
-			result_add(request->request_ctx, inst, request, &request->request_pairs, pw, 2, "request_items");
-		} while ((pw = get_next(buffer, inst->ht, &last_found)));
+		if (inst->index) {
+			if (!passwd_index_map(inst, request, buffer)) continue;
+		} else {
+			pw = get_pw_nam(buffer, inst->ht, &last_found);
+			if (!pw) continue;
+
+			do {
+				result_add(request->control_ctx, inst, request, &request->control_pairs, pw, 0, "config");
+				result_add(request->reply_ctx, inst, request, &request->reply_pairs, pw, 1, "reply_items");
+				result_add(request->request_ctx, inst, request, &request->request_pairs, pw, 2, "request_items");
+			} while ((pw = get_next(buffer, inst->ht, &last_found)));
+		}
 
 		found++;
 
@@ -77,10 +77,32 @@ typedef struct {
 	bool		perl_parsed;
 	HV		*rad_perlconf_hv;	//!< holds "config" items (perl %RAD_PERLCONF hash).
 
+	bool		lazy_pairs;		//!< Tie the %RAD_* hashes to the pair lists instead
+						///< of copying every pair in and out on each call.
 } rlm_perl_t;
 
+/** A pair list which one of the %RAD_* hashes is tied to
+ *
+ */
+typedef struct {
+	request_t		*request;	//!< Being processed.  NULL outside of a call.
+	TALLOC_CTX		*ctx;		//!< To allocate new pairs in.
+	fr_pair_list_t		*list;		//!< The hash gives access to.
+	char const		*hash_name;	//!< Name of the hash, for debug messages.
+	char const		*list_name;	//!< Name of the list, for debug messages.
+
+	fr_pair_t		*iter;		//!< Next pair to return a key for, when iterating
+						///< over the hash.
+	fr_rb_tree_t		*seen;		//!< Attributes keys have been returned for.
+} rlm_perl_pairs_t;
+
 typedef struct {
 	PerlInterpreter		*perl;	//!< Thread specific perl interpreter.
+
+	rlm_perl_pairs_t	request;	//!< Bound to %RAD_REQUEST when lazy_pairs is set.
+	rlm_perl_pairs_t	reply;		//!< Bound to %RAD_REPLY when lazy_pairs is set.
+	rlm_perl_pairs_t	control;	//!< Bound to %RAD_CONFIG when lazy_pairs is set.
+	rlm_perl_pairs_t	session_state;	//!< Bound to %RAD_STATE when lazy_pairs is set.
 } rlm_perl_thread_t;
 
 static void *perl_dlhandle;		//!< To allow us to load perl's symbols into the global symbol table.
@@ -103,6 +125,8 @@ static const conf_parser_t module_config[] = {
 
 	{ FR_CONF_OFFSET("perl_flags", rlm_perl_t, perl_flags) },
 
+	{ FR_CONF_OFFSET("lazy_pairs", rlm_perl_t, lazy_pairs), .dflt = "no" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -231,6 +255,14 @@ static XS(XS_radiusd_xlat)
 	XSRETURN(1);
 }
 
+static XS(XS_radiusd_pairs_fetch);
+static XS(XS_radiusd_pairs_store);
+static XS(XS_radiusd_pairs_exists);
+static XS(XS_radiusd_pairs_delete);
+static XS(XS_radiusd_pairs_clear);
+static XS(XS_radiusd_pairs_firstkey);
+static XS(XS_radiusd_pairs_nextkey);
+
 static void xs_init(pTHX)
 {
 	char const *file = __FILE__;
@@ -240,6 +272,17 @@ static void xs_init(pTHX)
 
 	newXS("radiusd::log",XS_radiusd_log, "rlm_perl");
 	newXS("radiusd::xlat",XS_radiusd_xlat, "rlm_perl");
+
+	/*
+	 *	Methods for hashes tied to pair lists
+	 */
+	newXS("radiusd::pairs::FETCH", XS_radiusd_pairs_fetch, "rlm_perl");
+	newXS("radiusd::pairs::STORE", XS_radiusd_pairs_store, "rlm_perl");
+	newXS("radiusd::pairs::EXISTS", XS_radiusd_pairs_exists, "rlm_perl");
+	newXS("radiusd::pairs::DELETE", XS_radiusd_pairs_delete, "rlm_perl");
+	newXS("radiusd::pairs::CLEAR", XS_radiusd_pairs_clear, "rlm_perl");
+	newXS("radiusd::pairs::FIRSTKEY", XS_radiusd_pairs_firstkey, "rlm_perl");
+	newXS("radiusd::pairs::NEXTKEY", XS_radiusd_pairs_nextkey, "rlm_perl");
 }
 
 /** Convert a list of value boxes to a Perl array for passing to subroutines
@@ -791,16 +834,393 @@ static int get_hv_content(TALLOC_CTX *ctx, request_t *request, HV *my_hv, fr_pai
 	return ret;
 }
 
+/** Get the pair list a tied hash refers to
+ *
+ * Croaks if the object isn't one of ours, or if the hash is used
+ * outside of a call to the module, e.g. from a saved reference.
+ */
+static rlm_perl_pairs_t *perl_pairs_from_sv(pTHX_ SV *self)
+{
+	rlm_perl_pairs_t *pairs;
+
+	if (!sv_isobject(self) || !sv_derived_from(self, "radiusd::pairs")) croak("Not a radiusd::pairs object");
+
+	pairs = INT2PTR(rlm_perl_pairs_t *, SvIV(SvRV(self)));
+	if (!pairs->request) croak("%%%s can only be used while the module is being called", pairs->hash_name);
+
+	return pairs;
+}
+
+/** Find the attribute a hash key refers to
+ *
+ */
+static fr_dict_attr_t const *perl_pairs_attr(rlm_perl_pairs_t *pairs, char const *key)
+{
+	return fr_dict_attr_search_by_qualified_oid(NULL, pairs->request->dict, key, true, true);
+}
+
+/** Convert a pair's value to a Perl scalar
+ *
+ * Uses the same representation as perl_store_vps().
+ */
+static SV *perl_pair_to_sv(fr_pair_t const *vp)
+{
+	SV *sv;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		sv = newSVpvn(vp->vp_strvalue, vp->vp_length);
+		break;
+
+	case FR_TYPE_OCTETS:
+		sv = newSVpvn((char const *)vp->vp_octets, vp->vp_length);
+		break;
+
+	default:
+	{
+		char	buffer[1024];
+		ssize_t	slen;
+
+		slen = fr_pair_print_value_quoted(&FR_SBUFF_OUT(buffer, sizeof(buffer)), vp, T_BARE_WORD);
+		if (slen < 0) return NULL;
+
+		sv = newSVpvn(buffer, (size_t)slen);
+	}
+		break;
+	}
+
+	SvTAINT(sv);
+	return sv;
+}
+
+/** Build the value of a hash entry from the list
+ *
+ * Attributes with multiple instances are returned as an array ref.
+ *
+ * @return
+ *	- A new mortal SV.
+ *	- NULL if the attribute isn't in the list.
+ */
+static SV *perl_pairs_value(pTHX_ rlm_perl_pairs_t *pairs, fr_dict_attr_t const *da)
+{
+	fr_pair_t	*vp, *next;
+	AV		*av;
+	SV		*sv;
+
+	vp = fr_pair_find_by_da_nested(pairs->list, NULL, da);
+	if (!vp) return NULL;
+
+	next = fr_pair_find_by_da_nested(pairs->list, vp, da);
+	if (!next) {
+		sv = perl_pair_to_sv(vp);
+		return sv ? sv_2mortal(sv) : NULL;
+	}
+
+	av = newAV();
+	do {
+		sv = perl_pair_to_sv(vp);
+		if (sv) av_push(av, sv);
+	} while ((vp = fr_pair_find_by_da_nested(pairs->list, vp, da)));
+
+	return sv_2mortal(newRV_noinc((SV *)av));
+}
+
+/** Return the next pair in a depth first walk of the list
+ *
+ * Descends into TLVs, VSAs and structs, so the pairs returned
+ * are the ones FETCH finds by their qualified names.  Groups can
+ * contain attributes from other dictionaries, so are returned
+ * as a whole, as are empty structural pairs.
+ */
+static fr_pair_t *perl_pairs_walk(fr_pair_list_t const *list, fr_pair_t const *prev)
+{
+	fr_pair_list_t const	*cur;
+	fr_pair_t		*vp;
+
+	if (!prev) {
+		cur = list;
+		vp = fr_pair_list_head(cur);
+	} else {
+		cur = fr_pair_parent_list(prev);
+		vp = fr_pair_list_next(cur, prev);
+	}
+
+	while (true) {
+		if (!vp) {
+			fr_pair_t *parent;
+
+			if (cur == list) return NULL;
+
+			parent = fr_pair_list_parent(cur);
+			cur = fr_pair_parent_list(parent);
+			vp = fr_pair_list_next(cur, parent);
+			continue;
+		}
+
+		if (!fr_type_is_structural(vp->vp_type) || (vp->vp_type == FR_TYPE_GROUP) ||
+		    fr_pair_list_empty(&vp->vp_group)) return vp;
+
+		cur = &vp->vp_group;
+		vp = fr_pair_list_head(cur);
+	}
+}
+
+/** Move the iterator past pairs which are about to be deleted
+ *
+ * Perl allows the key last returned to be deleted while iterating
+ * over the hash, so the iterator must not be left pointing at a
+ * freed pair.
+ */
+static void perl_pairs_iter_skip(rlm_perl_pairs_t *pairs, fr_dict_attr_t const *da)
+{
+	fr_pair_t *vp;
+
+	while (pairs->iter) {
+		for (vp = pairs->iter; vp && (vp->da != da); vp = fr_pair_parent(vp));
+		if (!vp) return;
+
+		pairs->iter = perl_pairs_walk(pairs->list, pairs->iter);
+	}
+}
+
+/*
+ *	$RAD_REQUEST{'User-Name'}
+ */
+static XS(XS_radiusd_pairs_fetch)
+{
+	dXSARGS;
+	rlm_perl_pairs_t	*pairs;
+	fr_dict_attr_t const	*da;
+	SV			*sv;
+
+	if (items != 2) croak("Usage: FETCH(self, key)");
+
+	pairs = perl_pairs_from_sv(aTHX_ ST(0));
+	da = perl_pairs_attr(pairs, SvPV_nolen(ST(1)));
+	if (!da) XSRETURN_UNDEF;
+
+	sv = perl_pairs_value(aTHX_ pairs, da);
+	if (!sv) XSRETURN_UNDEF;
+
+	ST(0) = sv;
+	XSRETURN(1);
+}
+
+/*
+ *	$RAD_REPLY{'Reply-Message'} = 'foo'
+ *
+ *	Replaces all instances of the attribute.
+ */
+static XS(XS_radiusd_pairs_store)
+{
+	dXSARGS;
+	rlm_perl_pairs_t	*pairs;
+	request_t		*request;
+	fr_dict_attr_t const	*da;
+	char			*key;
+	SV			*value;
+
+	if (items != 3) croak("Usage: STORE(self, key, value)");
+
+	pairs = perl_pairs_from_sv(aTHX_ ST(0));
+	request = pairs->request;
+	key = SvPV_nolen(ST(1));
+	value = ST(2);
+
+	da = perl_pairs_attr(pairs, key);
+	if (!da) {
+		REDEBUG("Ignoring unknown attribute '%s'", key);
+		XSRETURN_EMPTY;
+	}
+
+	perl_pairs_iter_skip(pairs, da);
+	fr_pair_delete_by_da_nested(pairs->list, da);
+
+	if (SvROK(value) && (SvTYPE(SvRV(value)) == SVt_PVAV)) {
+		AV	*av = (AV *)SvRV(value);
+		I32	i, len = av_len(av);
+
+		for (i = 0; i <= len; i++) {
+			SV **av_sv = av_fetch(av, i, 0);
+
+			if (av_sv) (void)pairadd_sv(pairs->ctx, request, pairs->list, key, *av_sv,
+						    pairs->hash_name, pairs->list_name);
+		}
+	} else {
+		(void)pairadd_sv(pairs->ctx, request, pairs->list, key, value, pairs->hash_name, pairs->list_name);
+	}
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_pairs_exists)
+{
+	dXSARGS;
+	rlm_perl_pairs_t	*pairs;
+	fr_dict_attr_t const	*da;
+
+	if (items != 2) croak("Usage: EXISTS(self, key)");
+
+	pairs = perl_pairs_from_sv(aTHX_ ST(0));
+	da = perl_pairs_attr(pairs, SvPV_nolen(ST(1)));
+	if (!da || !fr_pair_find_by_da_nested(pairs->list, NULL, da)) XSRETURN_NO;
+
+	XSRETURN_YES;
+}
+
+static XS(XS_radiusd_pairs_delete)
+{
+	dXSARGS;
+	rlm_perl_pairs_t	*pairs;
+	request_t		*request;
+	fr_dict_attr_t const	*da;
+	SV			*sv;
+
+	if (items != 2) croak("Usage: DELETE(self, key)");
+
+	pairs = perl_pairs_from_sv(aTHX_ ST(0));
+	request = pairs->request;
+	da = perl_pairs_attr(pairs, SvPV_nolen(ST(1)));
+	if (!da) XSRETURN_UNDEF;
+
+	sv = perl_pairs_value(aTHX_ pairs, da);
+	if (!sv) XSRETURN_UNDEF;
+
+	RDEBUG2("delete $%s{'%s'} -> &%s.%s", pairs->hash_name, da->name, pairs->list_name, da->name);
+	perl_pairs_iter_skip(pairs, da);
+	fr_pair_delete_by_da_nested(pairs->list, da);
+
+	ST(0) = sv;
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_pairs_clear)
+{
+	dXSARGS;
+	rlm_perl_pairs_t	*pairs;
+
+	if (items != 1) croak("Usage: CLEAR(self)");
+
+	pairs = perl_pairs_from_sv(aTHX_ ST(0));
+	pairs->iter = NULL;
+	fr_pair_list_free(pairs->list);
+
+	XSRETURN_EMPTY;
+}
+
+/** Return the next key, skipping attributes which have already been returned
+ *
+ * The list isn't sorted, so instances of an attribute needn't be
+ * next to each other.  Each attribute is only returned once, and
+ * FETCH returns all of its instances.
+ */
+static SV *perl_pairs_key_next(pTHX_ rlm_perl_pairs_t *pairs)
+{
+	fr_pair_t	*vp;
+	char		buffer[1024];
+	fr_slen_t	slen;
+
+	if (!pairs->seen) return NULL;
+
+	while ((vp = pairs->iter)) {
+		pairs->iter = perl_pairs_walk(pairs->list, vp);
+
+		if (fr_rb_find(pairs->seen, vp->da)) continue;
+		fr_rb_insert(pairs->seen, vp->da);
+
+		slen = fr_dict_attr_oid_print(&FR_SBUFF_OUT(buffer, sizeof(buffer)), NULL, vp->da, false);
+		if (slen <= 0) continue;
+
+		return sv_2mortal(newSVpvn(buffer, (size_t)slen));
+	}
+
+	return NULL;
+}
+
+static XS(XS_radiusd_pairs_firstkey)
+{
+	dXSARGS;
+	rlm_perl_pairs_t	*pairs;
+	SV			*sv;
+
+	if (items != 1) croak("Usage: FIRSTKEY(self)");
+
+	pairs = perl_pairs_from_sv(aTHX_ ST(0));
+
+	talloc_free(pairs->seen);
+	MEM(pairs->seen = fr_rb_alloc(pairs->request, fr_pointer_cmp, NULL));
+	pairs->iter = perl_pairs_walk(pairs->list, NULL);
+
+	sv = perl_pairs_key_next(aTHX_ pairs);
+	if (!sv) XSRETURN_UNDEF;
+
+	ST(0) = sv;
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_pairs_nextkey)
+{
+	dXSARGS;
+	rlm_perl_pairs_t	*pairs;
+	SV			*sv;
+
+	if (items != 2) croak("Usage: NEXTKEY(self, lastkey)");
+
+	pairs = perl_pairs_from_sv(aTHX_ ST(0));
+
+	sv = perl_pairs_key_next(aTHX_ pairs);
+	if (!sv) XSRETURN_UNDEF;
+
+	ST(0) = sv;
+	XSRETURN(1);
+}
+
+/** Tie one of the %RAD_* hashes to a pair list
+ *
+ * Done once per thread.  The pair list is bound to the request
+ * for the duration of each call by perl_pairs_bind().
+ */
+static void perl_pairs_tie(pTHX_ rlm_perl_pairs_t *pairs, char const *hash_name, char const *list_name)
+{
+	HV	*hv;
+	SV	*obj;
+
+	pairs->hash_name = hash_name;
+	pairs->list_name = list_name;
+
+	hv = get_hv(hash_name, 1);
+	hv_clear(hv);
+
+	obj = sv_setref_pv(newSV(0), "radiusd::pairs", pairs);
+	sv_magic((SV *)hv, obj, PERL_MAGIC_tied, NULL, 0);
+	SvREFCNT_dec(obj);	/* sv_magic takes its own reference */
+}
+
+static inline CC_HINT(always_inline)
+void perl_pairs_bind(rlm_perl_pairs_t *pairs, request_t *request, TALLOC_CTX *ctx, fr_pair_list_t *list)
+{
+	TALLOC_FREE(pairs->seen);
+	pairs->iter = NULL;
+
+	pairs->request = request;
+	pairs->ctx = ctx;
+	pairs->list = list;
+}
+
 /*
  * 	Call the function_name inside the module
  * 	Store all vps in hashes %RAD_CONFIG %RAD_REPLY %RAD_REQUEST
  *
+ *	With lazy_pairs the hashes are tied to the pair lists, and
+ *	nothing needs to be copied.
+ *
  */
 static unlang_action_t do_perl(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
 			       PerlInterpreter *interp, char const *function_name)
 {
 
 	rlm_perl_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_perl_t);
+	rlm_perl_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_perl_thread_t);
 	fr_pair_list_t		vps;
 	int			ret=0, count;
 	STRLEN			n_a;
@@ -832,10 +1252,18 @@ static unlang_action_t do_perl(rlm_rcode_t *p_result, module_ctx_t const *mctx,
 		rad_request_hv = get_hv("RAD_REQUEST", 1);
 		rad_state_hv = get_hv("RAD_STATE", 1);
 
-		perl_store_vps(request->request_ctx, request, &request->request_pairs, rad_request_hv, "RAD_REQUEST", "request");
-		perl_store_vps(request->reply_ctx, request, &request->reply_pairs, rad_reply_hv, "RAD_REPLY", "reply");
-		perl_store_vps(request->control_ctx, request, &request->control_pairs, rad_config_hv, "RAD_CONFIG", "control");
-		perl_store_vps(request->session_state_ctx, request, &request->session_state_pairs, rad_state_hv, "RAD_STATE", "session-state");
+		if (inst->lazy_pairs) {
+			perl_pairs_bind(&t->request, request, request->request_ctx, &request->request_pairs);
+			perl_pairs_bind(&t->reply, request, request->reply_ctx, &request->reply_pairs);
+			perl_pairs_bind(&t->control, request, request->control_ctx, &request->control_pairs);
+			perl_pairs_bind(&t->session_state, request, request->session_state_ctx,
+					&request->session_state_pairs);
+		} else {
+			perl_store_vps(request->request_ctx, request, &request->request_pairs, rad_request_hv, "RAD_REQUEST", "request");
+			perl_store_vps(request->reply_ctx, request, &request->reply_pairs, rad_reply_hv, "RAD_REPLY", "reply");
+			perl_store_vps(request->control_ctx, request, &request->control_pairs, rad_config_hv, "RAD_CONFIG", "control");
+			perl_store_vps(request->session_state_ctx, request, &request->session_state_pairs, rad_state_hv, "RAD_STATE", "session-state");
+		}
 
 		/*
 		 * Store pointer to request structure globally so radiusd::xlat works
@@ -874,6 +1302,19 @@ static unlang_action_t do_perl(rlm_rcode_t *p_result, module_ctx_t const *mctx,
 		FREETMPS;
 		LEAVE;
 
+		/*
+		 *	Any changes have already been made to
+		 *	the lists.
+		 */
+		if (inst->lazy_pairs) {
+			perl_pairs_bind(&t->request, NULL, NULL, NULL);
+			perl_pairs_bind(&t->reply, NULL, NULL, NULL);
+			perl_pairs_bind(&t->control, NULL, NULL, NULL);
+			perl_pairs_bind(&t->session_state, NULL, NULL, NULL);
+
+			RETURN_MODULE_RCODE(ret);
+		}
+
 		fr_pair_list_init(&vps);
 		if ((get_hv_content(request->request_ctx, request, rad_request_hv, &vps, "RAD_REQUEST", "request")) > 0) {
 			fr_pair_list_free(&request->request_pairs);
@@ -968,6 +1409,13 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 
 	t->perl = interp;			/* Store perl interp for easy freeing later */
 
+	if (inst->lazy_pairs) {
+		perl_pairs_tie(aTHX_ &t->request, "RAD_REQUEST", "request");
+		perl_pairs_tie(aTHX_ &t->reply, "RAD_REPLY", "reply");
+		perl_pairs_tie(aTHX_ &t->control, "RAD_CONFIG", "control");
+		perl_pairs_tie(aTHX_ &t->session_state, "RAD_STATE", "session-state");
+	}
+
 	return 0;
 }
 
@@ -40,6 +40,15 @@ RCSID("$Id$")
 #include <libgen.h>
 #include <dlfcn.h>
 
+/*
+ *	Python 3.12 added interpreters with their own GIL,
+ *	which lets each worker thread run Python code in
+ *	parallel with the others.
+ */
+#if PY_VERSION_HEX >= 0x030C0000
+#  define PYTHON_PER_THREAD_INTERPRETER
+#endif
+
 /** Specifies the module.function to load for processing a section
  *
  */
@@ -70,6 +79,13 @@ typedef struct {
 
 	PyObject	*pythonconf_dict;	//!< Configuration parameters defined in the module
 						//!< made available to the python script.
+
+	bool		per_thread_interpreter;	//!< Create an isolated interpreter, with its own
+						///< GIL, for each worker thread.
+
+	bool		lazy_pairs;		//!< Pass freeradius.Pairs objects instead of
+						///< copying the request into a tuple.
+	PyObject	*pairs_type;		//!< freeradius.Pairs in the instance's interpreter.
 } rlm_python_t;
 
 /** Global config for python library
@@ -80,6 +96,18 @@ typedef struct {
 	bool		path_include_default;	//!< Include the default python path in `path`
 } libpython_global_config_t;
 
+/** Gives a Python function access to one of the request's pair lists
+ *
+ * Attributes are only converted when they're accessed, and changes
+ * are made directly to the list.
+ */
+typedef struct {
+	PyObject_HEAD
+	request_t	*request;		//!< Being processed.  NULL once the function has returned.
+	TALLOC_CTX	*ctx;			//!< To allocate new pairs in.
+	fr_pair_list_t	*list;			//!< The object gives access to.
+} python_pairs_t;
+
 /** Tracks a python module inst/thread state pair
  *
  * Multiple instances of python create multiple interpreters and each
@@ -87,6 +115,20 @@ typedef struct {
  */
 typedef struct {
 	PyThreadState	*state;			//!< Module instance/thread specific state.
+	PyObject	*pairs_type;		//!< freeradius.Pairs in the interpreter this thread uses.
+
+#ifdef PYTHON_PER_THREAD_INTERPRETER
+	PyThreadState	*parent;		//!< Thread state in the instance's interpreter, used
+						///< to create this thread's interpreter.
+	PyObject	*module;		//!< freeradius module in this thread's interpreter.
+
+	python_func_def_t
+	authorize,
+	authenticate,
+	preacct,
+	accounting,
+	post_auth;
+#endif
 } rlm_python_thread_t;
 
 static void			*python_dlhandle;
@@ -159,6 +201,9 @@ static conf_parser_t module_config[] = {
 
 #undef A
 
+	{ FR_CONF_OFFSET("per_thread_interpreter", rlm_python_t, per_thread_interpreter), .dflt = "no" },
+	{ FR_CONF_OFFSET("lazy_pairs", rlm_python_t, lazy_pairs), .dflt = "no" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -366,74 +411,56 @@ static void mod_vptuple(TALLOC_CTX *ctx, module_ctx_t const *mctx, request_t *re
 }
 
 
-/*
- *	This is the core Python function that the others wrap around.
- *	Pass the value-pair print strings in a tuple.
+/** Convert a pair's value to a Python object
+ *
+ * @return
+ *	- A new reference.
+ *	- NULL on error, with a Python exception set.
  */
-static int mod_populate_vptuple(module_ctx_t const *mctx, request_t *request, PyObject *pp, fr_pair_t *vp)
+static PyObject *python_value_from_pair(fr_pair_t const *vp)
 {
-	PyObject *attribute = NULL;
-	PyObject *value = NULL;
-
-	attribute = PyUnicode_FromString(vp->da->name);
-	if (!attribute) return -1;
-
 	switch (vp->vp_type) {
 	case FR_TYPE_STRING:
-		value = PyUnicode_FromStringAndSize(vp->vp_strvalue, vp->vp_length);
-		break;
+		return PyUnicode_FromStringAndSize(vp->vp_strvalue, vp->vp_length);
 
 	case FR_TYPE_OCTETS:
-		value = PyBytes_FromStringAndSize((char const *)vp->vp_octets, vp->vp_length);
-		break;
+		return PyBytes_FromStringAndSize((char const *)vp->vp_octets, vp->vp_length);
 
 	case FR_TYPE_BOOL:
-		value = PyBool_FromLong(vp->vp_bool);
-		break;
+		return PyBool_FromLong(vp->vp_bool);
 
 	case FR_TYPE_UINT8:
-		value = PyLong_FromUnsignedLong(vp->vp_uint8);
-		break;
+		return PyLong_FromUnsignedLong(vp->vp_uint8);
 
 	case FR_TYPE_UINT16:
-		value = PyLong_FromUnsignedLong(vp->vp_uint16);
-		break;
+		return PyLong_FromUnsignedLong(vp->vp_uint16);
 
 	case FR_TYPE_UINT32:
-		value = PyLong_FromUnsignedLong(vp->vp_uint32);
-		break;
+		return PyLong_FromUnsignedLong(vp->vp_uint32);
 
 	case FR_TYPE_UINT64:
-		value = PyLong_FromUnsignedLongLong(vp->vp_uint64);
-		break;
+		return PyLong_FromUnsignedLongLong(vp->vp_uint64);
 
 	case FR_TYPE_INT8:
-		value = PyLong_FromLong(vp->vp_int8);
-		break;
+		return PyLong_FromLong(vp->vp_int8);
 
 	case FR_TYPE_INT16:
-		value = PyLong_FromLong(vp->vp_int16);
-		break;
+		return PyLong_FromLong(vp->vp_int16);
 
 	case FR_TYPE_INT32:
-		value = PyLong_FromLong(vp->vp_int32);
-		break;
+		return PyLong_FromLong(vp->vp_int32);
 
 	case FR_TYPE_INT64:
-		value = PyLong_FromLongLong(vp->vp_int64);
-		break;
+		return PyLong_FromLongLong(vp->vp_int64);
 
 	case FR_TYPE_FLOAT32:
-		value = PyFloat_FromDouble((double) vp->vp_float32);
-		break;
+		return PyFloat_FromDouble((double) vp->vp_float32);
 
 	case FR_TYPE_FLOAT64:
-		value = PyFloat_FromDouble(vp->vp_float64);
-		break;
+		return PyFloat_FromDouble(vp->vp_float64);
 
 	case FR_TYPE_SIZE:
-		value = PyLong_FromSize_t(vp->vp_size);
-		break;
+		return PyLong_FromSize_t(vp->vp_size);
 
 	case FR_TYPE_TIME_DELTA:
 	case FR_TYPE_DATE:
@@ -451,21 +478,41 @@ static int mod_populate_vptuple(module_ctx_t const *mctx, request_t *request, Py
 
 		slen = fr_value_box_print(&FR_SBUFF_OUT(buffer, sizeof(buffer)), &vp->data, NULL);
 		if (slen < 0) {
-		error:
-			ROPTIONAL(REDEBUG, ERROR, "Failed marshalling %pP to Python value", vp);
-			python_error_log(mctx, request);
-			Py_XDECREF(attribute);
-			return -1;
+			PyErr_Format(PyExc_ValueError, "Failed printing value of %s", vp->da->name);
+			return NULL;
 		}
-		value = PyUnicode_FromStringAndSize(buffer, (size_t)slen);
+		return PyUnicode_FromStringAndSize(buffer, (size_t)slen);
 	}
-		break;
 
 	case FR_TYPE_NON_LEAF:
-		return 0;
+		break;
 	}
 
-	if (value == NULL) goto error;
+	PyErr_Format(PyExc_TypeError, "%s is not a leaf attribute", vp->da->name);
+	return NULL;
+}
+
+/*
+ *	This is the core Python function that the others wrap around.
+ *	Pass the value-pair print strings in a tuple.
+ */
+static int mod_populate_vptuple(module_ctx_t const *mctx, request_t *request, PyObject *pp, fr_pair_t *vp)
+{
+	PyObject *attribute = NULL;
+	PyObject *value = NULL;
+
+	if (fr_type_is_non_leaf(vp->vp_type)) return 0;
+
+	attribute = PyUnicode_FromString(vp->da->name);
+	if (!attribute) return -1;
+
+	value = python_value_from_pair(vp);
+	if (value == NULL) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed marshalling %pP to Python value", vp);
+		python_error_log(mctx, request);
+		Py_XDECREF(attribute);
+		return -1;
+	}
 
 	PyTuple_SET_ITEM(pp, 0, attribute);
 	PyTuple_SET_ITEM(pp, 1, value);
@@ -473,6 +520,365 @@ static int mod_populate_vptuple(module_ctx_t const *mctx, request_t *request, Py
 	return 0;
 }
 
+/** Find the attribute a key refers to
+ *
+ * @return
+ *	- The attribute.
+ *	- NULL with a Python exception set.
+ */
+static fr_dict_attr_t const *python_pairs_attr(python_pairs_t *pairs, PyObject *key)
+{
+	fr_dict_attr_t const	*da;
+	char const		*name;
+
+	if (!pairs->request) {
+		PyErr_SetString(PyExc_RuntimeError, "Pairs can only be used while the function is being called");
+		return NULL;
+	}
+
+	if (!PyUnicode_Check(key)) {
+		PyErr_SetString(PyExc_TypeError, "Attribute names must be strings");
+		return NULL;
+	}
+
+	name = PyUnicode_AsUTF8(key);
+	if (!name) return NULL;
+
+	da = fr_dict_attr_search_by_qualified_oid(NULL, pairs->request->dict, name, true, true);
+	if (!da) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	return da;
+}
+
+/** Add a pair with a value converted from a Python object
+ *
+ */
+static int python_pairs_add(python_pairs_t *pairs, fr_dict_attr_t const *da, PyObject *value)
+{
+	fr_pair_t	*vp;
+	PyObject	*str = NULL;
+	char		*buf;
+	Py_ssize_t	len;
+	int		ret;
+
+	if (PyBytes_Check(value)) {
+		if (PyBytes_AsStringAndSize(value, &buf, &len) < 0) return -1;
+
+	} else if (PyBool_Check(value)) {
+		buf = UNCONST(char *, (value == Py_True) ? "yes" : "no");
+		len = strlen(buf);
+
+	} else {
+		str = PyObject_Str(value);
+		if (!str) return -1;
+
+		buf = UNCONST(char *, PyUnicode_AsUTF8AndSize(str, &len));
+		if (!buf) {
+			Py_DECREF(str);
+			return -1;
+		}
+	}
+
+	vp = fr_pair_afrom_da_nested(pairs->ctx, pairs->list, da);
+	if (!vp) {
+		Py_XDECREF(str);
+		PyErr_Format(PyExc_RuntimeError, "Failed creating %s", da->name);
+		return -1;
+	}
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		ret = fr_pair_value_bstrndup(vp, buf, len, true);
+		break;
+
+	case FR_TYPE_OCTETS:
+		ret = fr_pair_value_memdup(vp, (uint8_t const *)buf, len, true);
+		break;
+
+	default:
+		ret = fr_pair_value_from_str(vp, buf, len, NULL, false);
+		break;
+	}
+	Py_XDECREF(str);
+
+	if (ret < 0) {
+		PyErr_Format(PyExc_ValueError, "Invalid value for %s: %s", da->name, fr_strerror());
+		fr_pair_delete(fr_pair_parent_list(vp), vp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	pairs['User-Name']
+ *
+ *	Attributes with multiple instances are returned as a list.
+ */
+static PyObject *python_pairs_getitem(PyObject *self, PyObject *key)
+{
+	python_pairs_t		*pairs = (python_pairs_t *)self;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp, *next;
+	PyObject		*list;
+
+	da = python_pairs_attr(pairs, key);
+	if (!da) return NULL;
+
+	vp = fr_pair_find_by_da_nested(pairs->list, NULL, da);
+	if (!vp) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	next = fr_pair_find_by_da_nested(pairs->list, vp, da);
+	if (!next) return python_value_from_pair(vp);
+
+	list = PyList_New(0);
+	if (!list) return NULL;
+
+	do {
+		PyObject *value;
+
+		value = python_value_from_pair(vp);
+		if (!value || (PyList_Append(list, value) < 0)) {
+			Py_XDECREF(value);
+			Py_DECREF(list);
+			return NULL;
+		}
+		Py_DECREF(value);
+	} while ((vp = fr_pair_find_by_da_nested(pairs->list, vp, da)));
+
+	return list;
+}
+
+/*
+ *	pairs['Reply-Message'] = 'foo', and del pairs['Reply-Message']
+ *
+ *	Assigning replaces all instances of the attribute.  A list
+ *	or tuple adds one instance for each member.
+ */
+static int python_pairs_setitem(PyObject *self, PyObject *key, PyObject *value)
+{
+	python_pairs_t		*pairs = (python_pairs_t *)self;
+	fr_dict_attr_t const	*da;
+	PyObject		*seq;
+	Py_ssize_t		i;
+	int			ret = 0;
+
+	da = python_pairs_attr(pairs, key);
+	if (!da) return -1;
+
+	if (fr_pair_delete_by_da_nested(pairs->list, da) == 0) {
+		if (!value) {
+			PyErr_SetObject(PyExc_KeyError, key);
+			return -1;
+		}
+	}
+	if (!value) return 0;
+
+	if (!PyList_Check(value) && !PyTuple_Check(value)) return python_pairs_add(pairs, da, value);
+
+	seq = PySequence_Fast(value, "Expected a list or tuple");
+	if (!seq) return -1;
+
+	for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+		ret = python_pairs_add(pairs, da, PySequence_Fast_GET_ITEM(seq, i));
+		if (ret < 0) break;
+	}
+	Py_DECREF(seq);
+
+	return ret;
+}
+
+/*
+ *	'User-Name' in pairs
+ */
+static int python_pairs_contains(PyObject *self, PyObject *key)
+{
+	python_pairs_t		*pairs = (python_pairs_t *)self;
+	fr_dict_attr_t const	*da;
+
+	da = python_pairs_attr(pairs, key);
+	if (!da) {
+		if (!PyErr_ExceptionMatches(PyExc_KeyError)) return -1;
+		PyErr_Clear();
+		return 0;
+	}
+
+	return (fr_pair_find_by_da_nested(pairs->list, NULL, da) != NULL);
+}
+
+/*
+ *	pairs.keys()
+ *
+ *	The names of the top level attributes in the list,
+ *	without duplicates.
+ */
+static PyObject *python_pairs_keys(PyObject *self, UNUSED PyObject *args)
+{
+	python_pairs_t	*pairs = (python_pairs_t *)self;
+	fr_pair_t	*vp;
+	PyObject	*keys, *seen;
+
+	if (!pairs->request) {
+		PyErr_SetString(PyExc_RuntimeError, "Pairs can only be used while the function is being called");
+		return NULL;
+	}
+
+	keys = PyList_New(0);
+	if (!keys) return NULL;
+
+	/*
+	 *	The list keeps the order of the pairs, the set
+	 *	makes checking for duplicates O(1).
+	 */
+	seen = PySet_New(NULL);
+	if (!seen) {
+		Py_DECREF(keys);
+		return NULL;
+	}
+
+	for (vp = fr_pair_list_head(pairs->list);
+	     vp;
+	     vp = fr_pair_list_next(pairs->list, vp)) {
+		PyObject	*name;
+		int		found;
+
+		name = PyUnicode_FromString(vp->da->name);
+		if (!name) goto error;
+
+		found = PySet_Contains(seen, name);
+		if ((found < 0) ||
+		    (!found && ((PySet_Add(seen, name) < 0) || (PyList_Append(keys, name) < 0)))) {
+			Py_DECREF(name);
+		error:
+			Py_DECREF(seen);
+			Py_DECREF(keys);
+			return NULL;
+		}
+		Py_DECREF(name);
+	}
+	Py_DECREF(seen);
+
+	return keys;
+}
+
+/*
+ *	pairs.get('User-Name', default)
+ */
+static PyObject *python_pairs_get(PyObject *self, PyObject *args)
+{
+	PyObject	*key, *dflt = Py_None, *value;
+
+	if (!PyArg_ParseTuple(args, "O|O", &key, &dflt)) return NULL;
+
+	value = python_pairs_getitem(self, key);
+	if (value || !PyErr_ExceptionMatches(PyExc_KeyError)) return value;
+	PyErr_Clear();
+
+	Py_INCREF(dflt);
+	return dflt;
+}
+
+static PyObject *python_pairs_iter(PyObject *self)
+{
+	PyObject	*keys, *iter;
+
+	keys = python_pairs_keys(self, NULL);
+	if (!keys) return NULL;
+
+	iter = PyObject_GetIter(keys);
+	Py_DECREF(keys);
+
+	return iter;
+}
+
+static void python_pairs_dealloc(PyObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+
+	type->tp_free(self);
+	Py_DECREF(type);	/* Instances of heap types hold a reference to their type */
+}
+
+static PyMethodDef python_pairs_methods[] = {
+	{ "get", &python_pairs_get, METH_VARARGS,
+	  "get(name[, default])\n\nReturn the value of an attribute, or default if it isn't in the list.\n"
+	},
+	{ "keys", &python_pairs_keys, METH_NOARGS,
+	  "keys()\n\nReturn the names of the attributes in the list.\n"
+	},
+	{ NULL, NULL, 0, NULL },
+};
+
+static PyType_Slot python_pairs_slots[] = {
+	{ Py_tp_doc, UNCONST(char *, "A pair list of the request being processed") },
+	{ Py_tp_dealloc, python_pairs_dealloc },
+	{ Py_tp_iter, python_pairs_iter },
+	{ Py_tp_methods, python_pairs_methods },
+	{ Py_mp_subscript, python_pairs_getitem },
+	{ Py_mp_ass_subscript, python_pairs_setitem },
+	{ Py_sq_contains, python_pairs_contains },
+	{ 0, NULL }
+};
+
+/*
+ *	A heap type, so that each interpreter gets its own copy.
+ */
+static PyType_Spec python_pairs_spec = {
+	.name = "freeradius.Pairs",
+	.basicsize = sizeof(python_pairs_t),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = python_pairs_slots
+};
+
+/** Build the argument passed to functions with lazy_pairs
+ *
+ * A dict of Pairs objects, one per list.  The objects are also
+ * written to lists, so they can be invalidated after the call.
+ */
+static PyObject *python_pairs_arg(PyObject *type, request_t *request, python_pairs_t *lists[static 4])
+{
+	PyObject	*dict;
+	size_t		i;
+	struct {
+		char const	*name;
+		TALLOC_CTX	*ctx;
+		fr_pair_list_t	*list;
+	} const map[] = {
+		{ "request", request->request_ctx, &request->request_pairs },
+		{ "reply", request->reply_ctx, &request->reply_pairs },
+		{ "control", request->control_ctx, &request->control_pairs },
+		{ "session-state", request->session_state_ctx, &request->session_state_pairs }
+	};
+
+	dict = PyDict_New();
+	if (!dict) return NULL;
+
+	for (i = 0; i < NUM_ELEMENTS(map); i++) {
+		python_pairs_t *pairs;
+
+		pairs = PyObject_New(python_pairs_t, (PyTypeObject *)type);
+		if (!pairs) {
+		error:
+			Py_DECREF(dict);
+			return NULL;
+		}
+		pairs->request = request;
+		pairs->ctx = map[i].ctx;
+		pairs->list = map[i].list;
+		lists[i] = pairs;
+
+		if (PyDict_SetItemString(dict, map[i].name, (PyObject *)pairs) < 0) goto error;
+	}
+
+	return dict;
+}
+
 static unlang_action_t do_python_single(rlm_rcode_t *p_result, module_ctx_t const *mctx,
 					request_t *request, PyObject *p_func, char const *funcname)
 {
@@ -481,6 +887,24 @@ static unlang_action_t do_python_single(rlm_rcode_t *p_result, module_ctx_t cons
 	PyObject	*p_arg = NULL;
 	int		tuple_len;
 	rlm_rcode_t	rcode = RLM_MODULE_OK;
+	rlm_python_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_python_t);
+	python_pairs_t	*lists[4] = { NULL };
+	size_t		n;
+
+	/*
+	 *	Pass objects which look up attributes when
+	 *	they're used, instead of copying the request.
+	 */
+	if (request && inst->lazy_pairs) {
+		rlm_python_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
+
+		p_arg = python_pairs_arg(t->pairs_type, request, lists);
+		if (!p_arg) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+		goto call;
+	}
 
 	/*
 	 *	We will pass a tuple containing (name, value) tuples
@@ -527,6 +951,7 @@ static unlang_action_t do_python_single(rlm_rcode_t *p_result, module_ctx_t cons
 		}
 	}
 
+call:
 	/* Call Python function. */
 	p_ret = PyObject_CallFunctionObjArgs(p_func, p_arg, NULL);
 	if (!p_ret) {
@@ -594,6 +1019,17 @@ static unlang_action_t do_python_single(rlm_rcode_t *p_result, module_ctx_t cons
 
 finish:
 	if (rcode == RLM_MODULE_FAIL) python_error_log(mctx, request);
+
+	/*
+	 *	The function may have kept references to the
+	 *	objects, which mustn't be used after the request
+	 *	has gone.
+	 */
+	for (n = 0; n < NUM_ELEMENTS(lists); n++) {
+		if (!lists[n]) continue;
+		lists[n]->request = NULL;
+		Py_DECREF(lists[n]);
+	}
 	Py_XDECREF(p_arg);
 	Py_XDECREF(p_ret);
 
@@ -624,10 +1060,25 @@ static unlang_action_t do_python(rlm_rcode_t *p_result, module_ctx_t const *mctx
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/*
+ *	With per_thread_interpreter the functions are the ones
+ *	loaded into the thread's own interpreter.
+ */
+#ifdef PYTHON_PER_THREAD_INTERPRETER
+#  define THREAD_FUNC(x) \
+	if (inst->per_thread_interpreter) { \
+		rlm_python_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t); \
+		return do_python(p_result, mctx, request, t->x.function, #x); \
+	}
+#else
+#  define THREAD_FUNC(x)
+#endif
+
 #define MOD_FUNC(x) \
 static unlang_action_t CC_HINT(nonnull) mod_##x(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request) \
 { \
 	rlm_python_t const *inst = talloc_get_type_abort_const(mctx->inst->data, rlm_python_t); \
+	THREAD_FUNC(x) \
 	return do_python(p_result, mctx, request, inst->x.function, #x);\
 }
 
@@ -774,21 +1225,21 @@ static int python_parse_config(module_inst_ctx_t const *mctx, CONF_SECTION *cs,
 /** Make the current instance's config available within the module we're initialising
  *
  */
-static int python_module_import_config(module_inst_ctx_t const *mctx, CONF_SECTION *conf, PyObject *module)
+static int python_module_import_config(module_inst_ctx_t const *mctx, CONF_SECTION *conf, PyObject *module,
+				       PyObject **pythonconf_dict)
 {
-	rlm_python_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_python_t);
 	CONF_SECTION *cs;
 
 	/*
 	 *	Convert a FreeRADIUS config structure into a python
 	 *	dictionary.
 	 */
-	inst->pythonconf_dict = PyDict_New();
-	if (!inst->pythonconf_dict) {
+	*pythonconf_dict = PyDict_New();
+	if (!*pythonconf_dict) {
 		ERROR("Unable to create python dict for config");
 	error:
-		Py_XDECREF(inst->pythonconf_dict);
-		inst->pythonconf_dict = NULL;
+		Py_XDECREF(*pythonconf_dict);
+		*pythonconf_dict = NULL;
 		python_error_log(MODULE_CTX_FROM_INST(mctx), NULL);
 		return -1;
 	}
@@ -796,13 +1247,13 @@ static int python_module_import_config(module_inst_ctx_t const *mctx, CONF_SECTI
 	cs = cf_section_find(conf, "config", NULL);
 	if (cs) {
 		DEBUG("Inserting \"config\" section into python environment as radiusd.config");
-		if (python_parse_config(mctx, cs, 0, inst->pythonconf_dict) < 0) goto error;
+		if (python_parse_config(mctx, cs, 0, *pythonconf_dict) < 0) goto error;
 	}
 
 	/*
 	 *	Add module configuration as a dict
 	 */
-	if (PyModule_AddObject(module, "config", inst->pythonconf_dict) < 0) goto error;
+	if (PyModule_AddObject(module, "config", *pythonconf_dict) < 0) goto error;
 
 	return 0;
 }
@@ -828,34 +1279,97 @@ static int python_module_import_constants(module_inst_ctx_t const *mctx, PyObjec
 /*
  *	Python 3 interpreter initialisation and destruction
  */
+/** Add the types to a new instance of the freeradius module
+ *
+ */
+static int python_module_exec(PyObject *module)
+{
+	PyObject	*type;
+
+	type = PyType_FromSpec(&python_pairs_spec);
+	if (!type) return -1;
+
+	if (PyModule_AddObject(module, "Pairs", type) < 0) {
+		Py_DECREF(type);
+		return -1;
+	}
+
+	return 0;
+}
+
 static PyObject *python_module_init(void)
 {
-	PyObject		*module;
+	/*
+	 *	Multi-phase initialisation, so that every
+	 *	interpreter gets its own module object.
+	 *	Interpreters with their own GIL can't import
+	 *	modules using single-phase initialisation.
+	 */
+	static PyModuleDef_Slot py_module_slots[] = {
+		{ Py_mod_exec, python_module_exec },
+#ifdef PYTHON_PER_THREAD_INTERPRETER
+		{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+		{ 0, NULL }
+	};
 
 	static struct PyModuleDef py_module_def = {
 		PyModuleDef_HEAD_INIT,
 		.m_name = "freeradius",
 		.m_doc = "freeRADIUS python module",
-		.m_size = -1,
-		.m_methods = module_methods
+		.m_size = 0,
+		.m_methods = module_methods,
+		.m_slots = py_module_slots
 	};
 
 	fr_assert(current_mctx);
 
-	module = PyModule_Create(&py_module_def);
+	return PyModuleDef_Init(&py_module_def);
+}
+
+/** Import the freeradius module into the current interpreter
+ *
+ * Each interpreter gets its own copy of the module, which
+ * it can mutate as much as it wants.
+ */
+static int python_module_import(module_inst_ctx_t const *mctx, PyObject **module_p, PyObject **pythonconf_dict,
+				PyObject **pairs_type)
+{
+	PyObject	*module;
+
+	module = PyImport_ImportModule("freeradius");
 	if (!module) {
-		python_error_log(current_mctx, NULL);
-		Py_RETURN_NONE;
+		ERROR("Failed importing \"freeradius\" module into interpreter");
+		python_error_log(MODULE_CTX_FROM_INST(mctx), NULL);
+		return -1;
+	}
+	if ((python_module_import_config(mctx, mctx->inst->conf, module, pythonconf_dict) < 0) ||
+	    (python_module_import_constants(mctx, module) < 0)) {
+		Py_DECREF(module);
+		return -1;
 	}
 
-	return module;
+	/*
+	 *	The module holds a reference to the type, for
+	 *	as long as the interpreter exists.
+	 */
+	*pairs_type = PyObject_GetAttrString(module, "Pairs");
+	if (!*pairs_type) {
+		python_error_log(MODULE_CTX_FROM_INST(mctx), NULL);
+		Py_DECREF(module);
+		return -1;
+	}
+	Py_DECREF(*pairs_type);
+
+	*module_p = module;
+
+	return 0;
 }
 
 static int python_interpreter_init(module_inst_ctx_t const *mctx)
 {
 	rlm_python_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_python_t);
 	CONF_SECTION	*conf = mctx->inst->conf;
-	PyObject	*module;
 
 	/*
 	 *	python_module_init takes no args, so we need
@@ -879,21 +1393,9 @@ static int python_interpreter_init(module_inst_ctx_t const *mctx)
 
 	/*
 	 *	Import the radiusd module into this python
-	 *	environment.  Each interpreter gets its
-	 *	own copy which it can mutate as much as
-	 *      it wants.
+	 *	environment.
 	 */
- 	module = PyImport_ImportModule("freeradius");
- 	if (!module) {
- 		ERROR("Failed importing \"freeradius\" module into interpreter %p", inst->interpreter);
- 		return -1;
- 	}
-	if ((python_module_import_config(mctx, conf, module) < 0) ||
-	    (python_module_import_constants(mctx, module) < 0)) {
-		Py_DECREF(module);
-		return -1;
-	}
-	inst->module = module;
+	if (python_module_import(mctx, &inst->module, &inst->pythonconf_dict, &inst->pairs_type) < 0) return -1;
 	PyEval_SaveThread();
 
 	return 0;
@@ -928,6 +1430,13 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	rlm_python_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_python_t);
 
+#ifndef PYTHON_PER_THREAD_INTERPRETER
+	if (inst->per_thread_interpreter) {
+		WARN("per_thread_interpreter requires Python 3.12 or later, all threads will share one interpreter");
+		inst->per_thread_interpreter = false;
+	}
+#endif
+
 	if (python_interpreter_init(mctx) < 0) return -1;
 
 	/*
@@ -1020,6 +1529,85 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 	return 0;
 }
 
+#ifdef PYTHON_PER_THREAD_INTERPRETER
+/** Create an interpreter with its own GIL for this thread
+ *
+ * The user's module is imported into the new interpreter, so any
+ * module level state is per thread.  The instantiate and detach
+ * functions are still only called in the instance's interpreter.
+ *
+ * C extensions which don't support multiple interpreters
+ * can't be imported.
+ */
+static int python_thread_interpreter_init(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_python_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_python_t);
+	rlm_python_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
+	module_inst_ctx_t const	*inst_mctx = MODULE_INST_CTX(mctx->inst);
+	PyObject		*pythonconf_dict;
+	PyStatus		status;
+	PyInterpreterConfig	config = {
+		.use_main_obmalloc = 0,
+		.allow_fork = 0,
+		.allow_exec = 0,
+		.allow_threads = 1,
+		.allow_daemon_threads = 0,
+		.check_multi_interp_extensions = 1,
+		.gil = PyInterpreterConfig_OWN_GIL,
+	};
+
+	/*
+	 *	Releases the instance interpreter's GIL, and
+	 *	returns holding the new interpreter's GIL.
+	 */
+	PyEval_RestoreThread(t->parent);
+	LSAN_DISABLE(status = Py_NewInterpreterFromConfig(&t->state, &config));
+	if (PyStatus_Exception(status)) {
+		ERROR("Failed creating thread interpreter: %s", status.err_msg ? status.err_msg : "Unknown error");
+		t->state = NULL;
+		PyEval_SaveThread();
+		return -1;
+	}
+	DEBUG3("Created new thread interpreter %p", t->state);
+
+	if (python_module_import(inst_mctx, &t->module, &pythonconf_dict, &t->pairs_type) < 0) {
+	error:
+		PyEval_SaveThread();
+		return -1;
+	}
+
+#define PYTHON_THREAD_FUNC_LOAD(_x) \
+	t->_x.module_name = inst->_x.module_name; \
+	t->_x.function_name = inst->_x.function_name; \
+	if (python_function_load(inst_mctx, &t->_x) < 0) goto error
+	PYTHON_THREAD_FUNC_LOAD(authenticate);
+	PYTHON_THREAD_FUNC_LOAD(authorize);
+	PYTHON_THREAD_FUNC_LOAD(preacct);
+	PYTHON_THREAD_FUNC_LOAD(accounting);
+	PYTHON_THREAD_FUNC_LOAD(post_auth);
+
+	PyEval_SaveThread();
+
+	return 0;
+}
+
+static void python_thread_interpreter_free(rlm_python_thread_t *t)
+{
+	PyEval_RestoreThread(t->state);
+
+#define PYTHON_THREAD_FUNC_DESTROY(_x) python_function_destroy(&t->_x)
+	PYTHON_THREAD_FUNC_DESTROY(authorize);
+	PYTHON_THREAD_FUNC_DESTROY(authenticate);
+	PYTHON_THREAD_FUNC_DESTROY(preacct);
+	PYTHON_THREAD_FUNC_DESTROY(accounting);
+	PYTHON_THREAD_FUNC_DESTROY(post_auth);
+	python_obj_destroy(&t->module);
+
+	Py_EndInterpreter(t->state);	/* Sets thread state to NULL, and releases the interpreter's GIL */
+	t->state = NULL;
+}
+#endif
+
 static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 {
 	PyThreadState		*state;
@@ -1034,6 +1622,14 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 
 	DEBUG3("Initialised new thread state %p", state);
 	t->state = state;
+	t->pairs_type = inst->pairs_type;
+
+#ifdef PYTHON_PER_THREAD_INTERPRETER
+	if (inst->per_thread_interpreter) {
+		t->parent = state;
+		return python_thread_interpreter_init(mctx);
+	}
+#endif
 
 	return 0;
 }
@@ -1042,6 +1638,13 @@ static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
 {
 	rlm_python_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
 
+#ifdef PYTHON_PER_THREAD_INTERPRETER
+	if (t->parent) {
+		if (t->state) python_thread_interpreter_free(t);
+		t->state = t->parent;
+	}
+#endif
+
 	PyEval_RestoreThread(t->state);	/* Swap in our local thread state */
 	PyThreadState_Clear(t->state);
 	PyEval_SaveThread();
@@ -38,6 +38,12 @@ RCSID("$Id$")
 #include "rlm_radius.h"
 #include "track.h"
 
+/** Length of the Vendor-Specific attribute carrying Extended-ID
+ *
+ * Type, length, vendor, vendor type, vendor length, and a 32-bit value.
+ */
+#define UDP_EXTENDED_ID_LENGTH	(2 + 4 + 2 + 4)
+
 /** Static configuration for the module.
  *
  */
@@ -58,6 +64,10 @@ typedef struct {
 	uint32_t		max_packet_size;	//!< Maximum packet size.
 	uint16_t		max_send_coalesce;	//!< Maximum number of packets to coalesce into one mmsg call.
 
+	uint16_t		num_ports;		//!< How many sockets (source ports) each connection uses.
+	bool			extended_id;		//!< Offer Extended-ID in Status-Server, so that the
+							///< ID spaces can share one socket.
+
 	bool			recv_buff_is_set;	//!< Whether we were provided with a recv_buf
 	bool			send_buff_is_set;	//!< Whether we were provided with a send_buf
 	bool			replicate;		//!< Copied from parent->replicate
@@ -71,6 +81,9 @@ typedef struct {
 	rlm_radius_udp_t const	*inst;			//!< our instance
 
 	fr_trunk_t		*trunk;			//!< trunk handler
+
+	bool			extended_id_rejected;	//!< The home server replied to a packet with
+							///< Extended-ID with a Protocol-Error.
 } udp_thread_t;
 
 typedef struct {
@@ -83,8 +96,19 @@ typedef struct udp_request_s udp_request_t;
 typedef struct {
 	struct iovec		out;			//!< Describes buffer to send.
 	fr_trunk_request_t	*treq;			//!< Used for signalling.
+	bool			sign;			//!< Sign the packet just before it's sent.
 } udp_coalesced_t;
 
+/** One of the sockets making up a connection
+ *
+ * Each socket has its own source port, and so its own ID space.
+ */
+typedef struct {
+	int			fd;			//!< File descriptor.
+	uint16_t		src_port;		//!< Source port of this socket.
+	radius_track_t		*tt;			//!< RADIUS ID tracking structure for this socket.
+} udp_port_t;
+
 /** Track the handle, which is tightly correlated with the FD
  *
  */
@@ -92,10 +116,19 @@ typedef struct {
 	char const     		*name;			//!< From IP PORT to IP PORT.
 	char const		*module_name;		//!< the module that opened the connection
 
-	int			fd;			//!< File descriptor.
+	int			fd;			//!< File descriptor of the first socket.
+							///< Used for status checks.
+
+	udp_port_t		*ports;			//!< Sockets this connection sends packets on.
+							///< The first is always the one in fd.
+	uint16_t		num_ports;		//!< Number of sockets.
+	bool			extended_id;		//!< The home server supports Extended-ID, so every
+							///< ID space uses the first socket, and packets
+							///< say which space their ID is from.
 
 	struct mmsghdr		*mmsgvec;		//!< Vector of inbound/outbound packets.
 	udp_coalesced_t		*coalesced;		//!< Outbound coalesced requests.
+	fr_radius_sign_multi_t	*sign;			//!< Coalesced packets to sign in one batch.
 
 	size_t			send_buff_actual;	//!< What we believe the maximum SO_SNDBUF size to be.
 							///< We don't try and encode more packet data than this
@@ -118,7 +151,7 @@ typedef struct {
 	uint8_t			*buffer;		//!< Receive buffer.
 	size_t			buflen;			//!< Receive buffer length.
 
-	radius_track_t		*tt;			//!< RADIUS ID tracking structure.
+	radius_track_t		*tt;			//!< RADIUS ID tracking structure of the first socket.
 
 	fr_time_t		mrs_time;		//!< Most recent sent time which had a reply.
 	fr_time_t		last_reply;		//!< When we last received a reply.
@@ -153,6 +186,7 @@ struct udp_request_s {
 
 	uint8_t			code;			//!< Packet code.
 	uint8_t			id;			//!< Last ID assigned to this packet.
+	uint16_t		port;			//!< Index of the socket the ID belongs to.
 	uint8_t			*packet;		//!< Packet we write to the network.
 	size_t			packet_len;		//!< Length of the packet.
 
@@ -177,6 +211,8 @@ static const conf_parser_t module_config[] = {
 
 	{ FR_CONF_OFFSET("max_packet_size", rlm_radius_udp_t, max_packet_size), .dflt = "4096" },
 	{ FR_CONF_OFFSET("max_send_coalesce", rlm_radius_udp_t, max_send_coalesce), .dflt = "1024" },
+	{ FR_CONF_OFFSET("num_ports", rlm_radius_udp_t, num_ports), .dflt = "1" },
+	{ FR_CONF_OFFSET("extended_id", rlm_radius_udp_t, extended_id), .dflt = "no" },
 
 	{ FR_CONF_OFFSET_TYPE_FLAGS("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, 0, rlm_radius_udp_t, src_ipaddr) },
 	{ FR_CONF_OFFSET_TYPE_FLAGS("src_ipv4addr", FR_TYPE_IPV4_ADDR, 0, rlm_radius_udp_t, src_ipaddr) },
@@ -197,6 +233,7 @@ static fr_dict_attr_t const *attr_acct_delay_time;
 static fr_dict_attr_t const *attr_error_cause;
 static fr_dict_attr_t const *attr_event_timestamp;
 static fr_dict_attr_t const *attr_extended_attribute_1;
+static fr_dict_attr_t const *attr_extended_id;
 static fr_dict_attr_t const *attr_message_authenticator;
 static fr_dict_attr_t const *attr_nas_identifier;
 static fr_dict_attr_t const *attr_original_packet_code;
@@ -211,6 +248,7 @@ fr_dict_attr_autoload_t rlm_radius_udp_dict_attr[] = {
 	{ .out = &attr_error_cause, .name = "Error-Cause", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_event_timestamp, .name = "Event-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_radius},
 	{ .out = &attr_extended_attribute_1, .name = "Extended-Attribute-1", .type = FR_TYPE_TLV, .dict = &dict_radius},
+	{ .out = &attr_extended_id, .name = "Vendor-Specific.FreeRADIUS.Extended-ID", .type = FR_TYPE_UINT32, .dict = &dict_radius},
 	{ .out = &attr_message_authenticator, .name = "Message-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_nas_identifier, .name = "NAS-Identifier", .type = FR_TYPE_STRING, .dict = &dict_radius},
 	{ .out = &attr_original_packet_code, .name = "Extended-Attribute-1.Original-Packet-Code", .type = FR_TYPE_UINT32, .dict = &dict_radius},
@@ -262,7 +300,8 @@ static rlm_rcode_t radius_code_to_rcode[FR_RADIUS_CODE_MAX] = {
 static void		conn_writable_status_check(UNUSED fr_event_list_t *el, UNUSED int fd,
 						   UNUSED int flags, void *uctx);
 
-static int 		encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u, uint8_t id);
+static int 		encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u, uint8_t id,
+			       bool extended_id, bool *sign);
 
 static decode_fail_t	decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *response_code,
 			       udp_handle_t *h, request_t *request, udp_request_t *u,
@@ -312,6 +351,129 @@ static void udp_request_reset(udp_request_t *u)
 	u->can_retransmit = false;
 }
 
+/** Count the tracking entries in use across all of a connection's sockets
+ *
+ */
+static uint32_t udp_num_requests(udp_handle_t const *h)
+{
+	uint32_t	num = 0;
+	uint16_t	i;
+
+	for (i = 0; i < h->num_ports; i++) {
+		if (h->ports[i].tt) num += h->ports[i].tt->num_requests;
+	}
+
+	return num;
+}
+
+/** Pick the socket to allocate a new ID from
+ *
+ * Sockets are filled in order, so that packets sent together are more
+ * likely to go out on the same socket with a single sendmmsg() call.
+ *
+ * @return index of the first socket which has a free ID, or the first
+ *	socket if none do, in which case allocating the ID will fail.
+ */
+static uint16_t udp_port_select(udp_handle_t const *h)
+{
+	uint16_t	i;
+
+	for (i = 0; i < h->num_ports; i++) {
+		if (h->ports[i].tt->num_requests <= UINT8_MAX) return i;
+	}
+
+	return 0;
+}
+
+/** Find the Extended-ID attribute in a packet
+ *
+ * This is done before the packet is verified, as which ID space the
+ * reply is for decides which request authenticator it's verified with.
+ *
+ * @param[out] out	The value of Extended-ID.
+ * @param[in] data	of the packet.
+ * @param[in] data_len	of the packet.  Must be at least RADIUS_HEADER_LENGTH.
+ * @return
+ *	- true if the packet contains Extended-ID.
+ *	- false if it doesn't.
+ */
+static bool udp_extended_id_find(uint32_t *out, uint8_t const *data, size_t data_len)
+{
+	uint8_t const	*attr, *end;
+	size_t		packet_len = fr_nbo_to_uint16(data + 2);
+
+	if (packet_len < data_len) data_len = packet_len;
+	end = data + data_len;
+
+	for (attr = data + RADIUS_HEADER_LENGTH;
+	     ((attr + 2) <= end) && (attr[1] >= 2) && ((attr + attr[1]) <= end);
+	     attr += attr[1]) {
+		if (attr[0] != FR_VENDOR_SPECIFIC) continue;
+		if (attr[1] != UDP_EXTENDED_ID_LENGTH) continue;
+		if (fr_nbo_to_uint32(attr + 2) != attr_extended_id->parent->attr) continue;
+		if ((attr[6] != attr_extended_id->attr) || (attr[7] != 6)) continue;
+
+		*out = fr_nbo_to_uint32(attr + 8);
+		return true;
+	}
+
+	return false;
+}
+
+/** Find the tracking entry for a reply
+ *
+ * When the ID spaces share one socket, the reply echoes the Extended-ID
+ * of the request, which says which space its ID is from.
+ *
+ * A reply without one, e.g. a Protocol-Error from a home server which
+ * doesn't understand Extended-ID after all, is checked against the
+ * request with that ID in every space.  Only the right one will have
+ * the request authenticator the reply was signed with.
+ *
+ * @param[in] h		the reply was received on.
+ * @param[in] port	the reply was received on.
+ * @param[in] data	of the reply.
+ * @param[in] data_len	of the reply.  Must be at least RADIUS_HEADER_LENGTH.
+ * @return
+ *	- The tracking entry.
+ *	- NULL if no request matches the reply.
+ */
+static radius_track_entry_t *udp_track_entry_find(udp_handle_t *h, udp_port_t *port, uint8_t *data, size_t data_len)
+{
+	rlm_radius_udp_t const	*inst = h->inst;
+	uint32_t		space;
+	uint16_t		i;
+
+	if (!h->extended_id) return radius_track_entry_find(port->tt, data[1], NULL);
+
+	if (udp_extended_id_find(&space, data, data_len)) {
+		if (space >= h->num_ports) return NULL;
+
+		return radius_track_entry_find(h->ports[space].tt, data[1], NULL);
+	}
+
+	for (i = 0; i < h->num_ports; i++) {
+		radius_track_entry_t	*rr;
+		uint8_t			original[RADIUS_HEADER_LENGTH];
+
+		rr = radius_track_entry_find(h->ports[i].tt, data[1], NULL);
+		if (!rr) continue;
+
+		original[0] = rr->code;
+		original[1] = 0;
+		original[2] = 0;
+		original[3] = RADIUS_HEADER_LENGTH;
+		memcpy(original + RADIUS_AUTH_VECTOR_OFFSET, rr->vector, RADIUS_AUTH_VECTOR_LENGTH);
+
+		if (fr_radius_verify(data, original,
+				     (uint8_t const *) inst->secret, talloc_array_length(inst->secret) - 1, false) == 0) {
+			return rr;
+		}
+	}
+
+	return NULL;
+}
+
 /** Reset a status_check packet, ready to reuse
  *
  */
@@ -524,6 +686,75 @@ static void conn_status_check_again(fr_event_list_t *el, UNUSED fr_time_t now, v
 /** Read the incoming status-check response.  If it's correct mark the connection as connected
  *
  */
+/** Set up the sockets for the ID spaces after the first
+ *
+ * If the home server supports Extended-ID, they all use the first
+ * socket.  Otherwise each one gets a socket of its own.
+ *
+ * @param[in] h		to set up the sockets for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int udp_ports_open(udp_handle_t *h)
+{
+	uint16_t	i;
+
+	if (h->num_ports == 1) return 0;
+
+	if (h->extended_id) {
+		for (i = 1; i < h->num_ports; i++) {
+			h->ports[i].fd = h->fd;
+			h->ports[i].src_port = h->src_port;
+		}
+
+		talloc_const_free(h->name);
+		h->name = fr_asprintf(h, "proto udp local %pV port %u (%u Extended-IDs) remote %pV port %u",
+				      fr_box_ipaddr(h->src_ipaddr), h->src_port, h->num_ports,
+				      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+		return 0;
+	}
+
+	for (i = 1; i < h->num_ports; i++) {
+		udp_port_t	*port = &h->ports[i];
+		fr_ipaddr_t	src_ipaddr = h->inst->src_ipaddr;
+
+		port->fd = fr_socket_client_udp(h->inst->interface, &src_ipaddr, &port->src_port,
+						&h->inst->dst_ipaddr, h->inst->dst_port, true);
+		if (port->fd < 0) {
+			PERROR("%s - Failed opening additional socket", h->module_name);
+			return -1;
+		}
+
+#ifdef SO_RCVBUF
+		if (h->inst->recv_buff_is_set) {
+			int opt = h->inst->recv_buff;
+
+			if (setsockopt(port->fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(int)) < 0) {
+				WARN("%s - Failed setting 'SO_RCVBUF': %s", h->module_name, fr_syserror(errno));
+			}
+		}
+#endif
+
+#ifdef SO_SNDBUF
+		if (h->inst->send_buff_is_set) {
+			int opt = h->inst->send_buff;
+
+			if (setsockopt(port->fd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(int)) < 0) {
+				WARN("%s - Failed setting 'SO_SNDBUF', write performance may be sub-optimal: %s",
+				     h->module_name, fr_syserror(errno));
+			}
+		}
+#endif
+	}
+
+	talloc_const_free(h->name);
+	h->name = fr_asprintf(h, "proto udp local %pV port %u (+%u sockets) remote %pV port %u",
+			      fr_box_ipaddr(h->src_ipaddr), h->src_port, h->num_ports - 1,
+			      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+	return 0;
+}
+
 static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
 {
 	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
@@ -581,6 +812,15 @@ static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
 
 	fr_pair_list_free(&reply);	/* FIXME - Do something with these... */
 
+	/*
+	 *	The home server echoes Extended-ID if it supports it.
+	 */
+	if (h->inst->extended_id && !h->thread->extended_id_rejected && (code != FR_RADIUS_CODE_PROTOCOL_ERROR)) {
+		uint32_t	space;
+
+		if (udp_extended_id_find(&space, h->buffer, slen) && (space == 0)) h->extended_id = true;
+	}
+
 	/*
 	 *	Process the error, and count this as a success.
 	 *	This is usually used for dynamic configuration
@@ -618,6 +858,11 @@ static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
 	 */
 	status_check_reset(h, u);
 
+	if (h->inst->extended_id && (udp_ports_open(h) < 0)) {
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
 	DEBUG("%s - Connection open - %s", h->module_name, h->name);
 
 	fr_connection_signal_connected(conn);
@@ -650,7 +895,12 @@ static void conn_writable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
 	DEBUG("%s - Sending %s ID %d length %ld over connection %s",
 	      h->module_name, fr_radius_packet_names[u->code], u->id, u->packet_len, h->name);
 
-	if (encode(h->inst, h->status_request, u, u->id) < 0) {
+	/*
+	 *	Offer Extended-ID.  The home server echoes it
+	 *	back if it supports it.
+	 */
+	if (encode(h->inst, h->status_request, u, u->id,
+		   h->inst->extended_id && !h->thread->extended_id_rejected, NULL) < 0) {
 	fail:
 		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
 		return;
@@ -690,10 +940,24 @@ static void conn_writable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
  */
 static int _udp_handle_free(udp_handle_t *h)
 {
+	uint16_t	i;
+
 	fr_assert(h->fd >= 0);
 
 	if (h->status_u) fr_event_timer_delete(&h->status_u->ev);
 
+	/*
+	 *	Close any additional sockets.  The first
+	 *	is closed below.
+	 */
+	for (i = 1; i < h->num_ports; i++) {
+		if ((h->ports[i].fd < 0) || (h->ports[i].fd == h->fd)) continue;
+
+		fr_event_fd_delete(h->thread->el, h->ports[i].fd, FR_EVENT_FILTER_IO);
+		close(h->ports[i].fd);
+		h->ports[i].fd = -1;
+	}
+
 	fr_event_fd_delete(h->thread->el, h->fd, FR_EVENT_FILTER_IO);
 
 	if (shutdown(h->fd, SHUT_RDWR) < 0) {
@@ -743,6 +1007,7 @@ static fr_connection_state_t conn_init(void **h_out, fr_connection_t *conn, void
 	 */
 	h->mmsgvec = talloc_zero_array(h, struct mmsghdr, h->inst->max_send_coalesce);
 	h->coalesced = talloc_zero_array(h, udp_coalesced_t, h->inst->max_send_coalesce);
+	h->sign = talloc_zero_array(h, fr_radius_sign_multi_t, h->inst->max_send_coalesce);
 	for (i = 0; i < h->inst->max_send_coalesce; i++) {
 		h->mmsgvec[i].msg_hdr.msg_iov = &h->coalesced[i].out;
 		h->mmsgvec[i].msg_hdr.msg_iovlen = 1;
@@ -836,6 +1101,26 @@ static fr_connection_state_t conn_init(void **h_out, fr_connection_t *conn, void
 
 	h->fd = fd;
 
+	/*
+	 *	The first socket is the one we've just opened.
+	 *	Any others give us more IDs to use without needing
+	 *	more connections.
+	 */
+	h->num_ports = h->inst->num_ports;
+	MEM(h->ports = talloc_zero_array(h, udp_port_t, h->num_ports));
+	h->ports[0] = (udp_port_t){ .fd = fd, .src_port = h->src_port, .tt = h->tt };
+	for (i = 1; i < h->num_ports; i++) {
+		h->ports[i].fd = -1;
+		MEM(h->ports[i].tt = radius_track_alloc(h));
+	}
+
+	/*
+	 *	With Extended-ID, we only know whether we need the
+	 *	other sockets once the home server has replied to
+	 *	the first Status-Server.
+	 */
+	if (!h->inst->extended_id && (udp_ports_open(h) < 0)) goto fail;
+
 	/*
 	 *	If we're doing status checks, then we want at least
 	 *	one positive response before signalling that the
@@ -886,11 +1171,16 @@ static void conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uc
 	 *	this is bad, they should have all been
 	 *	released.
 	 */
-	if (h->tt && (h->tt->num_requests != 0)) {
+	if (h->tt && (udp_num_requests(h) != 0)) {
 #ifndef NDEBUG
-		radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__, h->tt, udp_tracking_entry_log);
+		uint16_t i;
+
+		for (i = 0; i < h->num_ports; i++) {
+			radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__,
+					       h->ports[i].tt, udp_tracking_entry_log);
+		}
 #endif
-		fr_assert_fail("%u tracking entries still allocated at conn close", h->tt->num_requests);
+		fr_assert_fail("%u tracking entries still allocated at conn close", udp_num_requests(h));
 	}
 
 	DEBUG4("Freeing rlm_radius_udp handle %p", handle);
@@ -1010,6 +1300,7 @@ static void thread_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *co
 	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
 	fr_event_fd_cb_t	read_fn = NULL;
 	fr_event_fd_cb_t	write_fn = NULL;
+	uint16_t		i;
 
 	switch (notify_on) {
 		/*
@@ -1043,12 +1334,37 @@ static void thread_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *co
 			       write_fn,
 			       conn_error,
 			       tconn) < 0) {
+	fail:
 		PERROR("%s - Failed inserting FD event", h->module_name);
 
 		/*
 		 *	May free the connection!
 		 */
 		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	Additional sockets only ever need to be read.
+	 *	Writability of the first socket drives the
+	 *	mux for all of them, and the demux drains
+	 *	every socket whichever one became readable.
+	 *
+	 *	Replies to packets sent on them can arrive
+	 *	whenever the connection isn't being drained,
+	 *	even if the trunk is only waiting for the first
+	 *	socket to become writable.
+	 */
+	if (read_fn != conn_discard) read_fn = fr_trunk_connection_callback_readable;
+
+	for (i = 1; i < h->num_ports; i++) {
+		if (h->ports[i].fd == h->fd) continue;
+
+		if (fr_event_fd_insert(h, el, h->ports[i].fd,
+				       read_fn,
+				       NULL,
+				       conn_error,
+				       tconn) < 0) goto fail;
 	}
 }
 
@@ -1232,12 +1548,29 @@ static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *res
 	return DECODE_FAIL_NONE;
 }
 
-static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u, uint8_t id)
+/** Encode a packet
+ *
+ * @param[in] inst	of the UDP transport.
+ * @param[in] request	the packet is for.
+ * @param[in] u		to encode the packet into.
+ * @param[in] id	of the packet.
+ * @param[in] extended_id	Add an Extended-ID attribute, saying which of the
+ *			connection's ID spaces id is from.
+ * @param[out] sign	If NULL, the packet is signed here.  Otherwise, it's
+ *			set to whether the packet needs signing, and the
+ *			caller signs it, usually with other packets.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u, uint8_t id,
+		  bool extended_id, bool *sign)
 {
 	ssize_t			packet_len;
 	uint8_t			*msg = NULL;
 	int			message_authenticator = u->require_ma * (RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2);
 	int			proxy_state = 6;
+	int			extended = extended_id * UDP_EXTENDED_ID_LENGTH;
 
 	fr_assert(inst->parent->allowed[u->code]);
 	fr_assert(!u->packet);
@@ -1311,13 +1644,13 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 	 *	We should have at minimum 64-byte packets, so don't
 	 *	bother doing run-time checks here.
 	 */
-	fr_assert(u->packet_len >= (size_t) (RADIUS_HEADER_LENGTH + proxy_state + message_authenticator));
+	fr_assert(u->packet_len >= (size_t) (RADIUS_HEADER_LENGTH + proxy_state + extended + message_authenticator));
 
 	/*
-	 *	Encode it, leaving room for Proxy-State and
-	 *	Message-Authenticator if necessary.
+	 *	Encode it, leaving room for Proxy-State, Extended-ID
+	 *	and Message-Authenticator if necessary.
 	 */
-	packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + message_authenticator), NULL,
+	packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + extended + message_authenticator), NULL,
 				      inst->secret, talloc_array_length(inst->secret) - 1,
 				      u->code, id, &request->request_pairs);
 	if (fr_pair_encode_is_error(packet_len)) {
@@ -1332,7 +1665,7 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 		size_t have;
 		size_t need;
 
-		have = u->packet_len - (proxy_state + message_authenticator);
+		have = u->packet_len - (proxy_state + extended + message_authenticator);
 		need = have - packet_len;
 
 		if (need > RADIUS_MAX_PACKET_SIZE) {
@@ -1348,7 +1681,7 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 	/*
 	 *	The encoded packet should NOT over-run the input buffer.
 	 */
-	fr_assert((size_t) (packet_len + proxy_state + message_authenticator) <= u->packet_len);
+	fr_assert((size_t) (packet_len + proxy_state + extended + message_authenticator) <= u->packet_len);
 
 	/*
 	 *	Add Proxy-State to the tail end of the packet.
@@ -1398,6 +1731,28 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 		fr_pair_append(&u->extra, vp);
 	}
 
+	/*
+	 *	Add Extended-ID, which the reply has to echo.  It's
+	 *	the index of the ID space, so the reply is matched
+	 *	to the request by the pair of it and the ID.
+	 */
+	if (extended) {
+		uint8_t		*attr = u->packet + packet_len;
+		fr_pair_t	*vp;
+
+		attr[0] = FR_VENDOR_SPECIFIC;
+		attr[1] = UDP_EXTENDED_ID_LENGTH;
+		fr_nbo_from_uint32(attr + 2, attr_extended_id->parent->attr);
+		attr[6] = (uint8_t)attr_extended_id->attr;
+		attr[7] = 6;
+		fr_nbo_from_uint32(attr + 8, u->port);
+		packet_len += UDP_EXTENDED_ID_LENGTH;
+
+		MEM(vp = fr_pair_afrom_da(u->packet, attr_extended_id));
+		vp->vp_uint32 = u->port;
+		fr_pair_append(&u->extra, vp);
+	}
+
 	/*
 	 *	Add Message-Authenticator manually.
 	 *
@@ -1465,6 +1820,8 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 		u->can_retransmit = false;
 	}
 
+	if (sign) *sign = false;
+
 	/*
 	 *	Only certain types of packet, and those with a
 	 *	message_authenticator need signing.
@@ -1475,6 +1832,11 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 	case FR_RADIUS_CODE_DISCONNECT_REQUEST:
 	case FR_RADIUS_CODE_COA_REQUEST:
 	sign:
+		if (sign) {
+			*sign = true;
+			break;
+		}
+
 		/*
 		 *	Now that we're done mangling the packet, sign it.
 		 */
@@ -1746,83 +2108,51 @@ static void status_check_retry(UNUSED fr_event_list_t *el, fr_time_t now, void *
         fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
 }
 
-static void request_mux(fr_event_list_t *el,
-			fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+/** Sign the packets coalesced by request_mux()
+ *
+ * The Message-Authenticators and Request Authenticators of all the
+ * packets are calculated in one pass of fr_radius_sign_multi(), which
+ * is much cheaper than signing them one at a time.
+ *
+ * Requests whose packets can't be signed are failed, and removed
+ * from h->coalesced.
+ *
+ * @param[in] h		handle of the connection.
+ * @param[in] queued	number of entries in h->coalesced.
+ * @return the number of entries left in h->coalesced.
+ */
+static uint16_t request_mux_sign(udp_handle_t *h, uint16_t queued)
 {
-	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
 	rlm_radius_udp_t const	*inst = h->inst;
-	int			sent;
-	uint16_t		i, queued;
-	size_t			total_len = 0;
+	uint16_t		i, num = 0, used = 0;
 
-	/*
-	 *	Encode multiple packets in preparation
-	 *      for transmission with sendmmsg.
-	 */
-	for (i = 0, queued = 0; (i < inst->max_send_coalesce) && (total_len < h->send_buff_actual); i++) {
-		fr_trunk_request_t	*treq;
-		udp_request_t		*u;
-		request_t		*request;
-
- 		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+	for (i = 0; i < queued; i++) {
+		if (!h->coalesced[i].sign) continue;
 
-		/*
-		 *	No more requests to send
-		 */
-		if (!treq) break;
-
- 		fr_assert((treq->state == FR_TRUNK_REQUEST_STATE_PENDING) ||
-			   (treq->state == FR_TRUNK_REQUEST_STATE_PARTIAL));
+		h->sign[num++] = (fr_radius_sign_multi_t){
+			.packet = h->coalesced[i].out.iov_base,
+			.secret = (uint8_t const *) inst->secret,
+			.secret_len = talloc_array_length(inst->secret) - 1
+		};
+	}
+	if (num == 0) return queued;
 
-		request = treq->request;
-		u = talloc_get_type_abort(treq->preq, udp_request_t);
+	(void) fr_radius_sign_multi(h->sign, num);
 
-		/*
-		 *	Start retransmissions from when the socket is writable.
-		 */
-		if (fr_time_eq(u->retry.start, fr_time_wrap(0))) {
-			(void) fr_retry_init(&u->retry, fr_time(), &h->inst->parent->retry[u->code]);
-			fr_assert(fr_time_delta_ispos(u->retry.rt));
-			fr_assert(fr_time_gt(u->retry.next, fr_time_wrap(0)));
-		}
+	for (i = 0, num = 0; i < queued; i++) {
+		fr_trunk_request_t	*treq = h->coalesced[i].treq;
+		request_t		*request = treq->request;
+		udp_request_t		*u = talloc_get_type_abort(treq->preq, udp_request_t);
 
-		/*
-		 *	No previous packet, OR can't retransmit the
-		 *	existing one.  Oh well.
-		 *
-		 *	Note that if we can't retransmit the previous
-		 *	packet, then u->rr MUST already have been
-		 *	deleted in the request_cancel() function
-		 *	or request_release_conn() function when
-		 *	the REQUEUE signal was received.
-		 */
-		if (!u->packet || !u->can_retransmit) {
-			fr_assert(!u->rr);
+		if (h->coalesced[i].sign) {
+			h->coalesced[i].sign = false;
 
-			if (unlikely(radius_track_entry_reserve(&u->rr, treq, h->tt, request, u->code, treq) < 0)) {
-#ifndef NDEBUG
-				radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__,
-						       h->tt, udp_tracking_entry_log);
-#endif
-				fr_assert_fail("Tracking entry allocation failed: %s", fr_strerror());
+			if (h->sign[num++].rcode < 0) {
+				RPERROR("Failed signing packet");
 				fr_trunk_request_signal_fail(treq);
 				continue;
 			}
-			u->id = u->rr->id;
 
-			RDEBUG("Sending %s ID %d length %ld over connection %s",
-			       fr_radius_packet_names[u->code], u->id, u->packet_len, h->name);
-
-			if (encode(h->inst, request, u, u->id) < 0) {
-				/*
-				 *	Need to do this because request_conn_release
-				 *	may not be called.
-				 */
-				udp_request_reset(u);
-				if (u->ev) (void) fr_event_timer_delete(&u->ev);
-				fr_trunk_request_signal_fail(treq);
-				continue;
-			}
 			RHEXDUMP3(u->packet, u->packet_len, "Encoded packet");
 
 			/*
@@ -1830,53 +2160,49 @@ static void request_mux(fr_event_list_t *el,
 			 *	packet signature.
 			 */
 			(void) radius_track_entry_update(u->rr, u->packet + RADIUS_AUTH_VECTOR_OFFSET);
-		} else {
-			RDEBUG("Retransmitting %s ID %d length %ld over connection %s",
-			       fr_radius_packet_names[u->code], u->id, u->packet_len, h->name);
 		}
 
-		log_request_pair_list(L_DBG_LVL_2, request, NULL, &request->request_pairs, NULL);
-		if (!fr_pair_list_empty(&u->extra)) log_request_pair_list(L_DBG_LVL_2, request, NULL, &u->extra, NULL);
-
 		/*
-		 *	Record pointers to the buffer we'll be writing
-		 *	We store the treq so we can place it back in
-		 *      the pending state if the sendmmsg call fails.
+		 *	mmsgvec points to the iovecs in coalesced, so
+		 *	moving the entries down keeps them in step.
 		 */
-		h->coalesced[queued].treq = treq;
-		h->coalesced[queued].out.iov_base = u->packet;
-		h->coalesced[queued].out.iov_len = u->packet_len;
+		if (used != i) h->coalesced[used] = h->coalesced[i];
+		used++;
+	}
 
-		/*
-		 *	Record how much data we have in total.
-		 *
-		 *	Try not to exceed the SO_SNDBUF value of the
-		 *	socket as we potentially just waste CPU
-		 *	time re-encoding the packets.
-		 */
-		total_len += u->packet_len;
+	return used;
+}
 
-		/*
-		 *	Tell the trunk API that this request is now in
-		 *	the "sent" state.  And we don't want to see
-		 *	this request again. The request hasn't actually
-		 *	been sent, but it's the only way to get at the
-		 *	next entry in the heap.
-		 */
-		fr_trunk_request_signal_sent(treq);
-		queued++;
-	}
-	if (queued == 0) return;	/* No work */
+/** Send the packets coalesced by request_mux() over one socket
+ *
+ * @param[in] el	the connection is running in.
+ * @param[in] tconn	the packets belong to.
+ * @param[in] h		connection handle.
+ * @param[in] port	socket whose IDs the packets were allocated from.
+ * @param[in] queued	number of entries in h->coalesced to send.
+ * @return
+ *	- true if the caller can keep using the connection.
+ *	- false if the connection was signalled to reconnect.
+ */
+static bool request_mux_send(fr_event_list_t *el, fr_trunk_connection_t *tconn, udp_handle_t *h,
+			     udp_port_t *port, uint16_t queued)
+{
+	rlm_radius_udp_t const	*inst = h->inst;
+	int			sent;
+	uint16_t		i;
 
 	/*
 	 *	Verify nothing accidentally freed the connection handle
 	 */
 	(void)talloc_get_type_abort(h, udp_handle_t);
 
+	queued = request_mux_sign(h, queued);
+	if (queued == 0) return true;
+
 	/*
 	 *	Send the coalesced datagrams
 	 */
-	sent = sendmmsg(h->fd, h->mmsgvec, queued, 0);
+	sent = sendmmsg(port->fd, h->mmsgvec, queued, 0);
 	if (sent < 0) {		/* Error means no messages were sent */
 		sent = 0;
 
@@ -1920,7 +2246,7 @@ static void request_mux(fr_event_list_t *el,
 			ERROR("%s - Failed sending data over connection %s: %s",
 			      h->module_name, h->name, fr_syserror(errno));
 			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
-			return;
+			return false;
 		}
 	}
 
@@ -2000,6 +2326,159 @@ static void request_mux(fr_event_list_t *el,
 	 *	the request ready for sending again...
 	 */
 	for (i = sent; i < queued; i++) fr_trunk_request_requeue(h->coalesced[i].treq);
+
+	return true;
+}
+
+static void request_mux(fr_event_list_t *el,
+			fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
+	rlm_radius_udp_t const	*inst = h->inst;
+	uint16_t		i, queued;
+	uint16_t		port = 0;
+	size_t			total_len = 0;
+
+	/*
+	 *	Encode multiple packets in preparation
+	 *      for transmission with sendmmsg.
+	 */
+	for (i = 0, queued = 0; (i < inst->max_send_coalesce) && (total_len < h->send_buff_actual); i++) {
+		fr_trunk_request_t	*treq;
+		udp_request_t		*u;
+		request_t		*request;
+
+ 		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+
+		/*
+		 *	No more requests to send
+		 */
+		if (!treq) break;
+
+ 		fr_assert((treq->state == FR_TRUNK_REQUEST_STATE_PENDING) ||
+			   (treq->state == FR_TRUNK_REQUEST_STATE_PARTIAL));
+
+		request = treq->request;
+		u = talloc_get_type_abort(treq->preq, udp_request_t);
+
+		/*
+		 *	Retransmissions must go out on the socket
+		 *	the ID was allocated from.  New packets go
+		 *	out on the first socket with a free ID.
+		 *
+		 *	sendmmsg() only writes to one socket, so
+		 *	flush what we have if the socket changes.
+		 *	The request hasn't been marked as sent yet,
+		 *	so it's still pending if the flush fails.
+		 */
+		{
+			uint16_t next = (u->packet && u->can_retransmit) ? u->port : udp_port_select(h);
+
+			if (queued && (next != port)) {
+				if (!request_mux_send(el, tconn, h, &h->ports[port], queued)) return;
+				queued = 0;
+				total_len = 0;
+			}
+			port = next;
+		}
+
+		/*
+		 *	Start retransmissions from when the socket is writable.
+		 */
+		if (fr_time_eq(u->retry.start, fr_time_wrap(0))) {
+			(void) fr_retry_init(&u->retry, fr_time(), &h->inst->parent->retry[u->code]);
+			fr_assert(fr_time_delta_ispos(u->retry.rt));
+			fr_assert(fr_time_gt(u->retry.next, fr_time_wrap(0)));
+		}
+
+		/*
+		 *	No previous packet, OR can't retransmit the
+		 *	existing one.  Oh well.
+		 *
+		 *	Note that if we can't retransmit the previous
+		 *	packet, then u->rr MUST already have been
+		 *	deleted in the request_cancel() function
+		 *	or request_release_conn() function when
+		 *	the REQUEUE signal was received.
+		 */
+		if (!u->packet || !u->can_retransmit) {
+			fr_assert(!u->rr);
+
+			if (unlikely(radius_track_entry_reserve(&u->rr, treq, h->ports[port].tt,
+								request, u->code, treq) < 0)) {
+#ifndef NDEBUG
+				radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__,
+						       h->ports[port].tt, udp_tracking_entry_log);
+#endif
+				fr_assert_fail("Tracking entry allocation failed: %s", fr_strerror());
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+			u->id = u->rr->id;
+			u->port = port;
+
+			RDEBUG("Sending %s ID %d length %ld over connection %s",
+			       fr_radius_packet_names[u->code], u->id, u->packet_len, h->name);
+
+			/*
+			 *	Packets are signed together just before
+			 *	they're sent, see request_mux_sign().
+			 */
+			if (encode(h->inst, request, u, u->id, h->extended_id, &h->coalesced[queued].sign) < 0) {
+				/*
+				 *	Need to do this because request_conn_release
+				 *	may not be called.
+				 */
+				udp_request_reset(u);
+				if (u->ev) (void) fr_event_timer_delete(&u->ev);
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+
+			if (!h->coalesced[queued].sign) {
+				RHEXDUMP3(u->packet, u->packet_len, "Encoded packet");
+				(void) radius_track_entry_update(u->rr, u->packet + RADIUS_AUTH_VECTOR_OFFSET);
+			}
+		} else {
+			RDEBUG("Retransmitting %s ID %d length %ld over connection %s",
+			       fr_radius_packet_names[u->code], u->id, u->packet_len, h->name);
+			h->coalesced[queued].sign = false;
+		}
+
+		log_request_pair_list(L_DBG_LVL_2, request, NULL, &request->request_pairs, NULL);
+		if (!fr_pair_list_empty(&u->extra)) log_request_pair_list(L_DBG_LVL_2, request, NULL, &u->extra, NULL);
+
+		/*
+		 *	Record pointers to the buffer we'll be writing
+		 *	We store the treq so we can place it back in
+		 *      the pending state if the sendmmsg call fails.
+		 */
+		h->coalesced[queued].treq = treq;
+		h->coalesced[queued].out.iov_base = u->packet;
+		h->coalesced[queued].out.iov_len = u->packet_len;
+
+		/*
+		 *	Record how much data we have in total.
+		 *
+		 *	Try not to exceed the SO_SNDBUF value of the
+		 *	socket as we potentially just waste CPU
+		 *	time re-encoding the packets.
+		 */
+		total_len += u->packet_len;
+
+		/*
+		 *	Tell the trunk API that this request is now in
+		 *	the "sent" state.  And we don't want to see
+		 *	this request again. The request hasn't actually
+		 *	been sent, but it's the only way to get at the
+		 *	next entry in the heap.
+		 */
+		fr_trunk_request_signal_sent(treq);
+		queued++;
+	}
+	if (queued == 0) return;	/* No work */
+
+	(void) request_mux_send(el, tconn, h, &h->ports[port], queued);
 }
 
 static void request_mux_replicate(UNUSED fr_event_list_t *el,
@@ -2033,7 +2512,7 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 		if (!u->packet) {
 			u->id = h->last_id++;
 
-			if (encode(h->inst, request, u, u->id) < 0) {
+			if (encode(h->inst, request, u, u->id, false, NULL) < 0) {
 				fr_trunk_request_signal_fail(treq);
 				continue;
 			}
@@ -2044,6 +2523,7 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 		RHEXDUMP3(u->packet, u->packet_len, "Encoded packet");
 
 		h->coalesced[queued].treq = treq;
+		h->coalesced[queued].sign = false;
 		h->coalesced[queued].out.iov_base = u->packet;
 		h->coalesced[queued].out.iov_len = u->packet_len;
 
@@ -2136,6 +2616,7 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 static void protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t *h)
 {
 	bool	  	error_601 = false;
+	bool		error_406 = false;
 	uint32_t  	response_length = 0;
 	uint8_t const	*attr, *end;
 
@@ -2153,6 +2634,7 @@ static void protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t
 			memcpy(&error, attr + 2, 4);
 			error = ntohl(error);
 			if (error == 601) error_601 = true;
+			if (error == 406) error_406 = true;
 			continue;
 		}
 
@@ -2230,6 +2712,18 @@ static void protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t
 		memcpy(h->buffer, attr, end - attr);
 	}
 
+	/*
+	 *	Error-Cause = Unsupported-Extension
+	 *
+	 *	We offered, or are using, Extended-ID, and the other
+	 *	end doesn't support it.  Don't offer it again.
+	 */
+	if (error_406 && h->inst->extended_id && !h->thread->extended_id_rejected) {
+		WARN("%s - Home server doesn't support Extended-ID, using a socket per ID space instead",
+		     h->module_name);
+		h->thread->extended_id_rejected = true;
+	}
+
 	/*
 	 *	fail - something went wrong internally, or with the connection.
 	 *	invalid - wrong response to packet
@@ -2319,12 +2813,17 @@ static void status_check_reply(fr_trunk_request_t *treq, fr_time_t now)
 	fr_trunk_connection_signal_active(treq->tconn);
 }
 
-static void request_demux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+/** Read and process all the replies waiting on one socket
+ *
+ * @param[in] tconn	the socket belongs to.
+ * @param[in] h		connection handle.
+ * @param[in] port	socket to read from.
+ * @return
+ *	- true if the caller can keep using the connection.
+ *	- false if the connection was signalled to reconnect.
+ */
+static bool request_demux_port(fr_trunk_connection_t *tconn, udp_handle_t *h, udp_port_t *port)
 {
-	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
-
-	DEBUG3("%s - Reading data for connection %s", h->module_name, h->name);
-
 	while (true) {
 		ssize_t			slen;
 
@@ -2345,16 +2844,16 @@ static void request_demux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tco
 		 *	saves a round through the event loop.  If we're not
 		 *	busy, a few extra system calls don't matter.
 		 */
-		slen = read(h->fd, h->buffer, h->buflen);
-		if (slen == 0) return;
+		slen = read(port->fd, h->buffer, h->buflen);
+		if (slen == 0) return true;
 
 		if (slen < 0) {
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return true;
 
 			ERROR("%s - Failed reading response from socket: %s",
 			      h->module_name, fr_syserror(errno));
 			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
-			return;
+			return false;
 		}
 
 		if (slen < RADIUS_HEADER_LENGTH) {
@@ -2365,9 +2864,10 @@ static void request_demux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tco
 
 		/*
 		 *	Note that we don't care about packet codes.  All
-		 *	packet codes share the same ID space.
+		 *	packet codes share the same ID space.  Each
+		 *	socket, or Extended-ID, has its own ID space.
 		 */
-		rr = radius_track_entry_find(h->tt, h->buffer[1], NULL);
+		rr = udp_track_entry_find(h, port, h->buffer, (size_t)slen);
 		if (!rr) {
 			WARN("%s - Ignoring reply with ID %i that arrived too late",
 			     h->module_name, h->buffer[1]);
@@ -2425,6 +2925,22 @@ static void request_demux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tco
 			break;
 		}
 
+		/*
+		 *	The home server doesn't support Extended-ID after
+		 *	all.  Finish this request, and move the others to
+		 *	a new connection, which will use a socket for each
+		 *	ID space instead.
+		 */
+		if (h->extended_id && h->thread->extended_id_rejected) {
+			fr_pair_list_free(&reply);
+			treq->request->reply->code = code;
+			fr_trunk_request_signal_complete(treq);
+
+			ERROR("%s - Home server rejected Extended-ID, reconnecting %s", h->module_name, h->name);
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return false;
+		}
+
 		/*
 		 *	Mark up the request as being an Access-Challenge, if
 		 *	required.
@@ -2474,6 +2990,25 @@ static void request_demux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tco
 	}
 }
 
+static void request_demux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
+	uint16_t		i;
+
+	DEBUG3("%s - Reading data for connection %s", h->module_name, h->name);
+
+	/*
+	 *	We don't know which socket became readable, so
+	 *	drain all of them.  With Extended-ID, they're all
+	 *	the first one.
+	 */
+	for (i = 0; i < h->num_ports; i++) {
+		if ((i > 0) && (h->ports[i].fd == h->fd)) break;
+
+		if (!request_demux_port(tconn, h, &h->ports[i])) return;
+	}
+}
+
 /** Remove the request from any tracking structures
  *
  * Frees encoded packets if the request is being moved to a new connection
@@ -2525,7 +3060,7 @@ static void request_conn_release(fr_connection_t *conn, void *preq_to_reset, UNU
 	 *	If there are no outstanding tracking entries
 	 *	allocated then the connection is "idle".
 	 */
-	if (!h->tt || (h->tt->num_requests == 0)) h->last_idle = fr_time();
+	if (!h->tt || (udp_num_requests(h) == 0)) h->last_idle = fr_time();
 }
 
 /** Clear out anything associated with the handle from the request
@@ -2846,6 +3381,37 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	 */
 	if (inst->max_send_coalesce == 0) inst->max_send_coalesce = 1;
 
+	/*
+	 *	Replicated packets don't need IDs tracking, so
+	 *	there's nothing to gain from more sockets.
+	 */
+	if (inst->replicate) {
+		inst->num_ports = 1;
+	} else {
+		FR_INTEGER_BOUND_CHECK("num_ports", inst->num_ports, >=, 1);
+		FR_INTEGER_BOUND_CHECK("num_ports", inst->num_ports, <=, 64);
+	}
+
+	/*
+	 *	Extended-ID is negotiated with Status-Server.
+	 */
+	if (inst->replicate || (inst->num_ports == 1)) {
+		inst->extended_id = false;
+
+	} else if (inst->extended_id && !parent->status_check) {
+		cf_log_err(conf, "'extended_id = yes' requires 'status_check' to be set");
+		return -1;
+	}
+
+	/*
+	 *	Each socket has 256 IDs, which limits how many
+	 *	requests can be outstanding on one connection.
+	 */
+	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", parent->trunk_conf.max_req_per_conn,
+			       <=, 255 * (uint32_t)inst->num_ports);
+	FR_INTEGER_BOUND_CHECK("trunk.per_connection_target", parent->trunk_conf.target_req_per_conn,
+			       <=, parent->trunk_conf.max_req_per_conn / 2);
+
 	/*
 	 *	Ensure that we have a destination address.
 	 */
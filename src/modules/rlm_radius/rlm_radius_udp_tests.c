@@ -0,0 +1,302 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for allocating IDs from several ID spaces, and matching replies to them
+ *
+ * @file src/modules/rlm_radius/rlm_radius_udp_tests.c
+ * @copyright 2024 The FreeRADIUS server project
+ */
+
+/*
+ *	The dictionaries are only loaded once, rather than
+ *	before every test with TEST_INIT.
+ */
+static void test_init(void) __attribute__((constructor));
+
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include "rlm_radius_udp.c"
+
+#define TEST_SECRET	"testing123"
+
+static void test_init(void)
+{
+	if (!fr_dict_global_ctx_init(NULL, true, "share/dictionary")) goto error;
+	if (fr_radius_init() < 0) goto error;
+	if (fr_dict_autoload(rlm_radius_udp_dict) < 0) goto error;
+	if (fr_dict_attr_autoload(rlm_radius_udp_dict_attr) < 0) goto error;
+
+	return;
+
+error:
+	fr_perror("rlm_radius_udp_tests");
+	fr_exit_now(EXIT_FAILURE);
+}
+
+/** Allocate a connection handle with num_ports ID spaces, and no sockets
+ *
+ */
+static udp_handle_t *test_handle_alloc(TALLOC_CTX *ctx, uint16_t num_ports, bool extended_id)
+{
+	rlm_radius_udp_t	*inst;
+	udp_handle_t		*h;
+	uint16_t		i;
+
+	MEM(inst = talloc_zero(ctx, rlm_radius_udp_t));
+	MEM(inst->secret = talloc_strdup(inst, TEST_SECRET));
+	inst->num_ports = num_ports;
+	inst->extended_id = extended_id;
+
+	MEM(h = talloc_zero(inst, udp_handle_t));
+	h->inst = inst;
+	h->fd = -1;
+	h->num_ports = num_ports;
+	h->extended_id = extended_id;
+
+	MEM(h->ports = talloc_zero_array(h, udp_port_t, num_ports));
+	for (i = 0; i < num_ports; i++) {
+		h->ports[i].fd = -1;
+		MEM(h->ports[i].tt = radius_track_alloc(h));
+	}
+	h->tt = h->ports[0].tt;
+
+	return h;
+}
+
+/** Reserve an ID from the space udp_port_select() picks, as request_mux() does
+ *
+ */
+static int test_reserve(radius_track_entry_t **rr, uint16_t *space, udp_handle_t *h)
+{
+	*space = udp_port_select(h);
+
+	return radius_track_entry_reserve(rr, NULL, h->ports[*space].tt, (request_t *)h,
+					  FR_RADIUS_CODE_ACCESS_REQUEST, NULL);
+}
+
+/** Write the header of a reply, and optionally an Extended-ID
+ *
+ * @return the length of the packet.
+ */
+static size_t test_reply_make(uint8_t *packet, uint8_t code, uint8_t id, bool with_extended_id, uint32_t space)
+{
+	size_t	packet_len = RADIUS_HEADER_LENGTH;
+
+	memset(packet, 0, RADIUS_HEADER_LENGTH);
+	packet[0] = code;
+	packet[1] = id;
+
+	if (with_extended_id) {
+		uint8_t *attr = packet + packet_len;
+
+		attr[0] = FR_VENDOR_SPECIFIC;
+		attr[1] = UDP_EXTENDED_ID_LENGTH;
+		fr_nbo_from_uint32(attr + 2, attr_extended_id->parent->attr);
+		attr[6] = attr_extended_id->attr;
+		attr[7] = 6;
+		fr_nbo_from_uint32(attr + 8, space);
+		packet_len += UDP_EXTENDED_ID_LENGTH;
+	}
+
+	fr_nbo_from_uint16(packet + 2, packet_len);
+
+	return packet_len;
+}
+
+/*
+ *	More than 256 requests can be outstanding on a connection,
+ *	and every reply finds its own request.
+ */
+static void test_outstanding(void)
+{
+	udp_handle_t		*h = test_handle_alloc(NULL, 3, true);
+	radius_track_entry_t	*rr[3 * 256] = { NULL };
+	uint16_t		space[3 * 256];
+	radius_track_entry_t	*extra = NULL;
+	uint16_t		extra_space;
+	uint8_t			packet[64];
+	size_t			i, packet_len;
+
+	for (i = 0; i < NUM_ELEMENTS(rr); i++) {
+		TEST_CHECK(test_reserve(&rr[i], &space[i], h) == 0);
+		TEST_MSG("Failed reserving ID %zu: %s", i, fr_strerror());
+
+		TEST_CHECK(space[i] == (i / 256));
+		TEST_MSG("Expected request %zu to use ID space %zu, got %u", i, i / 256, space[i]);
+	}
+
+	TEST_CHECK(udp_num_requests(h) == NUM_ELEMENTS(rr));
+	TEST_MSG("Expected %zu outstanding requests, got %u", NUM_ELEMENTS(rr), udp_num_requests(h));
+
+	/*
+	 *	Every ID space is full.
+	 */
+	TEST_CHECK(test_reserve(&extra, &extra_space, h) < 0);
+	TEST_MSG("Expected reserving ID %zu to fail", NUM_ELEMENTS(rr));
+
+	for (i = 0; i < NUM_ELEMENTS(rr); i++) {
+		packet_len = test_reply_make(packet, FR_RADIUS_CODE_ACCESS_ACCEPT, rr[i]->id, true, space[i]);
+
+		TEST_CHECK(udp_track_entry_find(h, &h->ports[0], packet, packet_len) == rr[i]);
+		TEST_MSG("Reply to request %zu (space %u, ID %u) didn't find its request", i, space[i], rr[i]->id);
+	}
+
+	/*
+	 *	Replies for ID spaces we don't have are ignored.
+	 */
+	packet_len = test_reply_make(packet, FR_RADIUS_CODE_ACCESS_ACCEPT, 0, true, 3);
+	TEST_CHECK(udp_track_entry_find(h, &h->ports[0], packet, packet_len) == NULL);
+
+	/*
+	 *	Freed IDs are reused from the space they came from.
+	 */
+	TEST_CHECK(radius_track_entry_release(&rr[300]) == 0);
+	TEST_CHECK(test_reserve(&extra, &extra_space, h) == 0);
+	TEST_CHECK(extra_space == 1);
+	TEST_MSG("Expected ID space 1, got %u", extra_space);
+
+	talloc_free(h->inst);
+}
+
+/*
+ *	Without Extended-ID, each socket's ID space is only searched
+ *	for replies which arrive on that socket.
+ */
+static void test_separate_sockets(void)
+{
+	udp_handle_t		*h = test_handle_alloc(NULL, 2, false);
+	radius_track_entry_t	*rr = NULL;
+	uint8_t			packet[64];
+	size_t			packet_len;
+
+	TEST_CHECK(radius_track_entry_reserve(&rr, NULL, h->ports[1].tt, (request_t *)h,
+					      FR_RADIUS_CODE_ACCESS_REQUEST, NULL) == 0);
+
+	packet_len = test_reply_make(packet, FR_RADIUS_CODE_ACCESS_ACCEPT, rr->id, true, 1);
+	TEST_CHECK(udp_track_entry_find(h, &h->ports[0], packet, packet_len) == NULL);
+	TEST_MSG("Reply on the first socket shouldn't find a request sent on the second");
+
+	TEST_CHECK(udp_track_entry_find(h, &h->ports[1], packet, packet_len) == rr);
+
+	talloc_free(h->inst);
+}
+
+/*
+ *	A home server which doesn't understand Extended-ID after all
+ *	replies without it.  The reply is matched to the request it
+ *	was signed for.
+ */
+static void test_protocol_error(void)
+{
+	udp_handle_t		*h = test_handle_alloc(NULL, 2, true);
+	radius_track_entry_t	*rr[2] = { NULL };
+	uint8_t			vector[2][RADIUS_AUTH_VECTOR_LENGTH];
+	uint8_t			original[RADIUS_HEADER_LENGTH];
+	uint8_t			packet[64];
+	size_t			i, packet_len;
+
+	/*
+	 *	Reserve the same ID in both spaces.
+	 */
+	TEST_CHECK(radius_track_entry_reserve(&rr[0], NULL, h->ports[0].tt, (request_t *)h,
+					      FR_RADIUS_CODE_ACCESS_REQUEST, NULL) == 0);
+	while (true) {
+		TEST_ASSERT(radius_track_entry_reserve(&rr[1], NULL, h->ports[1].tt, (request_t *)h,
+						       FR_RADIUS_CODE_ACCESS_REQUEST, NULL) == 0);
+		if (rr[1]->id == rr[0]->id) break;
+
+		TEST_ASSERT(radius_track_entry_release(&rr[1]) == 0);
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(rr); i++) {
+		memset(vector[i], i + 1, sizeof(vector[i]));
+		TEST_CHECK(radius_track_entry_update(rr[i], vector[i]) == 0);
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(rr); i++) {
+		packet_len = test_reply_make(packet, FR_RADIUS_CODE_PROTOCOL_ERROR, rr[i]->id, false, 0);
+
+		original[0] = FR_RADIUS_CODE_ACCESS_REQUEST;
+		original[1] = rr[i]->id;
+		fr_nbo_from_uint16(original + 2, RADIUS_HEADER_LENGTH);
+		memcpy(original + RADIUS_AUTH_VECTOR_OFFSET, vector[i], RADIUS_AUTH_VECTOR_LENGTH);
+
+		TEST_CHECK(fr_radius_sign(packet, original, (uint8_t const *)TEST_SECRET,
+					  sizeof(TEST_SECRET) - 1) == 0);
+
+		TEST_CHECK(udp_track_entry_find(h, &h->ports[0], packet, packet_len) == rr[i]);
+		TEST_MSG("Protocol-Error for space %zu didn't find its request", i);
+	}
+
+	/*
+	 *	A reply signed for neither is ignored.
+	 */
+	packet_len = test_reply_make(packet, FR_RADIUS_CODE_PROTOCOL_ERROR, rr[0]->id, false, 0);
+	memset(packet + RADIUS_AUTH_VECTOR_OFFSET, 0xff, RADIUS_AUTH_VECTOR_LENGTH);
+	TEST_CHECK(udp_track_entry_find(h, &h->ports[0], packet, packet_len) == NULL);
+
+	talloc_free(h->inst);
+}
+
+/*
+ *	The Extended-ID we write, and look for, is the one the
+ *	encoder writes for the dictionary attribute.
+ */
+static void test_extended_id_encoding(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	fr_pair_list_t	list;
+	fr_pair_t	*vp;
+	uint8_t		packet[256];
+	uint8_t		expected[64];
+	ssize_t		slen;
+	uint32_t	space = 0;
+
+	fr_pair_list_init(&list);
+	TEST_CHECK(fr_pair_append_by_da_parent(ctx, &vp, &list, attr_extended_id) == 0);
+	vp->vp_uint32 = 42;
+
+	slen = fr_radius_encode(packet, sizeof(packet), NULL, TEST_SECRET, sizeof(TEST_SECRET) - 1,
+				FR_RADIUS_CODE_ACCOUNTING_RESPONSE, 7, &list);
+	TEST_CHECK(slen == (RADIUS_HEADER_LENGTH + UDP_EXTENDED_ID_LENGTH));
+	TEST_MSG("Expected %u bytes, got %zd", RADIUS_HEADER_LENGTH + UDP_EXTENDED_ID_LENGTH, slen);
+
+	TEST_CHECK(udp_extended_id_find(&space, packet, slen));
+	TEST_CHECK(space == 42);
+	TEST_MSG("Expected Extended-ID 42, got %u", space);
+
+	(void) test_reply_make(expected, FR_RADIUS_CODE_ACCOUNTING_RESPONSE, 7, true, 42);
+	TEST_CHECK(memcmp(packet + RADIUS_HEADER_LENGTH, expected + RADIUS_HEADER_LENGTH, UDP_EXTENDED_ID_LENGTH) == 0);
+	TEST_MSG("Encoded Extended-ID differs from the one rlm_radius_udp writes");
+
+	/*
+	 *	Truncated attributes aren't read past the end of the packet.
+	 */
+	fr_nbo_from_uint16(packet + 2, RADIUS_HEADER_LENGTH + 6);
+	TEST_CHECK(!udp_extended_id_find(&space, packet, slen));
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "outstanding",		test_outstanding },
+	{ "separate_sockets",		test_separate_sockets },
+	{ "protocol_error",		test_protocol_error },
+	{ "extended_id_encoding",	test_extended_id_encoding },
+
+	{ NULL }
+};
@@ -0,0 +1,8 @@
+TARGET		:= rlm_radius_udp_tests$(E)
+SOURCES		:= rlm_radius_udp_tests.c track.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util$(L) libfreeradius-server$(L) libfreeradius-unlang$(L) libfreeradius-radius$(L)
+
+TGT_INSTALLDIR	:=
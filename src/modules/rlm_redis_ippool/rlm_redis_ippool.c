@@ -34,6 +34,8 @@
  *     * counter - How many times this IP address has been bound.
  * - @verbatim {<pool name>:<pool type>}:device:<client id> @endverbatim (string) contains last
  *	IP address bound by this client.
+ * - @verbatim {<pool name>:<pool type>}:reserved @endverbatim (hash) contains addresses reserved
+ *	by a worker for local allocation, and the identifier of the worker which reserved them.
  *
  * @copyright 2015 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
  * @copyright 2015 The FreeRADIUS server project
@@ -75,9 +77,35 @@ typedef struct {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< allocated_address_attr if updates are successful.
 
+	uint32_t		reserve_num;	//!< How many free leases each worker reserves at once
+						//!< for making offers locally.  0 disables reservations.
+
+	fr_time_delta_t		reserve_time;	//!< How long reserved leases are held for.
+
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
 } rlm_redis_ippool_t;
 
+/** A block of leases reserved by a worker, for a single pool
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;		//!< Entry in the thread's tree of reservations.
+	char			*pool_name;	//!< Pool the leases were reserved from.
+	size_t			pool_name_len;	//!< Length of the pool name.
+	redisReply		*block;		//!< Reply from the offer script which reserved
+						///< the block.  Holds addresses from element 4.
+	size_t			next;		//!< Next element of the block to hand out.
+	fr_time_t		expires;	//!< When the reservations expire in Redis.
+} ippool_reservation_t;
+
+/** rlm_redis_ippool thread instance
+ *
+ */
+typedef struct {
+	fr_rb_tree_t		*reservations;	//!< Blocks of reserved leases, by pool name.
+	char const		*reserve_id;	//!< Identifies leases reserved by this worker.
+} rlm_redis_ippool_thread_t;
+
 static conf_parser_t redis_config[] = {
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
@@ -94,6 +122,9 @@ static conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("ipv4_integer", rlm_redis_ippool_t, ipv4_integer) },
 	{ FR_CONF_OFFSET("copy_on_update", rlm_redis_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
 
+	{ FR_CONF_OFFSET("reserve_num", rlm_redis_ippool_t, reserve_num), .dflt = "0" },
+	{ FR_CONF_OFFSET("reserve_time", rlm_redis_ippool_t, reserve_time), .dflt = "30" },
+
 	/*
 	 *	Split out to allow conversion to universal ippool module with
 	 *	minimum of config changes.
@@ -313,21 +344,22 @@ static char lua_alloc_cmd[] =
 	"  return {" STRINGIFY(_IPPOOL_RCODE_POOL_EMPTY) "}" EOL					/* 35 */
 	"end" EOL											/* 36 */
 	"redis.call('ZADD', pool_key, 'XX', ARGV[1] + ARGV[2], ip[1])" EOL				/* 37 */
+	"redis.call('HDEL', '{' .. KEYS[1] .. '}:"IPPOOL_RESERVED_KEY"', ip[1])" EOL			/* 38 */
 
 	/*
 	 *	Set the device/gateway keys
 	 */
-	"address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. ip[1]" EOL			/* 38 */
-	"redis.call('HMSET', address_key, 'device', ARGV[3], 'gateway', ARGV[4])" EOL			/* 39 */
-	"redis.call('SET', owner_key, ip[1])" EOL							/* 40 */
-	"redis.call('EXPIRE', owner_key, ARGV[2])" EOL							/* 41 */
-	"return { " EOL											/* 42 */
-	"  " STRINGIFY(_IPPOOL_RCODE_SUCCESS) "," EOL							/* 43 */
-	"  ip[1], " EOL											/* 44 */
-	"  redis.call('HGET', address_key, 'range'), " EOL						/* 45 */
-	"  tonumber(ARGV[2]), " EOL									/* 46 */
-	"  redis.call('HINCRBY', address_key, 'counter', 1)" EOL					/* 47 */
-	"}" EOL;											/* 48 */
+	"address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. ip[1]" EOL			/* 39 */
+	"redis.call('HMSET', address_key, 'device', ARGV[3], 'gateway', ARGV[4])" EOL			/* 40 */
+	"redis.call('SET', owner_key, ip[1])" EOL							/* 41 */
+	"redis.call('EXPIRE', owner_key, ARGV[2])" EOL							/* 42 */
+	"return { " EOL											/* 43 */
+	"  " STRINGIFY(_IPPOOL_RCODE_SUCCESS) "," EOL							/* 44 */
+	"  ip[1], " EOL											/* 45 */
+	"  redis.call('HGET', address_key, 'range'), " EOL						/* 46 */
+	"  tonumber(ARGV[2]), " EOL									/* 47 */
+	"  redis.call('HINCRBY', address_key, 'counter', 1)" EOL					/* 48 */
+	"}" EOL;											/* 49 */
 static char lua_alloc_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
 
 /** Lua script for updating leases
@@ -344,6 +376,9 @@ static char lua_alloc_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
  * - IPPOOL_RCODE_NOT_FOUND lease not found in pool.
  * - IPPOOL_RCODE_EXPIRED lease has already expired.
  * - IPPOOL_RCODE_DEVICE_MISMATCH lease was allocated to a different client.
+ *
+ * If the lease was reserved by a worker, and offered from that reservation
+ * to the device provided, it's bound to the device.
  */
 static char lua_update_cmd[] =
 	"local ret" EOL									/* 1 */
@@ -365,17 +400,31 @@ static char lua_update_cmd[] =
 	"if not found[2] then" EOL							/* 8 */
 	"  return {" STRINGIFY(_IPPOOL_RCODE_NOT_FOUND) "}" EOL				/* 9 */
 	"end" EOL									/* 10 */
+
+	/*
+	 *	Leases reserved by a worker are offered without
+	 *	being bound to a device.  The reservation records
+	 *	who they were offered to as <worker>|<owner>, bind
+	 *	them now if that's the device updating the lease.
+	 */
 	"if found[2] ~= ARGV[4] then" EOL						/* 11 */
-	"  return {" STRINGIFY(_IPPOOL_RCODE_DEVICE_MISMATCH) ", found[2]}" EOL		/* 12 */
-	"end" EOL									/* 13 */
+	"  local r = redis.call('HGET', '{' .. KEYS[1] .. '}:"IPPOOL_RESERVED_KEY"', ARGV[3])" EOL	/* 12 */
+	"  local s = r and string.find(r, '|', 1, true)" EOL				/* 13 */
+	"  if not s or (string.sub(r, s + 1) ~= ARGV[4]) then" EOL			/* 14 */
+	"    return {" STRINGIFY(_IPPOOL_RCODE_DEVICE_MISMATCH) ", found[2]}" EOL	/* 15 */
+	"  end" EOL									/* 16 */
+	"  redis.call('HDEL', '{' .. KEYS[1] .. '}:"IPPOOL_RESERVED_KEY"', ARGV[3])" EOL	/* 17 */
+	"  redis.call('HSET', address_key, 'device', ARGV[4])" EOL			/* 18 */
+	"  redis.call('SET', '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":' .. ARGV[4], ARGV[3])" EOL	/* 19 */
+	"end" EOL									/* 20 */
 
 	/*
 	 *	Update the expiry time
 	 */
-	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL			/* 14 */
-	"local expires = tonumber(redis.call('ZSCORE', pool_key, ARGV[3]))" EOL		/* 15 */
-	"local static = expires > " STRINGIFY(IPPOOL_STATIC_BIT) EOL			/* 16 */
-	"redis.call('ZADD', pool_key, 'XX', ARGV[1] + ARGV[2] + (static and " STRINGIFY(IPPOOL_STATIC_BIT) " or 0), ARGV[3])" EOL	/* 17 */
+	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL			/* 21 */
+	"local expires = tonumber(redis.call('ZSCORE', pool_key, ARGV[3]))" EOL		/* 22 */
+	"local static = expires > " STRINGIFY(IPPOOL_STATIC_BIT) EOL			/* 23 */
+	"redis.call('ZADD', pool_key, 'XX', ARGV[1] + ARGV[2] + (static and " STRINGIFY(IPPOOL_STATIC_BIT) " or 0), ARGV[3])" EOL	/* 24 */
 
 	/*
 	 *	The device key should usually exist, but
@@ -383,21 +432,149 @@ static char lua_update_cmd[] =
 	 *	of a lease being expired, it may have been
 	 *	removed.
 	 */
-	"owner_key = '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":' .. ARGV[4]" EOL		/* 18 */
-	"if not static and (redis.call('EXPIRE', owner_key, ARGV[2]) == 0) then" EOL	/* 19 */
-	"  redis.call('SET', owner_key, ARGV[3])" EOL					/* 20 */
-	"  redis.call('EXPIRE', owner_key, ARGV[2])" EOL				/* 21 */
-	"end" EOL									/* 22 */
+	"owner_key = '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":' .. ARGV[4]" EOL		/* 25 */
+	"if not static and (redis.call('EXPIRE', owner_key, ARGV[2]) == 0) then" EOL	/* 26 */
+	"  redis.call('SET', owner_key, ARGV[3])" EOL					/* 27 */
+	"  redis.call('EXPIRE', owner_key, ARGV[2])" EOL				/* 28 */
+	"end" EOL									/* 29 */
 
 	/*
 	 *	Update the gateway address
 	 */
-	"if ARGV[5] ~= found[3] then" EOL						/* 23 */
-	"  redis.call('HSET', address_key, 'gateway', ARGV[5])" EOL			/* 24 */
-	"end" EOL									/* 25 */
-	"return { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", found[1], found[4] }"EOL;	/* 26 */
+	"if ARGV[5] ~= found[3] then" EOL						/* 30 */
+	"  redis.call('HSET', address_key, 'gateway', ARGV[5])" EOL			/* 31 */
+	"end" EOL									/* 32 */
+	"return { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", found[1], found[4] }"EOL;	/* 33 */
 static char lua_update_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
 
+/** Lua script for offering a lease from the block reserved by a worker
+ *
+ * - KEYS[1] The pool name.
+ * - ARGV[1] Wall time (seconds since epoch).
+ * - ARGV[2] Expires in (seconds).
+ * - ARGV[3] Lease owner identifier.
+ * - ARGV[4] Identifier of the worker making the offer.
+ * - ARGV[5] Gateway identifier.  May be empty.
+ * - ARGV[6] Reserve new leases for (seconds).
+ * - ARGV[7] Number of leases to reserve if none of the candidates can be offered.
+ * - ARGV[8] Space separated list of candidate addresses, from the worker's block,
+ *	     in the order they should be offered.  May be empty.
+ * - ARGV[9] Space separated list of addresses from the worker's block which
+ *	     should be returned to the pool.  May be empty.
+ *
+ * Reserving, returning and offering are all done here, so every offer is a
+ * single round trip, including the ones which need a new block.
+ *
+ * The owner is checked first.  If it was already offered a reserved lease
+ * which hasn't expired, that lease is offered again.  If it has any other
+ * lease nothing is offered, and the allocation script should be used to
+ * find it.
+ *
+ * Otherwise the first candidate still reserved by this worker is offered.
+ * If there isn't one, a new block of leases is reserved, and the first of
+ * them is offered.  Reserved leases are marked as used until the
+ * reservation expires, so if the worker goes away they return to the pool
+ * without any further action.
+ *
+ * The reservation records the worker, and once offered the owner, as
+ * @verbatim <worker>|<owner> @endverbatim.  Only that owner can then bind
+ * the lease by updating it.
+ *
+ * Returns @verbatim array { <rcode>, <ip>, <range>, <used>[, <reserved ip>]... } @endverbatim
+ * where used is the number of candidates consumed, and the reserved ips
+ * are a new block, not including the address offered.
+ * - IPPOOL_RCODE_SUCCESS lease offered.
+ * - IPPOOL_RCODE_DEVICE_MISMATCH owner already has a lease.
+ * - IPPOOL_RCODE_POOL_EMPTY no candidates, and no free leases to reserve.
+ */
+static char lua_offer_cmd[] =
+	"local pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL				/* 1 */
+	"local reserved_key = '{' .. KEYS[1] .. '}:"IPPOOL_RESERVED_KEY"'" EOL			/* 2 */
+	"local owner_key = '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":' .. ARGV[3]" EOL		/* 3 */
+	"local address_key" EOL									/* 4 */
+	"local ret = {" STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", false, false, 0}" EOL			/* 5 */
+	"local ip" EOL										/* 6 */
+
+	/*
+	 *	Return what the worker is done with.
+	 */
+	"for r in string.gmatch(ARGV[9], '%S+') do" EOL						/* 7 */
+	"  if redis.call('HGET', reserved_key, r) == ARGV[4] then" EOL				/* 8 */
+	"    redis.call('HDEL', reserved_key, r)" EOL						/* 9 */
+	"    redis.call('ZADD', pool_key, 'XX', ARGV[1] - 1, r)" EOL				/* 10 */
+	"  end" EOL										/* 11 */
+	"end" EOL										/* 12 */
+
+	/*
+	 *	Check to see if the client already has a lease,
+	 *	or an offer.
+	 */
+	"local exists = redis.call('GET', owner_key)" EOL					/* 13 */
+	"if exists then" EOL									/* 14 */
+	"  local expires = tonumber(redis.call('ZSCORE', pool_key, exists))" EOL		/* 15 */
+	"  if expires and (expires > tonumber(ARGV[1])) then" EOL				/* 16 */
+	"    local r = redis.call('HGET', reserved_key, exists)" EOL				/* 17 */
+	"    local s = r and string.find(r, '|', 1, true)" EOL					/* 18 */
+	"    if not s or (string.sub(r, s + 1) ~= ARGV[3]) then" EOL				/* 19 */
+	"      ret[1] = " STRINGIFY(_IPPOOL_RCODE_DEVICE_MISMATCH) EOL				/* 20 */
+	"      return ret" EOL									/* 21 */
+	"    end" EOL										/* 22 */
+	"    address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. exists" EOL		/* 23 */
+	"    ret[2] = exists" EOL								/* 24 */
+	"    ret[3] = redis.call('HGET', address_key, 'range') or false" EOL			/* 25 */
+	"    return ret" EOL									/* 26 */
+	"  end" EOL										/* 27 */
+	"end" EOL										/* 28 */
+
+	/*
+	 *	The reservation may have expired, and the
+	 *	address given to someone else.  Skip over
+	 *	any candidates we no longer hold.
+	 */
+	"for r in string.gmatch(ARGV[8], '%S+') do" EOL						/* 29 */
+	"  ret[4] = ret[4] + 1" EOL								/* 30 */
+	"  if redis.call('HGET', reserved_key, r) == ARGV[4] then" EOL				/* 31 */
+	"    ip = r" EOL									/* 32 */
+	"    break" EOL										/* 33 */
+	"  end" EOL										/* 34 */
+	"end" EOL										/* 35 */
+
+	/*
+	 *	Nothing left, reserve a new block, getting the
+	 *	IP addresses which expired the longest time ago.
+	 */
+	"if not ip then" EOL									/* 36 */
+	"  local ips = redis.call('ZRANGEBYSCORE', pool_key, '-inf', '(' .. ARGV[1], 'LIMIT', 0, ARGV[7])" EOL	/* 37 */
+	"  if #ips == 0 then" EOL								/* 38 */
+	"    ret[1] = " STRINGIFY(_IPPOOL_RCODE_POOL_EMPTY) EOL					/* 39 */
+	"    return ret" EOL									/* 40 */
+	"  end" EOL										/* 41 */
+	"  for i, r in ipairs(ips) do" EOL							/* 42 */
+	"    redis.call('ZADD', pool_key, 'XX', ARGV[1] + ARGV[6], r)" EOL			/* 43 */
+	"    redis.call('HSET', '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. r, 'device', ARGV[4])" EOL	/* 44 */
+	"    redis.call('HSET', reserved_key, r, ARGV[4])" EOL					/* 45 */
+	"    if i == 1 then" EOL								/* 46 */
+	"      ip = r" EOL									/* 47 */
+	"    else" EOL										/* 48 */
+	"      ret[#ret + 1] = r" EOL								/* 49 */
+	"    end" EOL										/* 50 */
+	"  end" EOL										/* 51 */
+	"end" EOL										/* 52 */
+
+	/*
+	 *	Record who the lease was offered to.
+	 */
+	"address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. ip" EOL			/* 53 */
+	"redis.call('HSET', reserved_key, ip, ARGV[4] .. '|' .. ARGV[3])" EOL			/* 54 */
+	"redis.call('HSET', address_key, 'gateway', ARGV[5])" EOL				/* 55 */
+	"redis.call('ZADD', pool_key, 'XX', ARGV[1] + ARGV[2], ip)" EOL				/* 56 */
+	"redis.call('SET', owner_key, ip)" EOL							/* 57 */
+	"redis.call('EXPIRE', owner_key, ARGV[2])" EOL						/* 58 */
+	"ret[2] = ip" EOL									/* 59 */
+	"ret[3] = redis.call('HGET', address_key, 'range') or false" EOL			/* 60 */
+	"return ret" EOL;									/* 61 */
+static char lua_offer_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
+
 /** Lua script for releasing leases
  *
  * - KEYS[1] The pool name.
@@ -690,68 +867,24 @@ finish:
 	return s_ret;
 }
 
-/** Allocate a new IP address from a pool
+/** Add the address, range and expiry of an allocated lease to the request
  *
+ * @param[in] request	The current request.
+ * @param[in] env	Call env for the allocation.
+ * @param[in] ip	Address element of the script result, may be NULL.
+ * @param[in] range	Range element of the script result, may be NULL.
+ * @param[in] expires	When the lease expires, may be NULL.
+ * @return
+ *	- IPPOOL_RCODE_SUCCESS on success.
+ *	- IPPOOL_RCODE_FAIL on failure.
  */
-static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request,
-					    redis_ippool_alloc_call_env_t *env, uint32_t lease_time)
+static ippool_rcode_t ippool_alloc_result(request_t *request, redis_ippool_alloc_call_env_t *env,
+					  redisReply const *ip, redisReply const *range, uint32_t const *expires)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
-
-	fr_assert(env->pool_name.vb_length > 0);
-	fr_assert(env->owner.vb_length > 0);
-
-	now = fr_time_to_timeval(fr_time());
-
-	status = ippool_script(&reply, request, inst->cluster,
-			       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
-			       inst->wait_num, inst->wait_timeout,
-			       lua_alloc_digest, lua_alloc_cmd,
-	 		       "EVALSHA %s 1 %b %u %u %b %b",
-	 		       lua_alloc_digest,
-			       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
-			       (unsigned int)now.tv_sec, lease_time,
-			       (uint8_t const *)env->owner.vb_strvalue, env->owner.vb_length,
-			       (uint8_t const *)env->gateway_id.vb_strvalue, env->gateway_id.vb_length);
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	fr_assert(reply);
-	if (reply->type != REDIS_REPLY_ARRAY) {
-		REDEBUG("Expected result to be array got \"%s\"",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	if (reply->elements == 0) {
-		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	/*
-	 *	Process return code
-	 */
-	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
-		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
-
 	/*
 	 *	Process IP address
 	 */
-	if (reply->elements > 1) {
+	if (ip) {
 		tmpl_t ip_rhs;
 		map_t ip_map = {
 			.lhs = env->allocated_address_attr,
@@ -760,7 +893,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 		};
 
 		tmpl_init_shallow(&ip_rhs, TMPL_TYPE_DATA, T_BARE_WORD, "", 0, NULL);
-		switch (reply->element[1]->type) {
+		switch (ip->type) {
 		/*
 		 *	Destination attribute may not be IPv4, in which case
 		 *	we want to pre-convert the integer value to an IPv4
@@ -772,43 +905,40 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 			if (tmpl_attr_tail_da(ip_map.lhs)->type != FR_TYPE_IPV4_ADDR) {
 				fr_value_box_t tmp;
 
-				fr_value_box(&tmp, (uint32_t)ntohl((uint32_t)reply->element[1]->integer), true);
+				fr_value_box(&tmp, (uint32_t)ntohl((uint32_t)ip->integer), true);
 				if (fr_value_box_cast(NULL, tmpl_value(ip_map.rhs), FR_TYPE_IPV4_ADDR,
 						      NULL, &tmp)) {
 					RPEDEBUG("Failed converting integer to IPv4 address");
-					ret = IPPOOL_RCODE_FAIL;
-					goto finish;
+					return IPPOOL_RCODE_FAIL;
 				}
 			} else {
 				fr_value_box(&ip_map.rhs->data.literal,
-					     (uint32_t)ntohl((uint32_t)reply->element[1]->integer), true);
+					     (uint32_t)ntohl((uint32_t)ip->integer), true);
 			}
 		}
 			goto do_ip_map;
 
 		case REDIS_REPLY_STRING:
 			fr_value_box_bstrndup_shallow(&ip_map.rhs->data.literal,
-						      NULL, reply->element[1]->str, reply->element[1]->len, false);
+						      NULL, ip->str, ip->len, false);
 		do_ip_map:
 			if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
+				return IPPOOL_RCODE_FAIL;
 			}
 			break;
 
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for IP element (result[1])",
-				fr_table_str_by_value(redis_reply_types, reply->element[1]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+				fr_table_str_by_value(redis_reply_types, ip->type, "<UNKNOWN>"));
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
 	/*
 	 *	Process Range identifier
 	 */
-	if (reply->elements > 2) {
-		switch (reply->element[2]->type) {
+	if (range) {
+		switch (range->type) {
 		/*
 		 *	Add range ID to request
 		 */
@@ -823,10 +953,9 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 
 			tmpl_init_shallow(&range_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0, NULL);
 			fr_value_box_bstrndup_shallow(&range_map.rhs->data.literal,
-						      NULL, reply->element[2]->str, reply->element[2]->len, true);
+						      NULL, range->str, range->len, true);
 			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
+				return IPPOOL_RCODE_FAIL;
 			}
 		}
 			break;
@@ -836,16 +965,15 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for range element (result[2])",
-				fr_table_str_by_value(redis_reply_types, reply->element[2]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+				fr_table_str_by_value(redis_reply_types, range->type, "<UNKNOWN>"));
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
 	/*
 	 *	Process Expiry time
 	 */
-	if (env->expiry_attr && (reply->elements > 3)) {
+	if (env->expiry_attr && expires) {
 		tmpl_t expiry_rhs;
 		map_t expiry_map = {
 			.lhs = env->expiry_attr,
@@ -854,24 +982,272 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 		};
 
 		tmpl_init_shallow(&expiry_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0, NULL);
-		if (reply->element[3]->type != REDIS_REPLY_INTEGER) {
-			REDEBUG("Server returned unexpected type \"%s\" for expiry element (result[3])",
-				fr_table_str_by_value(redis_reply_types, reply->element[3]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
+		fr_value_box(&expiry_map.rhs->data.literal, *expires, true);
+		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
+	}
 
-		fr_value_box(&expiry_map.rhs->data.literal, (uint32_t)reply->element[3]->integer, true);
-		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Allocate a new IP address from a pool
+ *
+ */
+static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request,
+					    redis_ippool_alloc_call_env_t *env, uint32_t lease_time)
+{
+	struct			timeval now;
+	redisReply		*reply = NULL;
+
+	fr_redis_rcode_t	status;
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+
+	fr_assert(env->pool_name.vb_length > 0);
+	fr_assert(env->owner.vb_length > 0);
+
+	now = fr_time_to_timeval(fr_time());
+
+	status = ippool_script(&reply, request, inst->cluster,
+			       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
+			       inst->wait_num, inst->wait_timeout,
+			       lua_alloc_digest, lua_alloc_cmd,
+	 		       "EVALSHA %s 1 %b %u %u %b %b",
+	 		       lua_alloc_digest,
+			       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
+			       (unsigned int)now.tv_sec, lease_time,
+			       (uint8_t const *)env->owner.vb_strvalue, env->owner.vb_length,
+			       (uint8_t const *)env->gateway_id.vb_strvalue, env->gateway_id.vb_length);
+	if (status != REDIS_RCODE_SUCCESS) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	fr_assert(reply);
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		REDEBUG("Expected result to be array got \"%s\"",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	if (reply->elements == 0) {
+		REDEBUG("Got empty result array");
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	Process return code
+	 */
+	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
+		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+	ret = reply->element[0]->integer;
+	if (ret < 0) goto finish;
+
+	{
+		uint32_t	expires;
+		bool		have_expires = false;
+
+		if (reply->elements > 3) {
+			if (reply->element[3]->type != REDIS_REPLY_INTEGER) {
+				REDEBUG("Server returned unexpected type \"%s\" for expiry element (result[3])",
+					fr_table_str_by_value(redis_reply_types, reply->element[3]->type, "<UNKNOWN>"));
+				ret = IPPOOL_RCODE_FAIL;
+				goto finish;
+			}
+			expires = (uint32_t)reply->element[3]->integer;
+			have_expires = true;
 		}
+
+		ret = ippool_alloc_result(request, env,
+					  reply->elements > 1 ? reply->element[1] : NULL,
+					  reply->elements > 2 ? reply->element[2] : NULL,
+					  have_expires ? &expires : NULL);
 	}
 finish:
 	fr_redis_reply_free(&reply);
 	return ret;
 }
 
+static int8_t reservation_cmp(void const *one, void const *two)
+{
+	ippool_reservation_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->pool_name_len, b->pool_name_len);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->pool_name, b->pool_name, a->pool_name_len);
+	return CMP(ret, 0);
+}
+
+static int _reservation_free(ippool_reservation_t *res)
+{
+	fr_redis_reply_free(&res->block);
+	return 0;
+}
+
+/** Build a space separated list of addresses from a block
+ *
+ * @param[in] ctx	to allocate the list in.
+ * @param[in] block	Reply holding the addresses.  May be NULL.
+ * @param[in] start	First element of the block to add.
+ * @return the list.  Empty if there are no addresses.
+ */
+static char *reservation_list(TALLOC_CTX *ctx, redisReply const *block, size_t start)
+{
+	char	*list;
+	size_t	i;
+
+	MEM(list = talloc_strdup(ctx, ""));
+	if (!block) return list;
+
+	for (i = start; i < block->elements; i++) {
+		redisReply const *ip = block->element[i];
+
+		if (ip->type != REDIS_REPLY_STRING) continue;
+		MEM(list = talloc_asprintf_append_buffer(list, "%.*s ", (int)ip->len, ip->str));
+	}
+
+	return list;
+}
+
+/** Make an offer from a block of leases reserved by this worker
+ *
+ * The addresses left in the current block are passed to the offer script
+ * as candidates, and it offers the first one this worker still holds.  If
+ * there isn't one, or the remaining reservation time is less than the
+ * offer time, the script reserves a new block and offers from that.
+ * Either way, each offer is a single round trip to Redis.
+ *
+ * Each offer records the owner in the reservation, so only that owner can
+ * bind the lease later.  If the owner already has a lease, nothing is
+ * offered, and the caller should fall back to the allocation script.
+ *
+ * @param[in] inst		of rlm_redis_ippool.
+ * @param[in] t			thread specific instance data.
+ * @param[in] request		The current request.
+ * @param[in] env		Call env for the allocation.
+ * @param[in] lease_time	How long the offer needs to be valid for.
+ * @return
+ *	- IPPOOL_RCODE_SUCCESS if an address was offered.
+ *	- IPPOOL_RCODE_DEVICE_MISMATCH if the owner already has a lease.
+ *	- IPPOOL_RCODE_POOL_EMPTY if no leases could be reserved.
+ *	- IPPOOL_RCODE_FAIL on error.
+ */
+static ippool_rcode_t redis_ippool_offer_reserved(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+						  request_t *request, redis_ippool_alloc_call_env_t *env,
+						  uint32_t lease_time)
+{
+	ippool_reservation_t	find, *res;
+	fr_time_t		now = fr_time();
+	struct timeval		tv = fr_time_to_timeval(now);
+	redisReply		*reply = NULL;
+	fr_redis_rcode_t	status;
+	ippool_rcode_t		ret;
+	uint32_t		expires;
+	char			*candidates, *unused;
+	size_t			used;
+
+	memcpy(&find.pool_name, &env->pool_name.vb_strvalue, sizeof(find.pool_name));
+	find.pool_name_len = env->pool_name.vb_length;
+
+	res = fr_rb_find(t->reservations, &find);
+	if (!res) {
+		MEM(res = talloc_zero(t->reservations, ippool_reservation_t));
+		talloc_set_destructor(res, _reservation_free);
+		MEM(res->pool_name = talloc_memdup(res, env->pool_name.vb_strvalue, env->pool_name.vb_length));
+		res->pool_name_len = env->pool_name.vb_length;
+		fr_rb_insert(t->reservations, res);
+	}
+
+	/*
+	 *	If the reservations would expire before the offer
+	 *	does, give them all back, and let the script reserve
+	 *	a new block.
+	 */
+	if (res->block && (fr_time_delta_to_sec(fr_time_sub(res->expires, now)) < lease_time)) {
+		MEM(candidates = talloc_strdup(request, ""));
+		unused = reservation_list(request, res->block, res->next);
+		res->next = res->block->elements;
+	} else {
+		candidates = reservation_list(request, res->block, res->next);
+		MEM(unused = talloc_strdup(request, ""));
+	}
+
+	status = ippool_script(&reply, request, inst->cluster,
+			       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
+			       inst->wait_num, inst->wait_timeout,
+			       lua_offer_digest, lua_offer_cmd,
+			       "EVALSHA %s 1 %b %u %u %b %s %b %u %u %b %b",
+			       lua_offer_digest,
+			       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
+			       (unsigned int)tv.tv_sec, lease_time,
+			       (uint8_t const *)env->owner.vb_strvalue, env->owner.vb_length,
+			       t->reserve_id,
+			       (uint8_t const *)env->gateway_id.vb_strvalue, env->gateway_id.vb_length,
+			       (unsigned int)fr_time_delta_to_sec(inst->reserve_time), inst->reserve_num,
+			       (uint8_t const *)candidates, talloc_array_length(candidates) - 1,
+			       (uint8_t const *)unused, talloc_array_length(unused) - 1);
+	talloc_free(candidates);
+	talloc_free(unused);
+	if (status != REDIS_RCODE_SUCCESS) return IPPOOL_RCODE_FAIL;
+
+	fr_assert(reply);
+	if ((reply->type != REDIS_REPLY_ARRAY) || (reply->elements < 4) ||
+	    (reply->element[0]->type != REDIS_REPLY_INTEGER) ||
+	    (reply->element[3]->type != REDIS_REPLY_INTEGER)) {
+		REDEBUG("Unexpected result from offer script");
+		fr_redis_reply_free(&reply);
+		return IPPOOL_RCODE_FAIL;
+	}
+
+	/*
+	 *	Skip over the candidates the script used, or found
+	 *	were no longer ours.
+	 */
+	used = (size_t)reply->element[3]->integer;
+	if (res->block) {
+		res->next += used;
+		if (res->next > res->block->elements) res->next = res->block->elements;
+	}
+
+	ret = reply->element[0]->integer;
+	if (ret != IPPOOL_RCODE_SUCCESS) {
+		fr_redis_reply_free(&reply);
+		return ret;
+	}
+
+	if (reply->element[1]->type != REDIS_REPLY_STRING) {
+		REDEBUG("Unexpected result from offer script");
+		fr_redis_reply_free(&reply);
+		return IPPOOL_RCODE_FAIL;
+	}
+
+	expires = lease_time;
+	ret = ippool_alloc_result(request, env, reply->element[1], reply->element[2], &expires);
+
+	/*
+	 *	The script reserved a new block.  It replaces
+	 *	whatever was left of the old one, which the script
+	 *	has now been through.
+	 */
+	if (reply->elements > 4) {
+		RDEBUG2("Reserved %zu leases", reply->elements - 4);
+		fr_redis_reply_free(&res->block);
+		res->block = reply;
+		res->next = 4;
+		res->expires = fr_time_add(now, inst->reserve_time);
+		return ret;
+	}
+
+	fr_redis_reply_free(&reply);
+	return ret;
+}
+
 /** Update an existing IP address in a pool
  *
  */
@@ -1101,8 +1477,10 @@ finish:
 static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->inst->data, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	redis_ippool_alloc_call_env_t	*env = talloc_get_type_abort(mctx->env_data, redis_ippool_alloc_call_env_t);
 	uint32_t			lease_time;
+	ippool_rcode_t			ret = IPPOOL_RCODE_POOL_EMPTY;
 
 	CHECK_POOL_NAME
 
@@ -1114,7 +1492,34 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 			env->offer_time.vb_uint32 : env->lease_time.vb_uint32;
 	ippool_action_print(request, POOL_ACTION_ALLOCATE, L_DBG_LVL_2, &env->pool_name, NULL,
 			    &env->owner, &env->gateway_id, lease_time);
-	switch (redis_ippool_allocate(inst, request, env, lease_time)) {
+
+	/*
+	 *	Offers can be made from leases this worker has
+	 *	already reserved.  They're bound to the device
+	 *	when the lease is updated.
+	 *
+	 *	Owners with an existing lease are given it back
+	 *	by the allocation script.
+	 */
+	if (inst->reserve_num && (env->offer_time.type == FR_TYPE_UINT32) &&
+	    (fr_time_delta_to_sec(inst->reserve_time) >= lease_time)) {
+		ret = redis_ippool_offer_reserved(inst, t, request, env, lease_time);
+		switch (ret) {
+		case IPPOOL_RCODE_SUCCESS:
+			break;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			RDEBUG2("Owner already has a lease, allocating from pool");
+			break;
+
+		default:
+			RDEBUG2("No reserved leases available, allocating from pool");
+			break;
+		}
+	}
+	if (ret != IPPOOL_RCODE_SUCCESS) ret = redis_ippool_allocate(inst, request, env, lease_time);
+
+	switch (ret) {
 	case IPPOOL_RCODE_SUCCESS:
 		RDEBUG2("IP address lease allocated");
 		RETURN_MODULE_UPDATED;
@@ -1231,6 +1636,24 @@ static unlang_action_t CC_HINT(nonnull) mod_bulk_release(rlm_rcode_t *p_result,
 	RETURN_MODULE_NOOP;
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+	char				hostname[256];
+
+	if (gethostname(hostname, sizeof(hostname)) < 0) strlcpy(hostname, "unknown", sizeof(hostname));
+	hostname[sizeof(hostname) - 1] = '\0';
+
+	/*
+	 *	Reservations are visible in Redis, so make the
+	 *	identifier something an administrator can trace.
+	 */
+	MEM(t->reserve_id = talloc_typed_asprintf(t, "%s:%u:%p", hostname, (unsigned int)getpid(), t));
+	MEM(t->reservations = fr_rb_inline_talloc_alloc(t, ippool_reservation_t, node, reservation_cmp, NULL));
+
+	return 0;
+}
+
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	static bool			done_hash = false;
@@ -1265,6 +1688,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		fr_sha1_final(digest, &sha1_ctx);
 		fr_base16_encode(&FR_SBUFF_OUT(lua_update_digest, sizeof(lua_update_digest)), &FR_DBUFF_TMP(digest, sizeof(digest)));
 
+		fr_sha1_init(&sha1_ctx);
+		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_offer_cmd, sizeof(lua_offer_cmd) - 1);
+		fr_sha1_final(digest, &sha1_ctx);
+		fr_base16_encode(&FR_SBUFF_OUT(lua_offer_digest, sizeof(lua_offer_digest)), &FR_DBUFF_TMP(digest, sizeof(digest)));
+
 		fr_sha1_init(&sha1_ctx);
 		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_release_cmd, sizeof(lua_release_cmd) - 1);
 		fr_sha1_final(digest, &sha1_ctx);
@@ -1290,7 +1718,10 @@ module_rlm_t rlm_redis_ippool = {
 		.inst_size	= sizeof(rlm_redis_ippool_t),
 		.config		= module_config,
 		.onload		= mod_load,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+
+		.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+		.thread_instantiate	= mod_thread_instantiate
 	},
 	.method_names = (module_method_name_t[]){
 		/*
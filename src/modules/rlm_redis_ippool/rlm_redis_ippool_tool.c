@@ -78,6 +78,12 @@ typedef struct {
 	size_t			gateway_len;
 } ippool_tool_lease_t;
 
+typedef struct {
+	char			*server;	//!< Server the reservations belong to, as "<host>:<pid>".
+	uint64_t		reserved;	//!< Addresses reserved by the server, and not yet offered.
+	uint64_t		offered;	//!< Addresses offered from a reservation, and not yet bound.
+} ippool_tool_server_stats_t;
+
 typedef struct {
 	uint64_t		total;		//!< Addresses available.
 	uint64_t		free;		//!< Addresses in use.
@@ -91,6 +97,7 @@ typedef struct {
 	uint64_t		static_30m;	//!< Static leases that should renew in the next 30 minutes.
 	uint64_t		static_1h;	//!< Static leases that should renew in the next hour.
 	uint64_t		static_1d;	//!< Static leases that should renew in the next day.
+	ippool_tool_server_stats_t *servers;	//!< Per-server reservation counts.
 } ippool_tool_stats_t;
 
 static conf_parser_t redis_config[] = {
@@ -1126,11 +1133,70 @@ static ssize_t driver_get_pools(TALLOC_CTX *ctx, uint8_t **out[], void *instance
 	return used;
 }
 
+/** Count the reservations held by each server
+ *
+ * Values in the reserved hash are the id of the worker which holds the
+ * reservation "<host>:<pid>:<ptr>", followed by "|<owner>" once the address
+ * has been offered.  Workers belonging to the same server are counted together.
+ */
+static int reservations_by_server(TALLOC_CTX *ctx, ippool_tool_server_stats_t **out, redisReply const *reply)
+{
+	ippool_tool_server_stats_t	*servers;
+	size_t				i, j, num = 0;
+
+	MEM(servers = talloc_zero_array(ctx, ippool_tool_server_stats_t, 0));
+
+	for (i = 0; i < reply->elements; i++) {
+		redisReply const	*value = reply->element[i];
+		char const		*worker_end, *p;
+		bool			offered;
+		size_t			len;
+
+		if (value->type != REDIS_REPLY_STRING) {
+			ERROR("Failed retrieving pool stats: Expected reservation string got %s",
+			      fr_table_str_by_value(redis_reply_types, value->type, "<UNKNOWN>"));
+			talloc_free(servers);
+			return -1;
+		}
+
+		worker_end = memchr(value->str, '|', value->len);
+		offered = (worker_end != NULL);
+		if (!worker_end) worker_end = value->str + value->len;
+
+		/*
+		 *	Strip the ":<ptr>" worker suffix to get "<host>:<pid>"
+		 */
+		for (p = worker_end; (p > value->str) && (p[-1] != ':'); p--);
+		len = (p > value->str) ? (size_t)(p - value->str) - 1 : (size_t)(worker_end - value->str);
+
+		for (j = 0; j < num; j++) {
+			if ((strlen(servers[j].server) == len) && (memcmp(servers[j].server, value->str, len) == 0)) break;
+		}
+		if (j == num) {
+			MEM(servers = talloc_realloc(ctx, servers, ippool_tool_server_stats_t, ++num));
+			servers[j] = (ippool_tool_server_stats_t){
+				.server = talloc_bstrndup(servers, value->str, len)
+			};
+		}
+
+		if (offered) {
+			servers[j].offered++;
+		} else {
+			servers[j].reserved++;
+		}
+	}
+
+	*out = servers;
+
+	return 0;
+}
+
 static int driver_get_stats(ippool_tool_stats_t *out, void *instance, uint8_t const *key_prefix, size_t key_prefix_len)
 {
 	redis_driver_conf_t		*inst = talloc_get_type_abort(instance, redis_driver_conf_t);
 	uint8_t				key[IPPOOL_MAX_POOL_KEY_SIZE];
 	uint8_t				*key_p = key;
+	char				reserved_key[IPPOOL_MAX_KEY_PREFIX_SIZE + sizeof("{}:" IPPOOL_RESERVED_KEY)];
 
 	fr_redis_conn_t			*conn;
 
@@ -1144,9 +1210,10 @@ static int driver_get_stats(ippool_tool_stats_t *out, void *instance, uint8_t co
 
 	size_t				reply_cnt = 0, i = 0;
 
-#define STATS_COMMANDS_TOTAL 14
+#define STATS_COMMANDS_TOTAL 15
 
 	IPPOOL_BUILD_KEY(key, key_p, key_prefix, key_prefix_len);
+	snprintf(reserved_key, sizeof(reserved_key), "{%.*s}:" IPPOOL_RESERVED_KEY, (int)key_prefix_len, key_prefix);
 
 	MEM(replies = talloc_zero_array(inst, redisReply *, STATS_COMMANDS_TOTAL));
 
@@ -1185,6 +1252,7 @@ static int driver_get_stats(ippool_tool_stats_t *out, void *instance, uint8_t co
 		redisAppendCommand(conn->handle, "ZCOUNT %b " STRINGIFY(IPPOOL_STATIC_BIT) " %"PRIu64,
 				   key, key_p - key,
 				   IPPOOL_STATIC_BIT + fr_time_to_sec(now) + (60 * 60 * 24));	/* Static renew in 1 day */
+		redisAppendCommand(conn->handle, "HVALS %s", reserved_key);		/* Reserved by workers */
 		redisAppendCommand(conn->handle, "EXEC");
 		if (!replies) return -1;
 
@@ -1237,6 +1305,9 @@ static int driver_get_stats(ippool_tool_stats_t *out, void *instance, uint8_t co
 	out->static_1h = reply->element[10]->integer - out->static_free;
 	out->static_1d = reply->element[11]->integer - out->static_free;
 
+	if ((reply->element[12]->type != REDIS_REPLY_ARRAY) ||
+	    (reservations_by_server(inst, &out->servers, reply->element[12]) < 0)) goto error;
+
 	fr_redis_pipeline_free(replies, reply_cnt);
 	talloc_free(replies);
 
@@ -1679,7 +1750,7 @@ do { \
 		ippool_tool_stats_t	stats;
 		uint8_t			**pools;
 		ssize_t			slen;
-		size_t			i;
+		size_t			i, j;
 
 		if (pool_arg) {
 			pools = talloc_zero_array(conf, uint8_t *, 1);
@@ -1711,6 +1782,13 @@ do { \
 			INFO("expiring 1-30m      : %" PRIu64, stats.expiring_30m - stats.expiring_1m);
 			INFO("expiring 30m-1h     : %" PRIu64, stats.expiring_1h - stats.expiring_30m);
 			INFO("expiring 1h-1d      : %" PRIu64, stats.expiring_1d - stats.expiring_1h);
+			for (j = 0; j < talloc_array_length(stats.servers); j++) {
+				INFO("reserved            : %" PRIu64 " (%s)",
+				     stats.servers[j].reserved, stats.servers[j].server);
+				INFO("reserved offered    : %" PRIu64 " (%s)",
+				     stats.servers[j].offered, stats.servers[j].server);
+			}
+			talloc_free(stats.servers);
 			INFO("static total        : %" PRIu64, stats.static_tot);
 			INFO("static 'free'       : %" PRIu64, stats.static_free);
 			INFO("static issued       : %" PRIu64, stats.static_tot - stats.static_free);
@@ -1751,6 +1751,14 @@ int rest_request_config(module_ctx_t const *mctx, rlm_rest_section_t const *sect
 	 */
 	if (inst->http_negotiation != CURL_HTTP_VERSION_NONE) FR_CURL_REQUEST_SET_OPTION(CURLOPT_HTTP_VERSION, inst->http_negotiation);
 
+#if CURL_AT_LEAST_VERSION(7,43,0)
+	/*
+	 *	Prefer waiting for a connection that may be able
+	 *	to multiplex, over opening a new one.
+	 */
+	if (inst->multiplex) FR_CURL_REQUEST_SET_OPTION(CURLOPT_PIPEWAIT, 1L);
+#endif
+
 	/*
 	 *	Setup any header options and generic headers.
 	 */
@@ -1173,7 +1173,7 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-	mhandle = fr_curl_io_init(t, mctx->el, inst->multiplex);
+	mhandle = fr_curl_io_init(t, mctx->el, &inst->conn_config, inst->multiplex);
 	if (!mhandle) return -1;
 
 	t->mhandle = mhandle;
@@ -1250,9 +1250,64 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	xlat = xlat_func_register_module(inst, mctx, mctx->inst->name, rest_xlat, FR_TYPE_STRING);
 	xlat_func_args_set(xlat, rest_xlat_args);
 
+	if (unlikely(!(xlat = xlat_func_register_module(inst, mctx, "connection_stats", rest_connection_stats_xlat,
+							FR_TYPE_UINT64)))) return -1;
+	xlat_func_args_set(xlat, rest_connection_stats_xlat_arg);
+
 	return 0;
 }
 
+static xlat_arg_parser_t const rest_connection_stats_xlat_arg[] = {
+	{ .required = true, .single = true, .type = FR_TYPE_STRING },
+	XLAT_ARG_PARSER_TERMINATOR
+};
+
+/** Return how many transfers this thread has completed, and how many reused a connection
+ *
+ * - transfers is the number of completed transfers.
+ * - connections is the number of new connections they needed.
+ * - reused is the number of transfers which reused an existing connection.
+ * - multiplexed is the number of those which reused an HTTP/2 connection.
+ *
+ * The totals are for the current worker thread.
+ *
+ * Example:
+@verbatim
+%rest.connection_stats(reused)
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t rest_connection_stats_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
+						xlat_ctx_t const *xctx,
+						request_t *request, fr_value_box_list_t *in)
+{
+	rlm_rest_thread_t	*t = talloc_get_type_abort(xctx->mctx->thread, rlm_rest_thread_t);
+	fr_curl_handle_t const	*mhandle = t->mhandle;
+	fr_value_box_t		*which, *vb;
+
+	XLAT_ARGS(in, &which);
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT64, NULL));
+	if (strcmp(which->vb_strvalue, "transfers") == 0) {
+		vb->vb_uint64 = mhandle->completed;
+	} else if (strcmp(which->vb_strvalue, "connections") == 0) {
+		vb->vb_uint64 = mhandle->connects;
+	} else if (strcmp(which->vb_strvalue, "reused") == 0) {
+		vb->vb_uint64 = mhandle->completed - mhandle->connects;
+	} else if (strcmp(which->vb_strvalue, "multiplexed") == 0) {
+		vb->vb_uint64 = mhandle->multiplexed;
+	} else {
+		REDEBUG("Unknown connection statistic \"%s\", expected \"transfers\", \"connections\", "
+			"\"reused\" or \"multiplexed\"", which->vb_strvalue);
+		talloc_free(vb);
+		return XLAT_ACTION_FAIL;
+	}
+	fr_dcursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+
 /** Initialises libcurl.
  *
  * Allocates global variables and memory required for libcurl to function.
@@ -704,16 +704,10 @@ static void smtp_io_module_signal(module_ctx_t const *mctx, request_t *request,
 {
 	fr_curl_io_request_t	*randle = talloc_get_type_abort(mctx->rctx, fr_curl_io_request_t);
 	rlm_smtp_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_smtp_thread_t);
-	CURLMcode		ret;
 
 	RDEBUG2("Forcefully cancelling pending SMTP request");
 
-	ret = curl_multi_remove_handle(t->mhandle->mandle, randle->candle);	/* Gracefully terminate the request */
-	if (ret != CURLM_OK) {
-		RERROR("Failed removing curl handle from multi-handle: %s (%i)", curl_multi_strerror(ret), ret);
-		/* Not much we can do */
-	}
-	t->mhandle->transfers--;
+	fr_curl_io_request_cancel(t->mhandle, randle);
 	smtp_slab_release(randle);
 }
 
@@ -1151,7 +1145,7 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-	mhandle = fr_curl_io_init(t, mctx->el, false);
+	mhandle = fr_curl_io_init(t, mctx->el, &inst->conn_config, false);
 	if (!mhandle) return -1;
 
 	t->mhandle = mhandle;
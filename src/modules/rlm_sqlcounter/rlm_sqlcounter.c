@@ -27,10 +27,16 @@ RCSID("$Id$")
 #define LOG_PREFIX "sqlcounter"
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/command.h>
 #include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/radius/defs.h>
+#include <freeradius-devel/unlang/xlat_func.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rb.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 #define MAX_QUERY_LEN 1024
 
@@ -52,6 +58,17 @@ RCSID("$Id$")
  *	Reset Time.
  */
 
+/** Configuration for the counter cache
+ *
+ */
+typedef struct {
+	bool		enable;			//!< Whether counters are cached.
+	tmpl_t		*increment;		//!< Cumulative usage of a session, e.g. Acct-Session-Time.
+	tmpl_t		*session;		//!< Identifies a session across accounting packets.
+	fr_time_delta_t	resync_interval;	//!< How long a counter is used before being re-read.
+	uint32_t	max_entries;		//!< Maximum number of counters to cache.
+} sqlcounter_cache_conf_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -72,10 +89,57 @@ typedef struct {
 	char const	*query;		//!< SQL query to retrieve current session time.
 	char const	*reset;  	//!< Daily, weekly, monthly, never or user defined.
 
+	sqlcounter_cache_conf_t	cache;	//!< Counter cache configuration.
+
 	fr_time_t	reset_time;
 	fr_time_t	last_reset;
+
+	pthread_mutex_t	mutex;		//!< Protects the cache and its statistics.
+	fr_rb_tree_t	*counters;	//!< Cached counters, indexed by key.
+	fr_dlist_head_t	lru;		//!< Cached counters, least recently used first.
+
+	uint64_t	hits;		//!< Counters found in the cache.
+	uint64_t	misses;		//!< Counters read from SQL because they weren't cached.
+	uint64_t	resyncs;	//!< Counters re-read from SQL because they were too old.
+	uint64_t	updates;	//!< Accounting packets which changed a cached counter.
+	uint64_t	evictions;	//!< Counters removed to make room for others.
 } rlm_sqlcounter_t;
 
+/** A cached counter
+ *
+ */
+typedef struct {
+	fr_rb_node_t	node;		//!< Entry in the counters tree.
+	fr_dlist_t	lru_entry;	//!< Entry in the LRU list.
+
+	char const	*key;		//!< The expanded 'key'.
+	uint64_t	counter;	//!< Current value.
+	fr_time_t	period;		//!< Start of the reset period the counter is for.
+	fr_time_t	synced;		//!< When the counter was last read from SQL.
+
+	fr_rb_tree_t	*sessions;	//!< Sessions seen since the counter was cached.
+} sqlcounter_entry_t;
+
+/** The last usage reported for a session
+ *
+ */
+typedef struct {
+	fr_rb_node_t	node;		//!< Entry in the sessions tree.
+	char const	*id;		//!< The expanded 'session'.
+	uint64_t	value;		//!< Last value of 'increment'.
+	fr_time_t	seen;		//!< When the last accounting packet was received.
+} sqlcounter_session_t;
+
+static const conf_parser_t cache_config[] = {
+	{ FR_CONF_OFFSET("enable", sqlcounter_cache_conf_t, enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("increment", sqlcounter_cache_conf_t, increment) },
+	{ FR_CONF_OFFSET("session", sqlcounter_cache_conf_t, session),
+	  .dflt = "%{%{Acct-Unique-Session-Id} || %{Acct-Session-Id}}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("resync_interval", sqlcounter_cache_conf_t, resync_interval), .dflt = "300" },
+	{ FR_CONF_OFFSET("max_entries", sqlcounter_cache_conf_t, max_entries), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("sql_module_instance", CONF_FLAG_REQUIRED, rlm_sqlcounter_t, sqlmod_inst) },
 
@@ -96,6 +160,8 @@ static const conf_parser_t module_config[] = {
 
 	/* Attribute to write remaining session to */
 	{ FR_CONF_OFFSET_FLAGS("reply_name", CONF_FLAG_ATTRIBUTE, rlm_sqlcounter_t, reply_attr) },
+
+	{ FR_CONF_OFFSET_SUBSECTION("cache", 0, rlm_sqlcounter_t, cache, cache_config) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -109,11 +175,13 @@ fr_dict_autoload_t rlm_sqlcounter_dict[] = {
 	{ NULL }
 };
 
+static fr_dict_attr_t const *attr_acct_status_type;
 static fr_dict_attr_t const *attr_reply_message;
 static fr_dict_attr_t const *attr_session_timeout;
 
 extern fr_dict_attr_autoload_t rlm_sqlcounter_dict_attr[];
 fr_dict_attr_autoload_t rlm_sqlcounter_dict_attr[] = {
+	{ .out = &attr_acct_status_type, .name = "Acct-Status-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_reply_message, .name = "Reply-Message", .type = FR_TYPE_STRING, .dict = &dict_radius },
 	{ .out = &attr_session_timeout, .name = "Session-Timeout", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ NULL }
@@ -244,6 +312,171 @@ static int find_prev_reset(rlm_sqlcounter_t *inst, fr_time_t now)
 }
 
 
+/** Run the counter query
+ *
+ * @param[out] out	the counter value.
+ * @param[in] inst	of rlm_sqlcounter.
+ * @param[in] request	being authorized.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlcounter_query(uint64_t *out, rlm_sqlcounter_t const *inst, request_t *request)
+{
+	size_t	len;
+	char	*expanded = NULL;
+	char	query[MAX_QUERY_LEN];
+
+	/* Then combine that with the name of the module were using to do the query */
+	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, inst->query);
+	if (len >= (sizeof(query) - 1)) {
+		REDEBUG("Insufficient query buffer space");
+		return -1;
+	}
+
+	/* Finally, xlat resulting SQL query */
+	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) return -1;
+
+	if (sscanf(expanded, "%" PRIu64, out) != 1) {
+		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
+			expanded);
+		*out = 0;
+	}
+
+	talloc_free(expanded);
+
+	return 0;
+}
+
+static int8_t sqlcounter_entry_cmp(void const *one, void const *two)
+{
+	sqlcounter_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->key, b->key);
+	return CMP(ret, 0);
+}
+
+static int8_t sqlcounter_session_cmp(void const *one, void const *two)
+{
+	sqlcounter_session_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->id, b->id);
+	return CMP(ret, 0);
+}
+
+/** Forget sessions which haven't sent an accounting packet since the last resync
+ *
+ * These are usually sessions whose Stop was lost, or was sent to
+ * another server.
+ */
+static void sqlcounter_sessions_prune(sqlcounter_entry_t *entry)
+{
+	fr_rb_iter_inorder_t	iter;
+	sqlcounter_session_t	*session;
+
+	if (!entry->sessions) return;
+
+	for (session = fr_rb_iter_init_inorder(&iter, entry->sessions);
+	     session;
+	     session = fr_rb_iter_next_inorder(&iter)) {
+		if (fr_time_gteq(session->seen, entry->synced)) continue;
+
+		fr_rb_iter_delete_inorder(&iter);
+		talloc_free(session);
+	}
+}
+
+/** Get a counter from the cache, reading it from SQL if it's missing or too old
+ *
+ * @param[out] out	the counter value.
+ * @param[in] inst	of rlm_sqlcounter.
+ * @param[in] request	being authorized.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlcounter_cache_read(uint64_t *out, rlm_sqlcounter_t *inst, request_t *request)
+{
+	sqlcounter_entry_t	*entry, find;
+	char			*key;
+	fr_time_t		now = fr_time();
+	uint64_t		counter;
+
+	if (tmpl_aexpand(request, &key, request, inst->key, NULL, NULL) < 0) {
+		REDEBUG("Failed expanding key");
+		return -1;
+	}
+	find.key = key;
+
+	pthread_mutex_lock(&inst->mutex);
+	entry = fr_rb_find(inst->counters, &find);
+	if (entry && fr_time_eq(entry->period, inst->last_reset) &&
+	    fr_time_lt(now, fr_time_add(entry->synced, inst->cache.resync_interval))) {
+		fr_dlist_remove(&inst->lru, entry);
+		fr_dlist_insert_tail(&inst->lru, entry);
+		counter = entry->counter;
+		inst->hits++;
+		pthread_mutex_unlock(&inst->mutex);
+
+		RDEBUG2("Using cached counter value %" PRIu64 " for \"%s\"", counter, key);
+		talloc_free(key);
+		*out = counter;
+		return 0;
+	}
+
+	if (entry) {
+		inst->resyncs++;
+	} else {
+		inst->misses++;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	/*
+	 *	The query is run without holding the mutex.  Any
+	 *	accounting packets for this key which are processed
+	 *	while it runs may be counted twice.  That's corrected
+	 *	at the next resync.
+	 */
+	if (sqlcounter_query(&counter, inst, request) < 0) {
+		talloc_free(key);
+		return -1;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	entry = fr_rb_find(inst->counters, &find);
+	if (!entry) {
+		MEM(entry = talloc_zero(inst->counters, sqlcounter_entry_t));
+		entry->key = talloc_steal(entry, key);
+		key = NULL;
+
+		fr_rb_insert(inst->counters, entry);
+		fr_dlist_insert_tail(&inst->lru, entry);
+
+		if (inst->cache.max_entries && (fr_rb_num_elements(inst->counters) > inst->cache.max_entries)) {
+			sqlcounter_entry_t *oldest = fr_dlist_head(&inst->lru);
+
+			fr_rb_remove(inst->counters, oldest);
+			fr_dlist_remove(&inst->lru, oldest);
+			talloc_free(oldest);
+			inst->evictions++;
+		}
+	} else {
+		sqlcounter_sessions_prune(entry);
+	}
+	entry->counter = counter;
+	entry->period = inst->last_reset;
+	entry->synced = now;
+	pthread_mutex_unlock(&inst->mutex);
+
+	RDEBUG2("Cached counter value %" PRIu64 " read from SQL", counter);
+	talloc_free(key);
+	*out = counter;
+
+	return 0;
+}
+
 /*
  *	Find the named user in this modules database.  Create the set
  *	of attribute-value pairs to check and reply with for this user
@@ -258,9 +491,6 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	fr_pair_t		*reply_item;
 	char			msg[128];
 	int			ret;
-	size_t len;
-	char *expanded = NULL;
-	char query[MAX_QUERY_LEN];
 
 	/*
 	 *	Before doing anything else, see if we have to reset
@@ -292,27 +522,12 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	}
 	vp->vp_uint64 = fr_time_to_sec(inst->reset_time);
 
-	/* Then combine that with the name of the module were using to do the query */
-	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, inst->query);
-	if (len >= (sizeof(query) - 1)) {
-		REDEBUG("Insufficient query buffer space");
-
+	if (inst->cache.enable) {
+		if (sqlcounter_cache_read(&counter, inst, request) < 0) RETURN_MODULE_FAIL;
+	} else if (sqlcounter_query(&counter, inst, request) < 0) {
 		RETURN_MODULE_FAIL;
 	}
 
-	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		RETURN_MODULE_FAIL;
-	}
-
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
-			expanded);
-		counter = 0;
-	}
-
-	talloc_free(expanded);
-
 	/*
 	 *	Check if check item > counter
 	 */
@@ -427,6 +642,203 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	RETURN_MODULE_OK;
 }
 
+/** Add the usage reported by an accounting packet to a cached counter
+ *
+ * 'increment' is the total usage of the session so far, so we
+ * remember the last value for each session, and add the difference.
+ * Counters which aren't cached are left alone, as the SQL query will
+ * include this packet's usage when they're next read.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sqlcounter_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlcounter_t);
+	fr_pair_t		*vp;
+	sqlcounter_entry_t	*entry, find_entry;
+	sqlcounter_session_t	*session, find_session;
+	char			*key = NULL, *id = NULL;
+	char			buff[64];
+	uint32_t		status;
+	uint64_t		value, delta = 0;
+	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
+
+	/*
+	 *	Without the cache, we do the same as we
+	 *	always have done in accounting sections.
+	 */
+	if (!inst->cache.enable) return mod_authorize(p_result, mctx, request);
+
+	vp = fr_pair_find_by_da(&request->request_pairs, NULL, attr_acct_status_type);
+	if (!vp) RETURN_MODULE_NOOP;
+
+	status = vp->vp_uint32;
+	switch (status) {
+	case FR_STATUS_START:
+	case FR_STATUS_ALIVE:
+	case FR_STATUS_STOP:
+		break;
+
+	default:
+		RETURN_MODULE_NOOP;
+	}
+
+	if (tmpl_expand(&value, buff, sizeof(buff), request, inst->cache.increment, NULL, NULL) < 0) {
+		if (status != FR_STATUS_START) {
+			RDEBUG2("Couldn't expand %s, doing nothing...", inst->cache.increment->name);
+			RETURN_MODULE_NOOP;
+		}
+		value = 0;
+	}
+
+	if (tmpl_aexpand(request, &key, request, inst->key, NULL, NULL) < 0) {
+		REDEBUG("Failed expanding key");
+		RETURN_MODULE_FAIL;
+	}
+
+	if ((tmpl_aexpand(request, &id, request, inst->cache.session, NULL, NULL) < 0) || !*id) {
+		RDEBUG2("No session identifier, doing nothing...");
+		goto finish;
+	}
+
+	find_entry.key = key;
+	find_session.id = id;
+
+	pthread_mutex_lock(&inst->mutex);
+	entry = fr_rb_find(inst->counters, &find_entry);
+	if (!entry || !fr_time_eq(entry->period, inst->last_reset)) {
+		pthread_mutex_unlock(&inst->mutex);
+		RDEBUG2("Counter for \"%s\" isn't cached, doing nothing...", key);
+		goto finish;
+	}
+
+	session = entry->sessions ? fr_rb_find(entry->sessions, &find_session) : NULL;
+	if (session) {
+		if (value > session->value) delta = value - session->value;
+
+	/*
+	 *	A session which started before the counter was cached
+	 *	has its usage so far in the SQL value.  We don't know
+	 *	how much, so we only count what it uses from now on.
+	 */
+	} else {
+		if (status == FR_STATUS_START) delta = value;
+
+		if (!entry->sessions) {
+			MEM(entry->sessions = fr_rb_inline_talloc_alloc(entry, sqlcounter_session_t, node,
+									sqlcounter_session_cmp, NULL));
+		}
+		MEM(session = talloc_zero(entry->sessions, sqlcounter_session_t));
+		session->id = talloc_steal(session, id);
+		id = NULL;
+		fr_rb_insert(entry->sessions, session);
+	}
+
+	if (status == FR_STATUS_STOP) {
+		fr_rb_remove(entry->sessions, session);
+		talloc_free(session);
+	} else {
+		session->value = value;
+		session->seen = fr_time();
+	}
+
+	entry->counter += delta;
+	inst->updates++;
+	pthread_mutex_unlock(&inst->mutex);
+
+	RDEBUG2("Added %" PRIu64 " to cached counter for \"%s\"", delta, key);
+	rcode = RLM_MODULE_UPDATED;
+
+finish:
+	talloc_free(key);
+	talloc_free(id);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static int cmd_show_module_cache(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	rlm_sqlcounter_t *inst = talloc_get_type_abort(ctx, rlm_sqlcounter_t);
+
+	pthread_mutex_lock(&inst->mutex);
+	fprintf(fp, "entries\t%u\n", fr_rb_num_elements(inst->counters));
+	fprintf(fp, "hits\t%" PRIu64 "\n", inst->hits);
+	fprintf(fp, "misses\t%" PRIu64 "\n", inst->misses);
+	fprintf(fp, "resyncs\t%" PRIu64 "\n", inst->resyncs);
+	fprintf(fp, "updates\t%" PRIu64 "\n", inst->updates);
+	fprintf(fp, "evictions\t%" PRIu64 "\n", inst->evictions);
+	pthread_mutex_unlock(&inst->mutex);
+
+	return 0;
+}
+
+static xlat_arg_parser_t const sqlcounter_cache_stats_xlat_arg[] = {
+	{ .required = true, .single = true, .type = FR_TYPE_STRING },
+	XLAT_ARG_PARSER_TERMINATOR
+};
+
+/** Return one of the counter cache statistics
+ *
+ * The same values as 'show module <name> cache' in radmin.
+ *
+ * Example:
+@verbatim
+%dailycounter.cache_stats(hits)
+%dailycounter.cache_stats(evictions)
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t sqlcounter_cache_stats_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
+						 xlat_ctx_t const *xctx,
+						 request_t *request, fr_value_box_list_t *in)
+{
+	rlm_sqlcounter_t	*inst = talloc_get_type_abort(xctx->mctx->inst->data, rlm_sqlcounter_t);
+	fr_value_box_t		*which, *vb;
+	char const		*name;
+
+	XLAT_ARGS(in, &which);
+	name = which->vb_strvalue;
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT64, NULL));
+
+	pthread_mutex_lock(&inst->mutex);
+	if (strcmp(name, "entries") == 0) {
+		vb->vb_uint64 = fr_rb_num_elements(inst->counters);
+	} else if (strcmp(name, "hits") == 0) {
+		vb->vb_uint64 = inst->hits;
+	} else if (strcmp(name, "misses") == 0) {
+		vb->vb_uint64 = inst->misses;
+	} else if (strcmp(name, "resyncs") == 0) {
+		vb->vb_uint64 = inst->resyncs;
+	} else if (strcmp(name, "updates") == 0) {
+		vb->vb_uint64 = inst->updates;
+	} else if (strcmp(name, "evictions") == 0) {
+		vb->vb_uint64 = inst->evictions;
+	} else {
+		pthread_mutex_unlock(&inst->mutex);
+		REDEBUG("Unknown cache statistic \"%s\"", name);
+		talloc_free(vb);
+		return XLAT_ACTION_FAIL;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	fr_dcursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+
+static fr_cmd_table_t cmd_sqlcounter_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "cache",
+		.func = cmd_show_module_cache,
+		.help = "Show how often counters were found in the cache.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -461,6 +873,32 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	pthread_mutex_init(&inst->mutex, NULL);
+
+	if (!inst->cache.enable) return 0;
+
+	if (!inst->cache.increment) {
+		cf_log_err(conf, "'cache.increment' must be set when the cache is enabled");
+		return -1;
+	}
+
+	MEM(inst->counters = fr_rb_inline_talloc_alloc(inst, sqlcounter_entry_t, node, sqlcounter_entry_cmp, NULL));
+	fr_dlist_talloc_init(&inst->lru, sqlcounter_entry_t, lru_entry);
+
+	if (fr_command_register_hook(NULL, mctx->inst->name, inst, cmd_sqlcounter_table) < 0) {
+		PERROR("Failed registering radmin commands for module %s", mctx->inst->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_sqlcounter_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlcounter_t);
+
+	pthread_mutex_destroy(&inst->mutex);
+
 	return 0;
 }
 
@@ -507,6 +945,14 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	if (inst->cache.enable) {
+		xlat_t *xlat;
+
+		if (unlikely(!(xlat = xlat_func_register_module(NULL, mctx, "cache_stats", sqlcounter_cache_stats_xlat,
+								FR_TYPE_UINT64)))) return -1;
+		xlat_func_args_set(xlat, sqlcounter_cache_stats_xlat_arg);
+	}
+
 	return 0;
 }
 
@@ -529,8 +975,11 @@ module_rlm_t rlm_sqlcounter = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
 	},
 	.method_names = (module_method_name_t[]){
+		{ .name1 = "recv",		.name2 = "accounting-request",	.method = mod_accounting },
+		{ .name1 = "accounting",	.name2 = CF_IDENT_ANY,		.method = mod_accounting },
 		{ .name1 = CF_IDENT_ANY,	.name2 = CF_IDENT_ANY,		.method = mod_authorize},
 		MODULE_NAME_TERMINATOR
 	}
@@ -31,11 +31,62 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/radius/radius.h>
 
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/util/heap.h>
+
 #include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 
 #define MAX_QUERY_LEN 4096
 
+typedef enum {
+	SQLIPPOOL_LEASE_DYNAMIC = 0,				//!< Can be allocated to anyone.
+	SQLIPPOOL_LEASE_STATIC,					//!< Only used by its owner.
+	SQLIPPOOL_LEASE_DECLINED,				//!< Marked as bad.
+	SQLIPPOOL_LEASE_DISABLED				//!< Not used.
+} sqlippool_lease_status_t;
+
+static fr_table_num_sorted_t const sqlippool_lease_status_table[] = {
+	{ L("declined"),	SQLIPPOOL_LEASE_DECLINED	},
+	{ L("disabled"),	SQLIPPOOL_LEASE_DISABLED	},
+	{ L("dynamic"),		SQLIPPOOL_LEASE_DYNAMIC		},
+	{ L("static"),		SQLIPPOOL_LEASE_STATIC		}
+};
+static size_t sqlippool_lease_status_table_len = NUM_ELEMENTS(sqlippool_lease_status_table);
+
+typedef struct sqlippool_pool_s sqlippool_pool_t;
+
+/** One address, when pools are held in memory
+ *
+ */
+typedef struct {
+	fr_rb_node_t		address_node;		//!< Entry in the pool's address tree.
+	fr_rb_node_t		owner_node;		//!< Entry in the pool's owner tree.
+	fr_heap_index_t		heap_id;		//!< Entry in the pool's expiry heap.
+	fr_dlist_t		dirty_entry;		//!< Entry in the list of leases to write.
+
+	sqlippool_pool_t	*pool;			//!< Pool the address belongs to.
+	char const		*address;		//!< As stored in the database.
+	char			*owner;			//!< Empty if the address isn't owned.
+	char			*gateway;
+	time_t			expires;
+	sqlippool_lease_status_t status;
+	bool			owned;			//!< In the owner tree.
+} sqlippool_lease_t;
+
+/** A pool read from the database
+ *
+ */
+struct sqlippool_pool_s {
+	fr_rb_node_t		node;			//!< Entry in the instance's pool tree.
+	char const		*name;
+	fr_rb_tree_t		*addresses;		//!< All leases, by address.
+	fr_rb_tree_t		*owners;		//!< Leases with an owner, by owner.
+	fr_heap_t		*expiry;		//!< Dynamic leases, by expiry time.
+};
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -93,8 +144,47 @@ typedef struct {
 						/* Reserved to handle 255.255.255.254 Requests */
 	char const	*defaultpool;		//!< Default Pool-Name if there is none in the check items.
 
+						/* In-memory pools */
+	bool		memory;			//!< Allocate from pools held in memory.
+	char const	*memory_load;		//!< SQL query to read a pool.
+	char const	*memory_write;		//!< SQL query to write a lease back.
+	fr_time_delta_t	memory_write_interval;	//!< How often changed leases are written.
+	char const	*memory_journal;	//!< File changed leases are recorded in before
+						///< they're returned.
+	uint32_t	offer_duration;
+	tmpl_t		*owner;			//!< Who a lease belongs to.
+	tmpl_t		*gateway;		//!< NAS or relay a lease was allocated through.
+
+	pthread_mutex_t	mutex;			//!< Protects the pools, the list of changed leases,
+						///< and appends to the journal.
+	fr_rb_tree_t	*pools;			//!< Pools which have been read.
+	fr_dlist_head_t	dirty;			//!< Leases which have changed since they were last written.
+	pthread_mutex_t	write_mutex;		//!< Held while leases are written to the database.
+
+	int		journal_fd;		//!< Changes which may not have been written yet.
+	pthread_rwlock_t journal_lock;		//!< Held for writing while the journal is replaced.
+	bool		journal_replayed;	//!< The journal left by the last run has been written.
+						///< Protected by the write mutex.
+
+	pthread_t	writer;			//!< Writes changed leases to the database.
+	pthread_cond_t	writer_cond;		//!< Signalled to stop the writer.
+	bool		writer_running;
+	bool		writer_stop;		//!< Protected by the mutex.
 } rlm_sqlippool_t;
 
+/** The state of a lease, copied so it can be written without holding the instance mutex
+ *
+ */
+typedef struct {
+	sqlippool_lease_t	*lease;			//!< NULL for changes read from the journal.
+	char const		*pool;
+	char const		*address;
+	char const		*owner;
+	char const		*gateway;
+	time_t			expires;
+	sqlippool_lease_status_t status;
+} sqlippool_write_t;
+
 static conf_parser_t message_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("exists", CONF_FLAG_XLAT, rlm_sqlippool_t, log_exists) },
 	{ FR_CONF_OFFSET_FLAGS("success", CONF_FLAG_XLAT, rlm_sqlippool_t, log_success) },
@@ -117,6 +207,23 @@ static conf_parser_t module_config[] = {
 
 	{ FR_CONF_OFFSET("default_pool", rlm_sqlippool_t, defaultpool), .dflt = "main_pool" },
 
+	{ FR_CONF_OFFSET("offer_duration", rlm_sqlippool_t, offer_duration), .dflt = "60" },
+
+	{ FR_CONF_OFFSET("owner", rlm_sqlippool_t, owner) },
+
+	{ FR_CONF_OFFSET("gateway", rlm_sqlippool_t, gateway) },
+
+
+	{ FR_CONF_OFFSET("memory", rlm_sqlippool_t, memory), .dflt = "no" },
+
+	{ FR_CONF_OFFSET_FLAGS("memory_load", CONF_FLAG_XLAT, rlm_sqlippool_t, memory_load) },
+
+	{ FR_CONF_OFFSET("memory_write", rlm_sqlippool_t, memory_write) },
+
+	{ FR_CONF_OFFSET("memory_write_interval", rlm_sqlippool_t, memory_write_interval), .dflt = "1.0" },
+
+	{ FR_CONF_OFFSET_FLAGS("memory_journal", CONF_FLAG_FILE_OUTPUT, rlm_sqlippool_t, memory_journal) },
+
 
 	{ FR_CONF_OFFSET_FLAGS("alloc_begin", CONF_FLAG_XLAT, rlm_sqlippool_t, alloc_begin), .dflt = "START TRANSACTION" },
 
@@ -268,138 +375,1254 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
 
 /** Perform a single sqlippool query
  *
- * Mostly wrapper around sql_query which does some special sqlippool sequence substitutions and expands
- * the format string.
+ * Mostly wrapper around sql_query which does some special sqlippool sequence substitutions and expands
+ * the format string.
+ *
+ * @param fmt sql query to expand.
+ * @param handle sql connection handle.
+ * @param data Instance of rlm_sqlippool.
+ * @param request Current request.
+ * @param param ip address string.
+ * @param param_len ip address string len.
+ * @return
+ *	- 0 on success.
+ *	- < 0 on error.
+ */
+static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
+			     rlm_sqlippool_t const *data, request_t *request,
+			     char *param, int param_len)
+{
+	char query[MAX_QUERY_LEN];
+	char *expanded = NULL;
+
+	int ret;
+	int affected;
+
+	/*
+	 *	If we don't have a command, do nothing.
+	 */
+	if (!fmt || !*fmt) return 0;
+
+	/*
+	 *	No handle?  That's an error.
+	 */
+	if (!handle || !*handle) return -1;
+
+	/*
+	 *	@todo this needs to die (should just be done in xlat expansion)
+	 */
+	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
+
+	if (xlat_aeval(request, &expanded, request, query, data->sql->sql_escape_func, *handle) < 0) return -1;
+
+	ret = data->sql->query(data->sql, request, handle, expanded);
+	talloc_free(expanded);
+	if (ret < 0){
+		return -1;
+	}
+
+	/*
+	 *	No handle, we can't continue.
+	 */
+	if (!*handle) return -1;
+
+	affected = (data->sql->driver->sql_affected_rows)(*handle, &data->sql->config);
+
+	(data->sql->driver->sql_finish_query)(*handle, &data->sql->config);
+
+	return affected;
+}
+
+/*
+ *	Don't repeat yourself
+ */
+#define DO_PART(_x) if(sqlippool_command(inst->_x, &handle, inst, request, NULL, 0) <0) goto error
+
+/*
+ * Query the database expecting a single result row
+ */
+static int CC_HINT(nonnull (1, 3, 4, 5)) sqlippool_query1(char *out, int outlen, char const *fmt,
+							  rlm_sql_handle_t **handle, rlm_sqlippool_t *data,
+							  request_t *request, char *param, int param_len)
+{
+	char query[MAX_QUERY_LEN];
+	char *expanded = NULL;
+
+	int rlen, retval;
+
+	rlm_sql_row_t row;
+
+	/*
+	 *	@todo this needs to die (should just be done in xlat expansion)
+	 */
+	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
+
+	*out = '\0';
+
+	/*
+	 *	Do an xlat on the provided string
+	 */
+	if (xlat_aeval(request, &expanded, request, query, data->sql->sql_escape_func, *handle) < 0) {
+		return 0;
+	}
+	retval = data->sql->select(data->sql, request, handle, expanded);
+	talloc_free(expanded);
+
+	if ((retval != 0) || !*handle) {
+		REDEBUG("database query error on '%s'", query);
+		return 0;
+	}
+
+	if (data->sql->fetch_row(&row, data->sql, request, handle) < 0) {
+		REDEBUG("Failed fetching query result");
+		goto finish;
+	}
+
+	if (!row) {
+		REDEBUG("SQL query did not return any results");
+		goto finish;
+	}
+
+	if (!row[0]) {
+		REDEBUG("The first column of the result was NULL");
+		goto finish;
+	}
+
+	rlen = strlen(row[0]);
+	if (rlen >= outlen) {
+		RDEBUG2("insufficient string space");
+		goto finish;
+	}
+
+	strcpy(out, row[0]);
+	retval = rlen;
+
+finish:
+	(data->sql->driver->sql_finish_select_query)(*handle, &data->sql->config);
+
+	return retval;
+}
+
+/*
+ *	If we have something to log, then we log it.
+ *	Otherwise we return the retcode as soon as possible
+ */
+static unlang_action_t do_logging(rlm_rcode_t *p_result, UNUSED rlm_sqlippool_t const *inst, request_t *request,
+				  char const *str, rlm_rcode_t rcode)
+{
+	char		*expanded = NULL;
+	fr_pair_t	*vp;
+
+	if (!str || !*str) RETURN_MODULE_RCODE(rcode);
+
+	MEM(pair_append_request(&vp, attr_module_success_message) == 0);
+	if (xlat_aeval(vp, &expanded, request, str, NULL, NULL) < 0) {
+		pair_delete_request(vp);
+		RETURN_MODULE_RCODE(rcode);
+	}
+	fr_pair_value_bstrdup_buffer_shallow(vp, expanded, true);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+
+static int8_t sqlippool_pool_cmp(void const *one, void const *two)
+{
+	sqlippool_pool_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->name, b->name), 0);
+}
+
+static int8_t sqlippool_address_cmp(void const *one, void const *two)
+{
+	sqlippool_lease_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->address, b->address), 0);
+}
+
+static int8_t sqlippool_owner_cmp(void const *one, void const *two)
+{
+	sqlippool_lease_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->owner, b->owner), 0);
+}
+
+static int8_t sqlippool_expiry_cmp(void const *one, void const *two)
+{
+	sqlippool_lease_t const *a = one, *b = two;
+
+	return CMP(a->expires, b->expires);
+}
+
+static inline sqlippool_lease_t *sqlippool_lease_by_address(sqlippool_pool_t *pool, char const *address)
+{
+	return fr_rb_find(pool->addresses, &(sqlippool_lease_t){ .address = address });
+}
+
+static inline sqlippool_lease_t *sqlippool_lease_by_owner(sqlippool_pool_t *pool, char const *owner)
+{
+	if (!*owner) return NULL;
+
+	return fr_rb_find(pool->owners, &(sqlippool_lease_t){ .owner = UNCONST(char *, owner) });
+}
+
+/** Make a lease the one found for its owner
+ *
+ * Only one lease per owner is indexed, the same as 'alloc_existing'
+ * only returning one.
+ */
+static void sqlippool_lease_own(sqlippool_pool_t *pool, sqlippool_lease_t *lease)
+{
+	sqlippool_lease_t *old;
+
+	if (lease->owned || !*lease->owner) return;
+
+	old = sqlippool_lease_by_owner(pool, lease->owner);
+	if (old) {
+		fr_rb_remove_by_inline_node(pool->owners, &old->owner_node);
+		old->owned = false;
+	}
+
+	fr_rb_insert(pool->owners, lease);
+	lease->owned = true;
+}
+
+static void sqlippool_lease_disown(sqlippool_pool_t *pool, sqlippool_lease_t *lease)
+{
+	if (!lease->owned) return;
+
+	fr_rb_remove_by_inline_node(pool->owners, &lease->owner_node);
+	lease->owned = false;
+}
+
+/** Escape a journal field, so it contains no tabs or newlines
+ *
+ */
+static char *sqlippool_journal_escape(TALLOC_CTX *ctx, char const *in)
+{
+	char		*out, *q;
+	char const	*p;
+
+	MEM(out = talloc_array(ctx, char, (strlen(in) * 2) + 1));
+	for (p = in, q = out; *p; p++) {
+		switch (*p) {
+		case '\\':
+			*q++ = '\\';
+			*q++ = '\\';
+			break;
+
+		case '\t':
+			*q++ = '\\';
+			*q++ = 't';
+			break;
+
+		case '\n':
+			*q++ = '\\';
+			*q++ = 'n';
+			break;
+
+		default:
+			*q++ = *p;
+			break;
+		}
+	}
+	*q = '\0';
+
+	return out;
+}
+
+/** Undo sqlippool_journal_escape() in place
+ *
+ */
+static void sqlippool_journal_unescape(char *in)
+{
+	char *p, *q;
+
+	for (p = q = in; *p; p++) {
+		if ((*p != '\\') || !p[1]) {
+			*q++ = *p;
+			continue;
+		}
+
+		switch (*++p) {
+		case 't':
+			*q++ = '\t';
+			break;
+
+		case 'n':
+			*q++ = '\n';
+			break;
+
+		default:
+			*q++ = *p;
+			break;
+		}
+	}
+	*q = '\0';
+}
+
+/** Record the new state of a lease in the journal
+ *
+ * Must be called with the instance mutex held, so the records are
+ * in the same order as the changes.  The record isn't durable until
+ * sqlippool_journal_sync() has been called.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlippool_journal_write(rlm_sqlippool_t *inst, sqlippool_lease_t const *lease)
+{
+	TALLOC_CTX	*tmp;
+	char		*record;
+	size_t		len, done;
+	ssize_t		ret;
+	off_t		start;
+
+	start = lseek(inst->journal_fd, 0, SEEK_END);
+	if (start < 0) {
+		ERROR("Failed seeking in journal %s: %s", inst->memory_journal, fr_syserror(errno));
+		return -1;
+	}
+
+	MEM(tmp = talloc_new(NULL));
+	MEM(record = talloc_typed_asprintf(tmp, "%s\t%s\t%s\t%s\t%" PRId64 "\t%s\n",
+					   sqlippool_journal_escape(tmp, lease->pool->name),
+					   sqlippool_journal_escape(tmp, lease->address),
+					   sqlippool_journal_escape(tmp, lease->owner),
+					   sqlippool_journal_escape(tmp, lease->gateway),
+					   (int64_t) lease->expires,
+					   fr_table_str_by_value(sqlippool_lease_status_table, lease->status, "dynamic")));
+	len = talloc_array_length(record) - 1;
+
+	for (done = 0; done < len; done += ret) {
+		ret = write(inst->journal_fd, record + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+
+			ERROR("Failed writing to journal %s: %s", inst->memory_journal, fr_syserror(errno));
+
+			/*
+			 *	Don't leave part of a record for the
+			 *	next one to be appended to.
+			 */
+			if (ftruncate(inst->journal_fd, start) < 0) {
+				ERROR("Failed truncating journal %s: %s", inst->memory_journal, fr_syserror(errno));
+			}
+			talloc_free(tmp);
+			return -1;
+		}
+	}
+	talloc_free(tmp);
+
+	return 0;
+}
+
+/** Make the records written by this thread durable
+ *
+ * Called after the instance mutex is released, so that syncs from
+ * different workers can overlap.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlippool_journal_sync(rlm_sqlippool_t *inst, request_t *request)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&inst->journal_lock);
+	ret = fsync(inst->journal_fd);
+	pthread_rwlock_unlock(&inst->journal_lock);
+
+	if (ret < 0) {
+		REDEBUG("Failed syncing journal %s: %s", inst->memory_journal, fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Change a lease, record it in the journal, and queue it to be written to the database
+ *
+ * Must be called with the instance mutex held.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the change couldn't be recorded in the journal.
+ */
+static int sqlippool_lease_set(rlm_sqlippool_t *inst, sqlippool_lease_t *lease,
+			       char const *owner, char const *gateway, time_t expires)
+{
+	sqlippool_pool_t	*pool = lease->pool;
+	char			*new_owner, *new_gateway;
+
+	/*
+	 *	Copy first, the new values may be the old ones.
+	 */
+	MEM(new_owner = talloc_typed_strdup(lease, owner));
+	MEM(new_gateway = talloc_typed_strdup(lease, gateway));
+
+	sqlippool_lease_disown(pool, lease);
+	talloc_free(lease->owner);
+	talloc_free(lease->gateway);
+	lease->owner = new_owner;
+	lease->gateway = new_gateway;
+	if ((lease->status == SQLIPPOOL_LEASE_DYNAMIC) || (lease->status == SQLIPPOOL_LEASE_STATIC)) {
+		sqlippool_lease_own(pool, lease);
+	}
+
+	lease->expires = expires;
+	if (fr_heap_entry_inserted(lease->heap_id)) {
+		fr_heap_extract(&pool->expiry, lease);
+		fr_heap_insert(&pool->expiry, lease);
+	}
+
+	if (!fr_dlist_entry_in_list(&lease->dirty_entry)) fr_dlist_insert_tail(&inst->dirty, lease);
+
+	return sqlippool_journal_write(inst, lease);
+}
+
+/** Read a pool from the database
+ *
+ * Each row returned by 'memory_load' is one address, with the columns
+ * address, owner, gateway, expiry time (in seconds since the epoch),
+ * and status.
+ */
+static sqlippool_pool_t *sqlippool_memory_load(rlm_sqlippool_t *inst, request_t *request, char const *name)
+{
+	sqlippool_pool_t	*pool;
+	rlm_sql_handle_t	*handle;
+	rlm_sql_row_t		row;
+	char			query[MAX_QUERY_LEN];
+	char			*expanded = NULL;
+	int			ret;
+
+	MEM(pool = talloc_zero(NULL, sqlippool_pool_t));
+	MEM(pool->name = talloc_typed_strdup(pool, name));
+	MEM(pool->addresses = fr_rb_inline_talloc_alloc(pool, sqlippool_lease_t, address_node,
+							 sqlippool_address_cmp, NULL));
+	MEM(pool->owners = fr_rb_inline_talloc_alloc(pool, sqlippool_lease_t, owner_node,
+						      sqlippool_owner_cmp, NULL));
+	MEM(pool->expiry = fr_heap_talloc_alloc(pool, sqlippool_expiry_cmp, sqlippool_lease_t, heap_id, 0));
+
+	handle = fr_pool_connection_get(inst->sql->pool, request);
+	if (!handle) {
+		REDEBUG("Failed reserving SQL connection");
+	error:
+		talloc_free(pool);
+		return NULL;
+	}
+
+	if (inst->sql->sql_set_user(inst->sql, request, NULL) < 0) {
+	release:
+		if (handle) fr_pool_connection_release(inst->sql->pool, request, handle);
+		goto error;
+	}
+
+	sqlippool_expand(query, sizeof(query), inst->memory_load, inst, NULL, 0);
+	if (xlat_aeval(request, &expanded, request, query, inst->sql->sql_escape_func, handle) < 0) goto release;
+
+	ret = inst->sql->select(inst->sql, request, &handle, expanded);
+	talloc_free(expanded);
+	if ((ret != 0) || !handle) {
+		REDEBUG("Failed reading pool \"%s\"", name);
+		goto release;
+	}
+
+	while ((inst->sql->fetch_row(&row, inst->sql, request, &handle) == 0) && row) {
+		sqlippool_lease_t	*lease;
+
+		if (!row[0] || !*row[0]) continue;
+
+		MEM(lease = talloc_zero(pool, sqlippool_lease_t));
+		lease->pool = pool;
+		MEM(lease->address = talloc_typed_strdup(lease, row[0]));
+		MEM(lease->owner = talloc_typed_strdup(lease, row[1] ? row[1] : ""));
+		MEM(lease->gateway = talloc_typed_strdup(lease, row[2] ? row[2] : ""));
+		lease->expires = row[3] ? (time_t) strtoll(row[3], NULL, 10) : 0;
+		lease->status = row[4] ? fr_table_value_by_str(sqlippool_lease_status_table, row[4],
+							       SQLIPPOOL_LEASE_DISABLED) : SQLIPPOOL_LEASE_DYNAMIC;
+
+		if (!fr_rb_insert(pool->addresses, lease)) {
+			RWDEBUG("Ignoring duplicate address %s in pool \"%s\"", lease->address, name);
+			talloc_free(lease);
+			continue;
+		}
+
+		switch (lease->status) {
+		case SQLIPPOOL_LEASE_DYNAMIC:
+			fr_heap_insert(&pool->expiry, lease);
+			FALL_THROUGH;
+
+		case SQLIPPOOL_LEASE_STATIC:
+		{
+			sqlippool_lease_t *old = sqlippool_lease_by_owner(pool, lease->owner);
+
+			/*
+			 *	The most recent lease wins.
+			 */
+			if (!old || (old->expires < lease->expires)) sqlippool_lease_own(pool, lease);
+		}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	(inst->sql->driver->sql_finish_select_query)(handle, &inst->sql->config);
+	fr_pool_connection_release(inst->sql->pool, request, handle);
+
+	RDEBUG2("Read %u addresses for pool \"%s\"", fr_rb_num_elements(pool->addresses), name);
+
+	return pool;
+}
+
+/** Expand 'memory_write' for one lease
+ *
+ *	%p	pool name
+ *	%a	address
+ *	%o	owner
+ *	%g	gateway
+ *	%e	expiry time, in seconds since the epoch
+ *	%s	status
+ *	%%	a literal '%'
+ *
+ * All values apart from the expiry time are escaped.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the query, or one of the escaped values, doesn't fit in the buffer.
+ */
+static int sqlippool_write_expand(char *out, size_t outlen, rlm_sqlippool_t const *inst,
+				  rlm_sql_handle_t *handle, sqlippool_write_t const *w)
+{
+	char		*q = out;
+	char const	*p;
+
+	for (p = inst->memory_write; *p; p++) {
+		size_t		freespace = outlen - (q - out);
+		char const	*value;
+		char		*escaped;
+		size_t		len;
+
+		if (freespace <= 1) return -1;
+
+		if ((*p != '%') || !p[1]) {
+			*q++ = *p;
+			continue;
+		}
+
+		switch (*++p) {
+		case 'p':
+			value = w->pool;
+			break;
+
+		case 'a':
+			value = w->address;
+			break;
+
+		case 'o':
+			value = w->owner;
+			break;
+
+		case 'g':
+			value = w->gateway;
+			break;
+
+		case 's':
+			value = fr_table_str_by_value(sqlippool_lease_status_table, w->status, "dynamic");
+			break;
+
+		case 'e':
+			q += snprintf(q, freespace, "%" PRId64, (int64_t) w->expires);
+			if ((size_t)(q - out) >= outlen) return -1;
+			continue;
+
+		case '%':
+			*q++ = '%';
+			continue;
+
+		default:
+			if (freespace < 3) return -1;
+
+			*q++ = '%';
+			*q++ = *p;
+			continue;
+		}
+
+		/*
+		 *	The escape functions silently truncate, so
+		 *	escape into a buffer large enough for the
+		 *	worst case, and check the result fits.
+		 */
+		len = (strlen(value) * 3) + 1;
+		MEM(escaped = talloc_array(NULL, char, len));
+		len = inst->sql->sql_escape_func(NULL, escaped, len, value, handle);
+		if (len >= freespace) {
+			talloc_free(escaped);
+			return -1;
+		}
+
+		memcpy(q, escaped, len);
+		q += len;
+		talloc_free(escaped);
+	}
+	*q = '\0';
+
+	return 0;
+}
+
+static int sqlippool_write_query(rlm_sqlippool_t *inst, request_t *request, rlm_sql_handle_t **handle,
+				 char const *query)
+{
+	if (!query || !*query) return 0;
+
+	if (inst->sql->query(inst->sql, request, handle, query) < 0) return -1;
+	if (!*handle) return -1;
+
+	(inst->sql->driver->sql_finish_query)(*handle, &inst->sql->config);
+
+	return 0;
+}
+
+/** Write the state of some leases to the database, in one transaction
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  Nothing was written.
+ */
+static int sqlippool_write_batch(rlm_sqlippool_t *inst, request_t *request,
+				 sqlippool_write_t const *writes, unsigned int count)
+{
+	rlm_sql_handle_t	*handle;
+	unsigned int		i;
+	char			query[MAX_QUERY_LEN];
+
+	handle = fr_pool_connection_get(inst->sql->pool, request);
+	if (!handle) return -1;
+
+	if (sqlippool_write_query(inst, request, &handle, inst->alloc_begin) < 0) goto fail;
+
+	for (i = 0; i < count; i++) {
+		if (sqlippool_write_expand(query, sizeof(query), inst, handle, &writes[i]) < 0) {
+			ERROR("Query to write address %s is too long", writes[i].address);
+			goto fail;
+		}
+
+		if (sqlippool_write_query(inst, request, &handle, query) < 0) goto fail;
+	}
+
+	if (sqlippool_write_query(inst, request, &handle, inst->alloc_commit) < 0) goto fail;
+
+	fr_pool_connection_release(inst->sql->pool, request, handle);
+
+	return 0;
+
+fail:
+	/*
+	 *	Close the connection, so that the rest of
+	 *	the transaction is discarded.
+	 */
+	if (handle) fr_pool_connection_close(inst->sql->pool, request, handle);
+
+	return -1;
+}
+
+/** Remove the records for changes which have been written to the database
+ *
+ * Records appended while the changes were being written are kept.
+ * Usually there aren't any, and the journal is truncated.  Otherwise
+ * they're copied to a new journal, which replaces the old one.
+ *
+ * @param[in] inst	of rlm_sqlippool.
+ * @param[in] written	Size of the journal when the changes were copied.
+ */
+static void sqlippool_journal_trim(rlm_sqlippool_t *inst, off_t written)
+{
+	char		*tmp_name = NULL;
+	uint8_t		*tail = NULL;
+	off_t		size;
+	ssize_t		len;
+	int		fd = -1;
+
+	pthread_mutex_lock(&inst->mutex);
+	size = lseek(inst->journal_fd, 0, SEEK_END);
+	if (size < 0) goto error;
+
+	/*
+	 *	If the truncation is lost, the old records are
+	 *	replayed on restart, which is harmless.
+	 */
+	if (size == written) {
+		if (ftruncate(inst->journal_fd, 0) < 0) goto error;
+		pthread_mutex_unlock(&inst->mutex);
+		return;
+	}
+
+	MEM(tail = talloc_array(NULL, uint8_t, size - written));
+	len = pread(inst->journal_fd, tail, size - written, written);
+	if (len != (size - written)) goto error;
+
+	MEM(tmp_name = talloc_typed_asprintf(NULL, "%s.tmp", inst->memory_journal));
+	fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+	if (fd < 0) goto error;
+
+	if ((write(fd, tail, len) != len) || (fsync(fd) < 0)) goto error;
+
+	/*
+	 *	Workers may be syncing the old journal.  Wait
+	 *	for them, so it's not closed underneath them.
+	 *	Their records have all been copied.
+	 */
+	pthread_rwlock_wrlock(&inst->journal_lock);
+	if (rename(tmp_name, inst->memory_journal) < 0) {
+		pthread_rwlock_unlock(&inst->journal_lock);
+		goto error;
+	}
+	close(inst->journal_fd);
+	inst->journal_fd = fd;
+	pthread_rwlock_unlock(&inst->journal_lock);
+	pthread_mutex_unlock(&inst->mutex);
+
+	talloc_free(tail);
+	talloc_free(tmp_name);
+	return;
+
+error:
+	pthread_mutex_unlock(&inst->mutex);
+
+	ERROR("Failed removing written leases from journal %s: %s", inst->memory_journal, fr_syserror(errno));
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp_name);
+	}
+	talloc_free(tail);
+	talloc_free(tmp_name);
+}
+
+/** Write the changes recorded in the journal by the last run to the database
+ *
+ * Called before the first pool is read, so that the pools
+ * reflect the leases which were given out before a crash.
+ *
+ * Must be called with the write mutex held.
  *
- * @param fmt sql query to expand.
- * @param handle sql connection handle.
- * @param data Instance of rlm_sqlippool.
- * @param request Current request.
- * @param param ip address string.
- * @param param_len ip address string len.
  * @return
  *	- 0 on success.
- *	- < 0 on error.
+ *	- -1 on failure.
  */
-static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
-			     rlm_sqlippool_t const *data, request_t *request,
-			     char *param, int param_len)
+static int sqlippool_journal_replay(rlm_sqlippool_t *inst, request_t *request)
 {
-	char query[MAX_QUERY_LEN];
-	char *expanded = NULL;
+	sqlippool_write_t	*writes = NULL;
+	char			*buff, *line, *next;
+	off_t			size;
+	unsigned int		count = 0;
+	int			ret = -1;
+
+	size = lseek(inst->journal_fd, 0, SEEK_END);
+	if (size < 0) {
+	error:
+		REDEBUG("Failed reading journal %s: %s", inst->memory_journal, fr_syserror(errno));
+		return -1;
+	}
+	if (size == 0) return 0;
 
-	int ret;
-	int affected;
+	MEM(buff = talloc_array(NULL, char, size + 1));
+	if (pread(inst->journal_fd, buff, size, 0) != size) {
+		talloc_free(buff);
+		goto error;
+	}
+	buff[size] = '\0';
 
 	/*
-	 *	If we don't have a command, do nothing.
+	 *	A record which is incomplete because the server
+	 *	crashed while writing it was never returned.
 	 */
-	if (!fmt || !*fmt) return 0;
+	for (line = buff; (line = strchr(line, '\n')); line++) count++;
+
+	MEM(writes = talloc_array(buff, sqlippool_write_t, count));
+	count = 0;
+	for (line = buff; (next = strchr(line, '\n')); line = next + 1) {
+		char	*fields[6];
+		char	*p = line;
+		size_t	i;
+
+		*next = '\0';
+		for (i = 0; i < NUM_ELEMENTS(fields); i++) {
+			fields[i] = p;
+			p = strchr(p, '\t');
+			if (!p) break;
+			*p++ = '\0';
+		}
+
+		if ((i != (NUM_ELEMENTS(fields) - 1)) || p) {
+			RWDEBUG("Ignoring invalid record in journal %s", inst->memory_journal);
+			continue;
+		}
+
+		for (i = 0; i < NUM_ELEMENTS(fields); i++) sqlippool_journal_unescape(fields[i]);
+
+		writes[count++] = (sqlippool_write_t) {
+			.pool = fields[0],
+			.address = fields[1],
+			.owner = fields[2],
+			.gateway = fields[3],
+			.expires = (time_t) strtoll(fields[4], NULL, 10),
+			.status = fr_table_value_by_str(sqlippool_lease_status_table, fields[5],
+							SQLIPPOOL_LEASE_DISABLED)
+		};
+	}
 
 	/*
-	 *	No handle?  That's an error.
+	 *	Later records for the same address overwrite
+	 *	the earlier ones, as they're written in order.
 	 */
-	if (!handle || !*handle) return -1;
+	if ((count > 0) && (sqlippool_write_batch(inst, request, writes, count) < 0)) {
+		REDEBUG("Failed writing %u leases from journal %s", count, inst->memory_journal);
+		goto finish;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	if (ftruncate(inst->journal_fd, 0) < 0) {
+		pthread_mutex_unlock(&inst->mutex);
+		REDEBUG("Failed truncating journal %s: %s", inst->memory_journal, fr_syserror(errno));
+		goto finish;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	RINFO("Wrote %u leases from journal %s", count, inst->memory_journal);
+	ret = 0;
+
+finish:
+	talloc_free(buff);
+
+	return ret;
+}
+
+/** Write changed leases to the database
+ *
+ * Only the latest state of each lease is written, in one transaction.
+ * If the transaction fails, the leases are written again next time.
+ *
+ * Called by the writer thread, and on detach.
+ *
+ * @param[in] inst	of rlm_sqlippool.
+ */
+static void sqlippool_memory_write(rlm_sqlippool_t *inst)
+{
+	sqlippool_write_t	*writes;
+	sqlippool_lease_t	*lease;
+	unsigned int		i, count;
+	off_t			written;
+
+	pthread_mutex_lock(&inst->write_mutex);
+
+	pthread_mutex_lock(&inst->mutex);
+	count = fr_dlist_num_elements(&inst->dirty);
+	if (count == 0) {
+		pthread_mutex_unlock(&inst->mutex);
+		pthread_mutex_unlock(&inst->write_mutex);
+		return;
+	}
+
+	MEM(writes = talloc_array(NULL, sqlippool_write_t, count));
+	for (i = 0; (lease = fr_dlist_pop_head(&inst->dirty)); i++) {
+		writes[i] = (sqlippool_write_t) {
+			.lease = lease,
+			.pool = lease->pool->name,
+			.address = lease->address,
+			.owner = talloc_typed_strdup(writes, lease->owner),
+			.gateway = talloc_typed_strdup(writes, lease->gateway),
+			.expires = lease->expires,
+			.status = lease->status
+		};
+	}
 
 	/*
-	 *	@todo this needs to die (should just be done in xlat expansion)
+	 *	Every record before this point is for a change
+	 *	which is either being written now, or was written
+	 *	by an earlier call.
 	 */
-	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
+	written = lseek(inst->journal_fd, 0, SEEK_END);
+	pthread_mutex_unlock(&inst->mutex);
 
-	if (xlat_aeval(request, &expanded, request, query, data->sql->sql_escape_func, *handle) < 0) return -1;
+	if (sqlippool_write_batch(inst, NULL, writes, count) < 0) {
+		ERROR("Failed writing %u leases, will retry", count);
 
-	ret = data->sql->query(data->sql, request, handle, expanded);
-	talloc_free(expanded);
-	if (ret < 0){
-		return -1;
+		pthread_mutex_lock(&inst->mutex);
+		for (i = 0; i < count; i++) {
+			lease = writes[i].lease;
+			if (!fr_dlist_entry_in_list(&lease->dirty_entry)) fr_dlist_insert_tail(&inst->dirty, lease);
+		}
+		pthread_mutex_unlock(&inst->mutex);
+
+		talloc_free(writes);
+		pthread_mutex_unlock(&inst->write_mutex);
+		return;
+	}
+
+	DEBUG3("Wrote %u leases", count);
+
+	if (written >= 0) sqlippool_journal_trim(inst, written);
+
+	talloc_free(writes);
+	pthread_mutex_unlock(&inst->write_mutex);
+}
+
+/** Write changed leases every memory_write_interval, so the workers never wait for the database
+ *
+ */
+static void *sqlippool_writer_thread(void *arg)
+{
+	rlm_sqlippool_t *inst = talloc_get_type_abort(arg, rlm_sqlippool_t);
+
+	pthread_mutex_lock(&inst->mutex);
+	while (!inst->writer_stop) {
+		struct timespec ts;
+		int64_t		ns;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ns = fr_time_delta_unwrap(inst->memory_write_interval) + ts.tv_nsec;
+		ts.tv_sec += ns / NSEC;
+		ts.tv_nsec = ns % NSEC;
+		(void) pthread_cond_timedwait(&inst->writer_cond, &inst->mutex, &ts);
+		if (inst->writer_stop) break;
+
+		pthread_mutex_unlock(&inst->mutex);
+		sqlippool_memory_write(inst);
+		pthread_mutex_lock(&inst->mutex);
 	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	return NULL;
+}
+
+/** Find the pool for a request, reading it from the database the first time it's used
+ *
+ * Pools are never freed while the instance exists, so the pool
+ * can be used after the instance mutex is released.
+ */
+static sqlippool_pool_t *sqlippool_memory_pool(rlm_sqlippool_t *inst, request_t *request, char const *name)
+{
+	sqlippool_pool_t	*pool, *found;
+
+	pthread_mutex_lock(&inst->mutex);
+	found = fr_rb_find(inst->pools, &(sqlippool_pool_t){ .name = name });
+	pthread_mutex_unlock(&inst->mutex);
+	if (found) return found;
 
 	/*
-	 *	No handle, we can't continue.
+	 *	Pools must include the leases which were
+	 *	given out, but not written, before a crash.
 	 */
-	if (!*handle) return -1;
+	pthread_mutex_lock(&inst->write_mutex);
+	if (!inst->journal_replayed) {
+		if (sqlippool_journal_replay(inst, request) < 0) {
+			pthread_mutex_unlock(&inst->write_mutex);
+			return NULL;
+		}
+		inst->journal_replayed = true;
+	}
+	pthread_mutex_unlock(&inst->write_mutex);
 
-	affected = (data->sql->driver->sql_affected_rows)(*handle, &data->sql->config);
+	/*
+	 *	Read without holding the mutex, so allocations
+	 *	from other pools can continue.
+	 */
+	pool = sqlippool_memory_load(inst, request, name);
+	if (!pool) return NULL;
+
+	pthread_mutex_lock(&inst->mutex);
+	found = fr_rb_find(inst->pools, pool);
+	if (!found) {
+		talloc_steal(inst->pools, pool);
+		fr_rb_insert(inst->pools, pool);
+		found = pool;
+		pool = NULL;
+	}
+	pthread_mutex_unlock(&inst->mutex);
 
-	(data->sql->driver->sql_finish_query)(*handle, &data->sql->config);
+	talloc_free(pool);
 
-	return affected;
+	return found;
 }
 
-/*
- *	Don't repeat yourself
+/** Expand one of the optional request expansions
+ *
+ * @return
+ *	- 0 on success, with an empty string if there's no expansion.
+ *	- -1 on failure.
  */
-#define DO_PART(_x) if(sqlippool_command(inst->_x, &handle, inst, request, NULL, 0) <0) goto error
+static int sqlippool_memory_expand(request_t *request, char **out, tmpl_t const *vpt)
+{
+	if (!vpt) {
+		MEM(*out = talloc_typed_strdup(request, ""));
+		return 0;
+	}
+
+	if (tmpl_aexpand(request, out, request, vpt, NULL, NULL) < 0) {
+		REDEBUG("Failed expanding %s", vpt->name);
+		return -1;
+	}
+
+	return 0;
+}
 
 /*
- * Query the database expecting a single result row
+ *	Allocate an IP number from a pool held in memory.
  */
-static int CC_HINT(nonnull (1, 3, 4, 5)) sqlippool_query1(char *out, int outlen, char const *fmt,
-							  rlm_sql_handle_t **handle, rlm_sqlippool_t *data,
-							  request_t *request, char *param, int param_len)
+static unlang_action_t CC_HINT(nonnull) mod_alloc_memory(rlm_rcode_t *p_result, rlm_sqlippool_t *inst, request_t *request,
+							 char const *name)
 {
-	char query[MAX_QUERY_LEN];
-	char *expanded = NULL;
-
-	int rlen, retval;
+	sqlippool_pool_t	*pool;
+	sqlippool_lease_t	*lease = NULL;
+	char			*owner = NULL, *gateway = NULL, *requested = NULL;
+	char			allocation[FR_MAX_STRING_LEN];
+	fr_pair_t		*vp;
+	time_t			now = time(NULL);
+	rlm_rcode_t		rcode = RLM_MODULE_FAIL;
+	int			journal_ret;
 
-	rlm_sql_row_t row;
+	pool = sqlippool_memory_pool(inst, request, name);
+	if (!pool) RETURN_MODULE_FAIL;
 
 	/*
-	 *	@todo this needs to die (should just be done in xlat expansion)
+	 *	The same as 'pool_check' finding nothing.
 	 */
-	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
+	if (fr_rb_num_elements(pool->addresses) == 0) {
+		RDEBUG2("IP address could not be allocated as no pool exists with that name");
+		RETURN_MODULE_NOOP;
+	}
 
-	*out = '\0';
+	if ((sqlippool_memory_expand(request, &owner, inst->owner) < 0) ||
+	    (sqlippool_memory_expand(request, &gateway, inst->gateway) < 0) ||
+	    (sqlippool_memory_expand(request, &requested, inst->requested_address) < 0)) goto finish;
+
+	pthread_mutex_lock(&inst->mutex);
 
 	/*
-	 *	Do an xlat on the provided string
+	 *	The existing address for this owner, then the
+	 *	requested address if it's free, then the address
+	 *	which expired longest ago.
 	 */
-	if (xlat_aeval(request, &expanded, request, query, data->sql->sql_escape_func, *handle) < 0) {
-		return 0;
+	lease = sqlippool_lease_by_owner(pool, owner);
+
+	if (!lease && *requested) {
+		lease = sqlippool_lease_by_address(pool, requested);
+		if (lease && ((lease->status != SQLIPPOOL_LEASE_DYNAMIC) || (lease->expires >= now))) lease = NULL;
 	}
-	retval = data->sql->select(data->sql, request, handle, expanded);
-	talloc_free(expanded);
 
-	if ((retval != 0) || !*handle) {
-		REDEBUG("database query error on '%s'", query);
-		return 0;
+	if (!lease) {
+		lease = fr_heap_peek(pool->expiry);
+		if (lease && (lease->expires >= now)) lease = NULL;
 	}
 
-	if (data->sql->fetch_row(&row, data->sql, request, handle) < 0) {
-		REDEBUG("Failed fetching query result");
-		goto finish;
+	if (!lease) {
+		pthread_mutex_unlock(&inst->mutex);
+
+		RDEBUG2("pool appears to be full");
+		talloc_free(owner);
+		talloc_free(gateway);
+		talloc_free(requested);
+		return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
 	}
 
-	if (!row) {
-		REDEBUG("SQL query did not return any results");
+	journal_ret = sqlippool_lease_set(inst, lease, owner, gateway, now + inst->offer_duration);
+	strlcpy(allocation, lease->address, sizeof(allocation));
+
+	pthread_mutex_unlock(&inst->mutex);
+
+	/*
+	 *	Don't give out the address until it would
+	 *	survive a crash.
+	 */
+	if ((journal_ret < 0) || (sqlippool_journal_sync(inst, request) < 0)) goto finish;
+
+	MEM(vp = fr_pair_afrom_da(request->reply_ctx, inst->allocated_address_da));
+	if (fr_pair_value_from_str(vp, allocation, strlen(allocation), NULL, true) < 0) {
+		talloc_free(vp);
+		RDEBUG2("Invalid IP number [%s] in pool \"%s\"", allocation, pool->name);
+		rcode = RLM_MODULE_NOOP;
 		goto finish;
 	}
 
-	if (!row[0]) {
-		REDEBUG("The first column of the result was NULL");
-		goto finish;
+	RDEBUG2("Allocated IP %s", allocation);
+	fr_pair_append(&request->reply_pairs, vp);
+	rcode = RLM_MODULE_OK;
+
+finish:
+	talloc_free(owner);
+	talloc_free(gateway);
+	talloc_free(requested);
+
+	switch (rcode) {
+	case RLM_MODULE_OK:
+		return do_logging(p_result, inst, request, inst->log_success, rcode);
+
+	case RLM_MODULE_NOOP:
+		return do_logging(p_result, inst, request, inst->log_failed, rcode);
+
+	default:
+		RETURN_MODULE_RCODE(rcode);
 	}
+}
 
-	rlen = strlen(row[0]);
-	if (rlen >= outlen) {
-		RDEBUG2("insufficient string space");
-		goto finish;
+/*
+ *	Update a lease in a pool held in memory.
+ *
+ *	If the address is free, e.g. because the server stopped
+ *	before the lease was written, it's given back to the owner.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_update_memory(rlm_rcode_t *p_result, rlm_sqlippool_t *inst, request_t *request,
+							  char const *name)
+{
+	sqlippool_pool_t	*pool;
+	sqlippool_lease_t	*lease, *other;
+	char			*owner = NULL, *requested = NULL;
+	time_t			now = time(NULL);
+	bool			updated = false;
+	int			journal_ret = 0;
+
+	pool = sqlippool_memory_pool(inst, request, name);
+	if (!pool) RETURN_MODULE_FAIL;
+
+	if ((sqlippool_memory_expand(request, &owner, inst->owner) < 0) ||
+	    (sqlippool_memory_expand(request, &requested, inst->requested_address) < 0)) {
+		talloc_free(owner);
+		RETURN_MODULE_FAIL;
 	}
 
-	strcpy(out, row[0]);
-	retval = rlen;
+	pthread_mutex_lock(&inst->mutex);
+	lease = sqlippool_lease_by_address(pool, requested);
+	if (!lease ||
+	    ((lease->status != SQLIPPOOL_LEASE_DYNAMIC) && (lease->status != SQLIPPOOL_LEASE_STATIC))) goto done;
 
-finish:
-	(data->sql->driver->sql_finish_select_query)(*handle, &data->sql->config);
+	if (strcmp(lease->owner, owner) != 0) {
+		if ((lease->status != SQLIPPOOL_LEASE_DYNAMIC) || (lease->expires >= now)) goto done;
 
-	return retval;
+		RDEBUG2("Address %s is free, giving it to the owner", lease->address);
+	}
+
+	/*
+	 *	The same as 'update_free', clear any other address
+	 *	offered to this owner.
+	 */
+	other = sqlippool_lease_by_owner(pool, owner);
+	if (other && (other != lease) && (other->status == SQLIPPOOL_LEASE_DYNAMIC) && (other->expires > now)) {
+		journal_ret |= sqlippool_lease_set(inst, other, "", "", now);
+	}
+
+	journal_ret |= sqlippool_lease_set(inst, lease, owner, lease->gateway, now + inst->lease_duration);
+	updated = true;
+
+done:
+	pthread_mutex_unlock(&inst->mutex);
+
+	talloc_free(owner);
+	talloc_free(requested);
+
+	if (updated && ((journal_ret < 0) || (sqlippool_journal_sync(inst, request) < 0))) RETURN_MODULE_FAIL;
+
+	if (updated) return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
+
+	return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
+}
+
+/*
+ *	Release or mark a lease in a pool held in memory.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_release_memory(rlm_rcode_t *p_result, rlm_sqlippool_t *inst, request_t *request,
+							   char const *name, bool mark)
+{
+	sqlippool_pool_t	*pool;
+	sqlippool_lease_t	*lease;
+	char			*owner = NULL, *requested = NULL;
+	time_t			now = time(NULL);
+	bool			changed = false;
+	int			journal_ret = 0;
+
+	pool = sqlippool_memory_pool(inst, request, name);
+	if (!pool) RETURN_MODULE_FAIL;
+
+	if ((sqlippool_memory_expand(request, &owner, inst->owner) < 0) ||
+	    (sqlippool_memory_expand(request, &requested, inst->requested_address) < 0)) {
+		talloc_free(owner);
+		RETURN_MODULE_FAIL;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	lease = sqlippool_lease_by_address(pool, requested);
+	if (lease && (strcmp(lease->owner, owner) == 0)) {
+		if (mark) {
+			lease->status = SQLIPPOOL_LEASE_DECLINED;
+			sqlippool_lease_disown(pool, lease);
+			if (fr_heap_entry_inserted(lease->heap_id)) fr_heap_extract(&pool->expiry, lease);
+			journal_ret = sqlippool_lease_set(inst, lease, lease->owner, lease->gateway, lease->expires);
+			changed = true;
+
+		} else if (lease->status == SQLIPPOOL_LEASE_DYNAMIC) {
+			journal_ret = sqlippool_lease_set(inst, lease, "", "", now);
+			changed = true;
+		}
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	talloc_free(owner);
+	talloc_free(requested);
+
+	if (changed && ((journal_ret < 0) || (sqlippool_journal_sync(inst, request) < 0))) RETURN_MODULE_FAIL;
+
+	RETURN_MODULE_OK;
+}
+
+/*
+ *	Release all the leases for a gateway in a pool held in memory.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_bulk_release_memory(rlm_rcode_t *p_result, rlm_sqlippool_t *inst,
+								request_t *request, char const *name)
+{
+	sqlippool_pool_t	*pool;
+	sqlippool_lease_t	*lease;
+	fr_rb_iter_inorder_t	iter;
+	char			*gateway = NULL;
+	time_t			now = time(NULL);
+	bool			changed = false;
+	int			journal_ret = 0;
+
+	pool = sqlippool_memory_pool(inst, request, name);
+	if (!pool) RETURN_MODULE_FAIL;
+
+	if (sqlippool_memory_expand(request, &gateway, inst->gateway) < 0) RETURN_MODULE_FAIL;
+
+	pthread_mutex_lock(&inst->mutex);
+	for (lease = fr_rb_iter_init_inorder(&iter, pool->addresses);
+	     lease;
+	     lease = fr_rb_iter_next_inorder(&iter)) {
+		if (lease->status != SQLIPPOOL_LEASE_DYNAMIC) continue;
+		if (strcmp(lease->gateway, gateway) != 0) continue;
+
+		journal_ret |= sqlippool_lease_set(inst, lease, "", "", now);
+		changed = true;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	talloc_free(gateway);
+
+	if (changed && ((journal_ret < 0) || (sqlippool_journal_sync(inst, request) < 0))) RETURN_MODULE_FAIL;
+
+	RETURN_MODULE_OK;
 }
 
 static int mod_bootstrap(module_inst_ctx_t const *mctx)
 {
 	rlm_sqlippool_t	*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
 	inst->name = talloc_asprintf(inst, "%s - %s", mctx->inst->name, inst->sql_name);
+	inst->journal_fd = -1;
 
 	return 0;
 }
@@ -468,30 +1691,84 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	pthread_mutex_init(&inst->mutex, NULL);
+	pthread_mutex_init(&inst->write_mutex, NULL);
+
+	if (inst->memory) {
+		if (!inst->memory_load || !*inst->memory_load) {
+			cf_log_err(conf, "'memory_load' must be set when 'memory = yes'");
+			return -1;
+		}
+
+		if (!inst->memory_write || !*inst->memory_write) {
+			cf_log_err(conf, "'memory_write' must be set when 'memory = yes'");
+			return -1;
+		}
+
+		if (!inst->owner) {
+			cf_log_err(conf, "'owner' must be set when 'memory = yes'");
+			return -1;
+		}
+
+		if (!inst->memory_journal || !*inst->memory_journal) {
+			cf_log_err(conf, "'memory_journal' must be set when 'memory = yes'");
+			return -1;
+		}
+
+		/*
+		 *	Any records left by the last run are
+		 *	written before the first pool is read.
+		 */
+		inst->journal_fd = open(inst->memory_journal, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+		if (inst->journal_fd < 0) {
+			cf_log_err(conf, "Failed opening journal %s: %s", inst->memory_journal, fr_syserror(errno));
+			return -1;
+		}
+		pthread_rwlock_init(&inst->journal_lock, NULL);
+		pthread_cond_init(&inst->writer_cond, NULL);
+
+		MEM(inst->pools = fr_rb_inline_talloc_alloc(inst, sqlippool_pool_t, node, sqlippool_pool_cmp, NULL));
+		fr_dlist_talloc_init(&inst->dirty, sqlippool_lease_t, dirty_entry);
+
+		if (fr_schedule_pthread_create(&inst->writer, sqlippool_writer_thread, inst) < 0) {
+			cf_log_perr(conf, "Failed starting thread to write leases");
+			return -1;
+		}
+		inst->writer_running = true;
+	}
+
 	return 0;
 }
 
-
-/*
- *	If we have something to log, then we log it.
- *	Otherwise we return the retcode as soon as possible
- */
-static unlang_action_t do_logging(rlm_rcode_t *p_result, UNUSED rlm_sqlippool_t const *inst, request_t *request,
-				  char const *str, rlm_rcode_t rcode)
+static int mod_detach(module_detach_ctx_t const *mctx)
 {
-	char		*expanded = NULL;
-	fr_pair_t	*vp;
+	rlm_sqlippool_t *inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
 
-	if (!str || !*str) RETURN_MODULE_RCODE(rcode);
+	if (inst->writer_running) {
+		pthread_mutex_lock(&inst->mutex);
+		inst->writer_stop = true;
+		pthread_cond_signal(&inst->writer_cond);
+		pthread_mutex_unlock(&inst->mutex);
 
-	MEM(pair_append_request(&vp, attr_module_success_message) == 0);
-	if (xlat_aeval(vp, &expanded, request, str, NULL, NULL) < 0) {
-		pair_delete_request(vp);
-		RETURN_MODULE_RCODE(rcode);
+		pthread_join(inst->writer, NULL);
 	}
-	fr_pair_value_bstrdup_buffer_shallow(vp, expanded, true);
 
-	RETURN_MODULE_RCODE(rcode);
+	/*
+	 *	Write anything which changed since the last
+	 *	write, so the journal is empty after a clean
+	 *	shutdown.
+	 */
+	if (inst->journal_fd >= 0) {
+		sqlippool_memory_write(inst);
+		close(inst->journal_fd);
+		pthread_rwlock_destroy(&inst->journal_lock);
+		pthread_cond_destroy(&inst->writer_cond);
+	}
+
+	pthread_mutex_destroy(&inst->mutex);
+	pthread_mutex_destroy(&inst->write_mutex);
+
+	return 0;
 }
 
 
@@ -503,7 +1780,7 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
 	char			allocation[FR_MAX_STRING_LEN];
 	int			allocation_len;
-	fr_pair_t		*vp = NULL;
+	fr_pair_t		*vp = NULL, *pool_name;
 	rlm_sql_handle_t	*handle;
 
 	/*
@@ -515,12 +1792,15 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 		return do_logging(p_result, inst, request, inst->log_exists, RLM_MODULE_NOOP);
 	}
 
-	if (fr_pair_find_by_da(&request->control_pairs, NULL, attr_pool_name) == NULL) {
+	pool_name = fr_pair_find_by_da(&request->control_pairs, NULL, attr_pool_name);
+	if (!pool_name) {
 		RDEBUG2("No %s defined", attr_pool_name->name);
 
 		return do_logging(p_result, inst, request, inst->log_nopool, RLM_MODULE_NOOP);
 	}
 
+	if (inst->memory) return mod_alloc_memory(p_result, inst, request, pool_name->vp_strvalue);
+
 	handle = fr_pool_connection_get(inst->sql->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -674,6 +1954,14 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 	rlm_sql_handle_t	*handle;
 	int			affected;
 
+	if (inst->memory) {
+		fr_pair_t *pool_name = fr_pair_find_by_da(&request->control_pairs, NULL, attr_pool_name);
+
+		if (!pool_name) RETURN_MODULE_NOOP;
+
+		return mod_update_memory(p_result, inst, request, pool_name->vp_strvalue);
+	}
+
 	handle = fr_pool_connection_get(inst->sql->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -726,6 +2014,14 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->memory) {
+		fr_pair_t *pool_name = fr_pair_find_by_da(&request->control_pairs, NULL, attr_pool_name);
+
+		if (!pool_name) RETURN_MODULE_NOOP;
+
+		return mod_release_memory(p_result, inst, request, pool_name->vp_strvalue, false);
+	}
+
 	handle = fr_pool_connection_get(inst->sql->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -756,6 +2052,14 @@ static unlang_action_t CC_HINT(nonnull) mod_bulk_release(rlm_rcode_t *p_result,
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->memory) {
+		fr_pair_t *pool_name = fr_pair_find_by_da(&request->control_pairs, NULL, attr_pool_name);
+
+		if (!pool_name) RETURN_MODULE_NOOP;
+
+		return mod_bulk_release_memory(p_result, inst, request, pool_name->vp_strvalue);
+	}
+
 	handle = fr_pool_connection_get(inst->sql->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -787,6 +2091,14 @@ static unlang_action_t CC_HINT(nonnull) mod_mark(rlm_rcode_t *p_result, module_c
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->inst->data, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->memory) {
+		fr_pair_t *pool_name = fr_pair_find_by_da(&request->control_pairs, NULL, attr_pool_name);
+
+		if (!pool_name) RETURN_MODULE_NOOP;
+
+		return mod_release_memory(p_result, inst, request, pool_name->vp_strvalue, true);
+	}
+
 	handle = fr_pool_connection_get(inst->sql->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -862,7 +2174,8 @@ module_rlm_t rlm_sqlippool = {
 		.inst_size	= sizeof(rlm_sqlippool_t),
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+		.detach		= mod_detach
 	},
 	.method_names = (module_method_name_t[]){
 		{ .name1 = "accounting",	.name2 = CF_IDENT_ANY,		.method = mod_accounting },
@@ -253,25 +253,28 @@ invalid:
 	return packet_len;
 }
 
-/** Sign a previously encoded packet
+/** Prepare a packet for the Message-Authenticator calculation
  *
- * Calculates the request/response authenticator for packets which need it, and fills
- * in the message-authenticator value if the attribute is present in the encoded packet.
+ * Finds the Message-Authenticator (if any), fills in the authenticator
+ * field with the value used when calculating the HMAC, and zeroes the
+ * Message-Authenticator value.
  *
+ * @param[out] ma_p		Where to write a pointer to the Message-Authenticator
+ *				attribute, or NULL if there isn't one.
  * @param[in,out] packet	(request or response).
  * @param[in] original		request (only if this is a response).
- * @param[in] secret		to sign the packet with.
  * @param[in] secret_len	The length of the secret.
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_sign(uint8_t *packet, uint8_t const *original,
-		   uint8_t const *secret, size_t secret_len)
+static int radius_sign_ma_prepare(uint8_t **ma_p, uint8_t *packet, uint8_t const *original, size_t secret_len)
 {
 	uint8_t		*msg, *end;
 	size_t		packet_len = fr_nbo_to_uint16(packet + 2);
 
+	*ma_p = NULL;
+
 	/*
 	 *	No real limit on secret length, this is just
 	 *	to catch uninitialised fields.
@@ -329,7 +332,10 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		case FR_RADIUS_CODE_DISCONNECT_NAK:
 		case FR_RADIUS_CODE_COA_ACK:
 		case FR_RADIUS_CODE_COA_NAK:
-			if (!original) goto need_original;
+			if (!original) {
+				fr_strerror_const("Cannot sign response packet without a request packet");
+				return -1;
+			}
 			memcpy(packet + 4, original + 4, RADIUS_AUTH_VECTOR_LENGTH);
 			break;
 
@@ -339,19 +345,34 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			break;
 
 		default:
-			goto bad_packet;
+			fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
+			return -1;
 		}
 
 		/*
-		 *	Force Message-Authenticator to be zero,
-		 *	calculate the HMAC, and put it into the
-		 *	Message-Authenticator attribute.
+		 *	Force Message-Authenticator to be zero, the
+		 *	caller calculates the HMAC, and puts it into
+		 *	the Message-Authenticator attribute.
 		 */
 		memset(msg + 2, 0, RADIUS_AUTH_VECTOR_LENGTH);
-		fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		*ma_p = msg;
 		break;
 	}
 
+	return 0;
+}
+
+/** Prepare a packet for the Request / Response Authenticator calculation
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] original		request (only if this is a response).
+ * @return
+ *	- <0 on error
+ *	- 0 if the authenticator is random data, and nothing more needs doing.
+ *	- 1 if the authenticator needs to be set to MD5(packet + secret).
+ */
+static int radius_sign_vector_prepare(uint8_t *packet, uint8_t const *original)
+{
 	/*
 	 *	Initialize the request authenticator.
 	 */
@@ -372,7 +393,6 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 	case FR_RADIUS_CODE_COA_NAK:
 	case FR_RADIUS_CODE_PROTOCOL_ERROR:
 		if (!original) {
-		need_original:
 			fr_strerror_const("Cannot sign response packet without a request packet");
 			return -1;
 		}
@@ -389,11 +409,40 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		return 0;
 
 	default:
-	bad_packet:
 		fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
 		return -1;
 	}
 
+	return 1;
+}
+
+/** Sign a previously encoded packet
+ *
+ * Calculates the request/response authenticator for packets which need it, and fills
+ * in the message-authenticator value if the attribute is present in the encoded packet.
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] original		request (only if this is a response).
+ * @param[in] secret		to sign the packet with.
+ * @param[in] secret_len	The length of the secret.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_sign(uint8_t *packet, uint8_t const *original,
+		   uint8_t const *secret, size_t secret_len)
+{
+	uint8_t		*ma;
+	size_t		packet_len = fr_nbo_to_uint16(packet + 2);
+	int		ret;
+
+	if (radius_sign_ma_prepare(&ma, packet, original, secret_len) < 0) return -1;
+
+	if (ma) fr_hmac_md5(ma + 2, packet, packet_len, secret, secret_len);
+
+	ret = radius_sign_vector_prepare(packet, original);
+	if (ret <= 0) return ret;
+
 	/*
 	 *	Request / Response Authenticator = MD5(packet + secret)
 	 */
@@ -410,6 +459,86 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 	return 0;
 }
 
+/** How many packets fr_radius_sign_multi() signs in one pass
+ *
+ */
+#define RADIUS_SIGN_MULTI_BATCH	16
+
+/** Sign a batch of previously encoded packets
+ *
+ * Does the same work as calling fr_radius_sign() for each packet, but
+ * calculates the Message-Authenticators, and then the Request / Response
+ * Authenticators of all packets in a batch in parallel.  This is much
+ * cheaper than signing the packets one at a time when there are several
+ * packets ready to go out at once, e.g. a coalesced sendmmsg() batch.
+ *
+ * @param[in,out] jobs	Packets to sign.  The rcode field of each job is
+ *			set to the result of signing that packet.
+ * @param[in] num	Number of packets.
+ * @return
+ *	- <0 if one or more of the packets couldn't be signed.
+ *	- 0 on success.
+ */
+int fr_radius_sign_multi(fr_radius_sign_multi_t *jobs, size_t num)
+{
+	int ret = 0;
+
+	while (num > 0) {
+		fr_hmac_md5_multi_t	hmac[RADIUS_SIGN_MULTI_BATCH];
+		fr_md5_multi_t		md5[RADIUS_SIGN_MULTI_BATCH];
+		size_t			n = (num > RADIUS_SIGN_MULTI_BATCH) ? RADIUS_SIGN_MULTI_BATCH : num;
+		size_t			i, num_hmac = 0, num_md5 = 0;
+
+		for (i = 0; i < n; i++) {
+			uint8_t *ma;
+
+			jobs[i].rcode = radius_sign_ma_prepare(&ma, jobs[i].packet, jobs[i].original,
+							       jobs[i].secret_len);
+			if ((jobs[i].rcode < 0) || !ma) continue;
+
+			hmac[num_hmac++] = (fr_hmac_md5_multi_t){
+				.in = jobs[i].packet,
+				.inlen = fr_nbo_to_uint16(jobs[i].packet + 2),
+				.key = jobs[i].secret,
+				.key_len = jobs[i].secret_len,
+				.digest = ma + 2
+			};
+		}
+		fr_hmac_md5_multi(hmac, num_hmac);
+
+		for (i = 0; i < n; i++) {
+			int rcode;
+
+			if (jobs[i].rcode < 0) {
+				ret = -1;
+				continue;
+			}
+
+			rcode = radius_sign_vector_prepare(jobs[i].packet, jobs[i].original);
+			if (rcode < 0) {
+				jobs[i].rcode = ret = -1;
+				continue;
+			}
+			if (rcode == 0) continue;
+
+			/*
+			 *	Request / Response Authenticator = MD5(packet + secret)
+			 */
+			md5[num_md5++] = (fr_md5_multi_t){
+				.in = { jobs[i].packet, jobs[i].secret },
+				.inlen = { fr_nbo_to_uint16(jobs[i].packet + 2), jobs[i].secret_len },
+				.out = jobs[i].packet + 4
+			};
+		}
+		fr_md5_calc_multi(md5, num_md5);
+
+		jobs += n;
+		num -= n;
+	}
+
+	return ret;
+}
+
 
 /** See if the data pointed to by PTR is a valid RADIUS packet.
  *
@@ -546,11 +675,31 @@ bool fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 	num_attributes = 0;
 
 	while (attr < end) {
+		size_t remaining = end - attr;
+
+		/*
+		 *	Fast path.  Almost every attribute has a sane
+		 *	header, and isn't one of the attributes we need
+		 *	to look at more closely.  Check all of that
+		 *	with a single branch, so that packets full of
+		 *	VSAs don't pay for the detailed checks below.
+		 *
+		 *	The bitwise '&' is deliberate, it lets the
+		 *	compiler evaluate the tests without branching.
+		 */
+		if (likely((remaining >= 2) &&
+			   ((attr[0] != 0) & (attr[1] >= 2) & (attr[1] <= remaining) &
+			    (attr[0] != FR_EAP_MESSAGE) & (attr[0] != FR_MESSAGE_AUTHENTICATOR)))) {
+			attr += attr[1];
+			num_attributes++;
+			continue;
+		}
+
 		/*
 		 *	We need at least 2 bytes to check the
 		 *	attribute header.
 		 */
-		if ((end - attr) < 2) {
+		if (remaining < 2) {
 			FR_DEBUG_STRERROR_PRINTF("attribute header overflows the packet");
 			failure = DECODE_FAIL_HEADER_OVERFLOW;
 			goto finish;
@@ -580,7 +729,7 @@ bool fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 		 *	If there are fewer bytes in the packet than in the
 		 *	attribute, it's a bad packet.
 		 */
-		if ((attr + attr[1]) > end) {
+		if (attr[1] > remaining) {
 			FR_DEBUG_STRERROR_PRINTF("attribute %u data overflows the packet starting at offset %zd",
 					   attr[0], attr - packet);
 			failure = DECODE_FAIL_ATTRIBUTE_OVERFLOW;
@@ -921,6 +1070,13 @@ ssize_t fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
 					 0x00, 0x00, 0x00, original[0]);
 	}
 
+	/*
+	 *	Replies usually look the same as the last one we
+	 *	sent, so try the cached shape for this packet code
+	 *	first.
+	 */
+	if (fr_radius_encode_shape(&work_dbuff, vps, code) > 0) goto done;
+
 	/*
 	 *	Loop over the reply attributes for the packet.
 	 */
@@ -938,6 +1094,13 @@ ssize_t fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
 		}
 	} /* done looping over all attributes */
 
+	/*
+	 *	The shape changed, remember the new one.
+	 */
+	fr_radius_encode_shape_learn(vps, code);
+
+done:
+
 	/*
 	 *	Fill in the length field we zeroed out earlier.
 	 *
@@ -1024,6 +1187,7 @@ void fr_radius_free(void)
 {
 	if (--instance_count > 0) return;
 
+	fr_radius_encode_shape_invalidate();
 	fr_dict_autofree(libfreeradius_radius_dict);
 }
 
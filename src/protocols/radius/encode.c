@@ -24,6 +24,7 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/util/atexit.h>
 #include <freeradius-devel/util/dbuff.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/struct.h>
@@ -1655,6 +1656,260 @@ ssize_t fr_radius_encode_pair(fr_dbuff_t *dbuff, fr_dcursor_t *cursor, void *enc
 	return fr_dbuff_set(dbuff, &work_dbuff);
 }
 
+/*
+ *	No one else should be using this.
+ */
+extern void *fr_radius_next_encodable(fr_dlist_head_t *list, void *to_eval, void *uctx);
+
+/*
+ *	Reply shape cache.
+ *
+ *	Most replies carry the same attributes in the same order, with
+ *	only the values changing.  For each packet code we remember the
+ *	sequence of attributes (the "shape") of a previous packet, along
+ *	with a pre-built header for each attribute.  When the next
+ *	packet has the same shape, the headers are copied in and the
+ *	values written directly after them, skipping the dictionary
+ *	walk and type dispatch of the full encoder.
+ *
+ *	Only plain RFC attributes are cached.  Anything else (tags,
+ *	encryption, VSAs, TLVs, extended attributes, etc.) means the
+ *	packet goes through the full encoder.  VSAs are nested under a
+ *	Vendor-Specific pair, so the top level walk never sees them.
+ *
+ *	The cache is disabled by default, and is enabled with
+ *	fr_radius_encode_shape_enable().
+ */
+#define RADIUS_ENCODE_SHAPE_MAX	(32)
+
+typedef struct {
+	fr_dict_attr_t const	*da;			//!< Attribute this header is for.
+	uint8_t			hdr[2];			//!< Pre-built header.  The length field is filled in
+							///< when the attribute is encoded.
+} radius_encode_shape_attr_t;
+
+typedef struct {
+	unsigned int			num;		//!< Number of attributes in the shape.
+							///< 0 if there's nothing cached.
+	radius_encode_shape_attr_t	attr[RADIUS_ENCODE_SHAPE_MAX];
+} radius_encode_shape_t;
+
+static _Thread_local radius_encode_shape_t	*encode_shapes;		//!< One shape per packet code.
+static _Thread_local uint32_t			encode_shapes_generation;
+
+/** Bumped whenever the dictionaries are freed, so stale shapes are discarded
+ *
+ */
+static atomic_uint_fast32_t			encode_shape_generation;
+
+/** Whether the shape cache is used at all
+ *
+ */
+static atomic_bool				encode_shape_enabled;
+
+static int _encode_shapes_free_on_exit(void *arg)
+{
+	return talloc_free(arg);
+}
+
+/** Get the cached shape for a packet code
+ *
+ */
+static radius_encode_shape_t *encode_shape_get(int code)
+{
+	uint32_t generation;
+
+	if ((code <= 0) || (code >= FR_RADIUS_CODE_MAX)) return NULL;
+
+	generation = atomic_load_explicit(&encode_shape_generation, memory_order_relaxed);
+
+	if (unlikely(!encode_shapes)) {
+		radius_encode_shape_t *shapes;
+
+		shapes = talloc_zero_array(NULL, radius_encode_shape_t, FR_RADIUS_CODE_MAX);
+		if (unlikely(!shapes)) return NULL;
+
+		fr_atexit_thread_local(encode_shapes, _encode_shapes_free_on_exit, shapes);
+		encode_shapes_generation = generation;
+
+	} else if (unlikely(encode_shapes_generation != generation)) {
+		memset(encode_shapes, 0, sizeof(*encode_shapes) * FR_RADIUS_CODE_MAX);
+		encode_shapes_generation = generation;
+	}
+
+	return &encode_shapes[code];
+}
+
+/** Build the header for an attribute in a shape
+ *
+ * @param[out] out	Where to write the header.
+ * @param[in] da	to build the header for.
+ * @return
+ *	- true if the attribute can be part of a cached shape.
+ *	- false if the attribute needs the full encoder.
+ */
+static bool encode_shape_attr(radius_encode_shape_attr_t *out, fr_dict_attr_t const *da)
+{
+	if (da->flags.is_unknown || da->flags.is_raw || da->flags.internal || da->flags.subtype) return false;
+	if ((da->attr == 0) || (da->attr > UINT8_MAX)) return false;
+
+	/*
+	 *	Types which the full encoder writes using
+	 *	fr_value_box_to_network(), with no extra magic.
+	 */
+	switch (da->type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IFID:
+	case FR_TYPE_ETHERNET:
+	case FR_TYPE_BOOL:
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+	case FR_TYPE_UINT64:
+	case FR_TYPE_INT8:
+	case FR_TYPE_INT16:
+	case FR_TYPE_INT32:
+	case FR_TYPE_INT64:
+	case FR_TYPE_DATE:
+	case FR_TYPE_TIME_DELTA:
+		break;
+
+	default:
+		return false;
+	}
+
+	/*
+	 *	These have special encoding rules.
+	 */
+	if ((da == attr_chargeable_user_identity) || (da == attr_message_authenticator) ||
+	    (da == attr_nas_filter_rule)) return false;
+
+	if (!da->parent->flags.is_root) return false;
+
+	out->da = da;
+	out->hdr[0] = (uint8_t)da->attr;
+	out->hdr[1] = 0;
+
+	return true;
+}
+
+/** Encode attributes using the cached shape for this packet code
+ *
+ * @param[out] dbuff	Where to write the encoded attributes.
+ * @param[in] vps	to encode.
+ * @param[in] code	of the packet the attributes are going into.
+ * @return
+ *	- >0 the number of bytes written.  All attributes were encoded.
+ *	- 0 the attributes don't match the cached shape.  Nothing was
+ *	  written, and the caller should use the full encoder.
+ */
+ssize_t fr_radius_encode_shape(fr_dbuff_t *dbuff, fr_pair_list_t *vps, int code)
+{
+	radius_encode_shape_t const	*shape;
+	fr_dbuff_t			work_dbuff = FR_DBUFF(dbuff);
+	fr_dcursor_t			cursor;
+	fr_pair_t const			*vp;
+	unsigned int			i = 0;
+
+	if (!atomic_load_explicit(&encode_shape_enabled, memory_order_relaxed)) return 0;
+
+	shape = encode_shape_get(code);
+	if (!shape || !shape->num) return 0;
+
+	for (vp = fr_pair_dcursor_iter_init(&cursor, vps, fr_radius_next_encodable, dict_radius);
+	     vp;
+	     vp = fr_dcursor_next(&cursor), i++) {
+		radius_encode_shape_attr_t const	*sa;
+		fr_dbuff_t				attr_dbuff;
+		uint8_t					*hdr;
+		size_t					len;
+
+		if ((i >= shape->num) || (vp->da != shape->attr[i].da)) return 0;
+		sa = &shape->attr[i];
+
+		attr_dbuff = FR_DBUFF_MAX(&work_dbuff, UINT8_MAX);
+		hdr = fr_dbuff_current(&attr_dbuff);
+
+		if (fr_dbuff_in_memcpy(&attr_dbuff, sa->hdr, sizeof(sa->hdr)) <= 0) return 0;
+
+		/*
+		 *	Empty values are skipped by the full encoder,
+		 *	and values which are too long are errors.  Let
+		 *	it deal with both.
+		 */
+		if (fr_value_box_to_network(&attr_dbuff, &vp->data) <= 0) return 0;
+
+		len = fr_dbuff_used(&attr_dbuff);
+		hdr[1] = (uint8_t)len;
+
+		FR_PROTO_HEX_DUMP(hdr, len, "shape %s", vp->da->name);
+
+		fr_dbuff_set(&work_dbuff, &attr_dbuff);
+	}
+
+	if (i != shape->num) return 0;
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
+/** Remember the shape of a list of attributes for the next packet with this code
+ *
+ * If any of the attributes can't be cached, then nothing is cached
+ * for this packet code.
+ *
+ * @param[in] vps	which were encoded.
+ * @param[in] code	of the packet they were encoded into.
+ */
+void fr_radius_encode_shape_learn(fr_pair_list_t *vps, int code)
+{
+	radius_encode_shape_t	*shape;
+	fr_dcursor_t		cursor;
+	fr_pair_t const		*vp;
+	unsigned int		num = 0;
+
+	if (!atomic_load_explicit(&encode_shape_enabled, memory_order_relaxed)) return;
+
+	shape = encode_shape_get(code);
+	if (!shape) return;
+
+	shape->num = 0;
+
+	for (vp = fr_pair_dcursor_iter_init(&cursor, vps, fr_radius_next_encodable, dict_radius);
+	     vp;
+	     vp = fr_dcursor_next(&cursor)) {
+		if (num >= RADIUS_ENCODE_SHAPE_MAX) return;
+		if (!encode_shape_attr(&shape->attr[num], vp->da)) return;
+		num++;
+	}
+
+	shape->num = num;
+}
+
+/** Discard all cached shapes
+ *
+ * Must be called when the dictionaries the shapes refer to are freed.
+ */
+void fr_radius_encode_shape_invalidate(void)
+{
+	atomic_fetch_add_explicit(&encode_shape_generation, 1, memory_order_relaxed);
+}
+
+/** Enable or disable the shape cache
+ *
+ * The cache is disabled by default.  Any shapes learned before the
+ * cache was toggled are discarded.
+ *
+ * @param[in] enable	whether fr_radius_encode_dbuff() should use
+ *			cached shapes.
+ */
+void fr_radius_encode_shape_enable(bool enable)
+{
+	atomic_store_explicit(&encode_shape_enabled, enable, memory_order_relaxed);
+	fr_radius_encode_shape_invalidate();
+}
+
 static int _test_ctx_free(UNUSED fr_radius_ctx_t *ctx)
 {
 	fr_radius_free();
@@ -1724,10 +1979,58 @@ static ssize_t fr_radius_encode_proto(UNUSED TALLOC_CTX *ctx, fr_pair_list_t *vp
 	return slen;
 }
 
-/*
- *	No one else should be using this.
+static int _shape_test_ctx_free(UNUSED fr_radius_ctx_t *ctx)
+{
+	fr_radius_encode_shape_enable(false);
+	fr_radius_free();
+
+	return 0;
+}
+
+static int encode_shape_test_ctx(void **out, TALLOC_CTX *ctx)
+{
+	if (encode_test_ctx(out, ctx) < 0) return -1;
+
+	talloc_set_destructor((fr_radius_ctx_t *)*out, _shape_test_ctx_free);
+	fr_radius_encode_shape_enable(true);
+
+	return 0;
+}
+
+/** Encode a packet twice, once to learn its shape, and once using the cached shape
+ *
+ * The two encodings must be identical.
  */
-extern void *fr_radius_next_encodable(fr_dlist_head_t *list, void *to_eval, void *uctx);
+static ssize_t fr_radius_encode_proto_shape(TALLOC_CTX *ctx, fr_pair_list_t *vps, uint8_t *data, size_t data_len, void *proto_ctx)
+{
+	fr_radius_ctx_t	*test_ctx = talloc_get_type_abort(proto_ctx, fr_radius_ctx_t);
+	fr_fast_rand_t	rand_ctx = test_ctx->rand_ctx;
+	uint8_t		*full;
+	ssize_t		full_len, slen;
+
+	full = talloc_array(ctx, uint8_t, data_len);
+	if (!full) return -1;
+
+	full_len = fr_radius_encode_proto(ctx, vps, full, data_len, proto_ctx);
+	if (full_len <= 0) {
+		talloc_free(full);
+		return full_len;
+	}
+
+	/*
+	 *	Use the same random Request Authenticator.
+	 */
+	test_ctx->rand_ctx = rand_ctx;
+
+	slen = fr_radius_encode_proto(ctx, vps, data, data_len, proto_ctx);
+	if ((slen > 0) && ((slen != full_len) || (memcmp(data, full, slen) != 0))) {
+		fr_strerror_const("Encoding using the cached shape differs from the full encoding");
+		slen = -1;
+	}
+	talloc_free(full);
+
+	return slen;
+}
 
 /*
  *	Test points
@@ -1745,3 +2048,9 @@ fr_test_point_proto_encode_t radius_tp_encode_proto = {
 	.test_ctx	= encode_test_ctx,
 	.func		= fr_radius_encode_proto
 };
+
+extern fr_test_point_proto_encode_t radius_tp_encode_proto_shape;
+fr_test_point_proto_encode_t radius_tp_encode_proto_shape = {
+	.test_ctx	= encode_shape_test_ctx,
+	.func		= fr_radius_encode_proto_shape
+};
@@ -102,9 +102,22 @@ enum {
 #define flag_long_extended(_flags)   (!(_flags)->extra && (_flags)->subtype == FLAG_LONG_EXTENDED_ATTR)
 #define flag_tunnel_password(_flags) (!(_flags)->extra && (((_flags)->subtype == FLAG_ENCRYPT_TUNNEL_PASSWORD) || ((_flags)->subtype == FLAG_TAGGED_TUNNEL_PASSWORD)))
 
+/** One packet in a batch passed to fr_radius_sign_multi()
+ *
+ */
+typedef struct {
+	uint8_t		*packet;		//!< Encoded packet to sign.
+	uint8_t const	*original;		//!< Original request (only if this is a response).
+	uint8_t const	*secret;		//!< Shared secret.
+	size_t		secret_len;		//!< Length of the shared secret.
+	int		rcode;			//!< Result of signing this packet, as for fr_radius_sign().
+} fr_radius_sign_multi_t;
+
 /*
  *	protocols/radius/base.c
  */
+int		fr_radius_sign_multi(fr_radius_sign_multi_t *jobs, size_t num) CC_HINT(nonnull);
+
 int		fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			       uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
 int		fr_radius_verify(uint8_t *packet, uint8_t const *original,
@@ -190,6 +203,14 @@ ssize_t		fr_radius_decode_abinary(fr_pair_t *vp, uint8_t const *data, size_t dat
  */
 ssize_t		fr_radius_encode_pair(fr_dbuff_t *dbuff, fr_dcursor_t *cursor, void *encode_ctx);
 
+ssize_t		fr_radius_encode_shape(fr_dbuff_t *dbuff, fr_pair_list_t *vps, int code) CC_HINT(nonnull);
+
+void		fr_radius_encode_shape_learn(fr_pair_list_t *vps, int code) CC_HINT(nonnull);
+
+void		fr_radius_encode_shape_invalidate(void);
+
+void		fr_radius_encode_shape_enable(bool enable);
+
 /*
  *	protocols/radius/decode.c
  */
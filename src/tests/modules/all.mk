@@ -76,6 +76,12 @@ $(foreach x, $(FILES), $(eval $$(OUTPUT.$(TEST))/$x: $(patsubst %,$(BUILD_DIR)/l
 #
 $(foreach x, $(filter sql_%,$(FILES)), $(eval $$(OUTPUT.$(TEST))/$x: $(BUILD_DIR)/lib/local/rlm_sql.la))
 
+#
+#  The sqlippool and sqlcounter tests are run against sqlite.
+#
+$(foreach x, $(filter sql_sqlite/ippool_%,$(FILES)), $(eval $$(OUTPUT.$(TEST))/$x: $(BUILD_DIR)/lib/local/rlm_sqlippool.la))
+$(foreach x, $(filter sql_sqlite/sqlcounter_%,$(FILES)), $(eval $$(OUTPUT.$(TEST))/$x: $(BUILD_DIR)/lib/local/rlm_sqlcounter.la))
+
 #
 #  Files in the output dir depend on the unit tests
 #
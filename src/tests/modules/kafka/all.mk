@@ -1,6 +1,6 @@
 #
 #  Test the "kafka" module
 #
-
-# Don't test kafka if KAFKA_TEST_SERVER ENV is not set
-kafka_require_test_server := 1
+#  The tests produce to librdkafka's in-process mock cluster,
+#  so no test server is needed.
+#
@@ -0,0 +1,36 @@
+function authorize()
+	-- fr.pair.{}
+	if fr.pair.get("User-Name") ~= "caipirinha" then return fr.rcode.fail end
+	if fr.pair.get("User-Name", 1) ~= nil then return fr.rcode.fail end
+	if fr.pair.count("User-Name") ~= 1 then return fr.rcode.fail end
+
+	fr.pair.set("Filter-Id", "limao")
+	fr.pair.set("Filter-Id", "acucar", 1)
+	if fr.pair.count("Filter-Id") ~= 2 then return fr.rcode.fail end
+	if fr.pair.get("Filter-Id", 1) ~= "acucar" then return fr.rcode.fail end
+
+	fr.pair.set("Filter-Id", "cachaca", 1)
+	if fr.pair.get("Filter-Id", 1) ~= "cachaca" then return fr.rcode.fail end
+
+	fr.pair.set("Filter-Id", nil, 0)
+	if fr.pair.count("Filter-Id") ~= 1 then return fr.rcode.fail end
+	if fr.pair.get("Filter-Id") ~= "cachaca" then return fr.rcode.fail end
+
+	fr.pair.set("Session-Timeout", 3600)
+	if fr.pair.get("Session-Timeout") ~= 3600 then return fr.rcode.fail end
+
+	-- Other lists are selected by qualifying the name
+	fr.pair.set("reply.Reply-Message", "saude")
+	if fr.pair.get("reply.Reply-Message") ~= "saude" then return fr.rcode.fail end
+	if fr.pair.get("Reply-Message") ~= nil then return fr.rcode.fail end
+
+	fr.pair.set("control.Filter-Id", "gelo")
+	if fr.pair.count("control.Filter-Id") ~= 1 then return fr.rcode.fail end
+	if fr.pair.count("Filter-Id") ~= 1 then return fr.rcode.fail end
+
+	fr.pair.set("control.Filter-Id", nil)
+	if fr.pair.count("control.Filter-Id") ~= 0 then return fr.rcode.fail end
+	fr.pair.set("control.Filter-Id", "gelo")
+
+	return fr.rcode.ok
+end
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+#  Fake "ntlm_auth --helper-protocol=ntlm-server-1"
+#
+#  Accepts "bob" (sent base64 encoded), and rejects everyone else.
+#  "crash" makes the helper exit without replying.
+#
+user=
+while read -r line; do
+	case "$line" in
+	"Username:: "*)
+		user="${line#Username:: }"
+		;;
+
+	.)
+		case "$user" in
+		Ym9i)
+			echo "Authenticated: Yes"
+			echo "User-Session-Key: 000102030405060708090a0b0c0d0e0f"
+			;;
+
+		Y3Jhc2g=)
+			exit 1
+			;;
+
+		*)
+			echo "Authenticated: No"
+			echo "Authentication-Error: Logon failure (0xc000006d)"
+			;;
+		esac
+		echo "."
+		user=
+		;;
+	esac
+done
@@ -0,0 +1,69 @@
+use strict;
+use warnings;
+
+#
+#  Checks for the %RAD_* hashes when they're tied to the
+#  pair lists with lazy_pairs.  Each function returns the
+#  results in reply.Reply-Message for lazy_pairs.unlang
+#  to check.
+#
+our (%RAD_REQUEST, %RAD_REPLY, %RAD_CONFIG, %RAD_STATE);
+
+use constant {
+	RLM_MODULE_OK       => 2,
+};
+
+#  Keys, and attributes with multiple instances
+sub authorize {
+	my @keys = keys %RAD_REQUEST;
+	my %count;
+
+	$count{$_}++ for @keys;
+
+	#  Each attribute should only be returned once, and every
+	#  key returned should be one FETCH can find.
+	my @dups = grep { $count{$_} > 1 } sort keys %count;
+	my @missing = grep { !defined $RAD_REQUEST{$_} } sort keys %count;
+
+	my $filter_id = $RAD_REQUEST{'Filter-Id'};
+	my $avpair = $RAD_REQUEST{'Vendor-Specific.Cisco.AVPair'};
+
+	$RAD_REPLY{'Reply-Message'} = [
+		'dups=' . join(',', @dups),
+		'missing=' . join(',', @missing),
+		'filter-id=' . (ref($filter_id) eq 'ARRAY' ? join(',', @$filter_id) : 'not an array'),
+		'avpair=' . (ref($avpair) eq 'ARRAY' ? join(',', @$avpair) : 'not an array'),
+		'avpair-keys=' . ($count{'Vendor-Specific.Cisco.AVPair'} // 0),
+	];
+
+	return RLM_MODULE_OK;
+}
+
+#  EXISTS and DELETE
+sub authenticate {
+	my @results;
+	my $deleted;
+	my ($before, $seen) = (0, 0);
+
+	push @results, 'exists=' . (exists $RAD_REQUEST{'Filter-Id'} ? 'yes' : 'no');
+	push @results, 'exists-missing=' . (exists $RAD_REQUEST{'Class'} ? 'yes' : 'no');
+
+	$deleted = delete $RAD_REQUEST{'Filter-Id'};
+	push @results, 'deleted=' . (ref($deleted) eq 'ARRAY' ? join(',', @$deleted) : 'not an array');
+	push @results, 'exists-deleted=' . (exists $RAD_REQUEST{'Filter-Id'} ? 'yes' : 'no');
+
+	$deleted = delete $RAD_REQUEST{'Class'};
+	push @results, 'deleted-missing=' . (defined $deleted ? $deleted : 'undef');
+
+	#  Deleting the key last returned is allowed while iterating
+	$before = scalar(keys %RAD_REQUEST);
+	while (my ($key) = each %RAD_REQUEST) {
+		$seen++;
+		delete $RAD_REQUEST{$key} if ($key eq 'NAS-Identifier');
+	}
+	push @results, 'each=' . ($seen == $before ? 'all' : "$seen of $before");
+
+	$RAD_REPLY{'Reply-Message'} = \@results;
+
+	return RLM_MODULE_OK;
+}
@@ -0,0 +1,18 @@
+import freeradius
+
+
+def authorize(p):
+    request = p["request"]
+
+    if request.get("User-Name") != "bob":
+        return freeradius.RLM_MODULE_REJECT
+
+    if "Reply-Message" in p["reply"]:
+        return freeradius.RLM_MODULE_FAIL
+
+    p["reply"]["Reply-Message"] = "Hello " + request["User-Name"]
+    p["control"]["Filter-Id"] = ["a", "b"]
+    del p["control"]["Filter-Id"]
+    p["control"]["Filter-Id"] = ("c", "d")
+
+    return freeradius.RLM_MODULE_OK
@@ -0,0 +1,27 @@
+import sys
+
+import freeradius
+
+#
+#  instantiate() is only called in the module instance's interpreter,
+#  so with per_thread_interpreter the module globals seen by authorize()
+#  are the ones in the worker thread's own interpreter.
+#
+instantiated = False
+
+
+def instantiate(p):
+    global instantiated
+    instantiated = True
+    return freeradius.RLM_MODULE_OK
+
+
+def authorize(p):
+    #  Separate interpreters with their own GIL need Python 3.12
+    if sys.version_info < (3, 12):
+        return freeradius.RLM_MODULE_NOOP
+
+    freeradius.log(freeradius.L_DBG, "Python - instantiated=" + str(instantiated))
+    if instantiated:
+        return freeradius.RLM_MODULE_FAIL
+    return freeradius.RLM_MODULE_OK
@@ -0,0 +1,16 @@
+#
+#  Does a fixed amount of pure Python work for every request, so that
+#  the throughput of the server is limited by the interpreter, and not
+#  by anything which releases the GIL.
+#
+import freeradius
+
+ROUNDS = 20000
+
+
+def authorize(p):
+    total = 0
+    for i in range(ROUNDS):
+        total += i * i
+
+    return freeradius.RLM_MODULE_OK
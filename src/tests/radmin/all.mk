@@ -52,6 +52,9 @@ $(OUTPUT)/depends.mk: $(addprefix $(DIR)/,$(FILES)) | $(OUTPUT)
 #
 #	Run the radmin commands against the radiusd.
 #
+#	Output which changes from run to run can be removed by
+#	a sed script with the same name as the test, e.g. "foo.sed".
+#
 $(OUTPUT)/%: $(DIR)/% | $(TEST).radiusd_kill $(TEST).radiusd_start
 	@echo "RADMIN-TEST $(notdir $@)"
 	${Q} [ -f $(dir $@)/radiusd.pid ] || exit 1
@@ -70,6 +73,9 @@ $(OUTPUT)/%: $(DIR)/% | $(TEST).radiusd_kill $(TEST).radiusd_start
 		exit 1; \
 	fi; \
 	sed -i.bak -e '$${/Executing: /d;}' $(FOUND); \
+	if [ -f $(patsubst %.txt,%.sed,$<) ]; then \
+		sed -i.bak -f $(patsubst %.txt,%.sed,$<) $(FOUND); \
+	fi; \
 	if ! cmp -s $(FOUND) $(EXPECTED); then \
 		echo "RADMIN FAILED $@"; \
 		echo "RADIUSD: $(RADIUSD_RUN)"; \
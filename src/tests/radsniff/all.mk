@@ -46,6 +46,7 @@ $(OUTPUT)/%.txt: $(DIR)/%.txt $(TEST_BIN_DIR)/radsniff $(PCAP_IN)
 	$(eval CMD_TEST := $(patsubst %.txt,%.cmd,$<))
 	$(eval EXPECTED := $<)
 	$(eval ARGV     := $(shell grep "^#.*ARGV:" $< | cut -f2 -d ':'))
+	$(eval REF_ARGV := $(shell grep "^#.*REFERENCE:" $< | cut -f2 -d ':'))
 
 	${Q}echo "RADSNIFF-TEST INPUT=$(TARGET) ARGV=\"$(ARGV)\""
 #
@@ -58,7 +59,35 @@ $(OUTPUT)/%.txt: $(DIR)/%.txt $(TEST_BIN_DIR)/radsniff $(PCAP_IN)
 		rm -f $@;										      \
 		exit 1;                                                                                       \
 	fi
-	${Q}if [ -e "$(EXPECTED)" ]; then                                                                     \
+#
+#	Tests with a "REFERENCE:" line compare the output against the output
+#	of radsniff run with the reference arguments, instead of against the
+#	contents of the test file.
+#
+	${Q}if [ -n "$(REF_ARGV)" ]; then                                                                     \
+		if ! TZ='UTC' $(TEST_BIN)/radsniff $(REF_ARGV) -I $(PCAP_IN) -D share/dictionary 1> $(FOUND).result; then \
+			echo "FAILED";                                                                        \
+			cat $(FOUND).result;                                                                  \
+			echo "RADSNIFF: TZ='UTC' $(TEST_BIN)/radsniff $(REF_ARGV) -I $(PCAP_IN) -D share/dictionary" -xx; \
+			rm -f $@;									      \
+			exit 1;                                                                               \
+		fi;                                                                                           \
+		if [ ! -s $(FOUND).result ]; then                                                             \
+			echo "RADSNIFF FAILED $@";                                                                \
+			echo "ERROR: radsniff $(REF_ARGV) produced no output to compare against";                 \
+			rm -f $@;									      \
+			exit 1;                                                                               \
+		fi;                                                                                           \
+		sed -i.bak -e '$${/Executing: /d;}' $(FOUND) $(FOUND).result;                                 \
+		if ! cmp $(FOUND) $(FOUND).result; then                                                       \
+			echo "RADSNIFF FAILED $@";                                                                \
+			echo "RADSNIFF: $(TEST_BIN)/radsniff $(ARGV) -I $(PCAP_IN) -D share/dictionary -xx";        \
+			echo "ERROR: The output is not the same as from: radsniff $(REF_ARGV)";                   \
+			diff $(FOUND) $(FOUND).result;                                                                \
+			rm -f $@;										      \
+			exit 1;                                                                                       \
+		fi; \
+	elif [ -e "$(EXPECTED)" ]; then                                                                       \
 		grep -v "^#" $(EXPECTED) > $(FOUND).result || true;                                           \
 		sed -i.bak -e '$${/Executing: /d;}' $(FOUND);                                                 \
 		if ! cmp $(FOUND) $(FOUND).result; then                                                       \